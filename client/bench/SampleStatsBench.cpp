@@ -0,0 +1,101 @@
+// Post-processing time of a long test's delays.
+//
+// Fills a SampleStore with synthetic round-trip, outbound and return delays
+// in NTP units, as a run of that many packets would leave it, then times the
+// end-of-test statistics the client works out: min, max, mean and variance of
+// each column, then the RTT percentiles. For comparison it times the same
+// summaries taken the plain way, one packet at a time in doubles.
+//
+// Usage: twamp-sample-bench [samples]
+
+#include "SampleStore.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+namespace
+{
+const size_t kDefaultSamples = 50000000;
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Mean and sample variance one value at a time, in doubles.
+void plainStats(const std::vector<int64_t> &values, double &mean, double &variance)
+{
+    double sum = 0;
+    double squares = 0;
+    double low = values[0];
+    double high = values[0];
+    for (int64_t value : values)
+    {
+        double ms = ntpUnitsToMs(static_cast<double>(value));
+        sum += ms;
+        squares += ms * ms;
+        low = std::min(low, ms);
+        high = std::max(high, ms);
+    }
+    mean = sum / values.size();
+    variance = (squares - sum * mean) / (values.size() - 1);
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : kDefaultSamples;
+    if (count < 2)
+    {
+        std::fprintf(stderr, "Usage: twamp-sample-bench [samples]\n");
+        return 1;
+    }
+
+    // Delays around half a millisecond each way with an exponential tail.
+    std::mt19937_64 random(1);
+    std::exponential_distribution<double> queueing(1.0 / 50e-6);
+    SampleStore samples;
+    samples.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int64_t out = static_cast<int64_t>((250e-6 + queueing(random)) * kNtpUnitsPerSecond);
+        int64_t back = static_cast<int64_t>((250e-6 + queueing(random)) * kNtpUnitsPerSecond);
+        samples.add(out + back, out, back);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    samplestats::Summary rtt = samplestats::summarize(samples.rtt().data(), count);
+    samplestats::Summary out = samplestats::summarize(samples.out().data(), count);
+    samplestats::Summary back = samplestats::summarize(samples.back().data(), count);
+    double summarySeconds = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    samplestats::Distribution distribution(samples.rtt().data(), count, rtt);
+    double p50 = distribution.percentile(50);
+    double p90 = distribution.percentile(90);
+    double p99 = distribution.percentile(99);
+    double percentileSeconds = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    double plainMean[3];
+    double plainVariance[3];
+    plainStats(samples.rtt(), plainMean[0], plainVariance[0]);
+    plainStats(samples.out(), plainMean[1], plainVariance[1]);
+    plainStats(samples.back(), plainMean[2], plainVariance[2]);
+    double plainSeconds = secondsSince(start);
+
+    std::printf("%zu samples\n", count);
+    std::printf("RTT mean %.6f ms, stddev %.6f ms, min %.6f ms, max %.6f ms\n", ntpUnitsToMs(rtt.mean),
+                ntpUnitsToMs(std::sqrt(rtt.variance)), ntpUnitsToMs(rtt.min), ntpUnitsToMs(rtt.max));
+    std::printf("RTT p50 %.6f ms, p90 %.6f ms, p99 %.6f ms\n", ntpUnitsToMs(p50), ntpUnitsToMs(p90),
+                ntpUnitsToMs(p99));
+    std::printf("Out mean %.6f ms, back mean %.6f ms\n", ntpUnitsToMs(out.mean), ntpUnitsToMs(back.mean));
+    std::printf("Plain doubles: RTT mean %.6f ms, stddev %.6f ms\n", plainMean[0], std::sqrt(plainVariance[0]));
+    std::printf("%-16s %10.3f s\n", "summaries", summarySeconds);
+    std::printf("%-16s %10.3f s\n", "percentiles", percentileSeconds);
+    std::printf("%-16s %10.3f s (summaries only)\n", "plain doubles", plainSeconds);
+    return 0;
+}
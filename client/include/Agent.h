@@ -0,0 +1,107 @@
+#ifndef TWAMP_AGENT_H
+#define TWAMP_AGENT_H
+
+#include "ClockEstimator.h"
+#include "Messages.h"
+#include "TimerWheel.h"
+#include "ResultWriter.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+
+// Long-running monitoring mode: runs periodic TWAMP tests against many
+// reflectors from a single epoll loop. Each target is a small state machine
+// with fixed-size buffers, so memory stays constant for the lifetime of the
+// process no matter how many cycles have run.
+class Agent {
+public:
+    Agent(int packetCount, int intervalMs, int periodSec, bool shortOutput = false,
+          OutputFormat format = OutputFormat::Text);
+    ~Agent();
+
+    // Reads "address[:port]" lines; blank lines and '#' comments are skipped.
+    bool loadTargets(const std::string& filename);
+
+    bool run();
+    void requestStop() { stopRequested_ = true; }
+
+private:
+    enum class State : uint8_t {
+        Idle,
+        Connecting,
+        AwaitGreeting,
+        AwaitAccept,
+        AwaitStartAck,
+        Testing,
+        Draining,
+        AwaitStopAck
+    };
+
+    struct Target {
+        std::string name;
+        struct sockaddr_in controlAddr;
+        uint16_t testPort;
+        uint16_t sessionTestPort;  // from Accept-Session; testPort if it gave none
+
+        State state;
+        uint32_t generation;
+        int controlSocket;
+        int testSocket;
+        uint32_t sid;
+        TimerWheel::Clock::time_point cycleStart;
+
+        char rxBuffer[AcceptSession::kSize];
+        size_t rxExpected;
+        size_t rxReceived;
+
+        uint32_t sent;
+        uint32_t received;
+        uint32_t invalid;
+        double totalRtt;
+        double totalOut;
+        double totalBack;
+        std::vector<uint64_t> seenBitmap;
+        std::vector<double> sentAt;
+
+        // Kept across cycles, so the drift estimate spans many tests.
+        ClockEstimator clock;
+    };
+
+    void scheduleTimer(uint32_t index, TimerWheel::Clock::time_point deadline);
+    void onTimer(uint32_t index);
+    void onControlEvent(uint32_t index, uint32_t events);
+    void onTestReadable(uint32_t index);
+
+    void startCycle(uint32_t index);
+    void finishCycle(uint32_t index, const char* failure);
+    void stopAll();
+    void expectControl(uint32_t index, size_t size, State next);
+    bool sendControl(uint32_t index, const char* data, size_t size);
+    bool sendRequestSession(uint32_t index);
+    void sendTestPacket(uint32_t index);
+    void closeSockets(Target& target);
+
+    bool perPacketRecords() const { return format_ != OutputFormat::Text && !shortOutput_; }
+
+    int packetCount_;
+    int intervalMs_;
+    std::chrono::seconds period_;
+    std::chrono::seconds replyTimeout_;
+    std::chrono::seconds controlTimeout_;
+    bool shortOutput_;
+    OutputFormat format_;
+    ResultWriter writer_;
+
+    int epollFd_;
+    std::atomic<bool> stopRequested_;
+    TimerWheel timers_;
+    std::vector<Target> targets_;
+    std::vector<TimerWheel::Timer> expired_;
+    std::mt19937 rng_;
+};
+
+#endif // TWAMP_AGENT_H
@@ -1,27 +1,130 @@
 #ifndef TWAMP_CLIENT_H
 #define TWAMP_CLIENT_H
 
+#include "ResultWriter.h"
+#include "IntervalAggregator.h"
+#include "ClockEstimator.h"
+#include "Crypto.h"
+#include "SocketTimestamps.h"
+#include "TrafficClass.h"
+#include "RtoEstimator.h"
+#include "TimerWheel.h"
+#include "TrainAnalyzer.h"
+#include "SampleStore.h"
+#include <chrono>
 #include <string>
+#include <memory>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <unordered_map>
 #include <vector>
 
 class Client {
 public:
-    Client(const std::string& serverAddress, int controlPort, int testPort, bool shortOutput = false);
+    Client(const std::string& serverAddress, int controlPort, int testPort, bool shortOutput = false,
+           OutputFormat format = OutputFormat::Text);
     ~Client();
     
     bool runTest(int packetCount, int intervalMs);
+
+    // Report time-bucketed statistics every N seconds for each given width.
+    void setIntervalRollups(const std::vector<int>& seconds);
+
+    // Use an authenticated or encrypted mode with the given shared secret.
+    void setSecurity(uint8_t mode, const std::string& keyId, const std::string& secret);
+
+    // Mark test packets with these DSCP values in turn and report each
+    // class separately.
+    void setDscpClasses(const std::vector<int>& dscps);
+
+    // Bounds of the adaptive time to wait for each reply before sending the
+    // next packet. A packet still counts as lost only after the full reply
+    // timeout, so these change how long a test takes, not its results.
+    void setReplyTimeoutBounds(int floorMs, int ceilingMs);
+
+    // Size of each test packet in bytes (default: 64).
+    void setPacketSize(size_t size);
+
+    // Sends every probe as a train of this many back-to-back packets (2 for
+    // packet pairs) and reports the dispersion of the trains. 1, the
+    // default, sends single packets.
+    void setTrainLength(int packets);
     
 private:
+    // A test packet whose reply has not come back yet. It is declared lost
+    // when its timer on lossTimers_ expires.
+    struct Outstanding {
+        std::chrono::steady_clock::time_point sentTime;
+        int64_t sentNs;       // T1, nanoseconds since the UNIX epoch
+        double sentAt;        // T1, seconds since the UNIX epoch
+        double kernelSentAt;  // 0 if unknown
+        uint32_t timestampId; // SocketTimestamps id of the send time
+        int dscp;
+        size_t classIndex;
+    };
+
+    // Totals for the packets of one DSCP class.
+    struct ClassTotals {
+        uint32_t sent = 0;
+        uint32_t received = 0;
+        uint32_t measured = 0;
+        double rtt = 0;
+        double out = 0;
+        double back = 0;
+        uint32_t remarkedOut = 0;
+        uint32_t remarkedBack = 0;
+    };
+
+    // Running totals of the current test; the delays themselves are kept in
+    // samples_.
+    struct TestTotals {
+        int received = 0;
+        KernelTimes kernel;
+        int kernelCount = 0;
+        std::vector<ClassTotals> classes;
+    };
+
     bool shortOutput_;
+    OutputFormat format_;
+    std::string target_;
+    std::unique_ptr<ResultWriter> writer_;
+    std::vector<int> rollupSeconds_;
+    std::vector<IntervalAggregator> aggregators_;
+    std::vector<IntervalRecord> closedIntervals_;
+    std::vector<int> dscpClasses_;
+    size_t packetSize_;
+    uint32_t trainLength_;
+    std::unique_ptr<TrainAnalyzer> trains_;
     std::string serverAddress_;
     int controlPort_;
     int testPort_;
     
     int controlSocket_;
     int testSocket_;
-    struct sockaddr_in serverAddr_;
+    SocketTimestamps timestamps_;
+    ClockEstimator clock_;
+    // Fed the kernel's send and receive times instead of T1 and T4, for the
+    // kernel one-way figures.
+    ClockEstimator kernelClock_;
+    RtoEstimator rto_;
+    TimerWheel lossTimers_;
+    std::vector<TimerWheel::Timer> expired_;
+    std::unordered_map<uint32_t, Outstanding> outstanding_;
+    TestTotals totals_;
+    SampleStore samples_;
+    // When the current test began, as an NTP timestamp and in seconds since
+    // the UNIX epoch.
+    uint64_t runStartNtp_;
+    double runStartAt_;
+    struct sockaddr_in6 serverAddr_;
     uint32_t sid_;
+
+    uint8_t mode_;
+    std::string keyId_;
+    std::string secret_;
+    SessionKeys keys_;
+    ControlCipher controlCipher_;
+    TestPacketCipher testCipher_;
     
     bool connectToServer();
     bool performControlConnection();
@@ -29,6 +132,34 @@ private:
     bool startTestSession();
     bool stopTestSession();
     bool sendTestPackets(int packetCount, int intervalMs);
+    // Sends the `count` messages of a train with as few sendmmsg() calls as
+    // the socket allows; returns how many went out.
+    size_t sendTrain(struct mmsghdr* messages, size_t count);
+    ssize_t receiveReply(char* buffer, size_t size, double& kernelReceivedAt, TrafficClass& traffic);
+
+    // Handles replies and expires lost packets until `until`, until nothing
+    // is outstanding, or until packet `awaited` (if not 0) is settled.
+    void serviceReplies(std::chrono::steady_clock::time_point until, uint32_t awaited);
+    void handleReply(char* response, ssize_t received, double kernelReceivedAt, const TrafficClass& traffic);
+    void declareLost(uint32_t seq);
+
+    // Seconds from the start of the test to NTP timestamp `ntp`: small
+    // enough for a double to hold to well below a nanosecond.
+    double runSeconds(uint64_t ntp) const
+    {
+        return static_cast<int64_t>(ntp - runStartNtp_) / kNtpUnitsPerSecond;
+    }
+    void sendSetupResponse(char* greetingExtension);
+
+    // Control message I/O, sealed and opened in the secured modes.
+    bool sendControl(const char* message, size_t size);
+    bool receiveControl(char* message, size_t size);
+
+    // Progress messages on stdout are only meaningful for interactive text
+    // output; structured formats keep stdout strictly machine-readable.
+    bool verbose() const { return !shortOutput_ && format_ == OutputFormat::Text; }
+    void flushOutput();
+    void reportIntervals(bool final);
 };
 
 #endif // TWAMP_CLIENT_H
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef TWAMP_CLOCK_ESTIMATOR_H
+#define TWAMP_CLOCK_ESTIMATOR_H
+
+#include <cstddef>
+#include <deque>
+
+// Tracks the offset and drift of the reflector's clock against ours from the
+// T1..T4 timestamps of test packets, so one-way delays can be reported even
+// when the two clocks disagree by more than the delays themselves.
+//
+// Each reply gives an offset ((T2 - T1) + (T3 - T4)) / 2 that is off by at
+// most half of its network delay (T4 - T1) - (T3 - T2). As in NTP's clock
+// filter, only the lowest-delay sample of every few is kept; a least-squares
+// line through the recent survivors gives the offset at any moment and its
+// slope the drift. Old points age out, so a change of drift or a step of
+// either clock is followed within a window.
+class ClockEstimator {
+public:
+    struct Estimate {
+        double offset;  // server clock minus client clock, seconds
+        double drift;   // seconds per second
+        double error;   // bound on the error of offset, seconds
+    };
+
+    ClockEstimator();
+
+    // T1 and T4 are client times, T2 and T3 server times, all in seconds.
+    void addSample(double t1, double t2, double t3, double t4);
+
+    bool valid() const { return candidateCount_ > 0 || !points_.empty(); }
+
+    // The estimate at client time `clientTime`. The error bound holds as
+    // long as the drift has not changed since the window began.
+    Estimate at(double clientTime) const;
+
+    void reset();
+
+private:
+    static const size_t kFilterSize = 8;
+    static const size_t kMaxPoints = 64;
+
+    struct Point {
+        double time;    // client time, seconds
+        double offset;
+        double delay;
+    };
+
+    std::deque<Point> points_;
+    Point candidate_;
+    size_t candidateCount_;
+};
+
+#endif // TWAMP_CLOCK_ESTIMATOR_H
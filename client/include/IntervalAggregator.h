@@ -0,0 +1,77 @@
+#ifndef TWAMP_INTERVAL_AGGREGATOR_H
+#define TWAMP_INTERVAL_AGGREGATOR_H
+
+#include "LatencyHistogram.h"
+#include "ResultWriter.h"
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Incremental time-bucketed statistics for long-running tests. Packets are
+// assigned to the interval in which they were sent. An interval closes once
+// its time has passed and every packet sent in it has been answered or
+// declared lost, or at the latest one reply timeout after it ended; it is
+// reported immediately and its memory is reused.
+//
+// Late-arrival policy: a reply that arrives after its packet was declared lost
+// or after its interval closed never changes an interval that has already
+// been reported. It is counted in the `late` field of the newest open
+// interval instead, and is not included in any delay statistics.
+class IntervalAggregator {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    IntervalAggregator(std::chrono::milliseconds width, std::chrono::milliseconds replyTimeout,
+                       Clock::time_point runStart, double runStartWall);
+
+    void onSent(Clock::time_point sentAt);
+    void onReply(Clock::time_point sentAt, double rttMs, double outMs, double backMs);
+    void onInvalidReply(Clock::time_point sentAt);
+    void onLost(Clock::time_point sentAt);
+    void onLateReply(Clock::time_point now);
+
+    // Closes every interval that is complete at `now` and appends its record.
+    void advance(Clock::time_point now, std::vector<IntervalRecord>& closed);
+
+    // Closes all remaining intervals at the end of the run.
+    void finish(std::vector<IntervalRecord>& closed);
+
+private:
+    struct Bucket {
+        uint32_t sent;
+        uint32_t received;
+        uint32_t invalid;
+        uint32_t lost;
+        uint32_t late;
+        uint32_t samples;
+        double minRtt;
+        double maxRtt;
+        double totalRtt;
+        double totalOut;
+        double totalBack;
+        double lastRtt;
+        double totalJitter;
+        uint32_t jitterSamples;
+        LatencyHistogram histogram;
+    };
+
+    uint64_t indexOf(Clock::time_point t) const;
+    Clock::time_point endOf(uint64_t index) const;
+    Bucket* find(uint64_t index);
+    Bucket& open(uint64_t index, std::vector<IntervalRecord>* closed);
+    void closeOldest(std::vector<IntervalRecord>& closed);
+
+    std::chrono::milliseconds width_;
+    std::chrono::milliseconds replyTimeout_;
+    Clock::time_point runStart_;
+    double runStartWall_;
+    // Intervals [nextToClose_, openEnd_) are open; interval k lives in
+    // ring_[k % ring_.size()]. The ring holds replyTimeout / width + 2
+    // buckets, so memory does not depend on run length.
+    uint64_t nextToClose_;
+    uint64_t openEnd_;
+    std::vector<Bucket> ring_;
+    std::vector<IntervalRecord> overflow_;
+};
+
+#endif // TWAMP_INTERVAL_AGGREGATOR_H
@@ -0,0 +1,173 @@
+#ifndef TWAMP_RESULT_WRITER_H
+#define TWAMP_RESULT_WRITER_H
+
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class OutputFormat {
+    Text,
+    Jsonl,
+    Csv
+};
+
+bool parseOutputFormat(const std::string& name, OutputFormat& format);
+
+enum class PacketStatus {
+    Ok,
+    Timeout,
+    InvalidTimestamps,
+    ShortReply
+};
+
+// Fields that are not known for a record are NaN and are written as JSON
+// null / empty CSV cells.
+//
+// The kernel figures use the client's kernel send and receive timestamps in
+// place of T1 and T4; the delays are how long the client took between
+// stamping the packet and the kernel sending it, and between the kernel
+// receiving the reply and the client reading it.
+struct KernelTimes {
+    double rttMs = NAN;
+    double outMs = NAN;
+    double backMs = NAN;
+    double sendDelayMs = NAN;
+    double receiveDelayMs = NAN;
+};
+
+// Offset of the server's clock from the client's, which the one-way delays
+// have been corrected for, a bound on its error and the drift between the
+// two clocks.
+struct ClockFigures {
+    double offsetMs = NAN;
+    double errorMs = NAN;
+    double driftPpm = NAN;
+};
+
+// The DSCP a packet was sent with, the DSCP and TTL it reached the reflector
+// with and the DSCP of its reply; -1 where unknown. A reflected DSCP that
+// differs from the one sent means the path remarked the packet.
+struct QosFields {
+    int dscp = -1;
+    int reflectorDscp = -1;
+    int reflectorTtl = -1;
+    int replyDscp = -1;
+};
+
+struct PacketRecord {
+    const char* target;
+    uint32_t seq;
+    PacketStatus status;
+    double sentAt;    // T1, seconds since the UNIX epoch
+    double rttMs;
+    double outMs;
+    double backMs;
+    KernelTimes kernel = {};
+    ClockFigures clock = {};
+    QosFields qos = {};
+};
+
+struct SummaryRecord {
+    const char* target;
+    uint32_t sent;
+    uint32_t received;
+    double avgRttMs;
+    double avgOutMs;
+    double avgBackMs;
+    const char* error;  // nullptr when the test completed
+    KernelTimes kernel = {};  // averages
+    ClockFigures clock = {};  // at the end of the test
+    // Spread of the round-trip times over the test.
+    double minRttMs = NAN;
+    double maxRttMs = NAN;
+    double p50RttMs = NAN;
+    double p90RttMs = NAN;
+    double p99RttMs = NAN;
+    double stddevRttMs = NAN;
+};
+
+// Totals for the packets of one DSCP, when the client marks several.
+// Remarked packets reached the reflector (out) or came back (back) with a
+// different DSCP.
+struct ClassRecord {
+    const char* target;
+    int dscp;
+    uint32_t sent;
+    uint32_t received;
+    double avgRttMs;
+    double avgOutMs;
+    double avgBackMs;
+    uint32_t remarkedOut;
+    uint32_t remarkedBack;
+};
+
+// Dispersion of the packet trains of a test (see TrainAnalyzer): bottleneck
+// capacity, available bandwidth and the delay growth within a train.
+struct TrainRecord {
+    const char* target;
+    uint32_t trains;
+    uint32_t trainLength;
+    uint32_t packetSize;
+    uint32_t measured;
+    double capacityMbps;
+    double availableMbps;
+    double avgDelayGrowthMs;
+    double maxDelayGrowthMs;
+};
+
+struct IntervalRecord {
+    const char* target;
+    double widthSec;
+    double startTime;  // interval start, seconds since the UNIX epoch
+    uint32_t sent;
+    uint32_t received;
+    uint32_t lost;
+    uint32_t late;
+    double minRttMs;
+    double avgRttMs;
+    double maxRttMs;
+    double p50RttMs;
+    double p90RttMs;
+    double p99RttMs;
+    double jitterMs;
+    double avgOutMs;
+    double avgBackMs;
+};
+
+// Formats machine-readable result records into a large in-memory buffer and
+// hands it to the stream in big chunks. Nothing is flushed per record; the
+// caller flushes at natural pause points (before sleeping or blocking) and
+// the destructor flushes whatever is left.
+class ResultWriter {
+public:
+    ResultWriter(std::ostream& out, OutputFormat format, size_t bufferSize = 64 * 1024);
+    ~ResultWriter();
+
+    void writePacket(const PacketRecord& record);
+    void writeSummary(const SummaryRecord& record);
+    void writeInterval(const IntervalRecord& record);
+    void writeClass(const ClassRecord& record);
+    void writeTrains(const TrainRecord& record);
+    void flush();
+
+private:
+    void ensureSpace(size_t size);
+    void appendf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    void appendNumber(const char* name, double value, bool leadingComma = true);
+    void appendInteger(const char* name, int value);
+    void appendString(const char* name, const char* value);
+    void appendKernelTimes(const KernelTimes& kernel);
+    void appendClockFigures(const ClockFigures& clock);
+    void appendQosFields(const QosFields& qos);
+    void writeHeaderOnce();
+
+    std::ostream& out_;
+    OutputFormat format_;
+    std::vector<char> buffer_;
+    size_t used_;
+    bool headerWritten_;
+};
+
+#endif // TWAMP_RESULT_WRITER_H
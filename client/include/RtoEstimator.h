@@ -0,0 +1,37 @@
+#ifndef TWAMP_RTO_ESTIMATOR_H
+#define TWAMP_RTO_ESTIMATOR_H
+
+// How long to wait for a reply before moving on to the next test packet,
+// from the round-trip times seen so far, as TCP computes its retransmission
+// timeout (Jacobson/Karels, RFC 6298): a smoothed RTT plus four times its
+// mean deviation, kept between a floor and a ceiling.
+//
+// Giving up on a packet here only means the client stops waiting for it; it
+// is not declared lost until the full reply timeout has passed.
+class RtoEstimator {
+public:
+    RtoEstimator(double floorMs, double ceilingMs);
+
+    void addSample(double rttMs);
+
+    // Doubles the timeout after a packet went unanswered, until the next
+    // sample, so a sudden rise in RTT is not taken for loss packet after
+    // packet.
+    void backOff();
+
+    double timeoutMs() const { return timeoutMs_; }
+
+    void reset();
+
+private:
+    void update(double timeoutMs);
+
+    double floorMs_;
+    double ceilingMs_;
+    double smoothedMs_;
+    double deviationMs_;
+    double timeoutMs_;
+    bool seeded_;
+};
+
+#endif // TWAMP_RTO_ESTIMATOR_H
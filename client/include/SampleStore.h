@@ -0,0 +1,81 @@
+#ifndef TWAMP_SAMPLE_STORE_H
+#define TWAMP_SAMPLE_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Delays are kept as signed 64-bit counts of NTP fraction units (2^-32 s,
+// about 0.23 ns), taken as differences of the packets' 64-bit NTP
+// timestamps. Nothing is lost to rounding the way seconds since 1970 in a
+// double lose everything below a few hundred nanoseconds.
+const double kNtpUnitsPerSecond = 4294967296.0;
+
+inline double ntpUnitsToMs(double units)
+{
+    return units * 1000.0 / kNtpUnitsPerSecond;
+}
+
+// The delays of every measured packet of a test, one column per figure, so
+// that the statistics at the end run over contiguous arrays.
+class SampleStore {
+public:
+    void clear();
+    void reserve(size_t count);
+    void add(int64_t rtt, int64_t out, int64_t back);
+
+    size_t size() const { return rtt_.size(); }
+    const std::vector<int64_t>& rtt() const { return rtt_; }
+    const std::vector<int64_t>& out() const { return out_; }
+    const std::vector<int64_t>& back() const { return back_; }
+
+private:
+    std::vector<int64_t> rtt_;
+    std::vector<int64_t> out_;
+    std::vector<int64_t> back_;
+};
+
+// Statistics over a column, vectorised with AVX2 where the CPU has it (the
+// choice is made at run time, so the binary still runs without it) and with
+// NEON on ARM; other machines take the scalar loops.
+namespace samplestats {
+
+struct Summary {
+    size_t count = 0;
+    int64_t min = 0;
+    int64_t max = 0;
+    double mean = 0;
+    double variance = 0;  // sample variance, 0 for fewer than two values
+};
+
+Summary summarize(const int64_t* values, size_t count);
+
+// Counts the values into bins of 2^shift units starting at `low`; values
+// past the last bin land in it. The counts are added to `bins`.
+void histogram(const int64_t* values, size_t count, int64_t low, unsigned shift, uint32_t* bins,
+               size_t binCount);
+
+// Exact percentiles of a column. A histogram with up to kBins bins over its
+// range finds the bin that holds each rank, and the sample is selected from
+// that bin's values. The column must outlive the distribution.
+class Distribution {
+public:
+    static const size_t kBins = 65536;
+
+    Distribution(const int64_t* values, size_t count, const Summary& summary);
+
+    // Value of the sample at the given percentile (0-100), by nearest rank.
+    double percentile(double p) const;
+
+private:
+    const int64_t* values_;
+    std::vector<uint32_t> bins_;
+    size_t count_;
+    int64_t low_;
+    int64_t high_;
+    unsigned shift_;
+};
+
+}  // namespace samplestats
+
+#endif // TWAMP_SAMPLE_STORE_H
@@ -0,0 +1,65 @@
+#ifndef TWAMP_SOCKET_TIMESTAMPS_H
+#define TWAMP_SOCKET_TIMESTAMPS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+// Kernel send and receive timestamps for a UDP socket (SO_TIMESTAMPING).
+// The send timestamp is taken as the packet leaves for the driver, or by
+// the NIC when hardware timestamping is already enabled on the interface
+// (for example by ptp4l); the receive timestamp as the packet arrives.
+// Neither includes the time the process takes to get scheduled, which is
+// what separates them from the timestamps in the packet itself.
+//
+// Times are seconds since the UNIX epoch, 0 when the kernel gave none.
+class SocketTimestamps {
+public:
+    SocketTimestamps();
+
+    // Returns false if the kernel does not support timestamping.
+    bool enable(int fd);
+    bool active() const { return fd_ >= 0; }
+
+    // Call after each packet is sent; returns the id its send timestamp will
+    // be reported under.
+    uint32_t onSent() { return nextId_++; }
+
+    // Kernel receive time of a message read with recvmsg(), from its
+    // control data.
+    double receivedAt(struct msghdr* msg);
+
+    // Send time of packet `id` from the socket error queue. Waits up to a
+    // millisecond for it, as a hardware timestamp can trail the packet.
+    double sentAt(uint32_t id);
+
+    // Empties the error queue without waiting; call when poll() reports
+    // POLLERR, which it does for as long as the queue holds anything. Send
+    // timestamps that turn up after sentAt() gave up on them are kept for
+    // lateSentAt().
+    void drain();
+
+    // Send time of packet `id` if it came too late for sentAt(), else 0.
+    double lateSentAt(uint32_t id);
+
+    // True once any hardware timestamp has been seen.
+    bool hardware() const { return hardware_; }
+
+private:
+    int fd_;
+    uint32_t nextId_;
+    bool hardware_;
+
+    // Late send timestamps by id, for the last kLateWindow packets.
+    static const uint32_t kLateWindow = 4096;
+    std::unordered_map<uint32_t, double> late_;
+
+    // Reads one entry from the error queue; false once it is empty.
+    bool readError(uint32_t& id, double& sentAt);
+    void keepLate(uint32_t id, double sentAt);
+};
+
+#endif // TWAMP_SOCKET_TIMESTAMPS_H
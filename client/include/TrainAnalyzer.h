@@ -0,0 +1,79 @@
+#ifndef TWAMP_TRAIN_ANALYZER_H
+#define TWAMP_TRAIN_ANALYZER_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Dispersion of back-to-back packet trains, from the times the reflector
+// received each packet. A bottleneck spaces the packets of a train by their
+// transmission time on it, so the gap between two neighbours gives its
+// capacity (packet-pair estimate, median over all pairs) and the spread of a
+// whole train the rate the path sustains alongside cross traffic (median
+// over trains), taken as the available bandwidth.
+//
+// Delay growth is how much later than the first packet of a train the last
+// one reached the reflector, beyond the larger of the gap they were sent
+// with and the spacing the bottleneck itself imposes at the estimated
+// capacity: queueing that built up while the train was in flight, as from a
+// microburst.
+//
+// Reflector times are the T2 of each reply. The server takes them from the
+// kernel's receive timestamp, so the reflector thread's scheduling does not
+// blur the gaps; only packets reflected over AF_XDP, which has none, carry
+// the time they were processed. They are only compared with each other, so
+// the two clocks need not agree.
+class TrainAnalyzer {
+public:
+    struct Result {
+        uint32_t measured = 0;  // trains with at least two replies
+        double capacityMbps = 0;
+        double availableMbps = 0;
+        double avgDelayGrowthMs = 0;
+        double maxDelayGrowthMs = 0;
+    };
+
+    // `wireBytes` is the size of each packet on the wire, headers included.
+    TrainAnalyzer(uint32_t trainLength, uint32_t wireBytes);
+
+    // Packet `position` (from 0) of train `train` came back or was lost.
+    // Times are nanoseconds since the UNIX epoch: the send time on the
+    // client's clock, the reflector's receive time on the server's.
+    void onReply(uint32_t train, uint32_t position, int64_t sentNs, int64_t reflectorNs);
+    void onLost(uint32_t train, uint32_t position);
+
+    // Settles the trains still waiting for replies and sums up the test.
+    Result finish();
+    void reset();
+
+private:
+    struct Sample {
+        int64_t sentNs;
+        int64_t reflectorNs;  // 0 until the reply is in
+    };
+
+    struct Train {
+        std::vector<Sample> samples;
+        uint32_t settled = 0;
+    };
+
+    // What a train contributes once all its packets are settled.
+    struct Growth {
+        double spreadNs;   // first to last arrival at the reflector
+        double sentGapNs;  // first to last send
+        uint32_t gaps;
+    };
+
+    Train& trainAt(uint32_t train);
+    void settle(uint32_t train, Train& entry);
+    static double median(std::vector<double>& values);
+
+    uint32_t length_;
+    double wireBits_;
+    std::unordered_map<uint32_t, Train> open_;
+    std::vector<double> pairRates_;   // bits per second
+    std::vector<double> trainRates_;  // bits per second
+    std::vector<Growth> growth_;
+};
+
+#endif // TWAMP_TRAIN_ANALYZER_H
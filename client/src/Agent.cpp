@@ -0,0 +1,666 @@
+#include "Agent.h"
+#include "Crypto.h"
+#include "TscClock.h"
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+constexpr uint64_t kTestSocketTag = 1;
+constexpr int kMaxEvents = 256;
+
+double nowSeconds()
+{
+    return TscClock::instance().nowNs() / 1e9;
+}
+
+void raiseFileLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+} // namespace
+
+Agent::Agent(int packetCount, int intervalMs, int periodSec, bool shortOutput, OutputFormat format)
+    : packetCount_(packetCount), intervalMs_(intervalMs), period_(periodSec),
+      replyTimeout_(2), controlTimeout_(10), shortOutput_(shortOutput), format_(format),
+      writer_(std::cout, format), epollFd_(-1), stopRequested_(false),
+      timers_(std::chrono::milliseconds(10), 4096), rng_(std::random_device{}()) {}
+
+Agent::~Agent()
+{
+    for (auto &target : targets_)
+    {
+        closeSockets(target);
+    }
+    if (epollFd_ != -1)
+    {
+        close(epollFd_);
+    }
+}
+
+bool Agent::loadTargets(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open target list: " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+        {
+            continue;
+        }
+        size_t end = line.find_first_of(" \t\r#", start);
+        std::string address = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+        int controlPort = 862;
+        size_t colonPos = address.find(':');
+        if (colonPos != std::string::npos)
+        {
+            controlPort = std::stoi(address.substr(colonPos + 1));
+            address = address.substr(0, colonPos);
+        }
+
+        Target target{};
+        target.name = address + ":" + std::to_string(controlPort);
+        target.controlAddr.sin_family = AF_INET;
+        target.controlAddr.sin_port = htons(controlPort);
+        target.testPort = static_cast<uint16_t>(controlPort + 1);
+        if (inet_pton(AF_INET, address.c_str(), &target.controlAddr.sin_addr) <= 0)
+        {
+            std::cerr << "Invalid target address: " << address << std::endl;
+            return false;
+        }
+
+        target.state = State::Idle;
+        target.controlSocket = -1;
+        target.testSocket = -1;
+        target.seenBitmap.resize((packetCount_ + 63) / 64);
+        if (perPacketRecords())
+        {
+            target.sentAt.resize(packetCount_);
+        }
+        targets_.push_back(std::move(target));
+    }
+
+    if (targets_.empty())
+    {
+        std::cerr << "Target list is empty" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Agent::run()
+{
+    raiseFileLimit();
+    TscClock::instance();
+
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0)
+    {
+        std::cerr << "Failed to create epoll instance: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Spread the first cycle of every target evenly across one period so the
+    // reflectors never see the whole fleet arrive at once.
+    auto now = TimerWheel::Clock::now();
+    for (uint32_t i = 0; i < targets_.size(); ++i)
+    {
+        targets_[i].cycleStart = now + (period_ * i) / targets_.size();
+        scheduleTimer(i, targets_[i].cycleStart);
+    }
+
+    if (format_ == OutputFormat::Text && !shortOutput_)
+    {
+        std::cout << "Agent monitoring " << targets_.size() << " targets every "
+                  << period_.count() << " s" << std::endl;
+    }
+
+    struct epoll_event events[kMaxEvents];
+    while (!stopRequested_)
+    {
+        // Results are batched per loop iteration rather than per record.
+        if (format_ == OutputFormat::Text)
+        {
+            std::cout.flush();
+        }
+        else
+        {
+            writer_.flush();
+        }
+
+        int timeout = timers_.pollTimeoutMs(TimerWheel::Clock::now());
+        int ready = epoll_wait(epollFd_, events, kMaxEvents, timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        for (int i = 0; i < ready; ++i)
+        {
+            uint32_t index = static_cast<uint32_t>(events[i].data.u64 >> 1);
+            if (events[i].data.u64 & kTestSocketTag)
+            {
+                onTestReadable(index);
+            }
+            else
+            {
+                onControlEvent(index, events[i].events);
+            }
+        }
+
+        expired_.clear();
+        timers_.advance(TimerWheel::Clock::now(), expired_);
+        for (const auto &timer : expired_)
+        {
+            if (timer.generation == targets_[timer.id].generation)
+            {
+                onTimer(timer.id);
+            }
+        }
+    }
+
+    stopAll();
+    return true;
+}
+
+void Agent::stopAll()
+{
+    // Tell every reflector with a running session that we are leaving, so it
+    // can free the session at once instead of waiting for its timeout, and
+    // report whatever the interrupted cycles measured.
+    for (uint32_t index = 0; index < targets_.size(); ++index)
+    {
+        Target &target = targets_[index];
+        if (target.state == State::Testing || target.state == State::Draining)
+        {
+            char stopSessions[ControlMessage::kSize] = {0};
+            ControlMessage(stopSessions).setCommand(CommandStopSessions);
+            if (!sendControl(index, stopSessions, sizeof(stopSessions)))
+            {
+                continue;
+            }
+        }
+        if (target.state == State::Testing || target.state == State::Draining ||
+            target.state == State::AwaitStopAck)
+        {
+            finishCycle(index, nullptr);
+        }
+        else
+        {
+            closeSockets(target);
+        }
+    }
+
+    if (format_ == OutputFormat::Text)
+    {
+        std::cout.flush();
+    }
+    else
+    {
+        writer_.flush();
+    }
+}
+
+void Agent::scheduleTimer(uint32_t index, TimerWheel::Clock::time_point deadline)
+{
+    Target &target = targets_[index];
+    target.generation++;
+    timers_.schedule(index, target.generation, deadline);
+}
+
+void Agent::onTimer(uint32_t index)
+{
+    Target &target = targets_[index];
+    switch (target.state)
+    {
+    case State::Idle:
+        startCycle(index);
+        break;
+    case State::Testing:
+        sendTestPacket(index);
+        break;
+    case State::Draining:
+    {
+        char stopSessions[ControlMessage::kSize] = {0};
+        ControlMessage(stopSessions).setCommand(CommandStopSessions);
+        if (sendControl(index, stopSessions, sizeof(stopSessions)))
+        {
+            expectControl(index, ControlMessage::kSize, State::AwaitStopAck);
+        }
+        break;
+    }
+    default:
+        finishCycle(index, "control timeout");
+        break;
+    }
+}
+
+void Agent::startCycle(uint32_t index)
+{
+    Target &target = targets_[index];
+    target.sent = 0;
+    target.received = 0;
+    target.invalid = 0;
+    target.totalRtt = 0;
+    target.totalOut = 0;
+    target.totalBack = 0;
+    std::fill(target.seenBitmap.begin(), target.seenBitmap.end(), 0);
+
+    target.controlSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    target.testSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (target.controlSocket < 0 || target.testSocket < 0)
+    {
+        finishCycle(index, "failed to create sockets");
+        return;
+    }
+
+    struct sockaddr_in localAddr;
+    memset(&localAddr, 0, sizeof(localAddr));
+    localAddr.sin_family = AF_INET;
+    localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(target.testSocket, (struct sockaddr *)&localAddr, sizeof(localAddr)) < 0)
+    {
+        finishCycle(index, "failed to bind test socket");
+        return;
+    }
+
+    if (connect(target.controlSocket, (struct sockaddr *)&target.controlAddr, sizeof(target.controlAddr)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        finishCycle(index, "failed to connect");
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.u64 = static_cast<uint64_t>(index) << 1;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, target.controlSocket, &ev);
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = (static_cast<uint64_t>(index) << 1) | kTestSocketTag;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, target.testSocket, &ev);
+
+    target.state = State::Connecting;
+    scheduleTimer(index, TimerWheel::Clock::now() + controlTimeout_);
+}
+
+void Agent::expectControl(uint32_t index, size_t size, State next)
+{
+    Target &target = targets_[index];
+    target.rxExpected = size;
+    target.rxReceived = 0;
+    target.state = next;
+    scheduleTimer(index, TimerWheel::Clock::now() + controlTimeout_);
+}
+
+bool Agent::sendControl(uint32_t index, const char *data, size_t size)
+{
+    // Control messages are far smaller than any socket buffer, so a short
+    // write means the connection is unusable.
+    if (send(targets_[index].controlSocket, data, size, MSG_NOSIGNAL) != static_cast<ssize_t>(size))
+    {
+        finishCycle(index, "failed to send control message");
+        return false;
+    }
+    return true;
+}
+
+bool Agent::sendRequestSession(uint32_t index)
+{
+    Target &target = targets_[index];
+
+    struct sockaddr_in controlLocal, testLocal;
+    socklen_t len = sizeof(controlLocal);
+    if (getsockname(target.controlSocket, (struct sockaddr *)&controlLocal, &len) < 0)
+    {
+        finishCycle(index, "failed to get control socket name");
+        return false;
+    }
+    len = sizeof(testLocal);
+    if (getsockname(target.testSocket, (struct sockaddr *)&testLocal, &len) < 0)
+    {
+        finishCycle(index, "failed to get test socket name");
+        return false;
+    }
+
+    target.sid = std::uniform_int_distribution<uint32_t>()(rng_);
+
+    char requestSession[RequestSession::kSize] = {0};
+    RequestSession request(requestSession);
+    request.setCommand(CommandRequestSession);
+    request.setSid(target.sid);
+    request.setSenderPort(ntohs(testLocal.sin_port));
+    request.setReceiverPort(target.testPort);
+    request.setSenderAddress(ntohl(controlLocal.sin_addr.s_addr));
+
+    return sendControl(index, requestSession, sizeof(requestSession));
+}
+
+void Agent::onControlEvent(uint32_t index, uint32_t events)
+{
+    Target &target = targets_[index];
+    if (target.controlSocket == -1)
+    {
+        return;
+    }
+
+    if (target.state == State::Connecting)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(target.controlSocket, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            finishCycle(index, "failed to connect");
+            return;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = static_cast<uint64_t>(index) << 1;
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, target.controlSocket, &ev);
+        expectControl(index, ServerGreeting::kSize, State::AwaitGreeting);
+        return;
+    }
+
+    if (target.state == State::Idle || target.rxReceived >= target.rxExpected)
+    {
+        // Unsolicited data or a hangup outside a control exchange. Stray
+        // bytes are read and dropped, or the level-triggered event would
+        // fire again at once; end of stream ends the cycle.
+        char discard[256];
+        ssize_t n = recv(target.controlSocket, discard, sizeof(discard), 0);
+        bool failed = n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+        if (n == 0 || failed || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            finishCycle(index, "control connection closed");
+        }
+        return;
+    }
+
+    ssize_t n = recv(target.controlSocket, target.rxBuffer + target.rxReceived,
+                     target.rxExpected - target.rxReceived, 0);
+    if (n == 0)
+    {
+        finishCycle(index, "control connection closed");
+        return;
+    }
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            finishCycle(index, "control connection error");
+        }
+        return;
+    }
+
+    target.rxReceived += n;
+    if (target.rxReceived < target.rxExpected)
+    {
+        return;
+    }
+
+    switch (target.state)
+    {
+    case State::AwaitGreeting:
+    {
+        if (ServerGreeting(target.rxBuffer).modes() != ModeUnauthenticated)
+        {
+            finishCycle(index, "unsupported server mode");
+            return;
+        }
+        char clientGreeting[ClientGreeting::kSize] = {0};
+        ClientGreeting(clientGreeting).setMode(ModeUnauthenticated);
+        if (sendControl(index, clientGreeting, sizeof(clientGreeting)) && sendRequestSession(index))
+        {
+            expectControl(index, AcceptSession::kSize, State::AwaitAccept);
+        }
+        break;
+    }
+    case State::AwaitAccept:
+    {
+        AcceptSession accept(target.rxBuffer);
+        if (accept.accept() != 0)
+        {
+            finishCycle(index, "session not accepted");
+            return;
+        }
+        target.sessionTestPort = accept.port() != 0 ? accept.port() : target.testPort;
+        char startSessions[ControlMessage::kSize] = {0};
+        ControlMessage(startSessions).setCommand(CommandStartSessions);
+        if (sendControl(index, startSessions, sizeof(startSessions)))
+        {
+            expectControl(index, ControlMessage::kSize, State::AwaitStartAck);
+        }
+        break;
+    }
+    case State::AwaitStartAck:
+        target.state = State::Testing;
+        sendTestPacket(index);
+        break;
+    case State::AwaitStopAck:
+        finishCycle(index, nullptr);
+        break;
+    default:
+        break;
+    }
+}
+
+void Agent::sendTestPacket(uint32_t index)
+{
+    Target &target = targets_[index];
+
+    struct sockaddr_in testServerAddr = target.controlAddr;
+    testServerAddr.sin_port = htons(target.sessionTestPort);
+
+    char packet[64] = {0};
+    TestPacket header(packet);
+    header.setSequence(target.sent + 1);
+    int64_t nowNs = TscClock::instance().nowNs();
+    header.setSenderTimestamp(ntpFromUnixNs(nowNs));
+    double sentAt = nowNs / 1e9;
+    if (target.sent < target.sentAt.size())
+    {
+        target.sentAt[target.sent] = sentAt;
+    }
+
+    // A lost send is indistinguishable from a lost reply; keep going.
+    sendto(target.testSocket, packet, sizeof(packet), 0,
+           (struct sockaddr *)&testServerAddr, sizeof(testServerAddr));
+    target.sent++;
+
+    if (target.sent < static_cast<uint32_t>(packetCount_))
+    {
+        scheduleTimer(index, TimerWheel::Clock::now() + std::chrono::milliseconds(intervalMs_));
+    }
+    else
+    {
+        target.state = State::Draining;
+        scheduleTimer(index, TimerWheel::Clock::now() + replyTimeout_);
+    }
+}
+
+void Agent::onTestReadable(uint32_t index)
+{
+    Target &target = targets_[index];
+    char response[1024];
+
+    while (target.testSocket != -1)
+    {
+        ssize_t received = recv(target.testSocket, response, sizeof(response), 0);
+        if (received < 0)
+        {
+            break;
+        }
+        if (received < static_cast<ssize_t>(TestPacket::kSize) || (target.state != State::Testing && target.state != State::Draining))
+        {
+            continue;
+        }
+
+        TestPacket reply(response);
+        uint32_t seq = reply.sequence();
+        if (seq == 0 || seq > target.sent || (seq - 1) / 64 >= target.seenBitmap.size())
+        {
+            continue;
+        }
+        uint64_t bit = 1ULL << ((seq - 1) % 64);
+        uint64_t &word = target.seenBitmap[(seq - 1) / 64];
+        if (word & bit)
+        {
+            continue;
+        }
+        word |= bit;
+        target.received++;
+        double sentAt = seq <= target.sentAt.size() ? target.sentAt[seq - 1] : NAN;
+
+        double T1 = unixSecondsFromNtp(reply.senderTimestamp());
+        double T2 = unixSecondsFromNtp(reply.receiveTimestamp());
+        double T3 = unixSecondsFromNtp(reply.reflectTimestamp());
+        double T4 = nowSeconds();
+
+        // T2 before T1 or T4 before T3 only means the clocks disagree.
+        if (T3 < T2 || T4 < T1)
+        {
+            target.invalid++;
+            if (perPacketRecords())
+            {
+                writer_.writePacket({target.name.c_str(), seq, PacketStatus::InvalidTimestamps,
+                                     sentAt, NAN, NAN, NAN});
+            }
+        }
+        else
+        {
+            target.clock.addSample(T1, T2, T3, T4);
+            ClockEstimator::Estimate estimate = target.clock.at((T1 + T4) / 2);
+            double outMs = (T2 - estimate.offset - T1) * 1000.0;
+            double backMs = (T4 - (T3 - estimate.offset)) * 1000.0;
+            target.totalRtt += (T4 - T1) * 1000.0;
+            target.totalOut += outMs;
+            target.totalBack += backMs;
+            if (perPacketRecords())
+            {
+                ClockFigures clock;
+                clock.offsetMs = estimate.offset * 1000.0;
+                clock.errorMs = estimate.error * 1000.0;
+                clock.driftPpm = estimate.drift * 1e6;
+                writer_.writePacket({target.name.c_str(), seq, PacketStatus::Ok, sentAt,
+                                     (T4 - T1) * 1000.0, outMs, backMs, {}, clock});
+            }
+        }
+
+        if (target.state == State::Draining && target.received == target.sent)
+        {
+            // Everything is back; no need to wait out the reply timeout.
+            onTimer(index);
+            return;
+        }
+    }
+}
+
+void Agent::closeSockets(Target &target)
+{
+    if (target.controlSocket != -1)
+    {
+        close(target.controlSocket);
+        target.controlSocket = -1;
+    }
+    if (target.testSocket != -1)
+    {
+        close(target.testSocket);
+        target.testSocket = -1;
+    }
+}
+
+void Agent::finishCycle(uint32_t index, const char *failure)
+{
+    Target &target = targets_[index];
+    closeSockets(target);
+
+    uint32_t valid = target.received - target.invalid;
+    ClockFigures clock;
+    if (target.clock.valid())
+    {
+        ClockEstimator::Estimate estimate = target.clock.at(nowSeconds());
+        clock.offsetMs = estimate.offset * 1000.0;
+        clock.errorMs = estimate.error * 1000.0;
+        clock.driftPpm = estimate.drift * 1e6;
+    }
+    if (format_ != OutputFormat::Text)
+    {
+        if (perPacketRecords())
+        {
+            for (uint32_t seq = 1; seq <= target.sent; ++seq)
+            {
+                if (!(target.seenBitmap[(seq - 1) / 64] & (1ULL << ((seq - 1) % 64))))
+                {
+                    writer_.writePacket({target.name.c_str(), seq, PacketStatus::Timeout,
+                                         target.sentAt[seq - 1], NAN, NAN, NAN});
+                }
+            }
+        }
+        writer_.writeSummary({target.name.c_str(), target.sent, target.received,
+                              valid > 0 ? target.totalRtt / valid : NAN,
+                              valid > 0 ? target.totalOut / valid : NAN,
+                              valid > 0 ? target.totalBack / valid : NAN, failure, {}, clock});
+    }
+    else if (failure)
+    {
+        std::cout << target.name << " - Test failed: " << failure << '\n';
+    }
+    else
+    {
+        std::cout << target.name << " - Sent: " << target.sent
+                  << ", Received: " << target.received;
+        if (valid > 0)
+        {
+            std::cout << ", RTT: " << (target.totalRtt / valid) << " ms"
+                      << ", Time Out: " << (target.totalOut / valid) << " ms"
+                      << ", Time Back: " << (target.totalBack / valid) << " ms"
+                      << ", Clock Offset: " << clock.offsetMs << " ms (+/- " << clock.errorMs << " ms)";
+        }
+        if (target.invalid > 0)
+        {
+            std::cout << ", Invalid timestamps: " << target.invalid;
+        }
+        std::cout << '\n';
+    }
+
+    // Keep each target on its own fixed cadence; a cycle that overran its
+    // period skips the missed slots instead of bunching up.
+    auto now = TimerWheel::Clock::now();
+    auto next = target.cycleStart + period_;
+    while (next <= now)
+    {
+        next += period_;
+    }
+    target.cycleStart = next;
+    target.state = State::Idle;
+    scheduleTimer(index, next);
+}
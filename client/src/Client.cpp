@@ -1,6 +1,9 @@
 #include "Client.h"
+#include "Address.h"
+#include "TscClock.h"
 #include <iostream>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -9,13 +12,149 @@
 #include <chrono>
 #include <thread>
 #include <random>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <openssl/crypto.h>
 
-Client::Client(const std::string &serverAddress, int controlPort, int testPort, bool shortOutput)
-    : serverAddress_(serverAddress), controlPort_(controlPort), testPort_(testPort),
-      controlSocket_(-1), testSocket_(-1), sid_(0), shortOutput_(shortOutput) {}
+namespace
+{
+// How long to wait for the reflected copy of each test packet before it
+// counts as lost.
+const std::chrono::seconds kReplyTimeout(2);
+
+// Bounds of the adaptive wait for each reply before the next packet is sent.
+const int kDefaultRtoFloorMs = 10;
+const int kDefaultRtoCeilingMs = 2000;
+
+// Test packets are 64 bytes unless asked otherwise.
+const size_t kDefaultPacketSize = 64;
+
+// UDP and IP headers, which take up the path as much as the payload does.
+const uint32_t kUdpHeaderSize = 8;
+const uint32_t kIpv4HeaderSize = 20;
+const uint32_t kIpv6HeaderSize = 40;
+
+// Signed distance between two NTP timestamps, in NTP fraction units. Exact
+// as long as they are less than 68 years apart.
+int64_t ntpDelta(uint64_t later, uint64_t earlier)
+{
+    return static_cast<int64_t>(later - earlier);
+}
+} // namespace
+
+Client::Client(const std::string &serverAddress, int controlPort, int testPort, bool shortOutput,
+               OutputFormat format)
+    : shortOutput_(shortOutput), format_(format), target_(serverAddress + ":" + std::to_string(controlPort)),
+      packetSize_(kDefaultPacketSize), trainLength_(1), serverAddress_(serverAddress), controlPort_(controlPort),
+      testPort_(testPort), controlSocket_(-1), testSocket_(-1), rto_(kDefaultRtoFloorMs, kDefaultRtoCeilingMs),
+      lossTimers_(std::chrono::milliseconds(10), 256), runStartNtp_(0), runStartAt_(0), sid_(0),
+      mode_(ModeUnauthenticated)
+{
+    if (format_ != OutputFormat::Text)
+    {
+        writer_.reset(new ResultWriter(std::cout, format_));
+    }
+}
+
+void Client::setIntervalRollups(const std::vector<int> &seconds)
+{
+    rollupSeconds_ = seconds;
+}
+
+void Client::setDscpClasses(const std::vector<int> &dscps)
+{
+    dscpClasses_ = dscps;
+}
+
+void Client::setReplyTimeoutBounds(int floorMs, int ceilingMs)
+{
+    // Waiting past the reply timeout would gain nothing; the packet is lost
+    // by then.
+    int limitMs = std::chrono::duration_cast<std::chrono::milliseconds>(kReplyTimeout).count();
+    rto_ = RtoEstimator(std::min(floorMs, limitMs), std::min(ceilingMs, limitMs));
+}
+
+void Client::setPacketSize(size_t size)
+{
+    packetSize_ = size;
+}
+
+void Client::setTrainLength(int packets)
+{
+    trainLength_ = static_cast<uint32_t>(std::max(packets, 1));
+}
+
+void Client::setSecurity(uint8_t mode, const std::string &keyId, const std::string &secret)
+{
+    mode_ = mode;
+    keyId_ = keyId;
+    secret_ = secret;
+}
+
+void Client::reportIntervals(bool final)
+{
+    closedIntervals_.clear();
+    for (auto &aggregator : aggregators_)
+    {
+        if (final)
+        {
+            aggregator.finish(closedIntervals_);
+        }
+        else
+        {
+            aggregator.advance(std::chrono::steady_clock::now(), closedIntervals_);
+        }
+    }
+
+    for (auto &record : closedIntervals_)
+    {
+        record.target = target_.c_str();
+        if (writer_)
+        {
+            writer_->writeInterval(record);
+            continue;
+        }
+
+        time_t start = static_cast<time_t>(record.startTime);
+        char startText[16];
+        strftime(startText, sizeof(startText), "%H:%M:%S", localtime(&start));
+
+        std::cout << "Interval " << record.widthSec << "s @ " << startText
+                  << " - Sent: " << record.sent << ", Received: " << record.received
+                  << ", Lost: " << record.lost << ", Late: " << record.late;
+        if (!std::isnan(record.avgRttMs))
+        {
+            std::cout << ", RTT min/avg/max: " << record.minRttMs << "/" << record.avgRttMs
+                      << "/" << record.maxRttMs << " ms"
+                      << ", p50/p90/p99: " << record.p50RttMs << "/" << record.p90RttMs
+                      << "/" << record.p99RttMs << " ms";
+        }
+        if (!std::isnan(record.jitterMs))
+        {
+            std::cout << ", Jitter: " << record.jitterMs << " ms";
+        }
+        std::cout << '\n';
+    }
+}
+
+void Client::flushOutput()
+{
+    if (writer_)
+    {
+        writer_->flush();
+    }
+    else
+    {
+        std::cout.flush();
+    }
+}
 
 bool Client::runTest(int packetCount, int intervalMs)
 {
+    // Calibrate the packet clock now rather than on the first test packet.
+    TscClock::instance();
+
     try
     {
         if (!connectToServer())
@@ -70,10 +209,10 @@ bool Client::runTest(int packetCount, int intervalMs)
 bool Client::connectToServer()
 {
     memset(&serverAddr_, 0, sizeof(serverAddr_));
-    serverAddr_.sin_family = AF_INET;
-    serverAddr_.sin_port = htons(controlPort_);
+    serverAddr_.sin6_family = AF_INET6;
+    serverAddr_.sin6_port = htons(controlPort_);
 
-    if (inet_pton(AF_INET, serverAddress_.c_str(), &serverAddr_.sin_addr) <= 0)
+    if (!parseAddress(serverAddress_, serverAddr_.sin6_addr))
     {
         if (!shortOutput_)
         {
@@ -82,18 +221,20 @@ bool Client::connectToServer()
         return false;
     }
 
-    controlSocket_ = socket(AF_INET, SOCK_STREAM, 0);
+    controlSocket_ = openSocket(serverAddr_.sin6_addr, SOCK_STREAM);
     if (controlSocket_ < 0)
     {
         if (!shortOutput_)
         {
-            std::cerr << "Failed to create control socket" << std::endl;
+            std::cerr << "Failed to create control socket: " << strerror(errno) << std::endl;
         }
         return false;
     }
 
     // Connect to server
-    if (connect(controlSocket_, (struct sockaddr *)&serverAddr_, sizeof(serverAddr_)) < 0)
+    struct sockaddr_storage name;
+    socklen_t nameSize = toSocketAddress(socketFamily(controlSocket_), serverAddr_, name);
+    if (connect(controlSocket_, (struct sockaddr *)&name, nameSize) < 0)
     {
         if (!shortOutput_)
         {
@@ -102,16 +243,28 @@ bool Client::connectToServer()
         return false;
     }
 
-    testSocket_ = socket(AF_INET, SOCK_DGRAM, 0);
+    testSocket_ = openSocket(serverAddr_.sin6_addr, SOCK_DGRAM);
     if (testSocket_ < 0)
     {
         if (!shortOutput_)
         {
-            std::cerr << "Failed to create test socket" << std::endl;
+            std::cerr << "Failed to create test socket: " << strerror(errno) << std::endl;
         }
         return false;
     }
 
+    // Without kernel timestamps only the packet-embedded times are reported.
+    if (!timestamps_.enable(testSocket_) && verbose())
+    {
+        std::cout << "Kernel timestamps unavailable" << std::endl;
+    }
+
+    // The DSCP of each reply, to tell remarking on the way back.
+    if (!enableTrafficClass(testSocket_) && verbose())
+    {
+        std::cout << "Reply DSCP unavailable" << std::endl;
+    }
+
     return true;
 }
 
@@ -127,32 +280,50 @@ bool Client::performControlConnection()
         setsockopt(controlSocket_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
         // Receive server greeting first (server sends first)
-        std::vector<char> serverGreeting(12);
-        ssize_t received = recv(controlSocket_, serverGreeting.data(), serverGreeting.size(), MSG_WAITALL);
+        char greetingBuffer[ServerGreeting::kSize];
+        ssize_t received = recv(controlSocket_, greetingBuffer, sizeof(greetingBuffer), MSG_WAITALL);
 
-        if (received != static_cast<ssize_t>(serverGreeting.size()))
+        if (received != static_cast<ssize_t>(sizeof(greetingBuffer)))
         {
             throw std::runtime_error("Failed to receive server greeting");
         }
 
         // Verify server mode
-        if (serverGreeting[3] != 1)
+        uint8_t serverModes = ServerGreeting(greetingBuffer).modes();
+        if ((serverModes & mode_) == 0)
+        {
+            throw std::runtime_error(std::string("Server does not support ") + modeName(mode_) + " mode");
+        }
+
+        // A server offering the secured modes sends Challenge, Salt and Count
+        // after its greeting, whichever mode the client picks.
+        char greetingExtension[ServerChallenge::kSize];
+        if ((serverModes & (ModeAuthenticated | ModeEncrypted)) &&
+            recv(controlSocket_, greetingExtension, sizeof(greetingExtension), MSG_WAITALL) !=
+                static_cast<ssize_t>(sizeof(greetingExtension)))
         {
-            throw std::runtime_error("Unsupported server mode");
+            throw std::runtime_error("Failed to receive server greeting");
         }
 
-        std::vector<char> clientGreeting(12, 0);
-        clientGreeting[3] = 1; // Unauthenticated mode
+        if (mode_ == ModeUnauthenticated)
+        {
+            char clientGreeting[ClientGreeting::kSize] = {0};
+            ClientGreeting(clientGreeting).setMode(ModeUnauthenticated);
 
-        if (send(controlSocket_, clientGreeting.data(), clientGreeting.size(), 0) !=
-            static_cast<ssize_t>(clientGreeting.size()))
+            if (send(controlSocket_, clientGreeting, sizeof(clientGreeting), 0) !=
+                static_cast<ssize_t>(sizeof(clientGreeting)))
+            {
+                throw std::runtime_error("Failed to send client greeting");
+            }
+        }
+        else
         {
-            throw std::runtime_error("Failed to send client greeting");
+            sendSetupResponse(greetingExtension);
         }
 
-        if (!shortOutput_)
+        if (verbose())
         {
-            std::cout << "Control connection established" << std::endl;
+            std::cout << "Control connection established (" << modeName(mode_) << " mode)" << std::endl;
         }
         return true;
     }
@@ -166,6 +337,83 @@ bool Client::performControlConnection()
     }
 }
 
+void Client::sendSetupResponse(char *greetingExtension)
+{
+    ServerChallenge challenge(greetingExtension);
+    uint32_t count = challenge.count();
+    if (count < kMinKeyDerivationCount || count > kMaxKeyDerivationCount)
+    {
+        throw std::runtime_error("Server sent an unreasonable key derivation count");
+    }
+
+    // Client greeting followed by KeyID(80) Token(64) Client-IV(16)
+    char clientGreeting[ClientGreeting::kSize + SetupResponse::kSize] = {0};
+    ClientGreeting(clientGreeting).setMode(mode_);
+    SetupResponse response(clientGreeting + ClientGreeting::kSize);
+    memcpy(response.keyId(), keyId_.data(), std::min(keyId_.size(), kKeyIdSize));
+
+    unsigned char key[16];
+    bool ok = randomBytes(keys_.aes, sizeof(keys_.aes)) && randomBytes(keys_.hmac, sizeof(keys_.hmac)) &&
+              randomBytes(response.clientIv(), 16) && deriveKey(secret_, challenge.salt(), count, key) &&
+              sealToken(key, challenge.challenge(), keys_, response.token());
+    OPENSSL_cleanse(key, sizeof(key));
+    if (!ok)
+    {
+        throw std::runtime_error("Failed to prepare authentication token");
+    }
+
+    if (send(controlSocket_, clientGreeting, sizeof(clientGreeting), 0) != static_cast<ssize_t>(sizeof(clientGreeting)))
+    {
+        throw std::runtime_error("Failed to send client greeting");
+    }
+
+    char startBuffer[ServerStart::kSize];
+    if (recv(controlSocket_, startBuffer, sizeof(startBuffer), MSG_WAITALL) != static_cast<ssize_t>(sizeof(startBuffer)))
+    {
+        throw std::runtime_error("Failed to receive Server-Start");
+    }
+    ServerStart serverStart(startBuffer);
+    if (serverStart.accept() != 0)
+    {
+        throw std::runtime_error("Server rejected authentication (code: " +
+                                 std::to_string(static_cast<int>(serverStart.accept())) + ")");
+    }
+
+    if (!controlCipher_.init(keys_, response.clientIv(), serverStart.serverIv()))
+    {
+        throw std::runtime_error("Failed to set up control encryption");
+    }
+}
+
+bool Client::sendControl(const char *message, size_t size)
+{
+    if (!controlCipher_.active())
+    {
+        return send(controlSocket_, message, size, 0) == static_cast<ssize_t>(size);
+    }
+    std::vector<char> sealed = controlCipher_.seal(message, size);
+    return !sealed.empty() && send(controlSocket_, sealed.data(), sealed.size(), 0) == static_cast<ssize_t>(sealed.size());
+}
+
+bool Client::receiveControl(char *message, size_t size)
+{
+    if (!controlCipher_.active())
+    {
+        return recv(controlSocket_, message, size, MSG_WAITALL) == static_cast<ssize_t>(size);
+    }
+
+    std::vector<char> sealed(ControlCipher::sealedSize(size));
+    size_t paddedSize = sealed.size() - kMacSize;
+    if (recv(controlSocket_, sealed.data(), sealed.size(), MSG_WAITALL) != static_cast<ssize_t>(sealed.size()) ||
+        !controlCipher_.decrypt(sealed.data(), sealed.size(), sealed.data()) ||
+        !controlCipher_.verify(sealed.data(), paddedSize, &sealed[paddedSize]))
+    {
+        return false;
+    }
+    memcpy(message, sealed.data(), size);
+    return true;
+}
+
 bool Client::setupTestSession()
 {
     try
@@ -180,14 +428,20 @@ bool Client::setupTestSession()
         std::mt19937 gen(rd());
         std::uniform_int_distribution<uint32_t> dis;
         sid_ = dis(gen);
+        if (!testCipher_.init(mode_, keys_, sid_))
+        {
+            throw std::runtime_error("Failed to set up test packet keys");
+        }
 
-        struct sockaddr_in localAddr;
+        struct sockaddr_in6 localAddr;
         memset(&localAddr, 0, sizeof(localAddr));
-        localAddr.sin_family = AF_INET;
-        localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-        localAddr.sin_port = 0; // Let system choose port
+        localAddr.sin6_family = AF_INET6;
+        localAddr.sin6_addr = in6addr_any;
+        localAddr.sin6_port = 0; // Let system choose port
 
-        if (bind(testSocket_, (struct sockaddr *)&localAddr, sizeof(localAddr)) < 0)
+        int family = socketFamily(testSocket_);
+        struct sockaddr_storage name;
+        if (bind(testSocket_, (struct sockaddr *)&name, toSocketAddress(family, localAddr, name)) < 0)
         {
             if (!shortOutput_)
             {
@@ -205,42 +459,42 @@ bool Client::setupTestSession()
             }
             return false;
         }
+        localAddr = fromSocketAddress(localAddr);
 
-        struct sockaddr_in tempAddr;
-        memset(&tempAddr, 0, sizeof(tempAddr));
-        tempAddr.sin_family = AF_INET;
-        tempAddr.sin_port = htons(1); // Dummy port
-        tempAddr.sin_addr = serverAddr_.sin_addr;
+        struct sockaddr_in6 tempAddr = serverAddr_;
+        tempAddr.sin6_port = htons(1); // Dummy port
 
-        int tempSocket = socket(AF_INET, SOCK_DGRAM, 0);
+        int tempSocket = openSocket(serverAddr_.sin6_addr, SOCK_DGRAM);
         if (tempSocket >= 0)
         {
-            if (connect(tempSocket, (struct sockaddr *)&tempAddr, sizeof(tempAddr)) == 0)
+            if (connect(tempSocket, (struct sockaddr *)&name, toSocketAddress(family, tempAddr, name)) == 0)
             {
                 socklen_t tempLen = sizeof(tempAddr);
                 if (getsockname(tempSocket, (struct sockaddr *)&tempAddr, &tempLen) == 0)
                 {
-                    localAddr.sin_addr = tempAddr.sin_addr;
+                    localAddr.sin6_addr = fromSocketAddress(tempAddr).sin6_addr;
                 }
             }
             close(tempSocket);
         }
 
-        if (localAddr.sin_addr.s_addr == 0)
+        if (IN6_IS_ADDR_UNSPECIFIED(&localAddr.sin6_addr))
         {
-            localAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            localAddr.sin6_addr = isMappedIpv4(serverAddr_.sin6_addr) ? mapIpv4(htonl(INADDR_LOOPBACK))
+                                                                      : in6addr_loopback;
         }
 
-        // Send Request-Session (28 bytes)
-        std::vector<char> requestSession(28, 0);
-        requestSession[0] = 1; // Request-Session command
-
-        *reinterpret_cast<uint32_t *>(&requestSession[12]) = htonl(sid_);               // SID
-        *reinterpret_cast<uint16_t *>(&requestSession[20]) = localAddr.sin_port;        // Keep in network order
-        *reinterpret_cast<uint32_t *>(&requestSession[24]) = localAddr.sin_addr.s_addr; // Keep in network order
-
-        ssize_t sent = send(controlSocket_, requestSession.data(), requestSession.size(), 0);
-        if (sent != static_cast<ssize_t>(requestSession.size()))
+        char requestBuffer[RequestSession::kSize] = {0};
+        RequestSession request(requestBuffer);
+        request.setCommand(CommandRequestSession);
+        request.setSid(sid_);
+        request.setSenderPort(ntohs(localAddr.sin6_port));
+        request.setReceiverPort(static_cast<uint16_t>(testPort_));
+        // The field only holds IPv4; 0 tells the server to expect test
+        // packets from the control connection's address.
+        request.setSenderAddress(isMappedIpv4(localAddr.sin6_addr) ? ntohl(mappedIpv4(localAddr.sin6_addr)) : 0);
+
+        if (!sendControl(requestBuffer, sizeof(requestBuffer)))
         {
             if (!shortOutput_)
             {
@@ -249,42 +503,46 @@ bool Client::setupTestSession()
             return false;
         }
 
-        if (!shortOutput_)
+        if (verbose())
         {
             std::cout << "Sent Request-Session with SID=" << sid_
-                      << ", port=" << ntohs(localAddr.sin_port)
-                      << ", addr=" << inet_ntoa(localAddr.sin_addr) << std::endl;
+                      << ", addr=" << formatAddress(localAddr) << std::endl;
         }
 
-        // Receive Accept-Session (28 bytes)
-        std::vector<char> acceptSession(28);
-        ssize_t received = recv(controlSocket_, acceptSession.data(), acceptSession.size(), MSG_WAITALL);
-
-        if (received != static_cast<ssize_t>(acceptSession.size()))
+        char acceptBuffer[AcceptSession::kSize];
+        errno = 0;
+        if (!receiveControl(acceptBuffer, sizeof(acceptBuffer)))
         {
             if (!shortOutput_)
             {
                 std::cerr << "Failed to receive Accept-Session: "
-                          << (received > 0 ? "incomplete" : strerror(errno))
+                          << (errno != 0 ? strerror(errno) : "incomplete or not authentic")
                           << std::endl;
             }
             return false;
         }
 
-        // Check if session was accepted (byte 16 should be 0)
-        if (acceptSession[16] != 0)
+        // Zero means accepted
+        AcceptSession accept(acceptBuffer);
+        if (accept.accept() != 0)
         {
             if (!shortOutput_)
             {
                 std::cerr << "Session was not accepted by server (code: "
-                          << static_cast<int>(acceptSession[16]) << ")" << std::endl;
+                          << static_cast<int>(accept.accept()) << ")" << std::endl;
             }
             return false;
         }
 
-        if (!shortOutput_)
+        // The server may give the session a test port of its own.
+        if (accept.port() != 0)
+        {
+            testPort_ = accept.port();
+        }
+
+        if (verbose())
         {
-            std::cout << "Session accepted by server" << std::endl;
+            std::cout << "Session accepted by server, test port " << testPort_ << std::endl;
         }
         return true;
     }
@@ -300,12 +558,10 @@ bool Client::setupTestSession()
 
 bool Client::startTestSession()
 {
-    // Send Start-Sessions (12 bytes)
-    std::vector<char> startSessions(12, 0);
-    startSessions[0] = 7; // Start-Sessions command
+    char startSessions[ControlMessage::kSize] = {0};
+    ControlMessage(startSessions).setCommand(CommandStartSessions);
 
-    if (send(controlSocket_, startSessions.data(), startSessions.size(), 0) !=
-        static_cast<ssize_t>(startSessions.size()))
+    if (!sendControl(startSessions, sizeof(startSessions)))
     {
         if (!shortOutput_)
         {
@@ -314,10 +570,8 @@ bool Client::startTestSession()
         return false;
     }
 
-    // Receive Start-Ack (12 bytes)
-    std::vector<char> startAck(12);
-    if (recv(controlSocket_, startAck.data(), startAck.size(), MSG_WAITALL) !=
-        static_cast<ssize_t>(startAck.size()))
+    char startAck[ControlMessage::kSize];
+    if (!receiveControl(startAck, sizeof(startAck)))
     {
         if (!shortOutput_)
         {
@@ -326,7 +580,7 @@ bool Client::startTestSession()
         return false;
     }
 
-    if (!shortOutput_)
+    if (verbose())
     {
         std::cout << "Test session started" << std::endl;
     }
@@ -335,12 +589,10 @@ bool Client::startTestSession()
 
 bool Client::stopTestSession()
 {
-    // Send Stop-Sessions (12 bytes)
-    std::vector<char> stopSessions(12, 0);
-    stopSessions[0] = 4; // Stop-Sessions command
+    char stopSessions[ControlMessage::kSize] = {0};
+    ControlMessage(stopSessions).setCommand(CommandStopSessions);
 
-    if (send(controlSocket_, stopSessions.data(), stopSessions.size(), 0) !=
-        static_cast<ssize_t>(stopSessions.size()))
+    if (!sendControl(stopSessions, sizeof(stopSessions)))
     {
         if (!shortOutput_)
         {
@@ -349,10 +601,8 @@ bool Client::stopTestSession()
         return false;
     }
 
-    // Receive Stop-Ack (12 bytes)
-    std::vector<char> stopAck(12);
-    if (recv(controlSocket_, stopAck.data(), stopAck.size(), MSG_WAITALL) !=
-        static_cast<ssize_t>(stopAck.size()))
+    char stopAck[ControlMessage::kSize];
+    if (!receiveControl(stopAck, sizeof(stopAck)))
     {
         if (!shortOutput_)
         {
@@ -361,180 +611,662 @@ bool Client::stopTestSession()
         return false;
     }
 
-    if (!shortOutput_)
+    if (verbose())
     {
         std::cout << "Test session stopped" << std::endl;
     }
     return true;
 }
 
-bool Client::sendTestPackets(int packetCount, int intervalMs)
+size_t Client::sendTrain(struct mmsghdr *messages, size_t count)
 {
-    // Prepare test packet (64 bytes as per TWAMP specification)
-    std::vector<char> testPacket(64, 0);
-    double total_rtt = 0;
-    double total_out = 0;
-    double total_back = 0;
-    int successCount = 0;
+    size_t sent = 0;
+    while (sent < count)
+    {
+        int result = sendmmsg(testSocket_, messages + sent, static_cast<unsigned int>(count - sent), 0);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            break;
+        }
+        sent += result;
+    }
+    return sent;
+}
 
-    struct sockaddr_in testServerAddr;
-    memset(&testServerAddr, 0, sizeof(testServerAddr));
-    testServerAddr.sin_family = AF_INET;
-    testServerAddr.sin_port = htons(testPort_);     // Server's test port
-    testServerAddr.sin_addr = serverAddr_.sin_addr; // Server's IP
+ssize_t Client::receiveReply(char *buffer, size_t size, double &kernelReceivedAt, TrafficClass &traffic)
+{
+    struct sockaddr_in6 from;
+    struct iovec iov = {buffer, size};
+    char control[256];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(testSocket_, &msg, MSG_DONTWAIT);
+    kernelReceivedAt = received >= 0 && timestamps_.active() ? timestamps_.receivedAt(&msg) : 0;
+    traffic = received >= 0 ? trafficClassOf(&msg) : TrafficClass{0, 0};
+    return received;
+}
 
-    if (!shortOutput_)
+bool Client::sendTestPackets(int packetCount, int intervalMs)
+{
+    // Every probe is a train, of one packet unless trains were asked for.
+    // The messages are laid out once; for each train only the packets'
+    // contents are rewritten and the whole train goes out with sendmmsg().
+    size_t length = trainLength_;
+    std::vector<char> buffers(length * packetSize_);
+    std::vector<char> controls(length * kTosControlSize);
+    std::vector<struct iovec> iovs(length);
+    std::vector<struct mmsghdr> messages(length);
+    std::vector<Outstanding> train(length);
+    totals_ = TestTotals();
+    totals_.kernel.rttMs = totals_.kernel.outMs = totals_.kernel.backMs = 0;
+    totals_.kernel.sendDelayMs = totals_.kernel.receiveDelayMs = 0;
+    totals_.classes.assign(dscpClasses_.size(), ClassTotals());
+    samples_.clear();
+    outstanding_.clear();
+
+    struct sockaddr_in6 testServerAddr = serverAddr_;
+    testServerAddr.sin6_port = htons(testPort_);
+    struct sockaddr_storage testServerName;
+    socklen_t testServerNameSize = toSocketAddress(socketFamily(testSocket_), testServerAddr, testServerName);
+    memset(messages.data(), 0, messages.size() * sizeof(struct mmsghdr));
+    for (size_t j = 0; j < length; ++j)
     {
-        std::cout << "Sending " << packetCount << " test packets to "
-                  << inet_ntoa(testServerAddr.sin_addr) << ":" << ntohs(testServerAddr.sin_port) << std::endl;
+        iovs[j].iov_base = buffers.data() + j * packetSize_;
+        iovs[j].iov_len = packetSize_;
+        messages[j].msg_hdr.msg_name = &testServerName;
+        messages[j].msg_hdr.msg_namelen = testServerNameSize;
+        messages[j].msg_hdr.msg_iov = &iovs[j];
+        messages[j].msg_hdr.msg_iovlen = 1;
     }
 
-    for (int i = 0; i < packetCount; i++)
+    uint32_t headers = kUdpHeaderSize + (isMappedIpv4(serverAddr_.sin6_addr) ? kIpv4HeaderSize : kIpv6HeaderSize);
+    trains_.reset(length > 1 ? new TrainAnalyzer(trainLength_, static_cast<uint32_t>(packetSize_) + headers)
+                             : nullptr);
+
+    aggregators_.clear();
+    clock_.reset();
+    kernelClock_.reset();
+    rto_.reset();
+    runStartNtp_ = ntpFromUnixNs(TscClock::instance().nowNs());
+    runStartAt_ = unixSecondsFromNtp(runStartNtp_);
+    auto runStart = std::chrono::steady_clock::now();
+    double runStartWall = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    for (int seconds : rollupSeconds_)
     {
-        // Fill sequence number (bytes 0-3)
-        *reinterpret_cast<uint32_t *>(&testPacket[0]) = htonl(i + 1);
-
-        // Add sender timestamp (bytes 8-15) - TWAMP uses this format
-        auto now = std::chrono::system_clock::now();
-        auto since_epoch = now.time_since_epoch();
-        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
-        auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(since_epoch - seconds);
+        aggregators_.emplace_back(std::chrono::seconds(seconds), kReplyTimeout, runStart, runStartWall);
+    }
 
-        uint32_t secs = htonl(static_cast<uint32_t>(seconds.count() + 2208988800UL)); // NTP epoch
-        uint32_t frac = htonl(static_cast<uint32_t>((microseconds.count() << 32) / 1000000));
+    if (verbose())
+    {
+        std::cout << "Sending " << packetCount;
+        if (length > 1)
+        {
+            std::cout << " trains of " << length << " " << packetSize_ << "-byte packets to ";
+        }
+        else
+        {
+            std::cout << " test packets to ";
+        }
+        std::cout << formatAddress(testServerAddr) << std::endl;
+    }
 
-        memcpy(&testPacket[8], &secs, 4);  // Sender timestamp seconds
-        memcpy(&testPacket[12], &frac, 4); // Sender timestamp fraction
+    for (int i = 0; i < packetCount; i++)
+    {
+        reportIntervals(false);
 
-        // Store send time for RTT calculation
-        auto send_time = std::chrono::steady_clock::now();
+        // A train keeps one DSCP so that its packets queue together.
+        size_t classIndex = totals_.classes.empty() ? 0 : i % totals_.classes.size();
+        int dscp = totals_.classes.empty() ? 0 : dscpClasses_[classIndex];
+        uint32_t firstSeq = static_cast<uint32_t>(i) * trainLength_ + 1;
+        for (size_t j = 0; j < length; ++j)
+        {
+            char *data = buffers.data() + j * packetSize_;
+            std::fill(data, data + packetSize_, 0);
+
+            uint32_t seq = firstSeq + static_cast<uint32_t>(j);
+            TestPacket header(data);
+            header.setSequence(seq);
+            int64_t nowNs = TscClock::instance().nowNs();
+            header.setSenderTimestamp(ntpFromUnixNs(nowNs));
+
+            // Store send time for RTT calculation
+            Outstanding &packet = train[j];
+            packet.sentTime = std::chrono::steady_clock::now();
+            packet.sentNs = nowNs;
+            packet.sentAt = nowNs / 1e9;
+            packet.classIndex = classIndex;
+            packet.dscp = dscp;
+
+            if (!testCipher_.seal(data, packetSize_))
+            {
+                if (!shortOutput_)
+                {
+                    std::cerr << "Failed to seal test packet " << seq << std::endl;
+                }
+                return false;
+            }
 
-        ssize_t sent = sendto(testSocket_, testPacket.data(), testPacket.size(), 0,
-                              (struct sockaddr *)&testServerAddr, sizeof(testServerAddr));
+            struct msghdr &msg = messages[j].msg_hdr;
+            char *control = controls.data() + j * kTosControlSize;
+            msg.msg_control = dscp > 0 ? control : nullptr;
+            msg.msg_controllen = dscp > 0 ? writeTos(control, testServerAddr, static_cast<uint8_t>(dscp << 2)) : 0;
+        }
 
-        if (sent != static_cast<ssize_t>(testPacket.size()))
+        size_t sent = sendTrain(messages.data(), length);
+        if (sent < length)
         {
             if (!shortOutput_)
             {
-                std::cerr << "Failed to send test packet " << (i + 1) << ": " << strerror(errno) << std::endl;
+                std::cerr << "Failed to send test packet " << firstSeq + sent << ": " << strerror(errno) << std::endl;
             }
             return false;
         }
 
-        char response[1024];
-        struct sockaddr_in fromAddr;
-        socklen_t fromLen = sizeof(fromAddr);
-
-        struct timeval timeout;
-        timeout.tv_sec = 2; // Increased timeout
-        timeout.tv_usec = 0;
-        setsockopt(testSocket_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        for (size_t j = 0; j < length; ++j)
+        {
+            uint32_t seq = firstSeq + static_cast<uint32_t>(j);
+            Outstanding &packet = train[j];
+            for (auto &aggregator : aggregators_)
+            {
+                aggregator.onSent(packet.sentTime);
+            }
+            if (!totals_.classes.empty())
+            {
+                totals_.classes[classIndex].sent++;
+            }
 
-        ssize_t received = recvfrom(testSocket_, response, sizeof(response), 0,
-                                    (struct sockaddr *)&fromAddr, &fromLen);
+            // Collected straight away, oldest first, as they reach the error
+            // queue; replies may come back in any order.
+            packet.timestampId = timestamps_.onSent();
+            packet.kernelSentAt = timestamps_.active() ? timestamps_.sentAt(packet.timestampId) : 0;
+            outstanding_[seq] = packet;
+            lossTimers_.schedule(seq, 0, packet.sentTime + kReplyTimeout);
+        }
 
-        if (received > 0)
+        // Wait for the last reply no longer than the network has lately
+        // taken. Past that the packets are left outstanding and the next
+        // probe is sent.
+        uint32_t lastSeq = firstSeq + static_cast<uint32_t>(length) - 1;
+        auto rtoDeadline =
+            train[length - 1].sentTime + std::chrono::microseconds(static_cast<int64_t>(rto_.timeoutMs() * 1000));
+        serviceReplies(rtoDeadline, lastSeq);
+        if (outstanding_.count(lastSeq))
         {
-            auto recv_time = std::chrono::steady_clock::now();
-            auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(recv_time - send_time);
+            rto_.backOff();
+        }
 
-            if (received >= 32)
+        if (i < packetCount - 1)
+        {
+            // Hand buffered output over before pausing so results stay live
+            // without paying for a flush on every packet.
+            auto nextSend = std::chrono::steady_clock::now() + std::chrono::milliseconds(intervalMs);
+            if (intervalMs > 0)
             {
-                uint32_t t1_secs, t1_frac;
-                uint32_t t2_secs, t2_frac;
-                uint32_t t3_secs, t3_frac;
-
-                memcpy(&t1_secs, &response[8], 4);
-                memcpy(&t1_frac, &response[12], 4);
-                memcpy(&t2_secs, &response[16], 4);
-                memcpy(&t2_frac, &response[20], 4);
-                memcpy(&t3_secs, &response[24], 4);
-                memcpy(&t3_frac, &response[28], 4);
-
-                double T1 = (ntohl(t1_secs) - 2208988800UL) +
-                            (static_cast<double>(ntohl(t1_frac)) / 4294967296.0);
-                double T2 = (ntohl(t2_secs) - 2208988800UL) +
-                            (static_cast<double>(ntohl(t2_frac)) / 4294967296.0);
-                double T3 = (ntohl(t3_secs) - 2208988800UL) +
-                            (static_cast<double>(ntohl(t3_frac)) / 4294967296.0);
-
-                // Current time T4 in seconds since UNIX epoch
-                auto now = std::chrono::system_clock::now();
-                auto since_epoch = now.time_since_epoch();
-                double T4 = std::chrono::duration_cast<std::chrono::microseconds>(since_epoch).count() / 1e6;
-
-                if (T2 < T1 || T3 < T2 || T4 < T3)
-                {
-                    if (!shortOutput_)
-                    {
-                        std::cerr << "Invalid timestamps detected: "
-                                  << "T1=" << T1 << ", T2=" << T2
-                                  << ", T3=" << T3 << ", T4=" << T4 << std::endl;
-                    }
-                    continue;
-                }
-                double out_time = (T2 - T1) * 1000.0;
-                double back_time = (T4 - T3) * 1000.0;
-                double rtt_calc = (T4 - T1) * 1000.0;
+                reportIntervals(false);
+                flushOutput();
+            }
+            serviceReplies(nextSend, 0);
+            std::this_thread::sleep_until(nextSend);
+        }
+    }
 
-                total_rtt += rtt_calc;
-                total_out += out_time;
-                total_back += back_time;
-                successCount++;
+    // Whatever is still outstanding is answered or declared lost within one
+    // reply timeout.
+    serviceReplies(std::chrono::steady_clock::time_point::max(), 0);
+    reportIntervals(true);
 
-                if (!shortOutput_)
-                {
-                    std::cout << "Packet " << (i + 1)
-                              << " - RTT: " << rtt_calc << " ms"
-                              << ", Time Out: " << out_time << " ms"
-                              << ", Time Back: " << back_time << " ms"
-                              << std::endl;
-                }
+    ClockFigures clock;
+    if (clock_.valid())
+    {
+        ClockEstimator::Estimate estimate = clock_.at(runSeconds(ntpFromUnixNs(TscClock::instance().nowNs())));
+        clock.offsetMs = estimate.offset * 1000.0;
+        clock.errorMs = estimate.error * 1000.0;
+        clock.driftPpm = estimate.drift * 1e6;
+    }
+
+    // Delays are summed up in NTP units and only turned into milliseconds
+    // at the end.
+    int successCount = static_cast<int>(samples_.size());
+    samplestats::Summary rttSummary = samplestats::summarize(samples_.rtt().data(), samples_.size());
+    samplestats::Summary outSummary = samplestats::summarize(samples_.out().data(), samples_.size());
+    samplestats::Summary backSummary = samplestats::summarize(samples_.back().data(), samples_.size());
+    samplestats::Distribution rttDistribution(samples_.rtt().data(), samples_.size(), rttSummary);
+    double avgRtt = ntpUnitsToMs(rttSummary.mean);
+    double avgOut = ntpUnitsToMs(outSummary.mean);
+    double avgBack = ntpUnitsToMs(backSummary.mean);
+    int kernelCount = totals_.kernelCount;
+    KernelTimes kernelAverage;
+    if (kernelCount > 0)
+    {
+        kernelAverage.rttMs = totals_.kernel.rttMs / kernelCount;
+        kernelAverage.outMs = totals_.kernel.outMs / kernelCount;
+        kernelAverage.backMs = totals_.kernel.backMs / kernelCount;
+        kernelAverage.sendDelayMs = totals_.kernel.sendDelayMs / kernelCount;
+        kernelAverage.receiveDelayMs = totals_.kernel.receiveDelayMs / kernelCount;
+    }
+
+    uint32_t sentCount = static_cast<uint32_t>(packetCount) * trainLength_;
+    TrainAnalyzer::Result trains;
+    if (trains_)
+    {
+        trains = trains_->finish();
+    }
+
+    if (writer_)
+    {
+        bool any = successCount > 0;
+        SummaryRecord summary = {target_.c_str(), sentCount, static_cast<uint32_t>(totals_.received),
+                                 any ? avgRtt : NAN, any ? avgOut : NAN, any ? avgBack : NAN,
+                                 nullptr, kernelAverage, clock};
+        if (any)
+        {
+            summary.minRttMs = ntpUnitsToMs(rttSummary.min);
+            summary.maxRttMs = ntpUnitsToMs(rttSummary.max);
+            summary.p50RttMs = ntpUnitsToMs(rttDistribution.percentile(50));
+            summary.p90RttMs = ntpUnitsToMs(rttDistribution.percentile(90));
+            summary.p99RttMs = ntpUnitsToMs(rttDistribution.percentile(99));
+            summary.stddevRttMs = ntpUnitsToMs(std::sqrt(rttSummary.variance));
+        }
+        writer_->writeSummary(summary);
+        for (size_t c = 0; c < totals_.classes.size(); ++c)
+        {
+            const ClassTotals &totals = totals_.classes[c];
+            bool measured = totals.measured > 0;
+            writer_->writeClass({target_.c_str(), dscpClasses_[c], totals.sent, totals.received,
+                                 measured ? totals.rtt / totals.measured : NAN,
+                                 measured ? totals.out / totals.measured : NAN,
+                                 measured ? totals.back / totals.measured : NAN,
+                                 totals.remarkedOut, totals.remarkedBack});
+        }
+        if (trains_)
+        {
+            bool measured = trains.measured > 0;
+            writer_->writeTrains({target_.c_str(), static_cast<uint32_t>(packetCount), trainLength_,
+                                  static_cast<uint32_t>(packetSize_), trains.measured,
+                                  measured ? trains.capacityMbps : NAN, measured ? trains.availableMbps : NAN,
+                                  measured ? trains.avgDelayGrowthMs : NAN, measured ? trains.maxDelayGrowthMs : NAN});
+        }
+        writer_->flush();
+    }
+    else if (successCount > 0)
+    {
+        if (shortOutput_)
+        {
+            std::cout << "RTT: " << avgRtt << " ms, "
+                      << "Time Out: " << avgOut << " ms, "
+                      << "Time Back: " << avgBack << " ms" << std::endl;
+        }
+        else
+        {
+            std::cout << "Average RTT: " << avgRtt << " ms" << std::endl;
+            std::cout << "Average Time Out: " << avgOut << " ms" << std::endl;
+            std::cout << "Average Time Back: " << avgBack << " ms" << std::endl;
+            std::cout << "RTT min/max/stddev: " << ntpUnitsToMs(rttSummary.min) << "/"
+                      << ntpUnitsToMs(rttSummary.max) << "/" << ntpUnitsToMs(std::sqrt(rttSummary.variance))
+                      << " ms" << std::endl;
+            std::cout << "RTT p50/p90/p99: " << ntpUnitsToMs(rttDistribution.percentile(50)) << "/"
+                      << ntpUnitsToMs(rttDistribution.percentile(90)) << "/"
+                      << ntpUnitsToMs(rttDistribution.percentile(99)) << " ms" << std::endl;
+            std::cout << "Clock Offset: " << clock.offsetMs << " ms (+/- " << clock.errorMs << " ms)"
+                      << ", Drift: " << clock.driftPpm << " ppm" << std::endl;
+            if (kernelCount > 0)
+            {
+                std::cout << "Average Kernel RTT: " << kernelAverage.rttMs << " ms"
+                          << (timestamps_.hardware() ? " (hardware)" : "") << std::endl;
+                std::cout << "Average Kernel Time Out: " << kernelAverage.outMs << " ms" << std::endl;
+                std::cout << "Average Kernel Time Back: " << kernelAverage.backMs << " ms" << std::endl;
+                std::cout << "Average Host Send Delay: " << kernelAverage.sendDelayMs << " ms" << std::endl;
+                std::cout << "Average Host Receive Delay: " << kernelAverage.receiveDelayMs << " ms" << std::endl;
             }
-            else
+            for (size_t c = 0; c < totals_.classes.size(); ++c)
             {
-                if (!shortOutput_)
+                const ClassTotals &totals = totals_.classes[c];
+                std::cout << "DSCP " << dscpClasses_[c] << ": " << totals.received << "/" << totals.sent
+                          << " received";
+                if (totals.measured > 0)
                 {
-                    std::cout << "Packet " << (i + 1) << " - Response received (" << received
-                              << " bytes), RTT: " << rtt.count() / 1000.0 << " ms" << std::endl;
+                    std::cout << ", RTT: " << totals.rtt / totals.measured << " ms"
+                              << ", Time Out: " << totals.out / totals.measured << " ms"
+                              << ", Time Back: " << totals.back / totals.measured << " ms";
                 }
+                std::cout << ", Remarked: " << totals.remarkedOut << " out, " << totals.remarkedBack << " back"
+                          << std::endl;
             }
         }
-        else
+        if (trains_)
         {
-            if (!shortOutput_)
+            std::cout << "Trains: " << trains.measured << "/" << packetCount << " measured";
+            if (trains.measured > 0)
             {
-                std::cout << "Packet " << (i + 1) << " - No response (timeout)" << std::endl;
+                std::cout << ", Capacity: " << trains.capacityMbps << " Mbps"
+                          << ", Available: " << trains.availableMbps << " Mbps"
+                          << ", Delay Growth avg/max: " << trains.avgDelayGrowthMs << "/" << trains.maxDelayGrowthMs
+                          << " ms";
             }
+            std::cout << std::endl;
         }
+    }
 
-        if (i < packetCount - 1)
+    if (verbose())
+    {
+        std::cout << "Test packets completed" << std::endl;
+    }
+    return true;
+}
+
+void Client::serviceReplies(std::chrono::steady_clock::time_point until, uint32_t awaited)
+{
+    char response[1024];
+    while (true)
+    {
+        auto now = std::chrono::steady_clock::now();
+        expired_.clear();
+        lossTimers_.advance(now, expired_);
+        for (const TimerWheel::Timer &timer : expired_)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+            declareLost(timer.id);
+        }
+
+        if (outstanding_.empty() || (awaited != 0 && !outstanding_.count(awaited)) || now >= until)
+        {
+            return;
+        }
+
+        // Sleep until a reply comes, the next loss timer is due or `until`.
+        int timeout = lossTimers_.pollTimeoutMs(now);
+        if (until != std::chrono::steady_clock::time_point::max())
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1;
+            timeout = timeout < 0 ? static_cast<int>(left) : std::min(timeout, static_cast<int>(left));
+        }
+        struct pollfd pfd = {testSocket_, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) <= 0)
+        {
+            continue;
+        }
+        // A send timestamp that missed sentAt() sits in the error queue and
+        // keeps poll() returning until it is read.
+        if (pfd.revents & POLLERR)
+        {
+            timestamps_.drain();
+        }
+
+        double kernelReceivedAt;
+        TrafficClass traffic;
+        ssize_t received;
+        while ((received = receiveReply(response, sizeof(response), kernelReceivedAt, traffic)) >= 0)
+        {
+            handleReply(response, received, kernelReceivedAt, traffic);
         }
     }
+}
 
-    if (successCount > 0)
+void Client::declareLost(uint32_t seq)
+{
+    auto it = outstanding_.find(seq);
+    if (it == outstanding_.end())
     {
-        if (shortOutput_)
+        return;
+    }
+    Outstanding packet = it->second;
+    outstanding_.erase(it);
+
+    for (auto &aggregator : aggregators_)
+    {
+        aggregator.onLost(packet.sentTime);
+    }
+    if (trains_)
+    {
+        trains_->onLost((seq - 1) / trainLength_, (seq - 1) % trainLength_);
+    }
+    if (writer_ && !shortOutput_)
+    {
+        writer_->writePacket({target_.c_str(), seq, PacketStatus::Timeout, packet.sentAt, NAN, NAN, NAN});
+    }
+    else if (verbose())
+    {
+        std::cout << "Packet " << seq << " - No response (timeout)" << '\n';
+    }
+}
+
+void Client::handleReply(char *response, ssize_t received, double kernelReceivedAt, const TrafficClass &traffic)
+{
+    if (received > 0 && !testCipher_.open(response, received))
+    {
+        if (!shortOutput_)
         {
-            std::cout << "RTT: " << (total_rtt / successCount) << " ms, "
-                      << "Time Out: " << (total_out / successCount) << " ms, "
-                      << "Time Back: " << (total_back / successCount) << " ms" << std::endl;
+            std::cerr << "Discarding reply that failed authentication" << std::endl;
         }
-        else
+        return;
+    }
+    if (received < 4)
+    {
+        return;
+    }
+
+    // A reply to a packet that was already declared lost, or a duplicate,
+    // is late; it must not be counted again.
+    uint32_t seq = TestPacket(response).sequence();
+    auto it = outstanding_.find(seq);
+    if (it == outstanding_.end())
+    {
+        for (auto &aggregator : aggregators_)
         {
-            std::cout << "Average RTT: " << (total_rtt / successCount) << " ms" << std::endl;
-            std::cout << "Average Time Out: " << (total_out / successCount) << " ms" << std::endl;
-            std::cout << "Average Time Back: " << (total_back / successCount) << " ms" << std::endl;
+            aggregator.onLateReply(std::chrono::steady_clock::now());
         }
+        return;
+    }
+    Outstanding packet = it->second;
+    outstanding_.erase(it);
+    if (packet.kernelSentAt == 0 && timestamps_.active())
+    {
+        packet.kernelSentAt = timestamps_.lateSentAt(packet.timestampId);
     }
 
-    if (!shortOutput_)
+    totals_.received++;
+    ClassTotals *classTotals = totals_.classes.empty() ? nullptr : &totals_.classes[packet.classIndex];
+    if (classTotals)
     {
-        std::cout << "Test packets completed" << std::endl;
+        classTotals->received++;
+    }
+    auto recv_time = std::chrono::steady_clock::now();
+    auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(recv_time - packet.sentTime);
+    rto_.addSample(rtt.count() / 1000.0);
+
+    uint32_t trainIndex = (seq - 1) / trainLength_;
+    uint32_t position = (seq - 1) % trainLength_;
+    if (received < static_cast<ssize_t>(TestPacket::kSize))
+    {
+        for (auto &aggregator : aggregators_)
+        {
+            aggregator.onInvalidReply(packet.sentTime);
+        }
+        if (trains_)
+        {
+            trains_->onLost(trainIndex, position);
+        }
+        if (writer_ && !shortOutput_)
+        {
+            writer_->writePacket({target_.c_str(), seq, PacketStatus::ShortReply, packet.sentAt,
+                                  rtt.count() / 1000.0, NAN, NAN});
+        }
+        else if (verbose())
+        {
+            std::cout << "Packet " << seq << " - Response received (" << received
+                      << " bytes), RTT: " << rtt.count() / 1000.0 << " ms" << '\n';
+        }
+        return;
+    }
+
+    TestPacket reply(response);
+    uint64_t t1 = reply.senderTimestamp();
+    uint64_t t2 = reply.receiveTimestamp();
+    uint64_t t3 = reply.reflectTimestamp();
+
+    // Current time T4
+    uint64_t t4 = ntpFromUnixNs(TscClock::instance().nowNs());
+
+    // Only timestamps from the same clock can be compared
+    // directly; T2 before T1 or T4 before T3 just means the
+    // clocks disagree, which the estimator corrects for.
+    if (ntpDelta(t3, t2) < 0 || ntpDelta(t4, t1) < 0)
+    {
+        for (auto &aggregator : aggregators_)
+        {
+            aggregator.onInvalidReply(packet.sentTime);
+        }
+        if (trains_)
+        {
+            trains_->onLost(trainIndex, position);
+        }
+        if (writer_ && !shortOutput_)
+        {
+            writer_->writePacket({target_.c_str(), seq, PacketStatus::InvalidTimestamps, packet.sentAt, NAN, NAN, NAN});
+        }
+        else if (!shortOutput_)
+        {
+            std::cerr << "Invalid timestamps detected: "
+                      << "T1=" << unixSecondsFromNtp(t1) << ", T2=" << unixSecondsFromNtp(t2)
+                      << ", T3=" << unixSecondsFromNtp(t3) << ", T4=" << unixSecondsFromNtp(t4) << std::endl;
+        }
+        return;
+    }
+
+    // The clock estimator works in seconds since the test began.
+    double T1 = runSeconds(t1);
+    double T2 = runSeconds(t2);
+    double T3 = runSeconds(t3);
+    double T4 = runSeconds(t4);
+    clock_.addSample(T1, T2, T3, T4);
+    if (trains_)
+    {
+        // The kernel's send time, where known, is when the packet really
+        // left; T1 was taken before the whole train was handed over.
+        int64_t sentNs = packet.kernelSentAt > 0 ? std::llround(packet.kernelSentAt * 1e9) : packet.sentNs;
+        trains_->onReply(trainIndex, position, sentNs, unixNsFromNtp(reply.receiveTimestamp()));
+    }
+    ClockEstimator::Estimate estimate = clock_.at((T1 + T4) / 2);
+    double offset = estimate.offset;
+    ClockFigures clock;
+    clock.offsetMs = offset * 1000.0;
+    clock.errorMs = estimate.error * 1000.0;
+    clock.driftPpm = estimate.drift * 1e6;
+
+    int64_t offsetUnits = std::llround(offset * kNtpUnitsPerSecond);
+    int64_t rttUnits = ntpDelta(t4, t1);
+    int64_t outUnits = ntpDelta(t2, t1) - offsetUnits;
+    int64_t backUnits = ntpDelta(t4, t3) + offsetUnits;
+    double out_time = ntpUnitsToMs(outUnits);
+    double back_time = ntpUnitsToMs(backUnits);
+    double rtt_calc = ntpUnitsToMs(rttUnits);
+
+    // The same figures from the kernel's own send and receive
+    // times, and how long the client itself held the packet on
+    // either side. The kernel reports seconds since the UNIX epoch;
+    // they are moved to the test's own time line first. The offset
+    // for them comes from the kernel times as well: one taken from T1
+    // and T4 carries the client's own send and receive delays, which
+    // would leave kernel one-way figures below zero on a short path.
+    KernelTimes kernel;
+    if (packet.kernelSentAt > 0 && kernelReceivedAt > 0)
+    {
+        double kernelSent = packet.kernelSentAt - runStartAt_;
+        double kernelReceived = kernelReceivedAt - runStartAt_;
+        kernelClock_.addSample(kernelSent, T2, T3, kernelReceived);
+        double kernelOffset = kernelClock_.at((kernelSent + kernelReceived) / 2).offset;
+        kernel.rttMs = (kernelReceived - kernelSent) * 1000.0;
+        kernel.outMs = (T2 - kernelOffset - kernelSent) * 1000.0;
+        kernel.backMs = (kernelReceived - (T3 - kernelOffset)) * 1000.0;
+        kernel.sendDelayMs = (kernelSent - T1) * 1000.0;
+        kernel.receiveDelayMs = (T4 - kernelReceived) * 1000.0;
+        totals_.kernel.rttMs += kernel.rttMs;
+        totals_.kernel.outMs += kernel.outMs;
+        totals_.kernel.backMs += kernel.backMs;
+        totals_.kernel.sendDelayMs += kernel.sendDelayMs;
+        totals_.kernel.receiveDelayMs += kernel.receiveDelayMs;
+        totals_.kernelCount++;
+    }
+
+    // What the reflector saw of the packet, and what came back.
+    // A reflector that does not report them leaves the fields
+    // zero and the flags clear.
+    QosFields qos;
+    qos.dscp = packet.dscp;
+    if (reply.reflectorFlags() & ReflectorSawTrafficClass)
+    {
+        qos.reflectorDscp = reply.senderTos() >> 2;
+        qos.reflectorTtl = reply.senderTtl();
+    }
+    if (traffic.ttl != 0)
+    {
+        qos.replyDscp = traffic.tos >> 2;
+    }
+    bool remarkedOut = qos.reflectorDscp >= 0 && qos.reflectorDscp != qos.dscp;
+    bool remarkedBack = (reply.reflectorFlags() & ReflectorMirroredDscp) && qos.replyDscp >= 0 &&
+                        qos.replyDscp != qos.reflectorDscp;
+
+    samples_.add(rttUnits, outUnits, backUnits);
+    if (classTotals)
+    {
+        classTotals->measured++;
+        classTotals->rtt += rtt_calc;
+        classTotals->out += out_time;
+        classTotals->back += back_time;
+        classTotals->remarkedOut += remarkedOut;
+        classTotals->remarkedBack += remarkedBack;
+    }
+    for (auto &aggregator : aggregators_)
+    {
+        aggregator.onReply(packet.sentTime, rtt_calc, out_time, back_time);
+    }
+
+    if (writer_ && !shortOutput_)
+    {
+        writer_->writePacket({target_.c_str(), seq, PacketStatus::Ok, packet.sentAt, rtt_calc, out_time, back_time,
+                              kernel, clock, qos});
+    }
+    else if (verbose())
+    {
+        std::cout << "Packet " << seq
+                  << " - RTT: " << rtt_calc << " ms"
+                  << ", Time Out: " << out_time << " ms"
+                  << ", Time Back: " << back_time << " ms"
+                  << " (+/- " << clock.errorMs << " ms)";
+        if (!std::isnan(kernel.rttMs))
+        {
+            std::cout << ", Kernel RTT: " << kernel.rttMs << " ms"
+                      << ", Host Delay: " << kernel.sendDelayMs << "/" << kernel.receiveDelayMs << " ms";
+        }
+        if (qos.reflectorTtl >= 0)
+        {
+            std::cout << ", DSCP: " << qos.dscp << "/" << qos.reflectorDscp;
+            if (qos.replyDscp >= 0)
+            {
+                std::cout << "/" << qos.replyDscp;
+            }
+            std::cout << ", TTL: " << qos.reflectorTtl;
+            if (remarkedOut)
+            {
+                std::cout << " (remarked out)";
+            }
+            if (remarkedBack)
+            {
+                std::cout << " (remarked back)";
+            }
+        }
+        std::cout << '\n';
     }
-    return true;
 }
 
 Client::~Client()
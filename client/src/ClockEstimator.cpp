@@ -0,0 +1,85 @@
+#include "ClockEstimator.h"
+#include <cmath>
+
+ClockEstimator::ClockEstimator() : candidate_{0, 0, 0}, candidateCount_(0) {}
+
+void ClockEstimator::reset()
+{
+    points_.clear();
+    candidateCount_ = 0;
+}
+
+void ClockEstimator::addSample(double t1, double t2, double t3, double t4)
+{
+    Point point;
+    point.time = (t1 + t4) / 2;
+    point.offset = ((t2 - t1) + (t3 - t4)) / 2;
+    // Clamped: clock resolution can make the reflector's hold time look
+    // longer than the round trip.
+    point.delay = std::fmax((t4 - t1) - (t3 - t2), 0.0);
+
+    if (candidateCount_ == 0 || point.delay < candidate_.delay)
+    {
+        candidate_ = point;
+    }
+    if (++candidateCount_ == kFilterSize)
+    {
+        points_.push_back(candidate_);
+        if (points_.size() > kMaxPoints)
+        {
+            points_.pop_front();
+        }
+        candidateCount_ = 0;
+    }
+}
+
+ClockEstimator::Estimate ClockEstimator::at(double clientTime) const
+{
+    Estimate estimate = {0, 0, NAN};
+    size_t count = points_.size() + (candidateCount_ > 0 ? 1 : 0);
+    if (count == 0)
+    {
+        return estimate;
+    }
+    auto point = [this](size_t i) -> const Point & { return i < points_.size() ? points_[i] : candidate_; };
+
+    // Times relative to the first point keep the sums well-conditioned.
+    double base = point(0).time;
+    double meanTime = 0, meanOffset = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        meanTime += point(i).time - base;
+        meanOffset += point(i).offset;
+    }
+    meanTime /= count;
+    meanOffset /= count;
+
+    double covariance = 0, variance = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        double dt = point(i).time - base - meanTime;
+        covariance += dt * (point(i).offset - meanOffset);
+        variance += dt * dt;
+    }
+    if (variance > 0)
+    {
+        estimate.drift = covariance / variance;
+    }
+
+    // At each point the true offset lies within half the delay of the
+    // measured one, so there the line is off by at most its residual plus
+    // that. With the drift right the error is the same along the whole
+    // line, and the tightest point bounds it.
+    for (size_t i = 0; i < count; ++i)
+    {
+        double fitted = meanOffset + estimate.drift * (point(i).time - base - meanTime);
+        double bound = std::fabs(fitted - point(i).offset) + point(i).delay / 2;
+        if (std::isnan(estimate.error) || bound < estimate.error)
+        {
+            estimate.error = bound;
+        }
+    }
+
+    estimate.offset = meanOffset + estimate.drift * (clientTime - base - meanTime);
+    return estimate;
+}
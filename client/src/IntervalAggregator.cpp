@@ -0,0 +1,216 @@
+#include "IntervalAggregator.h"
+#include <algorithm>
+#include <cmath>
+
+IntervalAggregator::IntervalAggregator(std::chrono::milliseconds width, std::chrono::milliseconds replyTimeout,
+                                       Clock::time_point runStart, double runStartWall)
+    : width_(width), replyTimeout_(replyTimeout), runStart_(runStart), runStartWall_(runStartWall),
+      nextToClose_(0), openEnd_(0), ring_(replyTimeout / width + 2) {}
+
+uint64_t IntervalAggregator::indexOf(Clock::time_point t) const
+{
+    if (t <= runStart_)
+    {
+        return 0;
+    }
+    return static_cast<uint64_t>((t - runStart_) / width_);
+}
+
+IntervalAggregator::Clock::time_point IntervalAggregator::endOf(uint64_t index) const
+{
+    return runStart_ + width_ * (index + 1);
+}
+
+IntervalAggregator::Bucket *IntervalAggregator::find(uint64_t index)
+{
+    if (index < nextToClose_ || index >= openEnd_)
+    {
+        return nullptr;
+    }
+    return &ring_[index % ring_.size()];
+}
+
+IntervalAggregator::Bucket &IntervalAggregator::open(uint64_t index, std::vector<IntervalRecord> *closed)
+{
+    if (index < nextToClose_)
+    {
+        index = nextToClose_;
+    }
+
+    // Make room by force-closing the oldest intervals; this only happens if
+    // the caller has not called advance() for longer than a reply timeout.
+    while (index >= nextToClose_ + ring_.size())
+    {
+        if (openEnd_ == nextToClose_)
+        {
+            open(nextToClose_, closed);
+        }
+        closeOldest(closed ? *closed : overflow_);
+    }
+
+    // Intervals without any traffic are still opened and later reported, so
+    // gaps in the output always mean the run was not going.
+    while (openEnd_ <= index)
+    {
+        Bucket &bucket = ring_[openEnd_ % ring_.size()];
+        bucket.sent = bucket.received = bucket.invalid = bucket.lost = bucket.late = 0;
+        bucket.samples = bucket.jitterSamples = 0;
+        bucket.minRtt = bucket.maxRtt = bucket.totalRtt = 0;
+        bucket.totalOut = bucket.totalBack = bucket.totalJitter = 0;
+        bucket.lastRtt = NAN;
+        bucket.histogram.reset();
+        openEnd_++;
+    }
+    return ring_[index % ring_.size()];
+}
+
+void IntervalAggregator::onSent(Clock::time_point sentAt)
+{
+    open(indexOf(sentAt), nullptr).sent++;
+}
+
+void IntervalAggregator::onReply(Clock::time_point sentAt, double rttMs, double outMs, double backMs)
+{
+    Bucket *bucket = find(indexOf(sentAt));
+    if (!bucket)
+    {
+        onLateReply(Clock::now());
+        return;
+    }
+
+    bucket->received++;
+    if (bucket->samples == 0 || rttMs < bucket->minRtt)
+    {
+        bucket->minRtt = rttMs;
+    }
+    if (bucket->samples == 0 || rttMs > bucket->maxRtt)
+    {
+        bucket->maxRtt = rttMs;
+    }
+    bucket->samples++;
+    bucket->totalRtt += rttMs;
+    bucket->totalOut += outMs;
+    bucket->totalBack += backMs;
+    bucket->histogram.record(static_cast<uint64_t>(rttMs * 1e6));
+
+    // Jitter is the mean absolute RTT difference between consecutive replies
+    // (IPDV, RFC 5481).
+    if (!std::isnan(bucket->lastRtt))
+    {
+        bucket->totalJitter += std::fabs(rttMs - bucket->lastRtt);
+        bucket->jitterSamples++;
+    }
+    bucket->lastRtt = rttMs;
+}
+
+void IntervalAggregator::onInvalidReply(Clock::time_point sentAt)
+{
+    Bucket *bucket = find(indexOf(sentAt));
+    if (!bucket)
+    {
+        onLateReply(Clock::now());
+        return;
+    }
+    bucket->received++;
+    bucket->invalid++;
+}
+
+void IntervalAggregator::onLost(Clock::time_point sentAt)
+{
+    // Packets of an already reported interval were counted as lost when it
+    // closed.
+    Bucket *bucket = find(indexOf(sentAt));
+    if (bucket)
+    {
+        bucket->lost++;
+    }
+}
+
+void IntervalAggregator::onLateReply(Clock::time_point now)
+{
+    uint64_t index = indexOf(now);
+    if (openEnd_ > nextToClose_ && index < openEnd_ - 1)
+    {
+        index = openEnd_ - 1;
+    }
+    open(index, nullptr).late++;
+}
+
+void IntervalAggregator::closeOldest(std::vector<IntervalRecord> &closed)
+{
+    const Bucket &bucket = ring_[nextToClose_ % ring_.size()];
+
+    IntervalRecord record{};
+    record.widthSec = std::chrono::duration<double>(width_).count();
+    record.startTime = runStartWall_ + record.widthSec * nextToClose_;
+    record.sent = bucket.sent;
+    record.received = bucket.received;
+    record.lost = bucket.sent > bucket.received ? bucket.sent - bucket.received : 0;
+    record.late = bucket.late;
+
+    if (bucket.samples > 0)
+    {
+        record.minRttMs = bucket.minRtt;
+        record.avgRttMs = bucket.totalRtt / bucket.samples;
+        record.maxRttMs = bucket.maxRtt;
+        // Histogram buckets report their midpoint; keep percentiles inside
+        // the exact observed range.
+        auto percentile = [&bucket](double p) {
+            double value = bucket.histogram.percentile(p) / 1e6;
+            return std::min(std::max(value, bucket.minRtt), bucket.maxRtt);
+        };
+        record.p50RttMs = percentile(50);
+        record.p90RttMs = percentile(90);
+        record.p99RttMs = percentile(99);
+        record.avgOutMs = bucket.totalOut / bucket.samples;
+        record.avgBackMs = bucket.totalBack / bucket.samples;
+    }
+    else
+    {
+        record.minRttMs = record.avgRttMs = record.maxRttMs = NAN;
+        record.p50RttMs = record.p90RttMs = record.p99RttMs = NAN;
+        record.avgOutMs = record.avgBackMs = NAN;
+    }
+    record.jitterMs = bucket.jitterSamples > 0 ? bucket.totalJitter / bucket.jitterSamples : NAN;
+
+    closed.push_back(record);
+    nextToClose_++;
+}
+
+void IntervalAggregator::advance(Clock::time_point now, std::vector<IntervalRecord> &closed)
+{
+    closed.insert(closed.end(), overflow_.begin(), overflow_.end());
+    overflow_.clear();
+
+    while (true)
+    {
+        if (nextToClose_ == openEnd_)
+        {
+            if (endOf(nextToClose_) > now)
+            {
+                break;
+            }
+            open(nextToClose_, &closed);
+        }
+
+        const Bucket &bucket = ring_[nextToClose_ % ring_.size()];
+        auto end = endOf(nextToClose_);
+        bool resolved = bucket.received + bucket.lost >= bucket.sent;
+        if (now < end || (!resolved && now < end + replyTimeout_))
+        {
+            break;
+        }
+        closeOldest(closed);
+    }
+}
+
+void IntervalAggregator::finish(std::vector<IntervalRecord> &closed)
+{
+    closed.insert(closed.end(), overflow_.begin(), overflow_.end());
+    overflow_.clear();
+
+    while (nextToClose_ < openEnd_)
+    {
+        closeOldest(closed);
+    }
+}
@@ -0,0 +1,453 @@
+#include "ResultWriter.h"
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <algorithm>
+
+namespace
+{
+// Upper bound for a single formatted field; records are written field by
+// field so this bounds every appendf call.
+constexpr size_t kMaxFieldSize = 256;
+
+// Empty CSV cells for the interval columns of packet and summary rows.
+constexpr const char *kEmptyIntervalColumns = ",,,,,,,,,";
+
+// Empty CSV cells for the kernel timestamp and clock columns of interval rows.
+constexpr const char *kEmptyKernelColumns = ",,,,,";
+constexpr const char *kEmptyClockColumns = ",,,";
+
+// Empty CSV cells for the DSCP columns of rows without them.
+constexpr const char *kEmptyQosColumns = ",,,,,,";
+constexpr const char *kEmptyRemarkColumns = ",,";
+
+// Empty CSV cells for the packet train columns of rows without them.
+constexpr const char *kEmptyTrainColumns = ",,,,,,,";
+
+// Empty CSV cell for the RTT standard deviation of rows other than summaries.
+constexpr const char *kEmptyStddevColumn = ",";
+
+const char *statusName(PacketStatus status)
+{
+    switch (status)
+    {
+    case PacketStatus::Ok:
+        return "ok";
+    case PacketStatus::Timeout:
+        return "timeout";
+    case PacketStatus::InvalidTimestamps:
+        return "invalid_timestamps";
+    case PacketStatus::ShortReply:
+        return "short_reply";
+    }
+    return "unknown";
+}
+} // namespace
+
+bool parseOutputFormat(const std::string &name, OutputFormat &format)
+{
+    if (name == "text")
+    {
+        format = OutputFormat::Text;
+    }
+    else if (name == "jsonl")
+    {
+        format = OutputFormat::Jsonl;
+    }
+    else if (name == "csv")
+    {
+        format = OutputFormat::Csv;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+ResultWriter::ResultWriter(std::ostream &out, OutputFormat format, size_t bufferSize)
+    : out_(out), format_(format), buffer_(bufferSize), used_(0), headerWritten_(false) {}
+
+ResultWriter::~ResultWriter()
+{
+    flush();
+}
+
+void ResultWriter::flush()
+{
+    if (used_ > 0)
+    {
+        out_.write(buffer_.data(), used_);
+        used_ = 0;
+    }
+    out_.flush();
+}
+
+void ResultWriter::ensureSpace(size_t size)
+{
+    if (buffer_.size() - used_ < size)
+    {
+        out_.write(buffer_.data(), used_);
+        used_ = 0;
+    }
+}
+
+void ResultWriter::appendf(const char *format, ...)
+{
+    ensureSpace(kMaxFieldSize);
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer_.data() + used_, buffer_.size() - used_, format, args);
+    va_end(args);
+
+    if (n > 0)
+    {
+        used_ += std::min(static_cast<size_t>(n), buffer_.size() - used_ - 1);
+    }
+}
+
+void ResultWriter::appendNumber(const char *name, double value, bool leadingComma)
+{
+    const char *comma = leadingComma ? "," : "";
+    if (format_ == OutputFormat::Jsonl)
+    {
+        if (std::isnan(value))
+        {
+            appendf("%s\"%s\":null", comma, name);
+        }
+        else
+        {
+            appendf("%s\"%s\":%.6f", comma, name, value);
+        }
+    }
+    else
+    {
+        if (std::isnan(value))
+        {
+            appendf("%s", comma);
+        }
+        else
+        {
+            appendf("%s%.6f", comma, value);
+        }
+    }
+}
+
+// Negative values are unknown.
+void ResultWriter::appendInteger(const char *name, int value)
+{
+    if (format_ == OutputFormat::Jsonl)
+    {
+        if (value < 0)
+        {
+            appendf(",\"%s\":null", name);
+        }
+        else
+        {
+            appendf(",\"%s\":%d", name, value);
+        }
+    }
+    else if (value < 0)
+    {
+        appendf(",");
+    }
+    else
+    {
+        appendf(",%d", value);
+    }
+}
+
+void ResultWriter::appendString(const char *name, const char *value)
+{
+    if (format_ == OutputFormat::Jsonl)
+    {
+        if (!value)
+        {
+            appendf(",\"%s\":null", name);
+            return;
+        }
+        appendf(",\"%s\":\"", name);
+    }
+    else
+    {
+        if (!value)
+        {
+            appendf(",");
+            return;
+        }
+        appendf(",\"");
+    }
+
+    // Escape quotes (both formats) and backslashes (JSON only).
+    for (const char *p = value; *p; ++p)
+    {
+        ensureSpace(4);
+        if (*p == '"')
+        {
+            buffer_[used_++] = format_ == OutputFormat::Jsonl ? '\\' : '"';
+        }
+        else if (*p == '\\' && format_ == OutputFormat::Jsonl)
+        {
+            buffer_[used_++] = '\\';
+        }
+        buffer_[used_++] = *p;
+    }
+    appendf("\"");
+}
+
+void ResultWriter::appendKernelTimes(const KernelTimes &kernel)
+{
+    appendNumber("kernel_rtt_ms", kernel.rttMs);
+    appendNumber("kernel_out_ms", kernel.outMs);
+    appendNumber("kernel_back_ms", kernel.backMs);
+    appendNumber("send_delay_ms", kernel.sendDelayMs);
+    appendNumber("receive_delay_ms", kernel.receiveDelayMs);
+}
+
+void ResultWriter::appendClockFigures(const ClockFigures &clock)
+{
+    appendNumber("clock_offset_ms", clock.offsetMs);
+    appendNumber("clock_error_ms", clock.errorMs);
+    appendNumber("clock_drift_ppm", clock.driftPpm);
+}
+
+void ResultWriter::appendQosFields(const QosFields &qos)
+{
+    appendInteger("dscp", qos.dscp);
+    appendInteger("reflector_dscp", qos.reflectorDscp);
+    appendInteger("reflector_ttl", qos.reflectorTtl);
+    appendInteger("reply_dscp", qos.replyDscp);
+}
+
+void ResultWriter::writeHeaderOnce()
+{
+    if (format_ == OutputFormat::Csv && !headerWritten_)
+    {
+        appendf("type,target,seq,status,t1,rtt_ms,out_ms,back_ms,sent,received,lost,error,"
+                "interval_s,start,late,min_rtt_ms,max_rtt_ms,p50_rtt_ms,p90_rtt_ms,p99_rtt_ms,jitter_ms,"
+                "kernel_rtt_ms,kernel_out_ms,kernel_back_ms,send_delay_ms,receive_delay_ms,"
+                "clock_offset_ms,clock_error_ms,clock_drift_ppm,"
+                "dscp,reflector_dscp,reflector_ttl,reply_dscp,remarked_out,remarked_back,"
+                "trains,train_length,packet_size,capacity_mbps,available_mbps,delay_growth_ms,"
+                "max_delay_growth_ms,rtt_stddev_ms\n");
+    }
+    headerWritten_ = true;
+}
+
+void ResultWriter::writePacket(const PacketRecord &record)
+{
+    if (format_ == OutputFormat::Text)
+    {
+        return;
+    }
+    writeHeaderOnce();
+
+    if (format_ == OutputFormat::Jsonl)
+    {
+        appendf("{\"type\":\"packet\"");
+        appendString("target", record.target);
+        appendf(",\"seq\":%u,\"status\":\"%s\"", record.seq, statusName(record.status));
+    }
+    else
+    {
+        appendf("packet");
+        appendString("target", record.target);
+        appendf(",%u,%s", record.seq, statusName(record.status));
+    }
+
+    appendNumber("t1", record.sentAt);
+    appendNumber("rtt_ms", record.rttMs);
+    appendNumber("out_ms", record.outMs);
+    appendNumber("back_ms", record.backMs);
+    if (format_ == OutputFormat::Jsonl)
+    {
+        appendKernelTimes(record.kernel);
+        appendClockFigures(record.clock);
+        appendQosFields(record.qos);
+        appendf("}\n");
+    }
+    else
+    {
+        appendf(",,,,%s", kEmptyIntervalColumns);
+        appendKernelTimes(record.kernel);
+        appendClockFigures(record.clock);
+        appendQosFields(record.qos);
+        appendf("%s%s%s\n", kEmptyRemarkColumns, kEmptyTrainColumns, kEmptyStddevColumn);
+    }
+}
+
+void ResultWriter::writeSummary(const SummaryRecord &record)
+{
+    if (format_ == OutputFormat::Text)
+    {
+        return;
+    }
+    writeHeaderOnce();
+
+    uint32_t lost = record.sent > record.received ? record.sent - record.received : 0;
+    if (format_ == OutputFormat::Jsonl)
+    {
+        appendf("{\"type\":\"summary\"");
+        appendString("target", record.target);
+        appendf(",\"sent\":%u,\"received\":%u,\"lost\":%u", record.sent, record.received, lost);
+        appendNumber("rtt_ms", record.avgRttMs);
+        appendNumber("out_ms", record.avgOutMs);
+        appendNumber("back_ms", record.avgBackMs);
+        appendString("error", record.error);
+        appendKernelTimes(record.kernel);
+        appendClockFigures(record.clock);
+        appendNumber("min_rtt_ms", record.minRttMs);
+        appendNumber("max_rtt_ms", record.maxRttMs);
+        appendNumber("p50_rtt_ms", record.p50RttMs);
+        appendNumber("p90_rtt_ms", record.p90RttMs);
+        appendNumber("p99_rtt_ms", record.p99RttMs);
+        appendNumber("rtt_stddev_ms", record.stddevRttMs);
+        appendf("}\n");
+    }
+    else
+    {
+        appendf("summary");
+        appendString("target", record.target);
+        appendf(",,,");
+        appendNumber("rtt_ms", record.avgRttMs);
+        appendNumber("out_ms", record.avgOutMs);
+        appendNumber("back_ms", record.avgBackMs);
+        appendf(",%u,%u,%u", record.sent, record.received, lost);
+        appendString("error", record.error);
+        // The RTT spread goes in the interval columns of the same name.
+        appendf(",,,");
+        appendNumber("min_rtt_ms", record.minRttMs);
+        appendNumber("max_rtt_ms", record.maxRttMs);
+        appendNumber("p50_rtt_ms", record.p50RttMs);
+        appendNumber("p90_rtt_ms", record.p90RttMs);
+        appendNumber("p99_rtt_ms", record.p99RttMs);
+        appendf(",");
+        appendKernelTimes(record.kernel);
+        appendClockFigures(record.clock);
+        appendf("%s%s", kEmptyQosColumns, kEmptyTrainColumns);
+        appendNumber("rtt_stddev_ms", record.stddevRttMs);
+        appendf("\n");
+    }
+}
+
+void ResultWriter::writeInterval(const IntervalRecord &record)
+{
+    if (format_ == OutputFormat::Text)
+    {
+        return;
+    }
+    writeHeaderOnce();
+
+    if (format_ == OutputFormat::Jsonl)
+    {
+        appendf("{\"type\":\"interval\"");
+        appendString("target", record.target);
+        appendNumber("interval_s", record.widthSec);
+        appendNumber("start", record.startTime);
+        appendf(",\"sent\":%u,\"received\":%u,\"lost\":%u,\"late\":%u",
+                record.sent, record.received, record.lost, record.late);
+        appendNumber("rtt_ms", record.avgRttMs);
+        appendNumber("min_rtt_ms", record.minRttMs);
+        appendNumber("max_rtt_ms", record.maxRttMs);
+        appendNumber("p50_rtt_ms", record.p50RttMs);
+        appendNumber("p90_rtt_ms", record.p90RttMs);
+        appendNumber("p99_rtt_ms", record.p99RttMs);
+        appendNumber("jitter_ms", record.jitterMs);
+        appendNumber("out_ms", record.avgOutMs);
+        appendNumber("back_ms", record.avgBackMs);
+        appendf("}\n");
+    }
+    else
+    {
+        appendf("interval");
+        appendString("target", record.target);
+        appendf(",,,");
+        appendNumber("rtt_ms", record.avgRttMs);
+        appendNumber("out_ms", record.avgOutMs);
+        appendNumber("back_ms", record.avgBackMs);
+        appendf(",%u,%u,%u,", record.sent, record.received, record.lost);
+        appendNumber("interval_s", record.widthSec);
+        appendNumber("start", record.startTime);
+        appendf(",%u", record.late);
+        appendNumber("min_rtt_ms", record.minRttMs);
+        appendNumber("max_rtt_ms", record.maxRttMs);
+        appendNumber("p50_rtt_ms", record.p50RttMs);
+        appendNumber("p90_rtt_ms", record.p90RttMs);
+        appendNumber("p99_rtt_ms", record.p99RttMs);
+        appendNumber("jitter_ms", record.jitterMs);
+        appendf("%s%s%s%s%s\n", kEmptyKernelColumns, kEmptyClockColumns, kEmptyQosColumns, kEmptyTrainColumns,
+                kEmptyStddevColumn);
+    }
+}
+
+void ResultWriter::writeClass(const ClassRecord &record)
+{
+    if (format_ == OutputFormat::Text)
+    {
+        return;
+    }
+    writeHeaderOnce();
+
+    uint32_t lost = record.sent > record.received ? record.sent - record.received : 0;
+    if (format_ == OutputFormat::Jsonl)
+    {
+        appendf("{\"type\":\"class\"");
+        appendString("target", record.target);
+        appendf(",\"dscp\":%d,\"sent\":%u,\"received\":%u,\"lost\":%u", record.dscp, record.sent,
+                record.received, lost);
+        appendNumber("rtt_ms", record.avgRttMs);
+        appendNumber("out_ms", record.avgOutMs);
+        appendNumber("back_ms", record.avgBackMs);
+        appendf(",\"remarked_out\":%u,\"remarked_back\":%u}\n", record.remarkedOut, record.remarkedBack);
+    }
+    else
+    {
+        appendf("class");
+        appendString("target", record.target);
+        appendf(",,,");
+        appendNumber("rtt_ms", record.avgRttMs);
+        appendNumber("out_ms", record.avgOutMs);
+        appendNumber("back_ms", record.avgBackMs);
+        appendf(",%u,%u,%u,", record.sent, record.received, lost);
+        appendf("%s%s%s", kEmptyIntervalColumns, kEmptyKernelColumns, kEmptyClockColumns);
+        appendf(",%d,,,,%u,%u%s%s\n", record.dscp, record.remarkedOut, record.remarkedBack, kEmptyTrainColumns,
+                kEmptyStddevColumn);
+    }
+}
+
+void ResultWriter::writeTrains(const TrainRecord &record)
+{
+    if (format_ == OutputFormat::Text)
+    {
+        return;
+    }
+    writeHeaderOnce();
+
+    if (format_ == OutputFormat::Jsonl)
+    {
+        appendf("{\"type\":\"trains\"");
+        appendString("target", record.target);
+        appendf(",\"trains\":%u,\"train_length\":%u,\"packet_size\":%u,\"measured\":%u", record.trains,
+                record.trainLength, record.packetSize, record.measured);
+        appendNumber("capacity_mbps", record.capacityMbps);
+        appendNumber("available_mbps", record.availableMbps);
+        appendNumber("delay_growth_ms", record.avgDelayGrowthMs);
+        appendNumber("max_delay_growth_ms", record.maxDelayGrowthMs);
+        appendf("}\n");
+    }
+    else
+    {
+        // Trains with replies to compare go in the received column.
+        appendf("trains");
+        appendString("target", record.target);
+        appendf(",,,,,,,,%u,,", record.measured);
+        appendf("%s%s%s%s", kEmptyIntervalColumns, kEmptyKernelColumns, kEmptyClockColumns, kEmptyQosColumns);
+        appendf(",%u,%u,%u", record.trains, record.trainLength, record.packetSize);
+        appendNumber("capacity_mbps", record.capacityMbps);
+        appendNumber("available_mbps", record.availableMbps);
+        appendNumber("delay_growth_ms", record.avgDelayGrowthMs);
+        appendNumber("max_delay_growth_ms", record.maxDelayGrowthMs);
+        appendf("%s\n", kEmptyStddevColumn);
+    }
+}
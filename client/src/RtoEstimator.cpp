@@ -0,0 +1,44 @@
+#include "RtoEstimator.h"
+#include <algorithm>
+#include <cmath>
+
+RtoEstimator::RtoEstimator(double floorMs, double ceilingMs) : floorMs_(floorMs), ceilingMs_(ceilingMs)
+{
+    reset();
+}
+
+void RtoEstimator::reset()
+{
+    // Until there is a sample, wait as long as we may.
+    smoothedMs_ = 0;
+    deviationMs_ = 0;
+    timeoutMs_ = ceilingMs_;
+    seeded_ = false;
+}
+
+void RtoEstimator::addSample(double rttMs)
+{
+    if (!seeded_)
+    {
+        smoothedMs_ = rttMs;
+        deviationMs_ = rttMs / 2;
+        seeded_ = true;
+    }
+    else
+    {
+        // Gains of 1/4 and 1/8, as RFC 6298.
+        deviationMs_ += (std::fabs(smoothedMs_ - rttMs) - deviationMs_) / 4;
+        smoothedMs_ += (rttMs - smoothedMs_) / 8;
+    }
+    update(smoothedMs_ + 4 * deviationMs_);
+}
+
+void RtoEstimator::backOff()
+{
+    update(timeoutMs_ * 2);
+}
+
+void RtoEstimator::update(double timeoutMs)
+{
+    timeoutMs_ = std::min(std::max(timeoutMs, floorMs_), ceilingMs_);
+}
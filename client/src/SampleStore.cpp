@@ -0,0 +1,329 @@
+#include "SampleStore.h"
+#include <algorithm>
+#include <climits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+// The vector loops turn offsets from a column's first value into doubles
+// exactly only below this; wider columns, which no real delays make, are
+// summed again by the scalar loop.
+const uint64_t kMaxVectorRange = 1ULL << 50;
+
+// Indices are worked out this many at a time before the bins are counted.
+const size_t kIndexBlock = 256;
+
+// Everything a summary needs, gathered in one pass: the extremes, and the
+// sum and sum of squares of each value's offset from the column's first
+// value. The offsets are small, so their squares keep their precision.
+struct Totals
+{
+    int64_t min;
+    int64_t max;
+    int64_t sum;
+    double squares;
+};
+
+Totals totalsScalar(const int64_t *values, size_t count, int64_t base, Totals totals)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        totals.min = std::min(totals.min, values[i]);
+        totals.max = std::max(totals.max, values[i]);
+        int64_t d = values[i] - base;
+        totals.sum += d;
+        totals.squares += static_cast<double>(d) * static_cast<double>(d);
+    }
+    return totals;
+}
+
+void binsScalar(const int64_t *values, size_t count, int64_t low, unsigned shift, uint32_t *bins,
+                size_t binCount)
+{
+    uint64_t last = binCount - 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint64_t index = static_cast<uint64_t>(values[i] - low) >> shift;
+        bins[std::min(index, last)]++;
+    }
+}
+
+#if defined(__x86_64__)
+bool haveAvx2()
+{
+    static const bool available = __builtin_cpu_supports("avx2");
+    return available;
+}
+
+__attribute__((target("avx2"))) Totals totalsAvx2(const int64_t *values, size_t count, int64_t base)
+{
+    // AVX2 has no 64-bit integer to double conversion. Below 2^51, adding
+    // the bits of 1.5 * 2^52 gives that double plus the integer, exactly.
+    const __m256i magicBits = _mm256_set1_epi64x(0x4338000000000000LL);
+    const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+    const __m256i b = _mm256_set1_epi64x(base);
+    __m256i min = _mm256_set1_epi64x(LLONG_MAX);
+    __m256i max = _mm256_set1_epi64x(LLONG_MIN);
+    __m256i sum = _mm256_setzero_si256();
+    __m256d squares = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i));
+        min = _mm256_blendv_epi8(min, x, _mm256_cmpgt_epi64(min, x));
+        max = _mm256_blendv_epi8(max, x, _mm256_cmpgt_epi64(x, max));
+        __m256i d = _mm256_sub_epi64(x, b);
+        sum = _mm256_add_epi64(sum, d);
+        __m256d v = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(d, magicBits)), magic);
+        squares = _mm256_add_pd(squares, _mm256_mul_pd(v, v));
+    }
+
+    alignas(32) int64_t lanes[3][4];
+    alignas(32) double squareLanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes[0]), min);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes[1]), max);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes[2]), sum);
+    _mm256_store_pd(squareLanes, squares);
+    Totals totals = {LLONG_MAX, LLONG_MIN, 0, 0};
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        totals.min = std::min(totals.min, lanes[0][lane]);
+        totals.max = std::max(totals.max, lanes[1][lane]);
+        totals.sum += lanes[2][lane];
+        totals.squares += squareLanes[lane];
+    }
+    return totalsScalar(values + i, count - i, base, totals);
+}
+
+__attribute__((target("avx2"))) void binsAvx2(const int64_t *values, size_t count, int64_t low, unsigned shift,
+                                              uint32_t *bins, size_t binCount)
+{
+    const __m256i base = _mm256_set1_epi64x(low);
+    const __m256i last = _mm256_set1_epi64x(static_cast<int64_t>(binCount - 1));
+    const __m128i bits = _mm_cvtsi32_si128(static_cast<int>(shift));
+    alignas(32) int64_t indices[kIndexBlock];
+    size_t i = 0;
+    while (i + 4 <= count)
+    {
+        size_t block = std::min(kIndexBlock, (count - i) & ~size_t(3));
+        for (size_t j = 0; j < block; j += 4)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i + j));
+            __m256i index = _mm256_srl_epi64(_mm256_sub_epi64(x, base), bits);
+            index = _mm256_blendv_epi8(index, last, _mm256_cmpgt_epi64(index, last));
+            _mm256_store_si256(reinterpret_cast<__m256i *>(indices + j), index);
+        }
+        for (size_t j = 0; j < block; ++j)
+        {
+            bins[indices[j]]++;
+        }
+        i += block;
+    }
+    binsScalar(values + i, count - i, low, shift, bins, binCount);
+}
+#elif defined(__aarch64__)
+Totals totalsNeon(const int64_t *values, size_t count, int64_t base)
+{
+    const int64x2_t b = vdupq_n_s64(base);
+    int64x2_t min = vdupq_n_s64(LLONG_MAX);
+    int64x2_t max = vdupq_n_s64(LLONG_MIN);
+    int64x2_t sum = vdupq_n_s64(0);
+    float64x2_t squares = vdupq_n_f64(0);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        int64x2_t x = vld1q_s64(values + i);
+        min = vbslq_s64(vcgtq_s64(min, x), x, min);
+        max = vbslq_s64(vcgtq_s64(x, max), x, max);
+        int64x2_t d = vsubq_s64(x, b);
+        sum = vaddq_s64(sum, d);
+        float64x2_t v = vcvtq_f64_s64(d);
+        squares = vaddq_f64(squares, vmulq_f64(v, v));
+    }
+
+    Totals totals = {LLONG_MAX, LLONG_MIN, vaddvq_s64(sum), vaddvq_f64(squares)};
+    totals.min = std::min(vgetq_lane_s64(min, 0), vgetq_lane_s64(min, 1));
+    totals.max = std::max(vgetq_lane_s64(max, 0), vgetq_lane_s64(max, 1));
+    return totalsScalar(values + i, count - i, base, totals);
+}
+
+void binsNeon(const int64_t *values, size_t count, int64_t low, unsigned shift, uint32_t *bins, size_t binCount)
+{
+    const int64x2_t base = vdupq_n_s64(low);
+    const uint64x2_t last = vdupq_n_u64(binCount - 1);
+    const int64x2_t bits = vdupq_n_s64(-static_cast<int64_t>(shift));
+    uint64_t indices[kIndexBlock];
+    size_t i = 0;
+    while (i + 2 <= count)
+    {
+        size_t block = std::min(kIndexBlock, (count - i) & ~size_t(1));
+        for (size_t j = 0; j < block; j += 2)
+        {
+            uint64x2_t offset = vreinterpretq_u64_s64(vsubq_s64(vld1q_s64(values + i + j), base));
+            uint64x2_t index = vshlq_u64(offset, bits);
+            vst1q_u64(indices + j, vbslq_u64(vcgtq_u64(index, last), last, index));
+        }
+        for (size_t j = 0; j < block; ++j)
+        {
+            bins[indices[j]]++;
+        }
+        i += block;
+    }
+    binsScalar(values + i, count - i, low, shift, bins, binCount);
+}
+#endif
+
+Totals totalsOf(const int64_t *values, size_t count, int64_t base)
+{
+    const Totals empty = {LLONG_MAX, LLONG_MIN, 0, 0};
+#if defined(__x86_64__)
+    if (haveAvx2())
+    {
+        Totals totals = totalsAvx2(values, count, base);
+        uint64_t range = static_cast<uint64_t>(totals.max) - static_cast<uint64_t>(totals.min);
+        if (range < kMaxVectorRange)
+        {
+            return totals;
+        }
+    }
+#elif defined(__aarch64__)
+    return totalsNeon(values, count, base);
+#endif
+    return totalsScalar(values, count, base, empty);
+}
+} // namespace
+
+void SampleStore::clear()
+{
+    rtt_.clear();
+    out_.clear();
+    back_.clear();
+}
+
+void SampleStore::reserve(size_t count)
+{
+    rtt_.reserve(count);
+    out_.reserve(count);
+    back_.reserve(count);
+}
+
+void SampleStore::add(int64_t rtt, int64_t out, int64_t back)
+{
+    rtt_.push_back(rtt);
+    out_.push_back(out);
+    back_.push_back(back);
+}
+
+namespace samplestats
+{
+
+Summary summarize(const int64_t *values, size_t count)
+{
+    Summary summary;
+    if (count == 0)
+    {
+        return summary;
+    }
+    int64_t base = values[0];
+    Totals totals = totalsOf(values, count, base);
+    summary.count = count;
+    summary.min = totals.min;
+    summary.max = totals.max;
+
+    // The whole part of the mean offset is added to the base as an integer,
+    // so a mean far from zero keeps its fraction.
+    int64_t whole = totals.sum / static_cast<int64_t>(count);
+    double rest = static_cast<double>(totals.sum - whole * static_cast<int64_t>(count)) / count;
+    summary.mean = static_cast<double>(base + whole) + rest;
+    if (count > 1)
+    {
+        double sum = static_cast<double>(totals.sum);
+        double squares = totals.squares - sum * sum / count;
+        summary.variance = std::max(squares, 0.0) / (count - 1);
+    }
+    return summary;
+}
+
+void histogram(const int64_t *values, size_t count, int64_t low, unsigned shift, uint32_t *bins, size_t binCount)
+{
+    if (binCount == 0)
+    {
+        return;
+    }
+#if defined(__x86_64__)
+    if (haveAvx2())
+    {
+        binsAvx2(values, count, low, shift, bins, binCount);
+        return;
+    }
+#elif defined(__aarch64__)
+    binsNeon(values, count, low, shift, bins, binCount);
+    return;
+#endif
+    binsScalar(values, count, low, shift, bins, binCount);
+}
+
+Distribution::Distribution(const int64_t *values, size_t count, const Summary &summary)
+    : values_(values), count_(count), low_(summary.min), high_(summary.max), shift_(0)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    uint64_t range = static_cast<uint64_t>(high_) - static_cast<uint64_t>(low_);
+    while ((range >> shift_) >= kBins)
+    {
+        ++shift_;
+    }
+    bins_.assign((range >> shift_) + 1, 0);
+    histogram(values, count, low_, shift_, bins_.data(), bins_.size());
+}
+
+double Distribution::percentile(double p) const
+{
+    if (count_ == 0)
+    {
+        return 0;
+    }
+
+    // Rank of the requested sample, 1-based and clamped to the population.
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * count_ + 0.5);
+    rank = std::min<uint64_t>(std::max<uint64_t>(rank, 1), count_);
+
+    // The histogram only narrows the search down to one bin; the sample is
+    // then picked out exactly from that bin's values, so an outlier that
+    // widens the bins costs time, not accuracy.
+    size_t bin = 0;
+    uint64_t below = 0;
+    while (below + bins_[bin] < rank)
+    {
+        below += bins_[bin++];
+    }
+    if (shift_ == 0)
+    {
+        return static_cast<double>(low_ + static_cast<int64_t>(bin));
+    }
+
+    // The bin's bounds, as offsets from the column's minimum.
+    uint64_t first = static_cast<uint64_t>(bin) << shift_;
+    uint64_t width = bin + 1 == bins_.size() ? UINT64_MAX - first : (1ULL << shift_) - 1;
+    std::vector<int64_t> candidates;
+    candidates.reserve(bins_[bin]);
+    for (size_t i = 0; i < count_; ++i)
+    {
+        if (static_cast<uint64_t>(values_[i]) - static_cast<uint64_t>(low_) - first <= width)
+        {
+            candidates.push_back(values_[i]);
+        }
+    }
+    auto nth = candidates.begin() + (rank - below - 1);
+    std::nth_element(candidates.begin(), nth, candidates.end());
+    return static_cast<double>(*nth);
+}
+
+} // namespace samplestats
@@ -0,0 +1,156 @@
+#include "SocketTimestamps.h"
+#include <cerrno>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+namespace
+{
+// ts[0] is the software timestamp, ts[2] the raw hardware one.
+double timestampOf(struct msghdr *msg, bool &hardware)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct timespec ts[3];
+            memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+            if (ts[2].tv_sec || ts[2].tv_nsec)
+            {
+                hardware = true;
+                return ts[2].tv_sec + ts[2].tv_nsec / 1e9;
+            }
+            return ts[0].tv_sec + ts[0].tv_nsec / 1e9;
+        }
+    }
+    return 0;
+}
+
+const struct sock_extended_err *extendedErrorOf(struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        {
+            return reinterpret_cast<const struct sock_extended_err *>(CMSG_DATA(cmsg));
+        }
+    }
+    return nullptr;
+}
+} // namespace
+
+SocketTimestamps::SocketTimestamps() : fd_(-1), nextId_(0), hardware_(false) {}
+
+bool SocketTimestamps::enable(int fd)
+{
+    // Hardware timestamps are asked for but only delivered when the NIC has
+    // been set up for them; software ones are always there as a fallback.
+    // OPT_ID numbers the send timestamps, OPT_TSONLY keeps the packet itself
+    // out of the error queue.
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        return false;
+    }
+    fd_ = fd;
+    nextId_ = 0;
+    return true;
+}
+
+double SocketTimestamps::receivedAt(struct msghdr *msg)
+{
+    return timestampOf(msg, hardware_);
+}
+
+bool SocketTimestamps::readError(uint32_t &id, double &sentAt)
+{
+    char control[256];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+    {
+        return false;
+    }
+    // Anything other than a send timestamp, such as an ICMP error, is
+    // reported with no time and so dropped by the callers.
+    const struct sock_extended_err *err = extendedErrorOf(&msg);
+    bool timestamp = err && err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+    id = timestamp ? err->ee_data : 0;
+    sentAt = timestamp ? timestampOf(&msg, hardware_) : 0;
+    return true;
+}
+
+double SocketTimestamps::sentAt(uint32_t id)
+{
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        // Older entries, for packets already given up on, are kept.
+        uint32_t entryId;
+        double entrySentAt;
+        while (readError(entryId, entrySentAt))
+        {
+            if (entryId == id && entrySentAt > 0)
+            {
+                return entrySentAt;
+            }
+            keepLate(entryId, entrySentAt);
+        }
+
+        // Nothing requested in events: poll() reports POLLERR once the error
+        // queue has something.
+        struct pollfd pfd = {fd_, 0, 0};
+        if (attempt == 0 && poll(&pfd, 1, 1) <= 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+void SocketTimestamps::drain()
+{
+    uint32_t id;
+    double sentAt;
+    while (readError(id, sentAt))
+    {
+        keepLate(id, sentAt);
+    }
+}
+
+void SocketTimestamps::keepLate(uint32_t id, double sentAt)
+{
+    if (sentAt <= 0)
+    {
+        return;
+    }
+    late_[id] = sentAt;
+
+    // Replies to the oldest packets are not coming any more.
+    if (late_.size() > kLateWindow)
+    {
+        for (auto it = late_.begin(); it != late_.end();)
+        {
+            it = nextId_ - it->first > kLateWindow ? late_.erase(it) : std::next(it);
+        }
+    }
+}
+
+double SocketTimestamps::lateSentAt(uint32_t id)
+{
+    auto it = late_.find(id);
+    if (it == late_.end())
+    {
+        return 0;
+    }
+    double sentAt = it->second;
+    late_.erase(it);
+    return sentAt;
+}
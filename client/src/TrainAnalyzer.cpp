@@ -0,0 +1,138 @@
+#include "TrainAnalyzer.h"
+#include <algorithm>
+
+TrainAnalyzer::TrainAnalyzer(uint32_t trainLength, uint32_t wireBytes)
+    : length_(trainLength), wireBits_(wireBytes * 8.0)
+{
+}
+
+void TrainAnalyzer::reset()
+{
+    open_.clear();
+    pairRates_.clear();
+    trainRates_.clear();
+    growth_.clear();
+}
+
+TrainAnalyzer::Train &TrainAnalyzer::trainAt(uint32_t train)
+{
+    Train &entry = open_[train];
+    if (entry.samples.empty())
+    {
+        entry.samples.assign(length_, Sample{0, 0});
+    }
+    return entry;
+}
+
+void TrainAnalyzer::onReply(uint32_t train, uint32_t position, int64_t sentNs, int64_t reflectorNs)
+{
+    if (position >= length_)
+    {
+        return;
+    }
+    Train &entry = trainAt(train);
+    entry.samples[position] = Sample{sentNs, reflectorNs};
+    if (++entry.settled == length_)
+    {
+        settle(train, entry);
+    }
+}
+
+void TrainAnalyzer::onLost(uint32_t train, uint32_t position)
+{
+    if (position >= length_)
+    {
+        return;
+    }
+    Train &entry = trainAt(train);
+    if (++entry.settled == length_)
+    {
+        settle(train, entry);
+    }
+}
+
+void TrainAnalyzer::settle(uint32_t train, Train &entry)
+{
+    const std::vector<Sample> &samples = entry.samples;
+    int first = -1;
+    int last = -1;
+    for (uint32_t i = 0; i < length_; ++i)
+    {
+        if (samples[i].reflectorNs == 0)
+        {
+            continue;
+        }
+        if (first < 0)
+        {
+            first = static_cast<int>(i);
+        }
+        else if (last == static_cast<int>(i) - 1)
+        {
+            // Only neighbours: a lost packet in between would double the gap.
+            int64_t gap = samples[i].reflectorNs - samples[last].reflectorNs;
+            if (gap > 0)
+            {
+                pairRates_.push_back(wireBits_ * 1e9 / gap);
+            }
+        }
+        last = static_cast<int>(i);
+    }
+
+    if (first >= 0 && last > first)
+    {
+        int64_t spread = samples[last].reflectorNs - samples[first].reflectorNs;
+        uint32_t gaps = static_cast<uint32_t>(last - first);
+        if (spread > 0)
+        {
+            trainRates_.push_back(wireBits_ * gaps * 1e9 / spread);
+        }
+        double sentGap = static_cast<double>(samples[last].sentNs - samples[first].sentNs);
+        growth_.push_back(Growth{static_cast<double>(spread), sentGap, gaps});
+    }
+    open_.erase(train);
+}
+
+double TrainAnalyzer::median(std::vector<double> &values)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+TrainAnalyzer::Result TrainAnalyzer::finish()
+{
+    // Packets never settled count as lost.
+    while (!open_.empty())
+    {
+        auto it = open_.begin();
+        settle(it->first, it->second);
+    }
+
+    Result result;
+    result.measured = static_cast<uint32_t>(growth_.size());
+    double capacity = median(pairRates_);
+    result.capacityMbps = capacity / 1e6;
+    result.availableMbps = median(trainRates_) / 1e6;
+
+    // The bottleneck spaces the packets by their transmission time even on
+    // an idle path; only what comes on top of that is queueing.
+    double sum = 0;
+    for (size_t i = 0; i < growth_.size(); ++i)
+    {
+        // A train sent slower than the bottleneck keeps its own spacing;
+        // one sent faster leaves it at the bottleneck's.
+        double selfNs = capacity > 0 ? wireBits_ * growth_[i].gaps * 1e9 / capacity : 0;
+        double excessMs = (growth_[i].spreadNs - std::max(growth_[i].sentGapNs, selfNs)) / 1e6;
+        sum += excessMs;
+        result.maxDelayGrowthMs = i == 0 ? excessMs : std::max(result.maxDelayGrowthMs, excessMs);
+    }
+    if (!growth_.empty())
+    {
+        result.avgDelayGrowthMs = sum / growth_.size();
+    }
+    return result;
+}
@@ -1,17 +1,46 @@
 #include "Client.h"
+#include "Agent.h"
+#include "Crypto.h"
 #include <iostream>
 #include <string>
 #include <cstdlib>
+#include <csignal>
+#include <vector>
+
+static Agent* agentInstance = nullptr;
+
+void agentSignalHandler(int) {
+    if (agentInstance) {
+        agentInstance->requestStop();
+    }
+}
 
 void printUsage() {
     std::cout << "Usage: twamp-client <server-address>[:port] [options]\n"
+              << "       twamp-client [<ipv6-address>]:port [options]\n"
+              << "       twamp-client --agent <targets-file> [options]\n"
               << "Options:\n"
               << "  -c <count>    Number of test packets to send (default: 10)\n"
               << "  -i <interval> Interval between packets in ms (default: 1000)\n"
               << "  -s            Short output (only summary after all packets)\n"
+              << "  --format <f>  Output format: text, jsonl or csv (default: text)\n"
+              << "  --rollup <s[,s...]> Report interval statistics every s seconds, e.g. 1,10,60\n"
+              << "  --dscp <d[,d...]> Mark packets with these DSCP values in turn and report each\n"
+              << "  --size <bytes> Size of each test packet, 64 to 1024 (default: 64)\n"
+              << "  --train <n>   Send each probe as a train of n back-to-back packets (2 = packet pair)\n"
+              << "                and report capacity, available bandwidth and delay growth\n"
+              << "  --rto-min <ms> Shortest wait for a reply before sending the next packet (default: 10)\n"
+              << "  --rto-max <ms> Longest wait for a reply before sending the next packet (default: 2000)\n"
+              << "  -p <period>   Agent mode: seconds between tests of each target (default: 60)\n"
+              << "  -m <mode>     unauthenticated, authenticated or encrypted (default: unauthenticated)\n"
+              << "  --key-file <f> File of \"keyid secret\" lines for the secured modes\n"
+              << "  --key-id <id> Key to use from the key file (default: the first one)\n"
               << "  -h            Show this help message\n"
               << "Example:\n"
-              << "  twamp-client 192.168.1.1:862 -c 20 -i 500 -s\n";
+              << "  twamp-client 192.168.1.1:862 -c 20 -i 500 -s\n"
+              << "  twamp-client --agent /etc/twamp/targets.txt -c 10 -i 100 -p 60\n"
+              << "  twamp-client 192.168.1.1 -m encrypted --key-file /etc/twamp/keys\n"
+              << "  twamp-client 192.168.1.1 -c 100 -i 100 --train 16 --size 1024\n";
 }
 
 int main(int argc, char* argv[]) {
@@ -26,6 +55,19 @@ int main(int argc, char* argv[]) {
     int packetCount = 10;
     int intervalMs = 1000;
     bool shortOutput = false;
+    OutputFormat format = OutputFormat::Text;
+    std::vector<int> rollups;
+    std::vector<int> dscps;
+    int packetSize = 64;
+    int trainLength = 1;
+    int rtoMinMs = 10;
+    int rtoMaxMs = 2000;
+    bool agentMode = false;
+    int periodSec = 60;
+    uint8_t mode = ModeUnauthenticated;
+    std::string keyFile;
+    std::string keyId;
+    int firstOption = 2;
 
     // Check for -h help flag early
     for (int i = 1; i < argc; ++i) {
@@ -36,16 +78,40 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // Parse port if specified in address
-    size_t colonPos = serverAddress.find(':');
-    if (colonPos != std::string::npos) {
-        controlPort = std::stoi(serverAddress.substr(colonPos + 1));
-        serverAddress = serverAddress.substr(0, colonPos);
-        testPort = controlPort + 1;
+    if (serverAddress == "--agent") {
+        if (argc < 3) {
+            printUsage();
+            return EXIT_FAILURE;
+        }
+        agentMode = true;
+        serverAddress = argv[2];
+        firstOption = 3;
+    }
+
+    // Parse port if specified in address; IPv6 addresses need brackets
+    // around them to take one, as in [2001:db8::1]:862.
+    if (!agentMode && !serverAddress.empty() && serverAddress[0] == '[') {
+        size_t closePos = serverAddress.find(']');
+        if (closePos == std::string::npos) {
+            std::cerr << "Invalid server address: " << serverAddress << std::endl;
+            return 1;
+        }
+        if (closePos + 1 < serverAddress.size() && serverAddress[closePos + 1] == ':') {
+            controlPort = std::stoi(serverAddress.substr(closePos + 2));
+            testPort = controlPort + 1;
+        }
+        serverAddress = serverAddress.substr(1, closePos - 1);
+    } else {
+        size_t colonPos = serverAddress.find(':');
+        if (!agentMode && colonPos != std::string::npos && serverAddress.find(':', colonPos + 1) == std::string::npos) {
+            controlPort = std::stoi(serverAddress.substr(colonPos + 1));
+            serverAddress = serverAddress.substr(0, colonPos);
+            testPort = controlPort + 1;
+        }
     }
 
     // Parse remaining options
-    for (int i = 2; i < argc; ++i) {
+    for (int i = firstOption; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "-c" && i + 1 < argc) {
             packetCount = std::stoi(argv[++i]);
@@ -53,6 +119,69 @@ int main(int argc, char* argv[]) {
             intervalMs = std::stoi(argv[++i]);
         } else if (arg == "-s") {
             shortOutput = true;
+        } else if (arg == "--format" && i + 1 < argc) {
+            if (!parseOutputFormat(argv[++i], format)) {
+                std::cerr << "Unknown output format: " << argv[i] << std::endl;
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--rollup" && i + 1 < argc) {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                int seconds = std::stoi(list.substr(start, comma - start));
+                if (seconds <= 0) {
+                    std::cerr << "Rollup interval must be positive" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                rollups.push_back(seconds);
+                if (comma == std::string::npos) break;
+                start = comma + 1;
+            }
+        } else if (arg == "--dscp" && i + 1 < argc) {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                int dscp = std::stoi(list.substr(start, comma - start));
+                if (dscp < 0 || dscp > 63) {
+                    std::cerr << "DSCP must be between 0 and 63" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                dscps.push_back(dscp);
+                if (comma == std::string::npos) break;
+                start = comma + 1;
+            }
+        } else if (arg == "--size" && i + 1 < argc) {
+            packetSize = std::stoi(argv[++i]);
+            if (packetSize < 64 || packetSize > 1024) {
+                std::cerr << "Packet size must be between 64 and 1024 bytes" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--train" && i + 1 < argc) {
+            trainLength = std::stoi(argv[++i]);
+            if (trainLength < 1 || trainLength > 256) {
+                std::cerr << "Train length must be between 1 and 256 packets" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--rto-min" && i + 1 < argc) {
+            rtoMinMs = std::stoi(argv[++i]);
+        } else if (arg == "--rto-max" && i + 1 < argc) {
+            rtoMaxMs = std::stoi(argv[++i]);
+        } else if (arg == "-p" && i + 1 < argc) {
+            periodSec = std::stoi(argv[++i]);
+        } else if (arg == "-m" && i + 1 < argc) {
+            mode = parseMode(argv[++i]);
+            if (mode == 0) {
+                std::cerr << "Unknown mode: " << argv[i] << std::endl;
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--key-file" && i + 1 < argc) {
+            keyFile = argv[++i];
+        } else if (arg == "--key-id" && i + 1 < argc) {
+            keyId = argv[++i];
         } else {
             std::cerr << "Unknown option: " << arg << std::endl;
             printUsage();
@@ -60,8 +189,80 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (packetCount < 1) {
+        std::cerr << "Packet count must be at least 1" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (intervalMs < 0) {
+        std::cerr << "Packet interval must not be negative" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (periodSec < 1) {
+        std::cerr << "Agent period must be at least 1 second" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (rtoMinMs < 1 || rtoMaxMs < rtoMinMs) {
+        std::cerr << "Reply timeout bounds must satisfy 1 <= --rto-min <= --rto-max" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    KeyRing keys;
+    const std::string* secret = nullptr;
+    if (mode != ModeUnauthenticated) {
+        if (agentMode) {
+            std::cerr << "Agent mode only supports unauthenticated mode" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (keyFile.empty() || !keys.load(keyFile)) {
+            std::cerr << "The " << modeName(mode) << " mode needs a readable --key-file" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (keyId.empty()) {
+            keyId = keys.firstKeyId();
+        }
+        secret = keys.find(keyId);
+        if (secret == nullptr) {
+            std::cerr << "Key not found in " << keyFile << ": " << keyId << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (agentMode && !dscps.empty()) {
+        std::cerr << "Agent mode does not mark DSCP" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (agentMode && (packetSize != 64 || trainLength != 1)) {
+        std::cerr << "Agent mode only sends single 64-byte packets" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (agentMode) {
+        Agent agent(packetCount, intervalMs, periodSec, shortOutput, format);
+        if (!agent.loadTargets(serverAddress)) {
+            return EXIT_FAILURE;
+        }
+        agentInstance = &agent;
+        signal(SIGINT, agentSignalHandler);
+        signal(SIGTERM, agentSignalHandler);
+        bool ok = agent.run();
+        agentInstance = nullptr;
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     try {
-        Client client(serverAddress, controlPort, testPort, shortOutput);
+        Client client(serverAddress, controlPort, testPort, shortOutput, format);
+        client.setIntervalRollups(rollups);
+        client.setDscpClasses(dscps);
+        client.setReplyTimeoutBounds(rtoMinMs, rtoMaxMs);
+        client.setPacketSize(packetSize);
+        client.setTrainLength(trainLength);
+        if (secret != nullptr) {
+            client.setSecurity(mode, keyId, *secret);
+        }
         if (!client.runTest(packetCount, intervalMs)) {
             return EXIT_FAILURE;
         }
@@ -0,0 +1,170 @@
+#ifndef TWAMP_ADDRESS_H
+#define TWAMP_ADDRESS_H
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+
+// Server and client are IPv6 throughout: sockets are AF_INET6 where the
+// kernel has IPv6 and IPv4 peers show up as IPv4-mapped addresses
+// (::ffff:a.b.c.d), so both families take the same path from the receive
+// batch to the session lookup. On a kernel without IPv6, sockets fall back
+// to AF_INET and their addresses are mapped on the way in and out.
+
+inline bool isMappedIpv4(const struct in6_addr &addr)
+{
+    return IN6_IS_ADDR_V4MAPPED(&addr);
+}
+
+// The IPv4 address inside a mapped one, in network order.
+inline uint32_t mappedIpv4(const struct in6_addr &addr)
+{
+    uint32_t ip;
+    memcpy(&ip, addr.s6_addr + 12, sizeof(ip));
+    return ip;
+}
+
+inline struct in6_addr mapIpv4(uint32_t networkOrderIp)
+{
+    struct in6_addr addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.s6_addr[10] = 0xff;
+    addr.s6_addr[11] = 0xff;
+    memcpy(addr.s6_addr + 12, &networkOrderIp, sizeof(networkOrderIp));
+    return addr;
+}
+
+// Hash of an address for lookup tables. Different addresses can share a
+// key, so entries found by it must still be compared in full. Never 0, which
+// callers keep for "no address yet".
+inline uint64_t addressKey(const struct in6_addr &addr)
+{
+    uint64_t high, low;
+    memcpy(&high, addr.s6_addr, sizeof(high));
+    memcpy(&low, addr.s6_addr + 8, sizeof(low));
+    uint64_t key = (high * 0x9e3779b97f4a7c15ULL) ^ low;
+    return key != 0 ? key : 1;
+}
+
+// Zeroes all but the first `bits` bits of the address.
+inline struct in6_addr maskAddress(const struct in6_addr &addr, int bits)
+{
+    struct in6_addr masked = addr;
+    for (int i = 0; i < 16; ++i)
+    {
+        int keep = bits - 8 * i;
+        if (keep <= 0)
+        {
+            masked.s6_addr[i] = 0;
+        }
+        else if (keep < 8)
+        {
+            masked.s6_addr[i] &= static_cast<uint8_t>(0xff << (8 - keep));
+        }
+    }
+    return masked;
+}
+
+// Accepts IPv4 and IPv6 literals; IPv4 ones come back mapped.
+inline bool parseAddress(const std::string &text, struct in6_addr &addr)
+{
+    struct in_addr ipv4;
+    if (inet_pton(AF_INET, text.c_str(), &ipv4) == 1)
+    {
+        addr = mapIpv4(ipv4.s_addr);
+        return true;
+    }
+    return inet_pton(AF_INET6, text.c_str(), &addr) == 1;
+}
+
+// Mapped addresses print as plain IPv4.
+inline std::string formatIp(const struct in6_addr &addr)
+{
+    char buf[INET6_ADDRSTRLEN];
+    if (isMappedIpv4(addr))
+    {
+        uint32_t ip = mappedIpv4(addr);
+        inet_ntop(AF_INET, &ip, buf, sizeof(buf));
+    }
+    else
+    {
+        inet_ntop(AF_INET6, &addr, buf, sizeof(buf));
+    }
+    return buf;
+}
+
+inline std::string formatAddress(const struct sockaddr_in6 &addr)
+{
+    std::string ip = formatIp(addr.sin6_addr);
+    if (!isMappedIpv4(addr.sin6_addr))
+    {
+        ip = "[" + ip + "]";
+    }
+    return ip + ":" + std::to_string(ntohs(addr.sin6_port));
+}
+
+// Opens an AF_INET6 socket, or an AF_INET one if the kernel was booted
+// without IPv6 and `address` is IPv4 or unspecified. Returns -1 with errno
+// set like socket() otherwise.
+inline int openSocket(const struct in6_addr &address, int type)
+{
+    int fd = socket(AF_INET6, type, 0);
+    if (fd < 0 && errno == EAFNOSUPPORT &&
+        (isMappedIpv4(address) || IN6_IS_ADDR_UNSPECIFIED(&address)))
+    {
+        fd = socket(AF_INET, type, 0);
+    }
+    return fd;
+}
+
+inline int socketFamily(int fd)
+{
+    int family = AF_INET6;
+    socklen_t size = sizeof(family);
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &family, &size);
+    return family;
+}
+
+// `addr` as a socket of `family` takes it in bind(), connect() and sendto():
+// unchanged for AF_INET6, unmapped for AF_INET, which openSocket() only
+// opens for IPv4 and unspecified addresses. The latter become INADDR_ANY.
+inline socklen_t toSocketAddress(int family, const struct sockaddr_in6 &addr, struct sockaddr_storage &out)
+{
+    memset(&out, 0, sizeof(out));
+    if (family != AF_INET)
+    {
+        memcpy(&out, &addr, sizeof(addr));
+        return sizeof(addr);
+    }
+    struct sockaddr_in ipv4;
+    memset(&ipv4, 0, sizeof(ipv4));
+    ipv4.sin_family = AF_INET;
+    ipv4.sin_port = addr.sin6_port;
+    ipv4.sin_addr.s_addr = isMappedIpv4(addr.sin6_addr) ? mappedIpv4(addr.sin6_addr) : htonl(INADDR_ANY);
+    memcpy(&out, &ipv4, sizeof(ipv4));
+    return sizeof(ipv4);
+}
+
+// What accept(), recvmsg() or getsockname() wrote into `raw`, with an
+// AF_INET socket's address mapped so it reads like any other.
+inline struct sockaddr_in6 fromSocketAddress(const struct sockaddr_in6 &raw)
+{
+    if (raw.sin6_family != AF_INET)
+    {
+        return raw;
+    }
+    struct sockaddr_in ipv4;
+    memcpy(&ipv4, &raw, sizeof(ipv4));
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = ipv4.sin_port;
+    addr.sin6_addr = mapIpv4(ipv4.sin_addr.s_addr);
+    return addr;
+}
+
+#endif // TWAMP_ADDRESS_H
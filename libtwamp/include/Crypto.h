@@ -0,0 +1,165 @@
+#ifndef TWAMP_CRYPTO_H
+#define TWAMP_CRYPTO_H
+
+#include "Messages.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+class HmacSha1;
+
+// RFC 5357 modes, as carried in the mode byte of the greetings. The server
+// offers a bitmask; the client picks exactly one.
+enum TwampMode : uint8_t
+{
+    ModeUnauthenticated = 1,
+    ModeAuthenticated = 2,
+    ModeEncrypted = 4
+};
+
+const char *modeName(uint8_t mode);
+
+// Returns 0 for an unknown name.
+uint8_t parseMode(const std::string &name);
+
+// Handshake additions in the secured modes. The server greeting is followed
+// by Challenge(16) Salt(16) Count(4) whenever a secured mode is offered; a
+// client choosing one follows its greeting with KeyID(80) Token(64)
+// Client-IV(16) and receives Accept(1) MBZ(15) Server-IV(16) in return.
+const size_t kGreetingExtensionSize = ServerChallenge::kSize;
+const size_t kSetupExtensionSize = SetupResponse::kSize;
+const size_t kServerStartSize = ServerStart::kSize;
+const size_t kKeyIdSize = SetupResponse::kKeyIdSize;
+const size_t kTokenSize = SetupResponse::kTokenSize;
+
+// Secured control messages are padded to whole AES blocks and followed by a
+// truncated HMAC-SHA1. Secured test packets carry theirs at offset 48.
+const size_t kMacSize = 16;
+const size_t kTestMacOffset = 48;
+const size_t kSecuredTestPacketSize = kTestMacOffset + kMacSize;
+
+struct SessionKeys
+{
+    unsigned char aes[16];
+    unsigned char hmac[32];
+};
+
+// Shared secrets by KeyID, read from "keyid secret" lines; blank lines and
+// '#' comments are skipped.
+class KeyRing
+{
+public:
+    bool load(const std::string &filename);
+    const std::string *find(const std::string &keyId) const;
+    bool empty() const { return secrets_.empty(); }
+    const std::string &firstKeyId() const { return secrets_.begin()->first; }
+
+private:
+    std::map<std::string, std::string> secrets_;
+};
+
+bool randomBytes(unsigned char *out, size_t size);
+
+// Bounds of the PBKDF2 iteration count. Below the minimum the derived keys
+// are too cheap to guess; above the maximum one handshake costs seconds.
+const uint32_t kMinKeyDerivationCount = 1024;
+const uint32_t kMaxKeyDerivationCount = 1u << 24;
+
+// PBKDF2-HMAC-SHA1 of the shared secret (RFC 4656, section 3.1).
+bool deriveKey(const std::string &secret, const unsigned char salt[16], uint32_t count, unsigned char key[16]);
+
+// Token = AES-CBC(key, zero IV, Challenge || AES session key || HMAC session key).
+bool sealToken(const unsigned char key[16], const unsigned char challenge[16], const SessionKeys &keys,
+               unsigned char token[kTokenSize]);
+bool openToken(const unsigned char key[16], const unsigned char token[kTokenSize],
+               const unsigned char challenge[16], SessionKeys &keys);
+
+// Protects the control messages that follow the handshake. Each direction
+// is one CBC chain seeded with the sender's IV; the HMAC also covers a
+// per-direction message counter so messages cannot be replayed or reordered.
+class ControlCipher
+{
+public:
+    ControlCipher();
+    ~ControlCipher();
+    ControlCipher(const ControlCipher &) = delete;
+    ControlCipher &operator=(const ControlCipher &) = delete;
+
+    bool init(const SessionKeys &keys, const unsigned char sendIv[16], const unsigned char receiveIv[16]);
+    bool active() const { return hmac_ != nullptr; }
+
+    // Where both chains and counters stand between messages, so that
+    // another process can carry on the same connection.
+    struct State
+    {
+        unsigned char sendIv[16];
+        unsigned char receiveIv[16];
+        uint64_t sendCount;
+        uint64_t receiveCount;
+    };
+    State state() const;
+    bool init(const SessionKeys &keys, const State &state);
+
+    // Bytes on the wire for a message of `size` bytes.
+    static size_t sealedSize(size_t size) { return (size + 15) / 16 * 16 + kMacSize; }
+
+    std::vector<char> seal(const char *message, size_t size);
+
+    // Decrypts whole blocks, continuing the receive chain. Lets a reader
+    // look at the command byte before it knows the message length.
+    bool decrypt(const char *in, size_t size, char *out);
+
+    // Checks the MAC of a padded message decrypted with decrypt().
+    bool verify(const char *padded, size_t size, const char *mac);
+
+private:
+    bool computeMac(uint64_t counter, const char *data, size_t size, unsigned char mac[20]);
+
+    EVP_CIPHER_CTX *encrypt_;
+    EVP_CIPHER_CTX *decrypt_;
+    HmacSha1 *hmac_;
+    uint64_t sendCount_;
+    uint64_t receiveCount_;
+
+    // Last ciphertext block in each direction: the IV the chain continues
+    // from.
+    unsigned char sendIv_[16];
+    unsigned char receiveIv_[16];
+};
+
+// Protects the test packets of one session. Key schedules and HMAC pads are
+// computed once in init(), so a packet costs a few AES block operations and
+// one HMAC with no allocation or re-keying. Authenticated mode encrypts the
+// first block (sequence number and sender timestamp) with AES-ECB; encrypted
+// mode encrypts everything before the MAC with AES-CBC and a zero IV. Not
+// thread-safe.
+class TestPacketCipher
+{
+public:
+    TestPacketCipher();
+    ~TestPacketCipher();
+    TestPacketCipher(const TestPacketCipher &) = delete;
+    TestPacketCipher &operator=(const TestPacketCipher &) = delete;
+
+    // Session keys are bound to the SID as in RFC 4656, section 4.1.2.
+    bool init(uint8_t mode, const SessionKeys &keys, uint32_t sid);
+    uint8_t mode() const { return mode_; }
+    bool secured() const { return mode_ != ModeUnauthenticated; }
+
+    // Verifies and decrypts a received packet in place.
+    bool open(char *packet, size_t size);
+
+    // Adds the MAC and encrypts a packet in place before it is sent.
+    bool seal(char *packet, size_t size);
+
+private:
+    uint8_t mode_;
+    EVP_CIPHER_CTX *encrypt_;
+    EVP_CIPHER_CTX *decrypt_;
+    HmacSha1 *hmac_;
+};
+
+#endif // TWAMP_CRYPTO_H
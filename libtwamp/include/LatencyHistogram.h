@@ -0,0 +1,54 @@
+#ifndef TWAMP_LATENCY_HISTOGRAM_H
+#define TWAMP_LATENCY_HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Fixed-size log-linear histogram of nanosecond values. Each power of two is
+// split into 32 linear sub-buckets, which bounds the relative error of any
+// reported percentile to about 3% while using constant memory.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint64_t valueNs);
+    void reset();
+
+    uint64_t count() const { return total_; }
+
+    // Value at the given percentile (0-100), reported as the midpoint of the
+    // bucket that contains it. Returns 0 when the histogram is empty.
+    uint64_t percentile(double p) const;
+
+private:
+    friend class SharedLatencyHistogram;
+
+    static constexpr int kSubBucketBits = 5;
+    static constexpr int kMaxValueBits = 44;  // ~4.9 hours in nanoseconds
+    static constexpr size_t kBucketCount = (kMaxValueBits - kSubBucketBits + 1) << kSubBucketBits;
+
+    static size_t indexOf(uint64_t value);
+    static uint64_t midpointOf(size_t index);
+
+    std::array<uint32_t, kBucketCount> counts_;
+    uint64_t total_;
+};
+
+// A histogram that one thread records into while others read it, without a
+// lock. Only the writer stores to the counts, so recording costs what it
+// does in a LatencyHistogram; readers add a snapshot of them to a
+// LatencyHistogram of their own, which can merge several.
+class SharedLatencyHistogram {
+public:
+    SharedLatencyHistogram();
+
+    void record(uint64_t valueNs);
+    void addTo(LatencyHistogram& out) const;
+
+private:
+    std::array<std::atomic<uint32_t>, LatencyHistogram::kBucketCount> counts_;
+};
+
+#endif // TWAMP_LATENCY_HISTOGRAM_H
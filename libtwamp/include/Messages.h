@@ -0,0 +1,291 @@
+#ifndef TWAMP_MESSAGES_H
+#define TWAMP_MESSAGES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Wire layouts of the TWAMP control messages and test packets, as views over
+// a caller's buffer. A view is a single pointer: it owns nothing, allocates
+// nothing and can be copied freely. Fields are read and written a byte at a
+// time in network order, so any buffer alignment is fine and the compiler
+// still folds each access into one load or store and a byte swap. Offsets
+// are checked against the message size at compile time.
+//
+// The control messages are the compact forms this implementation has always
+// used, not the full RFC 5357 layouts; both ends share these definitions.
+
+// Control commands, as carried in the first byte of each control message.
+enum ControlCommand : uint8_t {
+    CommandRequestSession = 1,
+    CommandAcceptSession = 3,
+    CommandStopSessions = 4,
+    CommandStartSessions = 7,
+    CommandStartAck = 8,
+    CommandStopAck = 9
+};
+
+// Seconds between the NTP epoch (1900) and the UNIX epoch.
+const uint64_t kNtpEpochOffset = 2208988800ULL;
+
+// 64-bit NTP timestamps: 32 bits of seconds and 32 bits of fraction.
+constexpr uint64_t ntpFromUnixNs(int64_t ns)
+{
+    return (static_cast<uint64_t>(ns / 1000000000 + kNtpEpochOffset) << 32) |
+           ((static_cast<uint64_t>(ns % 1000000000) << 32) / 1000000000);
+}
+
+constexpr int64_t unixNsFromNtp(uint64_t ntp)
+{
+    return (static_cast<int64_t>(ntp >> 32) - static_cast<int64_t>(kNtpEpochOffset)) * 1000000000 +
+           static_cast<int64_t>(((ntp & 0xffffffffULL) * 1000000000) >> 32);
+}
+
+constexpr double unixSecondsFromNtp(uint64_t ntp)
+{
+    return (static_cast<double>(ntp >> 32) - kNtpEpochOffset) + (ntp & 0xffffffffULL) / 4294967296.0;
+}
+
+// Common base of the views; Size is the length of the fixed layout.
+template <size_t Size>
+class MessageView {
+public:
+    static constexpr size_t kSize = Size;
+
+    constexpr explicit MessageView(char* data) : data_(data) {}
+    constexpr char* data() const { return data_; }
+
+protected:
+    template <size_t Offset>
+    constexpr uint8_t get8() const
+    {
+        static_assert(Offset + 1 <= Size, "field outside the message");
+        return static_cast<uint8_t>(data_[Offset]);
+    }
+
+    template <size_t Offset>
+    constexpr void set8(uint8_t value) const
+    {
+        static_assert(Offset + 1 <= Size, "field outside the message");
+        data_[Offset] = static_cast<char>(value);
+    }
+
+    template <size_t Offset, size_t Bytes>
+    constexpr uint64_t get() const
+    {
+        static_assert(Offset + Bytes <= Size, "field outside the message");
+        static_assert(Bytes == 2 || Bytes == 4 || Bytes == 8, "unsupported field width");
+        if constexpr (Bytes == 2) {
+            return static_cast<uint64_t>(byte(Offset)) << 8 | byte(Offset + 1);
+        } else if constexpr (Bytes == 4) {
+            return static_cast<uint64_t>(byte(Offset)) << 24 | static_cast<uint64_t>(byte(Offset + 1)) << 16 |
+                   static_cast<uint64_t>(byte(Offset + 2)) << 8 | byte(Offset + 3);
+        } else {
+            return get<Offset, 4>() << 32 | get<Offset + 4, 4>();
+        }
+    }
+
+    template <size_t Offset, size_t Bytes>
+    constexpr void set(uint64_t value) const
+    {
+        static_assert(Offset + Bytes <= Size, "field outside the message");
+        static_assert(Bytes == 2 || Bytes == 4 || Bytes == 8, "unsupported field width");
+        if constexpr (Bytes == 8) {
+            set<Offset, 4>(value >> 32);
+            set<Offset + 4, 4>(value);
+        } else {
+            for (size_t i = 0; i < Bytes; ++i) {
+                data_[Offset + i] = static_cast<char>(value >> (8 * (Bytes - 1 - i)));
+            }
+        }
+    }
+
+    // Opaque byte fields (keys, IVs, challenges) are handed out in place.
+    template <size_t Offset, size_t Bytes>
+    unsigned char* bytes() const
+    {
+        static_assert(Offset + Bytes <= Size, "field outside the message");
+        return reinterpret_cast<unsigned char*>(data_ + Offset);
+    }
+
+private:
+    constexpr uint8_t byte(size_t offset) const { return static_cast<uint8_t>(data_[offset]); }
+
+    char* data_;
+};
+
+// Server greeting: MBZ(3) Modes(1) Server-ID(4) MBZ(4).
+class ServerGreeting : public MessageView<12> {
+public:
+    using MessageView::MessageView;
+    constexpr uint8_t modes() const { return get8<3>(); }
+    constexpr void setModes(uint8_t modes) const { set8<3>(modes); }
+    constexpr uint32_t serverId() const { return static_cast<uint32_t>(get<4, 4>()); }
+    constexpr void setServerId(uint32_t id) const { set<4, 4>(id); }
+};
+
+// Follows the server greeting whenever a secured mode is offered:
+// Challenge(16) Salt(16) Count(4).
+class ServerChallenge : public MessageView<36> {
+public:
+    using MessageView::MessageView;
+    unsigned char* challenge() const { return bytes<0, 16>(); }
+    unsigned char* salt() const { return bytes<16, 16>(); }
+    constexpr uint32_t count() const { return static_cast<uint32_t>(get<32, 4>()); }
+    constexpr void setCount(uint32_t count) const { set<32, 4>(count); }
+};
+
+// Client greeting: MBZ(3) Mode(1) MBZ(8), the mode being exactly one bit.
+class ClientGreeting : public MessageView<12> {
+public:
+    using MessageView::MessageView;
+    constexpr uint8_t mode() const { return get8<3>(); }
+    constexpr void setMode(uint8_t mode) const { set8<3>(mode); }
+};
+
+// Follows the client greeting in the secured modes:
+// KeyID(80) Token(64) Client-IV(16).
+class SetupResponse : public MessageView<160> {
+public:
+    using MessageView::MessageView;
+    static constexpr size_t kKeyIdSize = 80;
+    static constexpr size_t kTokenSize = 64;
+    constexpr char* keyId() const { return data(); }
+    unsigned char* token() const { return bytes<80, kTokenSize>(); }
+    unsigned char* clientIv() const { return bytes<144, 16>(); }
+};
+
+// Server-Start: Accept(1) MBZ(15) Server-IV(16). A non-zero Accept tells
+// the client why the connection is about to close.
+class ServerStart : public MessageView<32> {
+public:
+    using MessageView::MessageView;
+    constexpr uint8_t accept() const { return get8<0>(); }
+    constexpr void setAccept(uint8_t accept) const { set8<0>(accept); }
+    unsigned char* serverIv() const { return bytes<16, 16>(); }
+};
+
+// Start-Sessions, Start-Ack, Stop-Sessions and Stop-Ack: Command(1) MBZ(11).
+class ControlMessage : public MessageView<12> {
+public:
+    using MessageView::MessageView;
+    constexpr uint8_t command() const { return get8<0>(); }
+    constexpr void setCommand(uint8_t command) const { set8<0>(command); }
+};
+
+// Request-Session: Command(1) MBZ(11) SID(4) MBZ(4) Sender-Port(2)
+// Receiver-Port(2) Sender-Address(4). Ports and address are in host order
+// here. A non-zero Receiver-Port also tells the server that the client will
+// send its test packets to whatever port Accept-Session returns; older
+// clients leave it zero. Sender-Address holds IPv4 only: zero stands for the
+// address of the control connection, which is how IPv6 clients fill it.
+class RequestSession : public MessageView<28> {
+public:
+    using MessageView::MessageView;
+    constexpr uint8_t command() const { return get8<0>(); }
+    constexpr void setCommand(uint8_t command) const { set8<0>(command); }
+    constexpr uint32_t sid() const { return static_cast<uint32_t>(get<12, 4>()); }
+    constexpr void setSid(uint32_t sid) const { set<12, 4>(sid); }
+    constexpr uint16_t senderPort() const { return static_cast<uint16_t>(get<20, 2>()); }
+    constexpr void setSenderPort(uint16_t port) const { set<20, 2>(port); }
+    constexpr uint16_t receiverPort() const { return static_cast<uint16_t>(get<22, 2>()); }
+    constexpr void setReceiverPort(uint16_t port) const { set<22, 2>(port); }
+    constexpr uint32_t senderAddress() const { return static_cast<uint32_t>(get<24, 4>()); }
+    constexpr void setSenderAddress(uint32_t address) const { set<24, 4>(address); }
+};
+
+// Accept-Session: Command(1) MBZ(11) SID(4) Accept(1) MBZ(1) Port(2) MBZ(8).
+// Port is the server's test port for the session, zero for the default one.
+class AcceptSession : public MessageView<28> {
+public:
+    using MessageView::MessageView;
+    constexpr uint8_t command() const { return get8<0>(); }
+    constexpr void setCommand(uint8_t command) const { set8<0>(command); }
+    constexpr uint32_t sid() const { return static_cast<uint32_t>(get<12, 4>()); }
+    constexpr void setSid(uint32_t sid) const { set<12, 4>(sid); }
+    constexpr uint8_t accept() const { return get8<16>(); }
+    constexpr void setAccept(uint8_t accept) const { set8<16>(accept); }
+    constexpr uint16_t port() const { return static_cast<uint16_t>(get<18, 2>()); }
+    constexpr void setPort(uint16_t port) const { set<18, 2>(port); }
+};
+
+// Length of the control message a command byte starts, 0 if unknown.
+constexpr size_t controlMessageSize(uint8_t command)
+{
+    switch (command) {
+        case CommandRequestSession:
+        case CommandAcceptSession:
+            return RequestSession::kSize;
+        case CommandStopSessions:
+        case CommandStartSessions:
+        case CommandStartAck:
+        case CommandStopAck:
+            return ControlMessage::kSize;
+    }
+    return 0;
+}
+
+// Header of a test packet, sent or reflected: Sequence(4) Sender-TTL(1)
+// Sender-TOS(1) Reflector-Flags(1) MBZ(1) Sender-Timestamp(8)
+// Receive-Timestamp(8) Reflect-Timestamp(8). The sender fills in the
+// sequence and its timestamp and leaves the rest zero; the reflector adds the
+// others. Sender-TTL and Sender-TOS are the TTL (hop limit) and TOS (traffic
+// class) the sender's packet arrived with, valid when the flags have
+// ReflectorSawTrafficClass; ReflectorMirroredDscp says the reply went out
+// with the same DSCP. Reflectors that predate the fields leave them zero.
+// Timestamps are raw NTP values.
+enum ReflectorFlags : uint8_t {
+    ReflectorSawTrafficClass = 1,
+    ReflectorMirroredDscp = 2
+};
+
+class TestPacket : public MessageView<32> {
+public:
+    using MessageView::MessageView;
+
+    // For code that cannot use the accessors, such as the XDP program.
+    static constexpr size_t kSenderTtlOffset = 4;
+    static constexpr size_t kSenderTosOffset = 5;
+    static constexpr size_t kReflectorFlagsOffset = 6;
+    static constexpr size_t kReceiveTimestampOffset = 16;
+    static constexpr size_t kReflectTimestampOffset = 24;
+
+    constexpr uint32_t sequence() const { return static_cast<uint32_t>(get<0, 4>()); }
+    constexpr void setSequence(uint32_t sequence) const { set<0, 4>(sequence); }
+    constexpr uint8_t senderTtl() const { return get8<kSenderTtlOffset>(); }
+    constexpr void setSenderTtl(uint8_t ttl) const { set8<kSenderTtlOffset>(ttl); }
+    constexpr uint8_t senderTos() const { return get8<kSenderTosOffset>(); }
+    constexpr void setSenderTos(uint8_t tos) const { set8<kSenderTosOffset>(tos); }
+    constexpr uint8_t reflectorFlags() const { return get8<kReflectorFlagsOffset>(); }
+    constexpr void setReflectorFlags(uint8_t flags) const { set8<kReflectorFlagsOffset>(flags); }
+    constexpr uint64_t senderTimestamp() const { return get<8, 8>(); }
+    constexpr void setSenderTimestamp(uint64_t ntp) const { set<8, 8>(ntp); }
+    constexpr uint64_t receiveTimestamp() const { return get<kReceiveTimestampOffset, 8>(); }
+    constexpr void setReceiveTimestamp(uint64_t ntp) const { set<kReceiveTimestampOffset, 8>(ntp); }
+    constexpr uint64_t reflectTimestamp() const { return get<kReflectTimestampOffset, 8>(); }
+    constexpr void setReflectTimestamp(uint64_t ntp) const { set<kReflectTimestampOffset, 8>(ntp); }
+};
+
+static_assert(std::is_trivially_copyable<TestPacket>::value && sizeof(TestPacket) == sizeof(char*),
+              "views are a single pointer");
+static_assert(SetupResponse::kKeyIdSize + SetupResponse::kTokenSize + 16 == SetupResponse::kSize,
+              "setup response layout");
+
+namespace messages_detail {
+constexpr bool encodesBigEndian()
+{
+    char buffer[RequestSession::kSize] = {};
+    RequestSession request(buffer);
+    request.setSid(0x01020304);
+    request.setSenderPort(0x0506);
+    return buffer[12] == 1 && buffer[15] == 4 && buffer[20] == 5 && request.sid() == 0x01020304 &&
+           request.senderPort() == 0x0506;
+}
+}  // namespace messages_detail
+
+static_assert(messages_detail::encodesBigEndian(), "field encoding");
+static_assert(ntpFromUnixNs(0) == kNtpEpochOffset << 32, "NTP epoch");
+static_assert(unixNsFromNtp(ntpFromUnixNs(1700000000123456789LL)) / 1000 == 1700000000123456LL,
+              "NTP round trip");
+
+#endif // TWAMP_MESSAGES_H
@@ -0,0 +1,190 @@
+#ifndef TWAMP_STATS_LAYOUT_H
+#define TWAMP_STATS_LAYOUT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+
+// Layout of the shared-memory statistics segment the server publishes
+// (stats_segment) for local collectors. The file is a header followed by a
+// server block, one block per reflector worker and a directory of session
+// slots, all at offsets given in the header and 64-byte aligned so writers
+// on different cores never share a cache line.
+//
+// Each block has one writer and is guarded by a seqlock: the writer makes
+// the sequence odd, updates the fields and makes it even again; a reader
+// copies the fields and retries if the sequence was odd or moved meanwhile.
+// Neither side takes a lock or makes a system call. Every field is an atomic
+// so that the racing reads are well defined; on 64-bit machines they are
+// plain loads and stores.
+namespace stats {
+
+const uint64_t kMagic = 0x315453504d415754ULL;  // "TWAMPST1" in memory order
+const uint32_t kVersion = 1;
+
+// Room for the server's drop reasons and timeout phases, with spare slots so
+// new ones do not change the layout.
+const size_t kDropReasons = 8;
+const size_t kTimeoutPhases = 8;
+
+// Names of the ones in use, in the server's order.
+const char* const kDropReasonNames[] = {"malformed", "unknown_source", "prefix_rate",
+                                        "inactive_session", "session_rate", "auth_failed"};
+const char* const kTimeoutPhaseNames[] = {"greeting", "request", "start", "idle"};
+const size_t kDropReasonsUsed = sizeof(kDropReasonNames) / sizeof(kDropReasonNames[0]);
+const size_t kTimeoutPhasesUsed = sizeof(kTimeoutPhaseNames) / sizeof(kTimeoutPhaseNames[0]);
+static_assert(kDropReasonsUsed <= kDropReasons && kTimeoutPhasesUsed <= kTimeoutPhases,
+              "out of counter slots");
+
+enum SessionState : uint32_t {
+    SessionFree = 0,
+    SessionSetup = 1,
+    SessionActive = 2
+};
+
+using Counter = std::atomic<uint64_t>;
+
+struct Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pid;
+    int64_t startedAtNs;  // wall clock
+    uint32_t workerCount;
+    uint32_t sessionCapacity;
+    uint64_t serverOffset;
+    uint64_t workersOffset;
+    uint64_t workerSize;
+    uint64_t sessionsOffset;
+    uint64_t sessionSize;
+    // Set when the server stops; the file is unlinked then, and a new one
+    // is created on the next start.
+    std::atomic<uint32_t> closed;
+};
+
+// Server-wide counters, published by the control thread a few times a
+// second.
+struct alignas(64) ServerBlock {
+    std::atomic<uint32_t> sequence;
+    Counter publishedAtNs;
+    Counter sessions;
+    Counter unlistedSessions;  // sessions that found the directory full
+    Counter drops[kDropReasons];
+    Counter timeouts[kTimeoutPhases];
+    Counter handshakeAuthFailures;
+    Counter kernelSessions;
+    Counter kernelDemotions;
+    Counter stampLatencyP50Ns;
+    Counter stampLatencyP99Ns;
+    Counter stampLatencyMaxNs;
+};
+
+// One reflector worker: its address and port, and what it has reflected and
+// dropped, published after every batch.
+struct alignas(64) WorkerBlock {
+    std::atomic<uint32_t> sequence;
+    Counter address[2];  // in6_addr, IPv4 mapped
+    Counter port;
+    Counter publishedAtNs;
+    Counter batches;
+    Counter received;
+    Counter reflected;
+    Counter reflectedBytes;
+    Counter drops[kDropReasons];
+};
+
+// One session. The identity is written by whichever thread drives the
+// session through its phases, the counters by the reflector worker that
+// serves it, each under its own sequence. A slot is reused once its session
+// is gone, which moves identitySequence, so a reader that sees the same
+// identitySequence before and after reading the counters has them for the
+// session it identified.
+struct alignas(64) SessionSlot {
+    std::atomic<uint32_t> identitySequence;
+    std::atomic<uint32_t> state;  // SessionState
+    Counter id;
+    Counter sid;
+    Counter mode;
+    Counter startedAtNs;  // wall clock
+    Counter controlAddress[2];
+    Counter controlPort;
+    Counter testAddress[2];
+    Counter testClientPort;
+    Counter testPort;  // 0 for test_port
+
+    alignas(64) std::atomic<uint32_t> countersSequence;
+    Counter lastPacketNs;  // steady clock
+    Counter packets;
+    Counter bytes;
+    Counter lost;
+    Counter reordered;
+    Counter duplicates;
+    Counter highestSeq;
+    Counter jitterNs;
+    Counter rateDrops;
+    Counter authDrops;
+
+    // Written on its own by the in-kernel reflector's sync thread.
+    Counter kernelPackets;
+};
+
+inline uint32_t writeBegin(std::atomic<uint32_t>& sequence)
+{
+    uint32_t value = sequence.load(std::memory_order_relaxed) + 1;
+    sequence.store(value, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return value;
+}
+
+inline void writeEnd(std::atomic<uint32_t>& sequence, uint32_t begun)
+{
+    sequence.store(begun + 1, std::memory_order_release);
+}
+
+// Waits out a write in progress and returns the sequence to check against.
+inline uint32_t readBegin(const std::atomic<uint32_t>& sequence)
+{
+    uint32_t value;
+    while ((value = sequence.load(std::memory_order_acquire)) & 1)
+    {
+    }
+    return value;
+}
+
+// True if a write overlapped the read and it has to be done again.
+inline bool readRetry(const std::atomic<uint32_t>& sequence, uint32_t begun)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sequence.load(std::memory_order_relaxed) != begun;
+}
+
+inline void store(Counter& counter, uint64_t value)
+{
+    counter.store(value, std::memory_order_relaxed);
+}
+
+inline uint64_t load(const Counter& counter)
+{
+    return counter.load(std::memory_order_relaxed);
+}
+
+inline void storeAddress(Counter (&to)[2], const struct in6_addr& address)
+{
+    uint64_t words[2];
+    memcpy(words, &address, sizeof(words));
+    store(to[0], words[0]);
+    store(to[1], words[1]);
+}
+
+inline struct in6_addr loadAddress(const Counter (&from)[2])
+{
+    uint64_t words[2] = {load(from[0]), load(from[1])};
+    struct in6_addr address;
+    memcpy(&address, words, sizeof(address));
+    return address;
+}
+
+}  // namespace stats
+
+#endif // TWAMP_STATS_LAYOUT_H
@@ -0,0 +1,97 @@
+#ifndef TWAMP_STATS_READER_H
+#define TWAMP_STATS_READER_H
+
+#include "StatsLayout.h"
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <string>
+
+// Reads the server's shared-memory statistics segment (StatsLayout.h). The
+// segment is mapped read-only once; every read after that is a consistent
+// copy of one block, taken without system calls and without ever holding up
+// the server. Nothing here allocates, so a collector can sample thousands
+// of sessions many times a second.
+class StatsReader {
+public:
+    struct Server {
+        int64_t publishedAtNs;
+        uint64_t sessions;
+        uint64_t unlistedSessions;
+        uint64_t drops[stats::kDropReasons];
+        uint64_t timeouts[stats::kTimeoutPhases];
+        uint64_t handshakeAuthFailures;
+        uint64_t kernelSessions;
+        uint64_t kernelDemotions;
+        uint64_t stampLatencyP50Ns;
+        uint64_t stampLatencyP99Ns;
+        uint64_t stampLatencyMaxNs;
+    };
+
+    struct Worker {
+        struct in6_addr address;
+        uint16_t port;
+        int64_t publishedAtNs;
+        uint64_t batches;
+        uint64_t received;
+        uint64_t reflected;
+        uint64_t reflectedBytes;
+        uint64_t drops[stats::kDropReasons];
+    };
+
+    struct Session {
+        stats::SessionState state;
+        uint64_t id;
+        uint32_t sid;
+        uint8_t mode;
+        int64_t startedAtNs;
+        struct sockaddr_in6 controlPeer;
+        struct sockaddr_in6 testClient;
+        uint16_t testPort;
+        int64_t lastPacketNs;
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t lost;
+        uint64_t reordered;
+        uint64_t duplicates;
+        uint32_t highestSeq;
+        double jitterUs;
+        uint64_t rateDrops;
+        uint64_t authDrops;
+        uint64_t kernelPackets;
+    };
+
+    StatsReader();
+    ~StatsReader();
+    StatsReader(const StatsReader&) = delete;
+    StatsReader& operator=(const StatsReader&) = delete;
+
+    // Maps the segment at `path`; false, with the reason in error(), if it is
+    // missing or not a segment this reader understands.
+    bool open(const std::string& path);
+    void close();
+    const std::string& error() const { return error_; }
+
+    // True once the server that wrote the segment has stopped. Reopen to
+    // follow a restarted server.
+    bool stale() const;
+    uint32_t pid() const { return header_->pid; }
+    int64_t startedAtNs() const { return header_->startedAtNs; }
+
+    size_t workerCount() const { return header_->workerCount; }
+    size_t sessionCapacity() const { return header_->sessionCapacity; }
+
+    void readServer(Server& out) const;
+    void readWorker(size_t index, Worker& out) const;
+
+    // False if the slot holds no session.
+    bool readSession(size_t slot, Session& out) const;
+
+private:
+    const char* base_;
+    size_t size_;
+    const stats::Header* header_;
+    std::string error_;
+};
+
+#endif // TWAMP_STATS_READER_H
@@ -0,0 +1,49 @@
+#ifndef TWAMP_TIMER_WHEEL_H
+#define TWAMP_TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Hashed timing wheel. Timers are identified by an (id, generation) pair;
+// cancelling or re-arming a timer is done by the owner bumping its
+// generation, so stale entries are simply ignored when they expire.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Timer {
+        uint32_t id;
+        uint32_t generation;
+    };
+
+    TimerWheel(std::chrono::milliseconds tick, size_t slotCount);
+
+    void schedule(uint32_t id, uint32_t generation, Clock::time_point deadline);
+
+    // Moves the wheel forward to `now` and appends every expired timer to
+    // `expired`. Returns the number of timers appended.
+    size_t advance(Clock::time_point now, std::vector<Timer>& expired);
+
+    // Milliseconds until the next tick boundary, or -1 if nothing is pending.
+    int pollTimeoutMs(Clock::time_point now) const;
+
+    bool empty() const { return pending_ == 0; }
+
+private:
+    struct Entry {
+        uint64_t expiryTick;
+        uint32_t id;
+        uint32_t generation;
+    };
+
+    uint64_t tickOf(Clock::time_point t) const;
+
+    std::chrono::milliseconds tick_;
+    Clock::time_point origin_;
+    uint64_t currentTick_;
+    size_t pending_;
+    std::vector<std::vector<Entry>> slots_;
+};
+
+#endif // TWAMP_TIMER_WHEEL_H
@@ -0,0 +1,39 @@
+#ifndef TWAMP_TRAFFIC_CLASS_H
+#define TWAMP_TRAFFIC_CLASS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// The IP header fields that tell traffic classes apart, carried as ancillary
+// data on UDP sockets: the TOS byte (DSCP and ECN; the traffic class in
+// IPv6) and the TTL (the hop limit in IPv6). On a dual-stack socket the
+// kernel reports IPv4 packets with the IPv4 options and IPv6 packets with
+// the IPv6 ones, so both are asked for and both are understood.
+
+// Room to receive both fields in a control buffer.
+const size_t kTrafficClassControlSize = 2 * CMSG_SPACE(sizeof(int));
+
+// Room to send a TOS with sendmsg().
+const size_t kTosControlSize = CMSG_SPACE(sizeof(int));
+
+// The TTL is 0 where the kernel gave none; no packet arrives with TTL 0.
+struct TrafficClass {
+    uint8_t tos;
+    uint8_t ttl;
+};
+
+// Asks the kernel to report the TOS and TTL of every packet received on
+// `fd`. Returns false if not even the IPv4 fields could be enabled.
+bool enableTrafficClass(int fd);
+
+// TOS and TTL from a received message's control data.
+TrafficClass trafficClassOf(struct msghdr* msg);
+
+// Writes a control message that sends a packet to `to` with `tos`, using
+// the option of the destination's family; returns its length. `control`
+// needs kTosControlSize bytes.
+size_t writeTos(char* control, const struct sockaddr_in6& to, uint8_t tos);
+
+#endif // TWAMP_TRAFFIC_CLASS_H
@@ -0,0 +1,70 @@
+#ifndef TWAMP_TSC_CLOCK_H
+#define TWAMP_TSC_CLOCK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Wall-clock time for per-packet timestamps, read from the invariant TSC.
+//
+// The TSC is calibrated against CLOCK_REALTIME at startup and re-synced once
+// a second by a background thread. Small differences are slewed away over
+// the following second, so readings never go backwards; only a jump of more
+// than a millisecond (the system clock being set) is followed by a step.
+// Reading the clock costs an RDTSC and a multiply instead of a
+// clock_gettime() call.
+//
+// Where the TSC is not invariant, or the kernel itself does not trust it as
+// a clocksource, every reading falls back to clock_gettime(CLOCK_REALTIME).
+// Safe to call from any thread.
+class TscClock {
+public:
+    // The process-wide clock; calibrates on first use.
+    static TscClock& instance();
+
+    ~TscClock();
+    TscClock(const TscClock&) = delete;
+    TscClock& operator=(const TscClock&) = delete;
+
+    // Nanoseconds since the UNIX epoch.
+    int64_t nowNs() const;
+
+    bool usingTsc() const { return useTsc_; }
+
+private:
+    struct Sample {
+        uint64_t tsc;
+        int64_t ns;
+    };
+
+    TscClock();
+
+    static bool tscReliable();
+    static Sample sample();
+    int64_t convert(uint64_t tsc) const;
+    void publish(uint64_t anchorTsc, int64_t anchorNs, uint64_t nsPerTick);
+    void resync();
+    void resyncThread();
+
+    bool useTsc_;
+
+    // Seqlock-protected mapping from TSC ticks to nanoseconds: nsPerTick is
+    // a 32.32 fixed-point value. Odd sequence numbers mean an update is in
+    // progress.
+    std::atomic<uint32_t> sequence_;
+    std::atomic<uint64_t> anchorTsc_;
+    std::atomic<int64_t> anchorNs_;
+    std::atomic<uint64_t> nsPerTick_;
+
+    // Resync state, owned by the background thread. The frequency is
+    // measured from origin_, so it gets more precise the longer we run.
+    Sample origin_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread thread_;
+};
+
+#endif // TWAMP_TSC_CLOCK_H
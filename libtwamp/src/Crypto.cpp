@@ -0,0 +1,437 @@
+// The SHA-1 block interface is deprecated in OpenSSL 3, but unlike EVP_MAC
+// it lets an HMAC start from precomputed pad states with a plain struct copy,
+// which more than halves the cost of a test packet HMAC.
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "Crypto.h"
+#include <arpa/inet.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+// HMAC-SHA1 with the inner and outer pad states computed once per key.
+class HmacSha1
+{
+public:
+    explicit HmacSha1(const unsigned char *key, size_t keySize)
+    {
+        unsigned char pad[SHA_CBLOCK];
+        for (int round = 0; round < 2; ++round)
+        {
+            unsigned char value = round == 0 ? 0x36 : 0x5c;
+            for (size_t i = 0; i < sizeof(pad); ++i)
+            {
+                pad[i] = (i < keySize ? key[i] : 0) ^ value;
+            }
+            SHA_CTX &state = round == 0 ? inner_ : outer_;
+            SHA1_Init(&state);
+            SHA1_Update(&state, pad, sizeof(pad));
+        }
+        OPENSSL_cleanse(pad, sizeof(pad));
+    }
+
+    ~HmacSha1()
+    {
+        OPENSSL_cleanse(&inner_, sizeof(inner_));
+        OPENSSL_cleanse(&outer_, sizeof(outer_));
+    }
+
+    void compute(const unsigned char *prefix, size_t prefixSize, const unsigned char *data, size_t size,
+                 unsigned char mac[SHA_DIGEST_LENGTH]) const
+    {
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        SHA_CTX state = inner_;
+        SHA1_Update(&state, prefix, prefixSize);
+        SHA1_Update(&state, data, size);
+        SHA1_Final(digest, &state);
+        state = outer_;
+        SHA1_Update(&state, digest, sizeof(digest));
+        SHA1_Final(mac, &state);
+    }
+
+private:
+    SHA_CTX inner_;
+    SHA_CTX outer_;
+};
+
+namespace
+{
+const unsigned char kZeroIv[16] = {0};
+
+EVP_CIPHER_CTX *newCipher(const EVP_CIPHER *cipher, const unsigned char *key, const unsigned char *iv, int encrypt)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (ctx == nullptr || EVP_CipherInit_ex(ctx, cipher, nullptr, key, iv, encrypt) != 1)
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        return nullptr;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    return ctx;
+}
+
+// One-shot AES-128 over whole blocks.
+bool aesOnce(const EVP_CIPHER *cipher, const unsigned char key[16], const unsigned char *in, size_t size,
+             unsigned char *out, int encrypt)
+{
+    EVP_CIPHER_CTX *ctx = newCipher(cipher, key, kZeroIv, encrypt);
+    int len = 0;
+    bool ok = ctx != nullptr && EVP_CipherUpdate(ctx, out, &len, in, static_cast<int>(size)) == 1 &&
+              len == static_cast<int>(size);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+void xorBlock(unsigned char *out, const unsigned char *a, const unsigned char *b)
+{
+    for (int i = 0; i < 16; ++i)
+    {
+        out[i] = a[i] ^ b[i];
+    }
+}
+} // namespace
+
+const char *modeName(uint8_t mode)
+{
+    switch (mode)
+    {
+    case ModeUnauthenticated:
+        return "unauthenticated";
+    case ModeAuthenticated:
+        return "authenticated";
+    case ModeEncrypted:
+        return "encrypted";
+    default:
+        return "unknown";
+    }
+}
+
+uint8_t parseMode(const std::string &name)
+{
+    if (name == "unauthenticated" || name == "open")
+    {
+        return ModeUnauthenticated;
+    }
+    if (name == "authenticated")
+    {
+        return ModeAuthenticated;
+    }
+    if (name == "encrypted")
+    {
+        return ModeEncrypted;
+    }
+    return 0;
+}
+
+bool KeyRing::load(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream in(line);
+        std::string keyId, secret;
+        if (!(in >> keyId) || keyId[0] == '#')
+        {
+            continue;
+        }
+        in >> secret;
+        if (secret.empty() || keyId.size() > kKeyIdSize)
+        {
+            return false;
+        }
+        secrets_[keyId] = secret;
+    }
+    return !secrets_.empty();
+}
+
+const std::string *KeyRing::find(const std::string &keyId) const
+{
+    auto it = secrets_.find(keyId);
+    return it == secrets_.end() ? nullptr : &it->second;
+}
+
+bool randomBytes(unsigned char *out, size_t size)
+{
+    return RAND_bytes(out, static_cast<int>(size)) == 1;
+}
+
+bool deriveKey(const std::string &secret, const unsigned char salt[16], uint32_t count, unsigned char key[16])
+{
+    return PKCS5_PBKDF2_HMAC_SHA1(secret.data(), static_cast<int>(secret.size()), salt, 16,
+                                  static_cast<int>(count), 16, key) == 1;
+}
+
+bool sealToken(const unsigned char key[16], const unsigned char challenge[16], const SessionKeys &keys,
+               unsigned char token[kTokenSize])
+{
+    unsigned char plain[kTokenSize];
+    memcpy(plain, challenge, 16);
+    memcpy(plain + 16, keys.aes, 16);
+    memcpy(plain + 32, keys.hmac, 32);
+    bool ok = aesOnce(EVP_aes_128_cbc(), key, plain, sizeof(plain), token, 1);
+    OPENSSL_cleanse(plain, sizeof(plain));
+    return ok;
+}
+
+bool openToken(const unsigned char key[16], const unsigned char token[kTokenSize],
+               const unsigned char challenge[16], SessionKeys &keys)
+{
+    unsigned char plain[kTokenSize];
+    bool ok = aesOnce(EVP_aes_128_cbc(), key, token, kTokenSize, plain, 0) &&
+              CRYPTO_memcmp(plain, challenge, 16) == 0;
+    if (ok)
+    {
+        memcpy(keys.aes, plain + 16, 16);
+        memcpy(keys.hmac, plain + 32, 32);
+    }
+    OPENSSL_cleanse(plain, sizeof(plain));
+    return ok;
+}
+
+ControlCipher::ControlCipher()
+    : encrypt_(nullptr), decrypt_(nullptr), hmac_(nullptr), sendCount_(0), receiveCount_(0)
+{
+    memset(sendIv_, 0, sizeof(sendIv_));
+    memset(receiveIv_, 0, sizeof(receiveIv_));
+}
+
+ControlCipher::~ControlCipher()
+{
+    EVP_CIPHER_CTX_free(encrypt_);
+    EVP_CIPHER_CTX_free(decrypt_);
+    delete hmac_;
+}
+
+bool ControlCipher::init(const SessionKeys &keys, const unsigned char sendIv[16], const unsigned char receiveIv[16])
+{
+    State state;
+    memcpy(state.sendIv, sendIv, 16);
+    memcpy(state.receiveIv, receiveIv, 16);
+    state.sendCount = 0;
+    state.receiveCount = 0;
+    return init(keys, state);
+}
+
+bool ControlCipher::init(const SessionKeys &keys, const State &state)
+{
+    EVP_CIPHER_CTX_free(encrypt_);
+    EVP_CIPHER_CTX_free(decrypt_);
+    delete hmac_;
+    encrypt_ = newCipher(EVP_aes_128_cbc(), keys.aes, state.sendIv, 1);
+    decrypt_ = newCipher(EVP_aes_128_cbc(), keys.aes, state.receiveIv, 0);
+    hmac_ = new HmacSha1(keys.hmac, sizeof(keys.hmac));
+    memcpy(sendIv_, state.sendIv, 16);
+    memcpy(receiveIv_, state.receiveIv, 16);
+    sendCount_ = state.sendCount;
+    receiveCount_ = state.receiveCount;
+    return encrypt_ != nullptr && decrypt_ != nullptr;
+}
+
+ControlCipher::State ControlCipher::state() const
+{
+    State state;
+    memcpy(state.sendIv, sendIv_, 16);
+    memcpy(state.receiveIv, receiveIv_, 16);
+    state.sendCount = sendCount_;
+    state.receiveCount = receiveCount_;
+    return state;
+}
+
+bool ControlCipher::computeMac(uint64_t counter, const char *data, size_t size, unsigned char mac[20])
+{
+    unsigned char prefix[8];
+    for (int i = 7; i >= 0; --i)
+    {
+        prefix[i] = static_cast<unsigned char>(counter);
+        counter >>= 8;
+    }
+    hmac_->compute(prefix, sizeof(prefix), reinterpret_cast<const unsigned char *>(data), size, mac);
+    return true;
+}
+
+std::vector<char> ControlCipher::seal(const char *message, size_t size)
+{
+    size_t padded = (size + 15) / 16 * 16;
+    std::vector<char> plain(padded + kMacSize, 0);
+    memcpy(plain.data(), message, size);
+
+    unsigned char mac[20];
+    if (!computeMac(sendCount_++, plain.data(), padded, mac))
+    {
+        return std::vector<char>();
+    }
+    memcpy(&plain[padded], mac, kMacSize);
+
+    std::vector<char> sealed(plain.size());
+    int len = 0;
+    if (EVP_EncryptUpdate(encrypt_, reinterpret_cast<unsigned char *>(sealed.data()), &len,
+                          reinterpret_cast<const unsigned char *>(plain.data()), static_cast<int>(plain.size())) != 1 ||
+        len != static_cast<int>(sealed.size()))
+    {
+        return std::vector<char>();
+    }
+    memcpy(sendIv_, &sealed[sealed.size() - 16], 16);
+    return sealed;
+}
+
+bool ControlCipher::decrypt(const char *in, size_t size, char *out)
+{
+    if (size % 16 != 0)
+    {
+        return false;
+    }
+    if (size == 0)
+    {
+        return true;
+    }
+    // Taken first: the caller may decrypt in place.
+    unsigned char last[16];
+    memcpy(last, in + size - 16, 16);
+    int len = 0;
+    if (EVP_DecryptUpdate(decrypt_, reinterpret_cast<unsigned char *>(out), &len,
+                          reinterpret_cast<const unsigned char *>(in), static_cast<int>(size)) != 1 ||
+        len != static_cast<int>(size))
+    {
+        return false;
+    }
+    memcpy(receiveIv_, last, 16);
+    return true;
+}
+
+bool ControlCipher::verify(const char *padded, size_t size, const char *mac)
+{
+    unsigned char expected[20];
+    return computeMac(receiveCount_++, padded, size, expected) && CRYPTO_memcmp(expected, mac, kMacSize) == 0;
+}
+
+TestPacketCipher::TestPacketCipher()
+    : mode_(ModeUnauthenticated), encrypt_(nullptr), decrypt_(nullptr), hmac_(nullptr) {}
+
+TestPacketCipher::~TestPacketCipher()
+{
+    EVP_CIPHER_CTX_free(encrypt_);
+    EVP_CIPHER_CTX_free(decrypt_);
+    delete hmac_;
+}
+
+bool TestPacketCipher::init(uint8_t mode, const SessionKeys &keys, uint32_t sid)
+{
+    EVP_CIPHER_CTX_free(encrypt_);
+    EVP_CIPHER_CTX_free(decrypt_);
+    delete hmac_;
+    encrypt_ = decrypt_ = nullptr;
+    hmac_ = nullptr;
+
+    mode_ = mode;
+    if (!secured())
+    {
+        return true;
+    }
+
+    // Test-session AES key: the SID encrypted with the AES session key.
+    // Test-session HMAC key: the HMAC session key encrypted with that key.
+    unsigned char sidBlock[16] = {0};
+    uint32_t sidNetwork = htonl(sid);
+    memcpy(sidBlock, &sidNetwork, 4);
+    unsigned char aesKey[16], hmacKey[32];
+    if (!aesOnce(EVP_aes_128_ecb(), keys.aes, sidBlock, 16, aesKey, 1) ||
+        !aesOnce(EVP_aes_128_cbc(), aesKey, keys.hmac, 32, hmacKey, 1))
+    {
+        return false;
+    }
+
+    // Both modes use ECB contexts; CBC with its fixed zero IV is chained by
+    // hand, which avoids resetting the cipher state for every packet.
+    encrypt_ = newCipher(EVP_aes_128_ecb(), aesKey, nullptr, 1);
+    decrypt_ = newCipher(EVP_aes_128_ecb(), aesKey, nullptr, 0);
+    hmac_ = new HmacSha1(hmacKey, sizeof(hmacKey));
+    OPENSSL_cleanse(aesKey, sizeof(aesKey));
+    OPENSSL_cleanse(hmacKey, sizeof(hmacKey));
+    return encrypt_ != nullptr && decrypt_ != nullptr;
+}
+
+bool TestPacketCipher::open(char *packet, size_t size)
+{
+    if (!secured())
+    {
+        return true;
+    }
+    if (size < kSecuredTestPacketSize)
+    {
+        return false;
+    }
+
+    unsigned char *data = reinterpret_cast<unsigned char *>(packet);
+    int len = 0;
+    if (mode_ == ModeAuthenticated)
+    {
+        if (EVP_DecryptUpdate(decrypt_, data, &len, data, 16) != 1)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // All blocks are decrypted in one call; undoing the chaining is
+        // then a XOR with the previous ciphertext block.
+        unsigned char plain[kTestMacOffset];
+        if (EVP_DecryptUpdate(decrypt_, plain, &len, data, static_cast<int>(kTestMacOffset)) != 1)
+        {
+            return false;
+        }
+        for (size_t block = kTestMacOffset - 16; block > 0; block -= 16)
+        {
+            xorBlock(data + block, plain + block, data + block - 16);
+        }
+        memcpy(data, plain, 16);
+    }
+
+    unsigned char mac[SHA_DIGEST_LENGTH];
+    hmac_->compute(nullptr, 0, data, kTestMacOffset, mac);
+    return CRYPTO_memcmp(mac, packet + kTestMacOffset, kMacSize) == 0;
+}
+
+bool TestPacketCipher::seal(char *packet, size_t size)
+{
+    if (!secured())
+    {
+        return true;
+    }
+    if (size < kSecuredTestPacketSize)
+    {
+        return false;
+    }
+
+    unsigned char *data = reinterpret_cast<unsigned char *>(packet);
+    unsigned char mac[SHA_DIGEST_LENGTH];
+    hmac_->compute(nullptr, 0, data, kTestMacOffset, mac);
+    memcpy(packet + kTestMacOffset, mac, kMacSize);
+
+    int len = 0;
+    if (EVP_EncryptUpdate(encrypt_, data, &len, data, 16) != 1)
+    {
+        return false;
+    }
+    if (mode_ == ModeEncrypted)
+    {
+        for (size_t block = 16; block < kTestMacOffset; block += 16)
+        {
+            xorBlock(data + block, data + block, data + block - 16);
+            if (EVP_EncryptUpdate(encrypt_, data + block, &len, data + block, 16) != 1)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,105 @@
+#include "LatencyHistogram.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    counts_.fill(0);
+    total_ = 0;
+}
+
+size_t LatencyHistogram::indexOf(uint64_t value)
+{
+    const uint64_t maxValue = (1ULL << kMaxValueBits) - 1;
+    if (value > maxValue)
+    {
+        value = maxValue;
+    }
+    if (value < (1ULL << kSubBucketBits))
+    {
+        return static_cast<size_t>(value);
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - kSubBucketBits;
+    size_t group = static_cast<size_t>(shift + 1);
+    size_t sub = static_cast<size_t>(value >> shift) & ((1u << kSubBucketBits) - 1);
+    return (group << kSubBucketBits) + sub;
+}
+
+uint64_t LatencyHistogram::midpointOf(size_t index)
+{
+    if (index < (1u << kSubBucketBits))
+    {
+        return index;
+    }
+
+    size_t group = index >> kSubBucketBits;
+    uint64_t sub = index & ((1u << kSubBucketBits) - 1);
+    uint64_t width = 1ULL << (group - 1);
+    uint64_t lower = ((1ULL << kSubBucketBits) + sub) << (group - 1);
+    return lower + width / 2;
+}
+
+void LatencyHistogram::record(uint64_t valueNs)
+{
+    counts_[indexOf(valueNs)]++;
+    total_++;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    if (total_ == 0)
+    {
+        return 0;
+    }
+
+    // Rank of the requested sample, 1-based and clamped to the population.
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * total_ + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    if (rank > total_)
+    {
+        rank = total_;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; ++i)
+    {
+        seen += counts_[i];
+        if (seen >= rank)
+        {
+            return midpointOf(i);
+        }
+    }
+    return midpointOf(kBucketCount - 1);
+}
+
+SharedLatencyHistogram::SharedLatencyHistogram()
+{
+    for (auto &count : counts_)
+    {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+void SharedLatencyHistogram::record(uint64_t valueNs)
+{
+    std::atomic<uint32_t> &count = counts_[LatencyHistogram::indexOf(valueNs)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void SharedLatencyHistogram::addTo(LatencyHistogram &out) const
+{
+    for (size_t i = 0; i < counts_.size(); ++i)
+    {
+        uint32_t count = counts_[i].load(std::memory_order_relaxed);
+        out.counts_[i] += count;
+        out.total_ += count;
+    }
+}
@@ -0,0 +1,185 @@
+#include "StatsReader.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+struct sockaddr_in6 socketAddress(const stats::Counter (&address)[2], uint64_t port)
+{
+    struct sockaddr_in6 result;
+    memset(&result, 0, sizeof(result));
+    result.sin6_family = AF_INET6;
+    result.sin6_addr = stats::loadAddress(address);
+    result.sin6_port = htons(static_cast<uint16_t>(port));
+    return result;
+}
+} // namespace
+
+StatsReader::StatsReader() : base_(nullptr), size_(0), header_(nullptr) {}
+
+StatsReader::~StatsReader()
+{
+    close();
+}
+
+bool StatsReader::open(const std::string &path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        error_ = path + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(stats::Header))
+    {
+        error_ = path + ": not a statistics segment";
+        ::close(fd);
+        return false;
+    }
+    void *memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        error_ = path + ": " + strerror(errno);
+        return false;
+    }
+    base_ = static_cast<const char *>(memory);
+    size_ = st.st_size;
+    header_ = reinterpret_cast<const stats::Header *>(base_);
+
+    // Every block must lie inside the file before any of them is read.
+    const stats::Header &header = *header_;
+    bool valid = header.magic == stats::kMagic && header.version == stats::kVersion &&
+                 header.serverOffset + sizeof(stats::ServerBlock) <= size_ &&
+                 header.workerSize >= sizeof(stats::WorkerBlock) &&
+                 header.workersOffset + header.workerCount * header.workerSize <= size_ &&
+                 header.sessionSize >= sizeof(stats::SessionSlot) &&
+                 header.sessionsOffset + header.sessionCapacity * header.sessionSize <= size_;
+    if (!valid)
+    {
+        error_ = path + ": not a statistics segment of version " + std::to_string(stats::kVersion);
+        close();
+        return false;
+    }
+    return true;
+}
+
+void StatsReader::close()
+{
+    if (base_)
+    {
+        munmap(const_cast<char *>(base_), size_);
+    }
+    base_ = nullptr;
+    size_ = 0;
+    header_ = nullptr;
+}
+
+bool StatsReader::stale() const
+{
+    return header_->closed.load(std::memory_order_acquire) != 0;
+}
+
+void StatsReader::readServer(Server &out) const
+{
+    const stats::ServerBlock &block = *reinterpret_cast<const stats::ServerBlock *>(base_ + header_->serverOffset);
+    uint32_t sequence;
+    do
+    {
+        sequence = stats::readBegin(block.sequence);
+        out.publishedAtNs = stats::load(block.publishedAtNs);
+        out.sessions = stats::load(block.sessions);
+        out.unlistedSessions = stats::load(block.unlistedSessions);
+        for (size_t i = 0; i < stats::kDropReasons; ++i)
+        {
+            out.drops[i] = stats::load(block.drops[i]);
+        }
+        for (size_t i = 0; i < stats::kTimeoutPhases; ++i)
+        {
+            out.timeouts[i] = stats::load(block.timeouts[i]);
+        }
+        out.handshakeAuthFailures = stats::load(block.handshakeAuthFailures);
+        out.kernelSessions = stats::load(block.kernelSessions);
+        out.kernelDemotions = stats::load(block.kernelDemotions);
+        out.stampLatencyP50Ns = stats::load(block.stampLatencyP50Ns);
+        out.stampLatencyP99Ns = stats::load(block.stampLatencyP99Ns);
+        out.stampLatencyMaxNs = stats::load(block.stampLatencyMaxNs);
+    } while (stats::readRetry(block.sequence, sequence));
+}
+
+void StatsReader::readWorker(size_t index, Worker &out) const
+{
+    const stats::WorkerBlock &block = *reinterpret_cast<const stats::WorkerBlock *>(
+        base_ + header_->workersOffset + index * header_->workerSize);
+    uint32_t sequence;
+    do
+    {
+        sequence = stats::readBegin(block.sequence);
+        out.address = stats::loadAddress(block.address);
+        out.port = static_cast<uint16_t>(stats::load(block.port));
+        out.publishedAtNs = stats::load(block.publishedAtNs);
+        out.batches = stats::load(block.batches);
+        out.received = stats::load(block.received);
+        out.reflected = stats::load(block.reflected);
+        out.reflectedBytes = stats::load(block.reflectedBytes);
+        for (size_t i = 0; i < stats::kDropReasons; ++i)
+        {
+            out.drops[i] = stats::load(block.drops[i]);
+        }
+    } while (stats::readRetry(block.sequence, sequence));
+}
+
+bool StatsReader::readSession(size_t slot, Session &out) const
+{
+    const stats::SessionSlot &block = *reinterpret_cast<const stats::SessionSlot *>(
+        base_ + header_->sessionsOffset + slot * header_->sessionSize);
+    while (true)
+    {
+        uint32_t identity = stats::readBegin(block.identitySequence);
+        out.state = static_cast<stats::SessionState>(block.state.load(std::memory_order_relaxed));
+        if (out.state == stats::SessionFree)
+        {
+            if (stats::readRetry(block.identitySequence, identity))
+            {
+                continue;
+            }
+            return false;
+        }
+        out.id = stats::load(block.id);
+        out.sid = static_cast<uint32_t>(stats::load(block.sid));
+        out.mode = static_cast<uint8_t>(stats::load(block.mode));
+        out.startedAtNs = stats::load(block.startedAtNs);
+        out.controlPeer = socketAddress(block.controlAddress, stats::load(block.controlPort));
+        out.testClient = socketAddress(block.testAddress, stats::load(block.testClientPort));
+        out.testPort = static_cast<uint16_t>(stats::load(block.testPort));
+
+        uint32_t counters;
+        do
+        {
+            counters = stats::readBegin(block.countersSequence);
+            out.lastPacketNs = stats::load(block.lastPacketNs);
+            out.packets = stats::load(block.packets);
+            out.bytes = stats::load(block.bytes);
+            out.lost = stats::load(block.lost);
+            out.reordered = stats::load(block.reordered);
+            out.duplicates = stats::load(block.duplicates);
+            out.highestSeq = static_cast<uint32_t>(stats::load(block.highestSeq));
+            out.jitterUs = stats::load(block.jitterNs) / 1000.0;
+            out.rateDrops = stats::load(block.rateDrops);
+            out.authDrops = stats::load(block.authDrops);
+        } while (stats::readRetry(block.countersSequence, counters));
+        out.kernelPackets = stats::load(block.kernelPackets);
+
+        // The slot may have changed hands while the counters were read.
+        if (!stats::readRetry(block.identitySequence, identity))
+        {
+            return true;
+        }
+    }
+}
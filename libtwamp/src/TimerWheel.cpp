@@ -0,0 +1,77 @@
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, size_t slotCount)
+    : tick_(tick), origin_(Clock::now()), currentTick_(0), pending_(0), slots_(slotCount) {}
+
+uint64_t TimerWheel::tickOf(Clock::time_point t) const
+{
+    if (t <= origin_)
+    {
+        return 0;
+    }
+    return static_cast<uint64_t>((t - origin_) / tick_);
+}
+
+void TimerWheel::schedule(uint32_t id, uint32_t generation, Clock::time_point deadline)
+{
+    // Round up so a timer never fires before its deadline, and never schedule
+    // into the slot that is currently being processed.
+    uint64_t expiry = tickOf(deadline) + 1;
+    if (expiry <= currentTick_)
+    {
+        expiry = currentTick_ + 1;
+    }
+
+    slots_[expiry % slots_.size()].push_back({expiry, id, generation});
+    pending_++;
+}
+
+size_t TimerWheel::advance(Clock::time_point now, std::vector<Timer>& expired)
+{
+    size_t count = 0;
+    uint64_t target = tickOf(now);
+
+    // If we fell behind by more than a full revolution every slot is visited
+    // once; entries whose expiry tick has passed are picked up regardless.
+    if (target > currentTick_ + slots_.size())
+    {
+        currentTick_ = target - slots_.size();
+    }
+
+    while (currentTick_ < target)
+    {
+        currentTick_++;
+        std::vector<Entry>& slot = slots_[currentTick_ % slots_.size()];
+
+        size_t i = 0;
+        while (i < slot.size())
+        {
+            if (slot[i].expiryTick <= target)
+            {
+                expired.push_back({slot[i].id, slot[i].generation});
+                slot[i] = slot.back();
+                slot.pop_back();
+                pending_--;
+                count++;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+
+    return count;
+}
+
+int TimerWheel::pollTimeoutMs(Clock::time_point now) const
+{
+    if (pending_ == 0)
+    {
+        return -1;
+    }
+
+    auto nextTick = origin_ + tick_ * (tickOf(now) + 1);
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - now).count();
+    return wait > 0 ? static_cast<int>(wait) + 1 : 1;
+}
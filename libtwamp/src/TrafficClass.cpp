@@ -0,0 +1,62 @@
+#include "TrafficClass.h"
+#include "Address.h"
+#include <cstring>
+
+bool enableTrafficClass(int fd)
+{
+    int on = 1;
+    bool ipv4 = setsockopt(fd, SOL_IP, IP_RECVTOS, &on, sizeof(on)) == 0 &&
+                setsockopt(fd, SOL_IP, IP_RECVTTL, &on, sizeof(on)) == 0;
+
+    // Fails harmlessly on IPv4-only sockets.
+    setsockopt(fd, SOL_IPV6, IPV6_RECVTCLASS, &on, sizeof(on));
+    setsockopt(fd, SOL_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on));
+    return ipv4;
+}
+
+TrafficClass trafficClassOf(struct msghdr *msg)
+{
+    TrafficClass result = {0, 0};
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        // IP_TOS comes as a single byte, the others as ints.
+        if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_TOS)
+        {
+            result.tos = *CMSG_DATA(cmsg);
+        }
+        else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_TTL) ||
+                 (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT))
+        {
+            int value;
+            memcpy(&value, CMSG_DATA(cmsg), sizeof(value));
+            result.ttl = static_cast<uint8_t>(value);
+        }
+        else if (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_TCLASS)
+        {
+            int value;
+            memcpy(&value, CMSG_DATA(cmsg), sizeof(value));
+            result.tos = static_cast<uint8_t>(value);
+        }
+    }
+    return result;
+}
+
+size_t writeTos(char *control, const struct sockaddr_in6 &to, uint8_t tos)
+{
+    memset(control, 0, kTosControlSize);
+    struct cmsghdr *cmsg = reinterpret_cast<struct cmsghdr *>(control);
+    if (to.sin6_family == AF_INET || isMappedIpv4(to.sin6_addr))
+    {
+        cmsg->cmsg_level = SOL_IP;
+        cmsg->cmsg_type = IP_TOS;
+    }
+    else
+    {
+        cmsg->cmsg_level = SOL_IPV6;
+        cmsg->cmsg_type = IPV6_TCLASS;
+    }
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    int value = tos;
+    memcpy(CMSG_DATA(cmsg), &value, sizeof(value));
+    return kTosControlSize;
+}
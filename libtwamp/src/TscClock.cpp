@@ -0,0 +1,199 @@
+#include "TscClock.h"
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TWAMP_HAVE_TSC 1
+#endif
+
+namespace
+{
+const int64_t kResyncPeriodNs = 1000000000;
+const int64_t kCalibrationNs = 20000000;
+// Larger offsets are stepped instead of slewed.
+const int64_t kMaxSlewNs = 1000000;
+// Largest rate change used to slew, in parts per million.
+const int64_t kMaxSlewPpm = 500;
+
+int64_t realtimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+uint64_t readTsc()
+{
+#ifdef TWAMP_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+} // namespace
+
+TscClock &TscClock::instance()
+{
+    static TscClock clock;
+    return clock;
+}
+
+TscClock::TscClock()
+    : useTsc_(false), sequence_(0), anchorTsc_(0), anchorNs_(0), nsPerTick_(0), origin_{0, 0}, stopping_(false)
+{
+    if (!tscReliable())
+    {
+        return;
+    }
+
+    // Two samples a short while apart give a first estimate of the
+    // frequency; the background thread refines it from then on.
+    origin_ = sample();
+    std::this_thread::sleep_for(std::chrono::nanoseconds(kCalibrationNs));
+    Sample now = sample();
+    if (now.tsc <= origin_.tsc || now.ns <= origin_.ns)
+    {
+        return;
+    }
+    uint64_t nsPerTick = static_cast<uint64_t>((static_cast<unsigned __int128>(now.ns - origin_.ns) << 32) /
+                                               (now.tsc - origin_.tsc));
+    publish(now.tsc, now.ns, nsPerTick);
+    useTsc_ = true;
+
+    thread_ = std::thread(&TscClock::resyncThread, this);
+}
+
+TscClock::~TscClock()
+{
+    if (thread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+    }
+}
+
+bool TscClock::tscReliable()
+{
+#ifdef TWAMP_HAVE_TSC
+    // Invariant TSC: constant rate in every P-, C- and T-state.
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+    {
+        return false;
+    }
+
+    // The kernel stops using the TSC when it finds it unsynchronised between
+    // CPUs or drifting against other clocks; follow its judgement.
+    std::ifstream source("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+    std::string name;
+    return (source >> name) && name == "tsc";
+#else
+    return false;
+#endif
+}
+
+TscClock::Sample TscClock::sample()
+{
+    // The TSC reading closest to the clock_gettime() call is the midpoint of
+    // the tightest of a few brackets.
+    Sample best = {0, 0};
+    uint64_t bestWidth = UINT64_MAX;
+    for (int i = 0; i < 5; ++i)
+    {
+        uint64_t before = readTsc();
+        int64_t ns = realtimeNs();
+        uint64_t after = readTsc();
+        if (after - before < bestWidth)
+        {
+            bestWidth = after - before;
+            best.tsc = before + (after - before) / 2;
+            best.ns = ns;
+        }
+    }
+    return best;
+}
+
+int64_t TscClock::nowNs() const
+{
+    if (!useTsc_)
+    {
+        return realtimeNs();
+    }
+    return convert(readTsc());
+}
+
+int64_t TscClock::convert(uint64_t tsc) const
+{
+    uint32_t sequence;
+    uint64_t anchorTsc, nsPerTick;
+    int64_t anchorNs;
+    do
+    {
+        sequence = sequence_.load(std::memory_order_acquire);
+        anchorTsc = anchorTsc_.load(std::memory_order_relaxed);
+        anchorNs = anchorNs_.load(std::memory_order_relaxed);
+        nsPerTick = nsPerTick_.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((sequence & 1) || sequence != sequence_.load(std::memory_order_relaxed));
+
+    // Signed, as a reading taken on another CPU can be a hair before the
+    // anchor.
+    __int128 ticks = static_cast<int64_t>(tsc - anchorTsc);
+    return anchorNs + static_cast<int64_t>((ticks * nsPerTick) >> 32);
+}
+
+void TscClock::publish(uint64_t anchorTsc, int64_t anchorNs, uint64_t nsPerTick)
+{
+    uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    anchorTsc_.store(anchorTsc, std::memory_order_relaxed);
+    anchorNs_.store(anchorNs, std::memory_order_relaxed);
+    nsPerTick_.store(nsPerTick, std::memory_order_relaxed);
+    sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+void TscClock::resync()
+{
+    Sample now = sample();
+    int64_t current = convert(now.tsc);
+    int64_t offset = now.ns - current;
+
+    if (offset > kMaxSlewNs || offset < -kMaxSlewNs || now.tsc <= origin_.tsc || now.ns <= origin_.ns)
+    {
+        // The system clock was set: start over from here.
+        uint64_t nsPerTick = nsPerTick_.load(std::memory_order_relaxed);
+        origin_ = now;
+        publish(now.tsc, now.ns, nsPerTick);
+        return;
+    }
+
+    // Carry on from where the current mapping is, at the long-run frequency
+    // adjusted so that the offset is gone by the next resync.
+    unsigned __int128 base =
+        (static_cast<unsigned __int128>(now.ns - origin_.ns) << 32) / (now.tsc - origin_.tsc);
+    int64_t maxSlew = kResyncPeriodNs / 1000000 * kMaxSlewPpm;
+    int64_t slew = offset > maxSlew ? maxSlew : (offset < -maxSlew ? -maxSlew : offset);
+    __int128 adjusted = static_cast<__int128>(base) * (kResyncPeriodNs + slew) / kResyncPeriodNs;
+    publish(now.tsc, current, static_cast<uint64_t>(adjusted));
+}
+
+void TscClock::resyncThread()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_)
+    {
+        wake_.wait_for(lock, std::chrono::nanoseconds(kResyncPeriodNs));
+        if (!stopping_)
+        {
+            resync();
+        }
+    }
+}
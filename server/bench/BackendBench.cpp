@@ -0,0 +1,199 @@
+// Reflector throughput of each test socket backend.
+//
+// A sender thread keeps a window of 64-byte test packets in flight to a
+// reflector socket on loopback; the reflector runs the same receive, stamp,
+// reflect and flush loop as the server, through MmsgSocket or IoUringSocket.
+// Session checks are left out so the figures compare the I/O paths alone:
+// packets per second, and how many packets each system call of the
+// reflector moved.
+//
+// Usage: twamp-backend-bench [packets] [window]
+
+#include "IoUringSocket.h"
+#include "MmsgSocket.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+const size_t kPacketSize = 64;
+const size_t kSendBatch = 32;
+
+struct Result
+{
+    double pps;
+    double packetsPerSyscall;
+    size_t lost;
+};
+
+int openSocket(struct sockaddr_in &addr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    int size = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), len) < 0 ||
+        getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+template <typename Backend> void reflect(Backend &backend, int pollFd, const std::atomic<bool> &running)
+{
+    typename Backend::Packet packets[Backend::kBatchSize];
+    struct pollfd pfd = {pollFd, POLLIN, 0};
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        if (poll(&pfd, 1, 10) <= 0)
+        {
+            continue;
+        }
+        size_t received;
+        do
+        {
+            received = backend.receive(packets, Backend::kBatchSize);
+            for (size_t i = 0; i < received; ++i)
+            {
+                // Stand-in for the timestamps the server would write.
+                memcpy(packets[i].payload + 16, packets[i].payload, 8);
+                backend.reflect(packets[i]);
+            }
+            backend.flush();
+        } while (received == Backend::kBatchSize);
+    }
+}
+
+// Sends packets in batches while fewer than `window` are outstanding and
+// counts the replies; a stall of 100 ms writes the outstanding ones off.
+size_t drive(int fd, size_t total, size_t window)
+{
+    char out[kSendBatch][kPacketSize];
+    char in[kSendBatch][kPacketSize];
+    struct iovec outIov[kSendBatch], inIov[kSendBatch];
+    struct mmsghdr outMsg[kSendBatch], inMsg[kSendBatch];
+    memset(out, 0, sizeof(out));
+    memset(outMsg, 0, sizeof(outMsg));
+    memset(inMsg, 0, sizeof(inMsg));
+    for (size_t i = 0; i < kSendBatch; ++i)
+    {
+        outIov[i] = {out[i], kPacketSize};
+        outMsg[i].msg_hdr.msg_iov = &outIov[i];
+        outMsg[i].msg_hdr.msg_iovlen = 1;
+        inIov[i] = {in[i], kPacketSize};
+        inMsg[i].msg_hdr.msg_iov = &inIov[i];
+        inMsg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t sent = 0, answered = 0, lost = 0;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (answered + lost < total)
+    {
+        size_t outstanding = sent - answered - lost;
+        size_t room = std::min(window - std::min(window, outstanding), total - sent);
+        size_t batch = std::min(room, kSendBatch);
+        if (batch > 0)
+        {
+            for (size_t i = 0; i < batch; ++i)
+            {
+                uint64_t seq = sent + i;
+                memcpy(out[i], &seq, sizeof(seq));
+            }
+            int n = sendmmsg(fd, outMsg, batch, 0);
+            sent += n > 0 ? n : 0;
+        }
+
+        int n = recvmmsg(fd, inMsg, kSendBatch, MSG_DONTWAIT, nullptr);
+        if (n > 0)
+        {
+            answered += n;
+            continue;
+        }
+        if (batch == 0 && poll(&pfd, 1, 100) == 0)
+        {
+            lost += sent - answered - lost;
+        }
+    }
+    return lost;
+}
+
+template <typename Backend> Result run(Backend &backend, int pollFd, int client, size_t packets, size_t window)
+{
+    std::atomic<bool> running(true);
+    uint64_t before = backend.stats().syscalls;
+    std::thread reflector([&] { reflect(backend, pollFd, running); });
+
+    auto start = std::chrono::steady_clock::now();
+    size_t lost = drive(client, packets, window);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    running = false;
+    reflector.join();
+    uint64_t syscalls = backend.stats().syscalls - before;
+
+    Result r;
+    r.pps = (packets - lost) / seconds;
+    r.packetsPerSyscall = syscalls ? static_cast<double>(packets - lost) / syscalls : 0;
+    r.lost = lost;
+    return r;
+}
+
+void print(const char *name, const Result &r)
+{
+    printf("%-10s %10.3f %14.1f %8zu\n", name, r.pps / 1e6, r.packetsPerSyscall, r.lost);
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t packets = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    size_t window = argc > 2 ? std::stoul(argv[2]) : 256;
+
+    struct sockaddr_in reflectorAddr, clientAddr;
+    int reflectorFd = openSocket(reflectorAddr);
+    int client = openSocket(clientAddr);
+    if (reflectorFd < 0 || client < 0 ||
+        connect(client, reinterpret_cast<struct sockaddr *>(&reflectorAddr), sizeof(reflectorAddr)) < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    printf("%-10s %10s %14s %8s\n", "backend", "Mpps", "pkts/syscall", "lost");
+
+    MmsgSocket mmsg;
+    mmsg.open(reflectorFd);
+    print("socket", run(mmsg, reflectorFd, client, packets, window));
+
+    IoUringSocket uring;
+    if (uring.open(reflectorFd))
+    {
+        print("io_uring", run(uring, uring.fd(), client, packets, window));
+        uring.close();
+    }
+    else
+    {
+        printf("%-10s unavailable\n", "io_uring");
+    }
+
+    close(client);
+    close(reflectorFd);
+    return 0;
+}
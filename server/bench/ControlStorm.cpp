@@ -0,0 +1,720 @@
+// Control-plane load: how fast the server sets sessions up and what each
+// live session costs it.
+//
+// A server is forked on loopback, from the given configuration or from a
+// generated one, and up to N control connections are kept busy against it
+// from a single epoll loop. Each connection runs the greeting,
+// Request-Session and Start-Sessions, holds the session for a while, stops
+// it with Stop-Sessions and reconnects. Once a second the tool prints the
+// setups completed, setup latency percentiles (connect to Start-Ack), live
+// sessions, and the server's RSS and thread count; at the end it prints
+// totals and why any setups failed.
+//
+// Usage: twamp-control-storm [--connections N] [--duration s] [--hold ms]
+//                            [--ramp per_s] [--port p] [--config file]
+//                            [--silent N]
+//
+// --hold -1 keeps every session open once started, which shows the memory
+// cost per session; --hold 0 measures the sustained setup rate.
+//
+// --silent N also opens N connections that read the server greeting and
+// then say nothing. The run passes only if setups kept completing while
+// they were held and the server's timeout_greeting counter, read from its
+// statistics segment, reached N; the exit status is 1 otherwise. The
+// duration must leave room for the ramp and the server's greeting_timeout.
+
+#include "LatencyHistogram.h"
+#include "Config.h"
+#include "Messages.h"
+#include "Server.h"
+#include "StatsReader.h"
+#include "TimerWheel.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <netinet/in.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+const int kMaxEvents = 512;
+const std::chrono::seconds kPhaseTimeout(10);
+
+enum class State
+{
+    Idle,
+    Connecting,
+    AwaitGreeting,
+    AwaitAccept,
+    AwaitStartAck,
+    Holding,
+    AwaitStopAck,
+    Silent
+};
+
+struct Connection
+{
+    int fd;
+    State state;
+    uint32_t generation;
+    TimerWheel::Clock::time_point started;
+    char rx[AcceptSession::kSize];
+    size_t rxExpected;
+    size_t rxReceived;
+};
+
+struct Options
+{
+    uint32_t connections = 10000;
+    int durationSec = 30;
+    int holdMs = 0;
+    uint32_t rampPerSec = 2000;
+    uint16_t port = 18620;
+    std::string config;
+    uint32_t silent = 0;
+};
+
+struct ProcessStats
+{
+    double rssMb;
+    long threads;
+};
+
+volatile sig_atomic_t stopServer = 0;
+
+void onServerSignal(int)
+{
+    stopServer = 1;
+}
+
+void raiseFileLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+ProcessStats readProcessStats(pid_t pid)
+{
+    ProcessStats stats = {0, 0};
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string key;
+    while (status >> key)
+    {
+        if (key == "VmRSS:")
+        {
+            long kb;
+            status >> kb;
+            stats.rssMb = kb / 1024.0;
+        }
+        else if (key == "Threads:")
+        {
+            status >> stats.threads;
+        }
+        status.ignore(256, '\n');
+    }
+    return stats;
+}
+
+// Runs a server in a child process until SIGTERM. Its output goes to
+// /dev/null: it logs every session.
+pid_t forkServer(const std::string &configFile)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        return pid;
+    }
+
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    signal(SIGTERM, onServerSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server(configFile);
+    if (!server.start())
+    {
+        _exit(1);
+    }
+    while (!stopServer)
+    {
+        usleep(100000);
+    }
+    server.stop();
+    _exit(0);
+}
+
+class Storm
+{
+public:
+    Storm(const Options &options, pid_t serverPid)
+        : options_(options), serverPid_(serverPid), timers_(std::chrono::milliseconds(10), 4096),
+          connections_(options.connections + options.silent), opened_(0), live_(0), setups_(0), intervalSetups_(0),
+          stops_(0)
+    {
+        memset(&serverAddr_, 0, sizeof(serverAddr_));
+        serverAddr_.sin_family = AF_INET;
+        serverAddr_.sin_port = htons(options.port);
+        serverAddr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (auto &connection : connections_)
+        {
+            connection.fd = -1;
+            connection.state = State::Idle;
+            connection.generation = 0;
+        }
+    }
+
+    void run()
+    {
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        baseline_ = readProcessStats(serverPid_);
+        printf("%6s %8s %9s %10s %10s %10s %9s %8s %10s %9s\n", "time", "live", "setups/s", "p50_ms", "p99_ms",
+               "max_ms", "rss_mb", "threads", "kb/session", "failures");
+
+        auto start = TimerWheel::Clock::now();
+        auto end = start + std::chrono::seconds(options_.durationSec);
+        auto nextReport = start + std::chrono::seconds(1);
+        std::vector<TimerWheel::Timer> expired;
+        struct epoll_event events[kMaxEvents];
+
+        while (TimerWheel::Clock::now() < end)
+        {
+            openMore(start);
+
+            int timeout = timers_.pollTimeoutMs(TimerWheel::Clock::now());
+            if (timeout < 0 || timeout > 10)
+            {
+                timeout = 10;
+            }
+            int ready = epoll_wait(epollFd_, events, kMaxEvents, timeout);
+            for (int i = 0; i < ready; ++i)
+            {
+                onEvent(static_cast<uint32_t>(events[i].data.u64), events[i].events);
+            }
+
+            expired.clear();
+            timers_.advance(TimerWheel::Clock::now(), expired);
+            for (const auto &timer : expired)
+            {
+                if (timer.generation == connections_[timer.id].generation)
+                {
+                    onTimer(timer.id);
+                }
+            }
+
+            auto now = TimerWheel::Clock::now();
+            if (now >= nextReport)
+            {
+                report(std::chrono::duration<double>(now - start).count());
+                nextReport += std::chrono::seconds(1);
+            }
+        }
+
+        for (auto &connection : connections_)
+        {
+            if (connection.fd != -1)
+            {
+                close(connection.fd);
+            }
+        }
+        close(epollFd_);
+
+        double seconds = std::chrono::duration<double>(TimerWheel::Clock::now() - start).count();
+        printf("\nsetups: %llu (%.0f/s), stops: %llu\n", static_cast<unsigned long long>(setups_), setups_ / seconds,
+               static_cast<unsigned long long>(stops_));
+        printf("setup latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+               total_.percentile(50) / 1e6, total_.percentile(90) / 1e6, total_.percentile(99) / 1e6,
+               total_.percentile(99.9) / 1e6, total_.percentile(100) / 1e6);
+        printf("peak server: %.1f MB RSS, %ld threads, %u live sessions\n", peak_.rssMb, peak_.threads, peakLive_);
+        for (const auto &failure : failures_)
+        {
+            printf("failed: %s: %llu\n", failure.first.c_str(), static_cast<unsigned long long>(failure.second));
+        }
+        if (options_.silent > 0)
+        {
+            printf("silent: %u opened, peak %u held, %u closed by server, %llu setups completed while held\n",
+                   silentOpened_, peakSilentHeld_, silentClosed_, static_cast<unsigned long long>(setupsWhileSilent_));
+        }
+    }
+
+    uint64_t setupsWhileSilent() const
+    {
+        return setupsWhileSilent_;
+    }
+
+private:
+    // Brings connections up at no more than the ramp rate, so the listen
+    // backlog is not what gets measured.
+    void openMore(TimerWheel::Clock::time_point start)
+    {
+        double elapsed = std::chrono::duration<double>(TimerWheel::Clock::now() - start).count();
+        uint64_t allowed = static_cast<uint64_t>(elapsed * options_.rampPerSec) + 1;
+        while (opened_ < options_.connections && opened_ < allowed)
+        {
+            connect(opened_++);
+        }
+        while (silentOpened_ < options_.silent && silentOpened_ < allowed)
+        {
+            connect(options_.connections + silentOpened_++);
+        }
+    }
+
+    bool isSilent(uint32_t index) const
+    {
+        return index >= options_.connections;
+    }
+
+    void schedule(uint32_t index, TimerWheel::Clock::time_point deadline)
+    {
+        connections_[index].generation++;
+        timers_.schedule(index, connections_[index].generation, deadline);
+    }
+
+    void connect(uint32_t index)
+    {
+        Connection &c = connections_[index];
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd < 0)
+        {
+            fail(index, "socket");
+            return;
+        }
+        // Reset instead of FIN on close: churn would otherwise run the
+        // loopback out of ports in TIME_WAIT.
+        struct linger linger = {1, 0};
+        setsockopt(c.fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+        c.started = TimerWheel::Clock::now();
+        if (::connect(c.fd, reinterpret_cast<struct sockaddr *>(&serverAddr_), sizeof(serverAddr_)) < 0 &&
+            errno != EINPROGRESS)
+        {
+            fail(index, errno == ECONNREFUSED ? "connect refused" : "connect");
+            return;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.u64 = index;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, c.fd, &ev);
+        c.state = State::Connecting;
+        schedule(index, c.started + kPhaseTimeout);
+    }
+
+    void expect(uint32_t index, size_t size, State next)
+    {
+        Connection &c = connections_[index];
+        c.rxExpected = size;
+        c.rxReceived = 0;
+        c.state = next;
+        schedule(index, TimerWheel::Clock::now() + kPhaseTimeout);
+    }
+
+    bool sendMessage(uint32_t index, const char *data, size_t size)
+    {
+        if (send(connections_[index].fd, data, size, MSG_NOSIGNAL) != static_cast<ssize_t>(size))
+        {
+            fail(index, "send");
+            return false;
+        }
+        return true;
+    }
+
+    void onEvent(uint32_t index, uint32_t events)
+    {
+        Connection &c = connections_[index];
+        if (c.fd == -1)
+        {
+            return;
+        }
+
+        if (c.state == State::Connecting)
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0 || (events & (EPOLLERR | EPOLLHUP)))
+            {
+                fail(index, error == ECONNREFUSED ? "connect refused" : "connect");
+                return;
+            }
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = index;
+            epoll_ctl(epollFd_, EPOLL_CTL_MOD, c.fd, &ev);
+            if (isSilent(index))
+            {
+                // Held until the server gives up on it; no deadline here.
+                c.state = State::Silent;
+                c.generation++;
+                silentHeld_++;
+                peakSilentHeld_ = std::max(peakSilentHeld_, silentHeld_);
+                return;
+            }
+            expect(index, ServerGreeting::kSize, State::AwaitGreeting);
+            return;
+        }
+
+        if (c.state == State::Silent)
+        {
+            onSilentEvent(index);
+            return;
+        }
+
+        if (c.state == State::Holding)
+        {
+            // The server only speaks when asked; anything here is a close.
+            fail(index, "closed while holding");
+            return;
+        }
+
+        ssize_t n = recv(c.fd, c.rx + c.rxReceived, c.rxExpected - c.rxReceived, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        if (n <= 0)
+        {
+            fail(index, n == 0 ? "closed by server" : (errno == ECONNRESET ? "reset by server" : "recv"));
+            return;
+        }
+        c.rxReceived += n;
+        if (c.rxReceived < c.rxExpected)
+        {
+            return;
+        }
+        onMessage(index);
+    }
+
+    void onMessage(uint32_t index)
+    {
+        Connection &c = connections_[index];
+        switch (c.state)
+        {
+        case State::AwaitGreeting:
+        {
+            if (!(ServerGreeting(c.rx).modes() & ModeUnauthenticated))
+            {
+                fail(index, "unauthenticated mode not offered");
+                return;
+            }
+            char message[ClientGreeting::kSize + RequestSession::kSize] = {0};
+            ClientGreeting(message).setMode(ModeUnauthenticated);
+            RequestSession request(message + ClientGreeting::kSize);
+            request.setCommand(CommandRequestSession);
+            request.setSid(index);
+            request.setSenderPort(static_cast<uint16_t>(20000 + index % 40000));
+            request.setSenderAddress(INADDR_LOOPBACK);
+            if (sendMessage(index, message, sizeof(message)))
+            {
+                expect(index, AcceptSession::kSize, State::AwaitAccept);
+            }
+            break;
+        }
+        case State::AwaitAccept:
+        {
+            if (AcceptSession(c.rx).accept() != 0)
+            {
+                fail(index, "session rejected");
+                return;
+            }
+            char start[ControlMessage::kSize] = {0};
+            ControlMessage(start).setCommand(CommandStartSessions);
+            if (sendMessage(index, start, sizeof(start)))
+            {
+                expect(index, ControlMessage::kSize, State::AwaitStartAck);
+            }
+            break;
+        }
+        case State::AwaitStartAck:
+        {
+            uint64_t latency =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(TimerWheel::Clock::now() - c.started).count();
+            interval_.record(latency);
+            total_.record(latency);
+            setups_++;
+            intervalSetups_++;
+            if (silentHeld_ > 0)
+            {
+                setupsWhileSilent_++;
+            }
+            live_++;
+            c.state = State::Holding;
+            if (options_.holdMs >= 0)
+            {
+                schedule(index, TimerWheel::Clock::now() + std::chrono::milliseconds(options_.holdMs));
+            }
+            else
+            {
+                c.generation++;
+            }
+            break;
+        }
+        case State::AwaitStopAck:
+            stops_++;
+            close(c.fd);
+            c.fd = -1;
+            c.state = State::Idle;
+            connect(index);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // The server greeting is read and dropped; the end of the stream means
+    // the server closed the connection, which is not retried.
+    void onSilentEvent(uint32_t index)
+    {
+        Connection &c = connections_[index];
+        char discard[ServerGreeting::kSize + ServerChallenge::kSize];
+        ssize_t n = recv(c.fd, discard, sizeof(discard), 0);
+        if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)))
+        {
+            return;
+        }
+        close(c.fd);
+        c.fd = -1;
+        c.state = State::Idle;
+        silentHeld_--;
+        silentClosed_++;
+    }
+
+    void onTimer(uint32_t index)
+    {
+        Connection &c = connections_[index];
+        if (c.state == State::Holding)
+        {
+            live_--;
+            char stop[ControlMessage::kSize] = {0};
+            ControlMessage(stop).setCommand(CommandStopSessions);
+            if (sendMessage(index, stop, sizeof(stop)))
+            {
+                expect(index, ControlMessage::kSize, State::AwaitStopAck);
+            }
+            return;
+        }
+        if (c.state == State::Idle)
+        {
+            connect(index);
+            return;
+        }
+
+        static const char *const phases[] = {"", "timeout connecting", "timeout greeting", "timeout accept",
+                                             "timeout start ack", "", "timeout stop ack", ""};
+        fail(index, phases[static_cast<int>(c.state)]);
+    }
+
+    // Drops the connection, counts why, and tries again a little later.
+    void fail(uint32_t index, const char *reason)
+    {
+        Connection &c = connections_[index];
+        failures_[reason]++;
+        if (c.state == State::Holding)
+        {
+            live_--;
+        }
+        if (c.fd != -1)
+        {
+            close(c.fd);
+            c.fd = -1;
+        }
+        c.state = State::Idle;
+        schedule(index, TimerWheel::Clock::now() + std::chrono::milliseconds(100));
+    }
+
+    void report(double elapsed)
+    {
+        ProcessStats stats = readProcessStats(serverPid_);
+        if (stats.rssMb > peak_.rssMb)
+        {
+            peak_ = stats;
+        }
+        if (live_ > peakLive_)
+        {
+            peakLive_ = live_;
+        }
+        uint64_t failures = 0;
+        for (const auto &failure : failures_)
+        {
+            failures += failure.second;
+        }
+        double perSession = live_ > 0 ? (stats.rssMb - baseline_.rssMb) * 1024 / live_ : 0;
+        printf("%6.0f %8u %9llu %10.3f %10.3f %10.3f %9.1f %8ld %10.1f %9llu\n", elapsed, live_,
+               static_cast<unsigned long long>(intervalSetups_), interval_.percentile(50) / 1e6,
+               interval_.percentile(99) / 1e6, interval_.percentile(100) / 1e6, stats.rssMb, stats.threads,
+               perSession, static_cast<unsigned long long>(failures));
+        fflush(stdout);
+        interval_.reset();
+        intervalSetups_ = 0;
+    }
+
+    Options options_;
+    pid_t serverPid_;
+    int epollFd_;
+    struct sockaddr_in serverAddr_;
+    TimerWheel timers_;
+    std::vector<Connection> connections_;
+    uint32_t opened_;
+    uint32_t live_;
+    uint32_t peakLive_ = 0;
+    uint32_t silentOpened_ = 0;
+    uint32_t silentHeld_ = 0;
+    uint32_t peakSilentHeld_ = 0;
+    uint32_t silentClosed_ = 0;
+    uint64_t setupsWhileSilent_ = 0;
+    uint64_t setups_;
+    uint64_t intervalSetups_;
+    uint64_t stops_;
+    LatencyHistogram interval_;
+    LatencyHistogram total_;
+    ProcessStats baseline_;
+    ProcessStats peak_ = {0, 0};
+    std::map<std::string, uint64_t> failures_;
+};
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "Missing value for %s\n", arg.c_str());
+            return 1;
+        }
+        if (arg == "--connections")
+        {
+            options.connections = std::stoul(argv[++i]);
+        }
+        else if (arg == "--duration")
+        {
+            options.durationSec = std::stoi(argv[++i]);
+        }
+        else if (arg == "--hold")
+        {
+            options.holdMs = std::stoi(argv[++i]);
+        }
+        else if (arg == "--ramp")
+        {
+            options.rampPerSec = std::stoul(argv[++i]);
+        }
+        else if (arg == "--port")
+        {
+            options.port = static_cast<uint16_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--config")
+        {
+            options.config = argv[++i];
+        }
+        else if (arg == "--silent")
+        {
+            options.silent = std::stoul(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: twamp-control-storm [--connections N] [--duration s] [--hold ms] "
+                            "[--ramp per_s] [--port p] [--config file] [--silent N]\n");
+            return 1;
+        }
+    }
+
+    raiseFileLimit();
+    signal(SIGPIPE, SIG_IGN);
+
+    // Sessions are not what is under test here, so their limits are out of
+    // the way; the server still enforces its phase deadlines.
+    std::string configFile = options.config;
+    if (configFile.empty())
+    {
+        char path[] = "/tmp/twamp-control-storm-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0)
+        {
+            perror("mkstemp");
+            return 1;
+        }
+        std::string config = "control_port = " + std::to_string(options.port) + "\n" +
+                             "test_port = " + std::to_string(options.port + 1) + "\n" +
+                             "admin_socket =\n"
+                             "stats_segment = " + path + ".stats\n" +
+                             "session_timeout = 60\n";
+        if (write(fd, config.data(), config.size()) != static_cast<ssize_t>(config.size()))
+        {
+            perror("write");
+            return 1;
+        }
+        close(fd);
+        configFile = path;
+    }
+
+    pid_t server = forkServer(configFile);
+    if (server < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+    // Give it a moment to bind.
+    usleep(300000);
+
+    printf("%u connections, hold %d ms, ramp %u/s, %d s against pid %d\n", options.connections, options.holdMs,
+           options.rampPerSec, options.durationSec, server);
+    Storm storm(options, server);
+    storm.run();
+
+    // Silent connections must all have been timed out by the server
+    // without holding up anyone else's setup.
+    int result = 0;
+    if (options.silent > 0)
+    {
+        Config config(configFile);
+        config.load();
+        std::string statsPath = config.getString("stats_segment", "");
+        StatsReader reader;
+        if (statsPath.empty() || !reader.open(statsPath))
+        {
+            fprintf(stderr, "Cannot read timeout_greeting: no statistics segment%s%s\n",
+                    statsPath.empty() ? "" : ", ", reader.error().c_str());
+            result = 1;
+        }
+        else
+        {
+            // Let the server publish the last closes.
+            usleep(300000);
+            StatsReader::Server stats;
+            reader.readServer(stats);
+            uint64_t greetingTimeouts = stats.timeouts[0];
+            bool passed = greetingTimeouts >= options.silent && storm.setupsWhileSilent() > 0;
+            printf("timeout_greeting: %llu of %u silent: %s\n", static_cast<unsigned long long>(greetingTimeouts),
+                   options.silent, passed ? "passed" : "FAILED");
+            result = passed ? 0 : 1;
+        }
+    }
+
+    kill(server, SIGTERM);
+    int status = 0;
+    waitpid(server, &status, 0);
+    if (options.config.empty())
+    {
+        unlink(configFile.c_str());
+    }
+    return result;
+}
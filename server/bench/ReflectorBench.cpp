@@ -0,0 +1,224 @@
+// Per-packet cost of the reflector in each TWAMP mode.
+//
+// A Session is driven through Request-Session and Start-Sessions over a
+// socketpair, exactly as the server would run it, and then fed pre-sealed
+// sender packets through Session::processTestPacket(). Socket I/O is left
+// out, so the difference between the modes is what authentication and
+// encryption add to every reflected packet.
+//
+// Usage: twamp-reflector-bench [packets]
+
+#include "Address.h"
+#include "Crypto.h"
+#include "Session.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+const size_t kPoolSize = 4096;
+const size_t kSampleEvery = 64;
+
+struct Result
+{
+    double nsPerPacket;
+    double p50Ns;
+    double p99Ns;
+};
+
+class ControlPeer
+{
+public:
+    ControlPeer(int fd, uint8_t mode, const SessionKeys &keys, const unsigned char clientIv[16],
+                const unsigned char serverIv[16])
+        : fd_(fd)
+    {
+        if (mode != ModeUnauthenticated && !cipher_.init(keys, clientIv, serverIv))
+        {
+            throw std::runtime_error("control cipher");
+        }
+    }
+
+    void exchange(const char *message, size_t size, size_t replySize)
+    {
+        std::vector<char> wire(message, message + size);
+        if (cipher_.active())
+        {
+            wire = cipher_.seal(message, size);
+        }
+        if (send(fd_, wire.data(), wire.size(), 0) != static_cast<ssize_t>(wire.size()))
+        {
+            throw std::runtime_error("send");
+        }
+
+        std::vector<char> reply(cipher_.active() ? ControlCipher::sealedSize(replySize) : replySize);
+        if (recv(fd_, reply.data(), reply.size(), MSG_WAITALL) != static_cast<ssize_t>(reply.size()))
+        {
+            throw std::runtime_error("recv");
+        }
+        size_t padded = reply.size() - kMacSize;
+        if (cipher_.active() && (!cipher_.decrypt(reply.data(), reply.size(), reply.data()) ||
+                                 !cipher_.verify(reply.data(), padded, &reply[padded])))
+        {
+            throw std::runtime_error("control reply failed authentication");
+        }
+    }
+
+private:
+    int fd_;
+    ControlCipher cipher_;
+};
+
+Result runMode(uint8_t mode, size_t packets)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        throw std::runtime_error("socketpair");
+    }
+
+    SessionKeys keys;
+    unsigned char clientIv[16], serverIv[16];
+    randomBytes(keys.aes, sizeof(keys.aes));
+    randomBytes(keys.hmac, sizeof(keys.hmac));
+    randomBytes(clientIv, sizeof(clientIv));
+    randomBytes(serverIv, sizeof(serverIv));
+
+    struct sockaddr_in6 peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin6_family = AF_INET6;
+    peer.sin6_addr = mapIpv4(htonl(INADDR_LOOPBACK));
+    peer.sin6_port = htons(40000);
+    TrafficClass traffic = {0, 64};
+
+    auto session = std::make_shared<Session>(fds[0], -1, 1, peer);
+    if (mode != ModeUnauthenticated)
+    {
+        session->setSecurity(mode, keys, clientIv, serverIv);
+    }
+    std::thread sessionThread([session]() {
+        try
+        {
+            session->run();
+        }
+        catch (const std::exception &)
+        {
+        }
+    });
+
+    // On failure, hang up so the session thread returns before unwinding.
+    struct Hangup
+    {
+        int fd;
+        std::thread &thread;
+        ~Hangup()
+        {
+            shutdown(fd, SHUT_RDWR);
+            thread.join();
+            close(fd);
+        }
+    } hangup{fds[1], sessionThread};
+
+    ControlPeer control(fds[1], mode, keys, clientIv, serverIv);
+    const uint32_t sid = 0x5eed;
+    char requestSession[RequestSession::kSize] = {0};
+    RequestSession request(requestSession);
+    request.setCommand(CommandRequestSession);
+    request.setSid(sid);
+    request.setSenderPort(ntohs(peer.sin6_port));
+    request.setSenderAddress(ntohl(mappedIpv4(peer.sin6_addr)));
+    control.exchange(requestSession, sizeof(requestSession), AcceptSession::kSize);
+
+    char startSessions[ControlMessage::kSize] = {0};
+    ControlMessage(startSessions).setCommand(CommandStartSessions);
+    control.exchange(startSessions, sizeof(startSessions), ControlMessage::kSize);
+
+    // Sender packets are sealed up front so only reflector work is timed.
+    TestPacketCipher sender;
+    sender.init(mode, keys, sid);
+    std::vector<char> pool(kPoolSize * 64, 0);
+    for (size_t i = 0; i < kPoolSize; ++i)
+    {
+        char *packet = &pool[i * 64];
+        TestPacket header(packet);
+        header.setSequence(static_cast<uint32_t>(i + 1));
+        header.setSenderTimestamp(static_cast<uint64_t>(3900000000u) << 32);
+        sender.seal(packet, 64);
+    }
+
+    char packet[64];
+    memcpy(packet, &pool[0], 64);
+    if (!session->processTestPacket(packet, sizeof(packet), peer, traffic, 0) || !sender.open(packet, sizeof(packet)))
+    {
+        throw std::runtime_error(std::string("reflected packet does not verify in ") + modeName(mode) + " mode");
+    }
+
+    std::vector<double> samples;
+    samples.reserve(packets / kSampleEvery + 1);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < packets; ++i)
+    {
+        memcpy(packet, &pool[(i % kPoolSize) * 64], 64);
+        if (i % kSampleEvery == 0)
+        {
+            auto before = std::chrono::steady_clock::now();
+            session->processTestPacket(packet, sizeof(packet), peer, traffic, 0);
+            samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - before).count());
+        }
+        else
+        {
+            session->processTestPacket(packet, sizeof(packet), peer, traffic, 0);
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    char stopSessions[ControlMessage::kSize] = {0};
+    ControlMessage(stopSessions).setCommand(CommandStopSessions);
+    control.exchange(stopSessions, sizeof(stopSessions), ControlMessage::kSize);
+
+    std::sort(samples.begin(), samples.end());
+    Result result;
+    result.nsPerPacket = elapsed / packets;
+    result.p50Ns = samples[samples.size() / 2];
+    result.p99Ns = samples[samples.size() * 99 / 100];
+    return result;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t packets = argc > 1 ? std::stoul(argv[1]) : 2000000;
+    const uint8_t modes[] = {ModeUnauthenticated, ModeAuthenticated, ModeEncrypted};
+
+    printf("%-16s %10s %10s %10s %10s %12s\n", "mode", "ns/pkt", "Mpps", "p50_ns", "p99_ns", "added_ns");
+    double baseline = 0;
+    for (uint8_t mode : modes)
+    {
+        try
+        {
+            Result r = runMode(mode, packets);
+            if (mode == ModeUnauthenticated)
+            {
+                baseline = r.nsPerPacket;
+            }
+            printf("%-16s %10.1f %10.2f %10.0f %10.0f %12.1f\n", modeName(mode), r.nsPerPacket,
+                   1e3 / r.nsPerPacket, r.p50Ns, r.p99Ns, r.nsPerPacket - baseline);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s: %s\n", modeName(mode), e.what());
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef TWAMP_BPF_H
+#define TWAMP_BPF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/bpf.h>
+#include <vector>
+
+// Thin wrappers over the bpf() system call for the XDP programs, which are
+// assembled by hand so the server needs neither clang nor libbpf. Functions
+// returning a descriptor return -1 and set errno on failure.
+
+struct bpf_insn bpfInsn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm);
+
+// Appends the two-instruction load of a 64-bit immediate or map reference.
+void bpfLoadImm64(std::vector<struct bpf_insn>& prog, uint8_t dst, uint64_t value);
+void bpfLoadMap(std::vector<struct bpf_insn>& prog, uint8_t dst, int mapFd);
+
+// Appends the common prologue of the XDP programs. On entry r1 is the
+// xdp_md context; afterwards r2 holds the start of the frame, with bounds
+// proven for the Ethernet, IPv4 and UDP headers plus `payloadSize` bytes.
+// Every frame that is not IPv4 without options, unfragmented, UDP to `port`
+// takes one of the jumps recorded in `misses`.
+void bpfMatchUdpPort(std::vector<struct bpf_insn>& prog, std::vector<size_t>& misses, uint16_t port,
+                     size_t payloadSize);
+
+// Points the recorded jumps at the next instruction to be appended.
+void bpfPatchJumps(std::vector<struct bpf_insn>& prog, std::vector<size_t>& jumps);
+
+int bpfCreateMap(enum bpf_map_type type, uint32_t keySize, uint32_t valueSize, uint32_t maxEntries);
+bool bpfUpdateElement(int mapFd, const void* key, const void* value);
+bool bpfLookupElement(int mapFd, const void* key, void* value);
+bool bpfDeleteElement(int mapFd, const void* key);
+
+// Loads an XDP program; the verifier log is printed if it is rejected.
+int bpfLoadXdpProgram(const std::vector<struct bpf_insn>& prog);
+
+// Attaches a program through a BPF link, preferring the native (driver) hook
+// over the generic one unless `generic` is set. Closing the link detaches the
+// program, so nothing is left behind on the interface if the server dies.
+int bpfAttachXdp(int progFd, int ifindex, bool generic, bool& nativeMode);
+
+#endif // TWAMP_BPF_H
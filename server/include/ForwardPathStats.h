@@ -0,0 +1,66 @@
+#ifndef TWAMP_FORWARD_PATH_STATS_H
+#define TWAMP_FORWARD_PATH_STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Sender-to-reflector path statistics for one session, derived from the test
+// packets as they arrive. update() is called only from the reflector thread;
+// snapshot() may be called concurrently from any thread.
+class ForwardPathStats {
+public:
+    struct Snapshot {
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t duplicates;
+        uint64_t reordered;
+        uint64_t lost;
+        uint32_t highestSeq;
+        double jitterUs;
+    };
+
+    // Everything update() works from, for carrying a session over to
+    // another process. Only valid while the reflector is not updating.
+    struct State {
+        bool started;
+        uint32_t firstSeq;
+        uint32_t maxSeq;
+        uint64_t window;
+        int64_t lastTransitNs;
+        double jitterNs;
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t duplicates;
+        uint64_t reordered;
+    };
+
+    ForwardPathStats();
+
+    void update(uint32_t seq, int64_t sentNs, int64_t receivedNs, size_t bytes);
+    Snapshot snapshot() const;
+    State save() const;
+    void restore(const State& state);
+
+private:
+    static constexpr uint32_t kWindowSize = 64;
+
+    // Reflector-thread state.
+    bool started_;
+    uint32_t firstSeq_;
+    uint32_t maxSeq_;
+    uint64_t window_;  // bit i set: maxSeq_ - i has been seen
+    int64_t lastTransitNs_;
+    double jitterNs_;
+
+    // Published counters.
+    std::atomic<uint64_t> packets_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> duplicates_;
+    std::atomic<uint64_t> reordered_;
+    std::atomic<uint64_t> expected_;
+    std::atomic<uint32_t> highestSeq_;
+    std::atomic<uint64_t> jitterNsBits_;
+};
+
+#endif // TWAMP_FORWARD_PATH_STATS_H
@@ -0,0 +1,64 @@
+#ifndef TWAMP_HANDOFF_H
+#define TWAMP_HANDOFF_H
+
+#include <netinet/in.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Messages between a running server and the process taking over from it,
+// exchanged on a local SOCK_SEQPACKET socket (handoff_socket). Sockets
+// travel as SCM_RIGHTS, one per message:
+//
+//   new -> old  Hello       version and size of Session::HandoffState
+//   old -> new  Accept      next session id, or Refuse
+//   old -> new  ControlSocket, TestSocket ...   listening sockets by address
+//   old -> new  SessionRecord ...               state and control connection
+//   old -> new  Done
+//   new -> old  Ack         the new process is serving; the old one exits
+namespace handoff {
+
+const uint32_t kMagic = 0x54574850; // "TWHP"
+const uint32_t kVersion = 1;
+
+enum Kind : uint32_t {
+    Hello = 1,
+    Accept,
+    Refuse,
+    ControlSocket,
+    TestSocket,
+    SessionRecord,
+    Done,
+    Ack
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    uint32_t payloadSize;
+    // The listener a socket or session belongs to, and the socket's port.
+    struct in6_addr address;
+    uint16_t port;
+    uint64_t value;
+};
+
+// Largest payload a message may carry.
+const size_t kMaxPayload = 4096;
+
+Header header(Kind kind);
+
+// Local sockets at `path`, only reachable by the server's own user. Both
+// return -1 after reporting why.
+int listen(const std::string& path);
+int connect(const std::string& path);
+
+// One message, with `fd` attached unless it is -1. On receipt the
+// descriptor, if any, is returned in `fd` and -1 otherwise.
+bool send(int socket, const Header& header, const void* payload, int fd);
+bool receive(int socket, Header& header, std::vector<char>& payload, int& fd);
+
+}  // namespace handoff
+
+#endif // TWAMP_HANDOFF_H
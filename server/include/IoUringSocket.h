@@ -0,0 +1,128 @@
+#ifndef TWAMP_IO_URING_SOCKET_H
+#define TWAMP_IO_URING_SOCKET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+#include "TrafficClass.h"
+
+struct io_uring_sqe;
+
+// Reflector I/O through io_uring on the test socket. A single multishot
+// recvmsg keeps receiving into buffers the kernel picks from a provided
+// buffer ring; replies are sent straight from the same buffers, which are
+// also registered as fixed buffers for zero-copy sends, and every send of a
+// batch goes in with one io_uring_enter(). Under a steady stream of test
+// packets that is the only system call the reflector makes. Replies that
+// must carry a DSCP (setReflectDscp()) go out with sendmsg instead, as the
+// plain send has no room for control data.
+//
+// Needs Linux 6.1 or later; open() fails cleanly on older kernels or where
+// io_uring is disabled. Shares its batch interface with MmsgSocket. Not
+// thread-safe: only the reflector thread touches it, apart from stats().
+class IoUringSocket {
+public:
+    static const size_t kBatchSize = 64;
+
+    struct Packet {
+        char* payload;
+        size_t size;
+        struct sockaddr_in6 from;  // IPv4 sources mapped
+        int64_t receivedNs;  // wall clock, 0 if the kernel gave none
+        TrafficClass traffic;
+        uint16_t buffer;
+    };
+
+    struct Stats {
+        uint64_t syscalls;
+        uint64_t noBuffers;
+        uint64_t sendErrors;
+    };
+
+    IoUringSocket();
+    ~IoUringSocket();
+    IoUringSocket(const IoUringSocket&) = delete;
+    IoUringSocket& operator=(const IoUringSocket&) = delete;
+
+    bool open(int socketFd);
+    void close();
+
+    bool active() const { return ringFd_ >= 0; }
+    void setReflectDscp(bool on) { reflectDscp_ = on; }
+
+    // Readable whenever completions are waiting.
+    int fd() const { return ringFd_; }
+    bool fixedSends() const { return fixedSends_; }
+
+    // Reaps completions: received packets are returned, finished sends give
+    // their buffers back to the kernel.
+    size_t receive(Packet* packets, size_t max);
+    void reflect(const Packet& packet);
+    void recycle(const Packet& packet);
+
+    // Re-arms the receive if the kernel ended it and submits queued sends.
+    void flush();
+
+    // Cancels the receive for good, leaving further packets queued on the
+    // socket. Packets the ring took before the cancel still come out of
+    // receive(); receiving() turns false after the last of them.
+    void stopReceiving();
+    bool receiving() const { return receiveArmed_; }
+
+    Stats stats() const;
+
+private:
+    static const uint32_t kBufferCount = 1024;
+    static const uint32_t kBufferSize = 2048;
+
+    // A reply sent with sendmsg, one per buffer.
+    struct SendMessage {
+        struct msghdr msg;
+        struct iovec iov;
+        char control[kTosControlSize];
+        uint8_t dscp;
+    };
+
+    struct io_uring_sqe* nextSqe();
+    void armReceive();
+    void submit();
+    void queueSend(uint16_t buffer);
+    void provide(uint16_t buffer);
+    char* bufferAt(uint16_t buffer) const;
+
+    int ringFd_;
+    void* sqRing_;
+    size_t sqRingSize_;
+    void* cqRing_;
+    size_t cqRingSize_;
+    struct io_uring_sqe* sqes_;
+    size_t sqesSize_;
+    uint32_t* sqHead_;
+    uint32_t* sqTail_;
+    uint32_t sqMask_;
+    uint32_t* cqHead_;
+    uint32_t* cqTail_;
+    uint32_t cqMask_;
+    void* cqes_;
+    uint32_t sqPending_;
+
+    char* buffers_;
+    void* bufferRing_;
+    uint16_t bufferTail_;
+    bool receiveArmed_;
+    bool stopping_;
+    bool fixedSends_;
+    bool reflectDscp_;
+    std::vector<SendMessage> sends_;
+
+    struct msghdr receiveMsg_;
+
+    std::atomic<uint64_t> syscalls_;
+    std::atomic<uint64_t> noBuffers_;
+    std::atomic<uint64_t> sendErrors_;
+};
+
+#endif // TWAMP_IO_URING_SOCKET_H
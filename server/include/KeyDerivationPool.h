@@ -0,0 +1,71 @@
+#ifndef TWAMP_KEY_DERIVATION_POOL_H
+#define TWAMP_KEY_DERIVATION_POOL_H
+
+#include "Crypto.h"
+#include "TimerWheel.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Checks the tokens of secured-mode handshakes on threads of its own. The
+// PBKDF2 behind each check is slow on purpose and KeyIDs are not secret,
+// so on the control thread anyone could stall every other handshake, and
+// the phase deadlines, with garbage tokens. Finished checks are picked up
+// by the control thread when fd() turns readable. Jobs whose handshake
+// deadline passes while they wait are dropped unworked.
+class KeyDerivationPool {
+public:
+    struct Job {
+        uint32_t slot;
+        uint32_t generation;
+        std::string secret;
+        uint32_t count;
+        unsigned char salt[16];
+        unsigned char challenge[16];
+        unsigned char token[kTokenSize];
+        TimerWheel::Clock::time_point deadline;
+    };
+
+    struct Result {
+        uint32_t slot;
+        uint32_t generation;
+        bool ok;
+        SessionKeys keys;  // only when ok
+    };
+
+    KeyDerivationPool();
+    ~KeyDerivationPool();
+    KeyDerivationPool(const KeyDerivationPool&) = delete;
+    KeyDerivationPool& operator=(const KeyDerivationPool&) = delete;
+
+    // Starts `threads` threads that take at most `maxPending` waiting jobs.
+    bool start(size_t threads, size_t maxPending);
+    // Drops the jobs still waiting and joins the threads.
+    void stop();
+    int fd() const { return eventFd_; }
+
+    // Takes the job, wiping its secret; false when the queue is full.
+    bool submit(Job& job);
+
+    // Moves every finished check to `out`.
+    void collect(std::vector<Result>& out);
+
+private:
+    void run();
+
+    int eventFd_;
+    size_t maxPending_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<Job> jobs_;
+    std::vector<Result> results_;
+    std::vector<std::thread> threads_;
+};
+
+#endif // TWAMP_KEY_DERIVATION_POOL_H
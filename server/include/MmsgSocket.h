@@ -0,0 +1,72 @@
+#ifndef TWAMP_MMSG_SOCKET_H
+#define TWAMP_MMSG_SOCKET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "TrafficClass.h"
+
+// Classic reflector I/O on a non-blocking UDP socket: packets are received
+// and sent in batches with recvmmsg()/sendmmsg() and reflected in place in
+// the receive buffers, so a busy reflector makes two system calls per batch
+// rather than two per packet.
+//
+// Packets carry the kernel's receive timestamp (SO_TIMESTAMPNS), so the
+// time they waited before the reflector got to them can be measured, and
+// the TOS and TTL they arrived with. With setReflectDscp(), each reply goes
+// out with the DSCP of the packet it answers.
+//
+// Shares its batch interface with XdpSocket and IoUringSocket: receive(),
+// then reflect() or recycle() for every packet, then flush(). Not
+// thread-safe: only the reflector thread touches it, apart from stats().
+class MmsgSocket {
+public:
+    static const size_t kBatchSize = 32;
+    static const size_t kBufferSize = 1024;
+
+    struct Packet {
+        char* payload;
+        size_t size;
+        struct sockaddr_in6 from;  // IPv4 sources mapped
+        int64_t receivedNs;  // wall clock, 0 if the kernel gave none
+        TrafficClass traffic;
+        size_t slot;
+    };
+
+    struct Stats {
+        uint64_t syscalls;
+    };
+
+    MmsgSocket();
+    MmsgSocket(const MmsgSocket&) = delete;
+    MmsgSocket& operator=(const MmsgSocket&) = delete;
+
+    void open(int fd);
+    int fd() const { return fd_; }
+    void setReflectDscp(bool on) { reflectDscp_ = on; }
+
+    // Returns no more than one batch; the packets stay valid until flush().
+    size_t receive(Packet* packets, size_t max);
+    void reflect(const Packet& packet);
+    void recycle(const Packet&) {}
+    void flush();
+
+    Stats stats() const;
+
+private:
+    int fd_;
+    bool reflectDscp_;
+    size_t replyCount_;
+    char buffers_[kBatchSize][kBufferSize];
+    struct sockaddr_in6 addrs_[kBatchSize];
+    char control_[kBatchSize][CMSG_SPACE(sizeof(struct timespec)) + kTrafficClassControlSize];
+    struct iovec iovs_[kBatchSize];
+    struct mmsghdr messages_[kBatchSize];
+    struct mmsghdr replies_[kBatchSize];
+    std::atomic<uint64_t> syscalls_;
+};
+
+#endif // TWAMP_MMSG_SOCKET_H
@@ -0,0 +1,43 @@
+#ifndef TWAMP_NUMA_H
+#define TWAMP_NUMA_H
+
+#include <cstddef>
+#include <netinet/in.h>
+#include <sched.h>
+
+// NUMA placement for reflector workers: which node a local address's NIC
+// sits on, which CPUs belong to that node, and memory that comes from it.
+// Topology is read from sysfs and memory policy set with the raw system
+// calls, so there is no libnuma dependency. Everything degrades to "no
+// preference" (node -1) on single-node machines, virtual interfaces or
+// kernels without NUMA support.
+namespace numa {
+
+// Node of the NIC that owns `addr` (IPv4 ones mapped), or -1 if unknown.
+int nodeOfAddress(const struct in6_addr& addr);
+
+// CPUs of `node`; false if the node is unknown or has none.
+bool nodeCpus(int node, cpu_set_t& cpus);
+
+// Anonymous memory preferring `node`; plain memory for node -1. Pages come
+// from the node as they are first touched.
+void* allocate(size_t size, int node);
+void release(void* memory, size_t size);
+
+// While in scope, memory this thread touches first prefers `node`: the
+// rings and buffers a backend maps while it is set up land on the node of
+// the NIC it serves.
+class ScopedPreference {
+public:
+    explicit ScopedPreference(int node);
+    ~ScopedPreference();
+    ScopedPreference(const ScopedPreference&) = delete;
+    ScopedPreference& operator=(const ScopedPreference&) = delete;
+
+private:
+    bool set_;
+};
+
+}  // namespace numa
+
+#endif // TWAMP_NUMA_H
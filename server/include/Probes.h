@@ -0,0 +1,32 @@
+#ifndef TWAMP_PROBES_H
+#define TWAMP_PROBES_H
+
+// Statically-defined tracepoints (USDT, provider "twamp") for bpftrace and
+// perf. Built against <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel)
+// each probe is a single nop until a tracer attaches to it; without the
+// header, or with TWAMP_NO_USDT defined, they compile to nothing.
+//
+//   receive(port, packets)             a batch taken from a backend
+//   lookup(port, session id)           session found for a packet, 0 if none
+//   stamp(port, session id, size)      reflected packet built in place
+//   transmit(port, packets)            a batch flushed back to the backend
+//   session_create(id)                 session thread started
+//   session_destroy(id)                session thread finished
+#if defined(__has_include) && !defined(TWAMP_NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TWAMP_USDT 1
+#endif
+#endif
+
+#ifdef TWAMP_USDT
+#define TWAMP_PROBE1(name, a) DTRACE_PROBE1(twamp, name, a)
+#define TWAMP_PROBE2(name, a, b) DTRACE_PROBE2(twamp, name, a, b)
+#define TWAMP_PROBE3(name, a, b, c) DTRACE_PROBE3(twamp, name, a, b, c)
+#else
+#define TWAMP_PROBE1(name, a) do { } while (0)
+#define TWAMP_PROBE2(name, a, b) do { } while (0)
+#define TWAMP_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif // TWAMP_PROBES_H
@@ -2,13 +2,26 @@
 #define TWAMP_SERVER_H
 
 #include <netinet/in.h>
+#include <sched.h>
 #include <string>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <memory>
+#include <unordered_map>
 #include <Config.h>
+#include "TokenBucket.h"
+#include "TimerWheel.h"
+#include "Crypto.h"
+#include "LatencyHistogram.h"
+#include "MmsgSocket.h"
+#include "IoUringSocket.h"
+#include "XdpSocket.h"
+#include "XdpReflector.h"
+#include "StatsSegment.h"
+#include "KeyDerivationPool.h"
 
 class Session;
 
@@ -20,38 +33,285 @@ public:
     
     bool start();
     void stop();
+
+    // Takes the sockets and sessions of the server listening on
+    // handoff_socket rather than opening its own. Must be called before
+    // start().
+    void setTakeover(bool takeover) { takeover_ = takeover; }
+
+    // Set once a new process has asked to take over; main() then calls
+    // handOff() instead of stop(). handOff() stops reflecting, passes every
+    // socket and parked session to the new process and returns true once
+    // that one is serving, leaving nothing for stop() to do. If the new
+    // process never confirms, it resumes serving and returns false.
+    bool canHandOff() const { return handoffSocket_ != -1; }
+    bool handoffRequested() const { return handoffRequested_; }
+    bool handOff();
     
+    // Why the reflector discarded a test packet without replying.
+    enum DropReason {
+        DropMalformed,
+        DropUnknownSource,
+        DropPrefixRate,
+        DropInactiveSession,
+        DropSessionRate,
+        DropAuthFailed,
+        DropReasonCount
+    };
+
+    // Control-protocol phase in which a connection hit its deadline.
+    enum TimeoutPhase {
+        TimeoutGreeting,
+        TimeoutRequest,
+        TimeoutStart,
+        TimeoutIdle,
+        TimeoutPhaseCount
+    };
+
 private:
-    std::vector<std::thread> controlConnectionThreads_;
-    std::mutex controlConnectionThreadsMutex_;
-    
-    static void signalHandler(int signum);
+    // One of the addresses the server is bound to (listen_addresses), or the
+    // IPv6 wildcard, which takes IPv4 as well. Each has its own control
+    // socket and test workers; those run on, and allocate from, the NUMA
+    // node of the NIC that owns the address when it is known.
+    struct Listener {
+        struct in6_addr address;
+        int controlSocket;
+        int numaNode;
+        bool hasCpus;
+        cpu_set_t cpus;
+    };
+
+    // A test socket and the thread that reflects it. Each listener's primary
+    // worker serves test_port; any others serve one port of test_ports each,
+    // so the kernel's socket lookup sorts packets by session and the workers
+    // can run on different cores. The first primary worker also serves
+    // AF_XDP if configured. Workers are allocated on their listener's node.
+    // Everything below `thread` belongs to the worker's thread.
+    struct TestWorker {
+        static void* operator new(size_t size, int numaNode);
+        static void operator delete(void* memory, size_t size);
+        static void operator delete(void* memory, int numaNode);
+
+        size_t listener;
+        bool primary;
+        uint16_t port;
+        int socket;
+        MmsgSocket mmsg;
+        IoUringSocket uring;
+        std::atomic<uint32_t> sessions;
+        std::thread thread;
+
+        // Sessions by addressKey() of their client address, rebuilt from
+        // activeSessions_ whenever sessionsVersion_ moves.
+        uint64_t tableVersion;
+        std::unordered_map<uint64_t, std::vector<std::shared_ptr<Session>>> table;
+        std::unordered_map<uint64_t, std::shared_ptr<SharedTokenBucket>> prefixRateLimits;
+
+        // Counted as packets are handled and copied to the worker's block
+        // of the statistics segment, if any, after every batch.
+        stats::WorkerBlock* stats;
+        uint64_t batches;
+        uint64_t received;
+        uint64_t reflected;
+        uint64_t reflectedBytes;
+        uint64_t drops[DropReasonCount];
+
+        // Packets left until the next one whose stages are timed.
+        uint32_t untilStageSample;
+
+        // Time from the kernel receiving a test packet to the reflector
+        // stamping it, recorded once per batch. Read by the admin and
+        // statistics paths, which merge every worker's.
+        SharedLatencyHistogram stampLatency;
+    };
+
+    // A control connection tracked by the control thread: first while its
+    // greeting is outstanding, then through a weak reference to its session so
+    // the session's phase deadlines can be enforced.
+    struct ControlSlot {
+        int fd;
+        size_t listener;
+        struct sockaddr_in6 peer;
+        char greeting[ClientGreeting::kSize + SetupResponse::kSize];
+        size_t expected;
+        size_t received;
+        unsigned char challenge[16];
+        unsigned char salt[16];
+        TimerWheel::Clock::time_point deadline;  // of the greeting
+        std::weak_ptr<Session> session;
+        uint32_t generation;
+    };
+
+    // A socket this process did not open: passed by systemd or by the
+    // server it takes over from. Taken by type, address and port as the
+    // configuration asks for them; any left over are closed.
+    struct InheritedSocket {
+        int fd;
+        int type;
+        struct in6_addr address;
+        uint16_t port;
+    };
+
+    // A session received in a takeover, started once the server runs.
+    struct PendingSession {
+        std::vector<char> state;
+        struct in6_addr listener;
+        int fd;
+    };
+
     void controlServerThread();
-    void testServerThread();
-    void sessionCleanupThread();
-    void handleControlConnection(int clientSocket);
+    void testServerThread(TestWorker& worker, size_t index);
+    void adminServerThread();
+    void kernelReflectorSyncThread();
     void handleTestConnection(int clientSocket);
+    void pollListeners(bool enable);
+    void acceptControlConnections(size_t listener);
+    void readClientGreeting(uint32_t slot);
+    void authenticateClient(uint32_t slot);
+    void finishAuthentications();
+    bool sendServerStart(uint32_t slot, uint8_t accept, const unsigned char serverIv[16]);
+    void logAuthFailure(uint32_t slot);
+    void startSession(uint32_t slot, const SessionKeys& keys, const unsigned char serverIv[16]);
+    void handleControlTimer(const TimerWheel::Timer& timer);
+    uint32_t allocateControlSlot();
+    void watchSession(uint32_t slot, const std::shared_ptr<Session>& session);
+    void releaseControlSlot(uint32_t slot);
+    void reapSessionThreads();
+    void configureSession(Session& session);
+    void launchSession(const std::shared_ptr<Session>& session);
+    void adoptSystemdSockets();
+    int takeInheritedSocket(int type, const struct in6_addr& address, uint16_t port);
+    bool receiveHandoff();
+    void startServing();
+    void resumeSessions();
+    bool finishTakeover();
+    bool setupHandoffSocket();
+    void acceptHandoff();
+    bool sendHandoff(int connection, const std::vector<std::shared_ptr<Session>>& sessions);
     
     Config config_;
-    int controlSocket_;
-    int testSocket_;
+
+    // Declared early so that it outlives the sessions holding its slots.
+    StatsSegment stats_;
+    std::atomic<uint64_t> unlistedSessions_;
+    TimerWheel::Clock::time_point nextStatsPublish_;
+    std::vector<Listener> listeners_;
+    int adminSocket_;
+    std::string adminSocketPath_;
+
+    // Takeover, either side. The admin thread accepts a new process on
+    // handoffSocket_ and leaves its connection in handoffConnection_ for
+    // handOff(); a taking-over process keeps its connection there until it
+    // acknowledges. Session threads wait on detachWake_ as well as their
+    // control connection, so one write parks them all.
+    bool takeover_;
+    int handoffSocket_;
+    std::string handoffSocketPath_;
+    int handoffConnection_;
+    std::atomic<bool> handoffRequested_;
+    int detachWake_;
+    std::vector<InheritedSocket> inherited_;
+    std::vector<PendingSession> pendingSessions_;
     std::atomic<bool> running_;
+    std::atomic<uint64_t> nextSessionId_;
     
     std::thread controlThread_;
-    std::thread testThread_;
-    std::thread cleanupThread_;
+    std::thread adminThread_;
+    std::thread kernelSyncThread_;
     
     std::mutex sessionsMutex_;
     std::vector<std::shared_ptr<Session>> activeSessions_;
-    std::vector<std::thread> sessionThreads_;
+    // One bucket per client prefix, shared by every worker that sees it so
+    // the limit holds however the prefix's sessions are spread over ports.
+    // Guarded by sessionsMutex_; workers keep their own references.
+    std::unordered_map<uint64_t, std::shared_ptr<SharedTokenBucket>> prefixRateLimits_;
+
+    // Bumped whenever a session is added or removed or changes its test
+    // address. Each reflector thread rebuilds its private lookup table when
+    // it sees a new version, so the per-packet path takes no locks.
+    std::atomic<uint64_t> sessionsVersion_;
+    std::atomic<uint64_t> drops_[DropReasonCount];
+    std::atomic<uint64_t> timeouts_[TimeoutPhaseCount];
+    std::atomic<uint64_t> handshakeAuthFailures_;
+
+    KeyRing authKeys_;
+    uint8_t offeredModes_;
+    uint32_t keyDerivationCount_;
+    KeyDerivationPool keyDerivation_;
+
+    // Owned by the control thread.
+    int controlEpoll_;
+    bool acceptPaused_;
+    TimerWheel::Clock::time_point acceptResumeAt_;
+    TimerWheel controlTimers_;
+    std::vector<ControlSlot> controlSlots_;
+    std::vector<uint32_t> freeControlSlots_;
+    std::chrono::seconds greetingTimeout_;
+    std::vector<KeyDerivationPool::Result> authResults_;
+    // Authentication failures are logged at most once a second.
+    TimerWheel::Clock::time_point authLogResumeAt_;
+    uint64_t authFailuresUnlogged_;
+
+    std::vector<std::unique_ptr<TestWorker>> testWorkers_;
+    int prefixLength_;
+    int prefixLengthV6_;
+    bool busyPoll_;
+    bool reflectDscp_;
+    XdpSocket xdp_;
+
+    // Where a sampled packet's turnaround went: waiting in the socket after
+    // the kernel timestamp, finding its session, stamping it, and the rest
+    // of the batch up to the end of the send. One packet in
+    // stageSampleInterval_ (stage_timing_sample) is timed, none when it is 0.
+    enum Stage {
+        StageWait,
+        StageLookup,
+        StageStamp,
+        StageSend,
+        StageCount
+    };
+    uint32_t stageSampleInterval_;
+    LatencyHistogram stageLatency_[StageCount];
+    std::mutex stageLatencyMutex_;
+
+    // In-kernel reflector; its session map is kept in step with the sessions
+    // by the sync thread, which is woken whenever sessionsVersion_ moves.
+    XdpReflector kernelReflector_;
+    std::mutex kernelSyncMutex_;
+    std::condition_variable kernelSyncWake_;
+    std::atomic<uint64_t> kernelSessions_;
+    std::atomic<uint64_t> kernelDemotions_;
+
+    // Session threads by session id. Each thread files its id under
+    // finishedSessionThreads_ as it exits and the control thread joins it
+    // shortly after, so session churn does not pile up the stacks of
+    // finished threads.
+    std::unordered_map<uint64_t, std::thread> sessionThreads_;
+    std::vector<uint64_t> finishedSessionThreads_;
     std::mutex sessionThreadsMutex_;
     
-    struct sockaddr_in controlAddr_;
-    struct sockaddr_in testAddr_;
-    
     std::string generateServerGreeting() const;
-    bool setupControlSocket();
-    bool setupTestSocket();
+    bool setupListeners();
+    int openControlSocket(const struct in6_addr& address);
+    bool setupTestSockets();
+    int openTestSocket(const struct in6_addr& address, uint16_t port);
+    bool setupAdminSocket();
+    void removeSession(const std::shared_ptr<Session>& session);
+    void sessionsChanged();
+    void refreshTestTable(TestWorker& worker);
+    void setupBusyPoll(TestWorker& worker, size_t index);
+    uint64_t prefixKey(const struct in6_addr& address) const;
+    void countDrop(TestWorker& worker, DropReason reason);
+    void publishWorkerStats(TestWorker& worker);
+    void publishServerStats();
+    void mergeStampLatency(LatencyHistogram& out) const;
+    template <typename Backend> void reflectBatches(TestWorker& worker, Backend& backend);
+    void drainForHandoff(TestWorker& worker);
+    // Sets lookupDoneNs, if given, once the packet's session has been found.
+    // receivedNs is the kernel's receive time, 0 if there is none.
+    bool reflectTestPacket(TestWorker& worker, char* packet, size_t size, const struct sockaddr_in6& fromAddr,
+                           const TrafficClass& traffic, int64_t receivedNs, int64_t* lookupDoneNs);
+    std::string handleAdminCommand(const std::string& command);
 };
 
 #endif // TWAMP_SERVER_H
\ No newline at end of file
@@ -8,35 +8,213 @@
 #include <ctime>
 #include <sys/time.h>
 #include <atomic>
+#include <string>
+#include <functional>
+#include <mutex>
+#include "ForwardPathStats.h"
+#include "TokenBucket.h"
+#include "Crypto.h"
+#include "TrafficClass.h"
+#include "StatsLayout.h"
 
 class Session {
 public:
-    Session(int controlSocket, int testSocket);
+    // Point-in-time view of a session for the admin interface.
+    struct Info {
+        uint64_t id;
+        uint32_t sid;
+        std::string controlPeer;
+        std::string testClient;
+        uint16_t testPort;
+        bool testActive;
+        const char* phase;
+        const char* mode;
+        double ageSec;
+        double idleSec;
+        uint64_t rateDrops;
+        uint64_t authDrops;
+        uint64_t kernelPackets;
+        ForwardPathStats::Snapshot forward;
+    };
+
+    // Control-protocol phase; each one has its own deadline measured from the
+    // last control message or test packet.
+    enum class Phase { AwaitRequest, AwaitStart, Testing, Closed };
+
+    // Everything needed to carry the session on in another process, taken
+    // while its thread is parked between control messages. Times are ages
+    // so that they survive the move.
+    struct HandoffState {
+        uint64_t id;
+        uint32_t sid;
+        uint8_t mode;
+        Phase phase;
+        bool testActive;
+        struct sockaddr_in6 controlPeer;
+        struct sockaddr_in6 testClient;
+        uint16_t offeredTestPort;
+        uint16_t testPort;
+        int64_t ageNs;
+        int64_t idleNs;
+        uint64_t rateDrops;
+        uint64_t authDrops;
+        uint64_t kernelPackets;
+        SessionKeys keys;
+        ControlCipher::State control;
+        ForwardPathStats::State forward;
+    };
+
+    Session(int controlSocket, int testSocket, uint64_t id, const struct sockaddr_in6& controlPeer,
+            bool logTestPackets = false);
     ~Session();
     
     void run();
     void requestStop();
     bool isExpired() const;
-    bool matchesTestAddress(const struct sockaddr_in& addr) const;
-    void processTestPacket(const char* data, size_t size, const struct sockaddr_in& fromAddr);
+    void setTimeouts(std::chrono::seconds request, std::chrono::seconds start, std::chrono::seconds idle);
+    Phase getPhase() const { return phase_; }
+    std::chrono::steady_clock::time_point getDeadline() const;
+    bool matchesTestAddress(const struct sockaddr_in6& addr) const;
+
+    // Turns a sender packet into the reflected packet in place, reporting the
+    // TOS and TTL it arrived with. T2 is `kernelReceivedNs`, the kernel's
+    // receive time, or the time of processing where that is 0. Returns false
+    // if nothing should be sent back.
+    bool processTestPacket(char* packet, size_t size, const struct sockaddr_in6& fromAddr,
+                           const TrafficClass& traffic, int64_t kernelReceivedNs);
+
+    // Whether replies leave with the DSCP of the packet they answer, which
+    // the reflected packets then say.
+    void setReflectDscp(bool on) { reflectDscp_ = on; }
+
+    // Switches the session to an authenticated or encrypted mode negotiated
+    // during the handshake. Must be called before run().
+    bool setSecurity(uint8_t mode, const SessionKeys& keys, const unsigned char clientIv[16],
+                     const unsigned char serverIv[16]);
+
+    uint64_t getId() const { return id_; }
+    Info getInfo() const;
+
+    // addressKey() of the address test packets are expected from; zero until
+    // Request-Session has been received.
+    uint64_t getTestClientKey() const { return testClientKey_; }
+    struct sockaddr_in6 getTestClientAddr() const;
+    bool isTestActive() const { return testActive_; }
+
+    // Test port offered in Accept-Session to clients that can follow it;
+    // 0, the default, keeps every client on the server's test_port. Must be
+    // called before run().
+    void setOfferedTestPort(uint16_t port) { offeredTestPort_ = port; }
+    uint16_t getOfferedTestPort() const { return offeredTestPort_; }
+    // The offered port's load counts the session from its first test packet
+    // there until the session is removed. claimOfferedPort() succeeds once,
+    // and never after releaseOfferedPort(), which tells whether to uncount.
+    bool offeredPortUnclaimed() const { return offeredPortUse_.load(std::memory_order_relaxed) == 0; }
+    bool claimOfferedPort() {
+        uint8_t unclaimed = 0;
+        return offeredPortUse_.compare_exchange_strong(unclaimed, 1);
+    }
+    bool releaseOfferedPort() { return offeredPortUse_.exchange(2) == 1; }
+    // Port the session's test packets go to once Request-Session has been
+    // answered, 0 for test_port.
+    uint16_t getTestPort() const { return testPort_; }
+
+    // Which of the server's addresses the control connection came in on;
+    // test packets are only taken on that address's ports.
+    void setListener(size_t index) { listener_ = index; }
+    size_t getListener() const { return listener_; }
+    uint8_t getMode() const { return mode_; }
+
+    // Called from the session thread whenever the test address changes or a
+    // test starts or stops, so the reflectors can refresh their lookup tables.
+    void setTestStateListener(std::function<void()> listener) { testStateListener_ = std::move(listener); }
+
+    // Accounts for packets reflected by the in-kernel reflector, which never
+    // reach processTestPacket(). They count as session activity.
+    void addKernelPackets(uint64_t count, int64_t nowNs);
+
+    // Per-session policing, applied by the reflector thread before any other
+    // work is done for a packet. Admitted packets count as session activity.
+    void setTestRateLimit(double packetsPerSec, double burst) { testRateLimit_.configure(packetsPerSec, burst); }
+    bool admitTestPacket(int64_t nowNs);
+
+    // Directory slot in the shared-memory statistics segment, kept up to
+    // date from then on: the identity by the session thread, the counters by
+    // the reflector thread as packets arrive. Must be called before run().
+    void setStatsSlot(std::shared_ptr<stats::SessionSlot> slot);
+
+    // Handoff to a new server process. With a wake descriptor set, run()
+    // waits for each control message with poll(); once requestDetach() has
+    // been called and the descriptor made readable, it returns at the next
+    // message boundary and leaves the control connection untouched.
+    void setDetachWake(int fd) { detachWake_ = fd; }
+    void requestDetach() { detachRequested_ = true; }
+    bool isDetached() const { return detached_; }
+    int getControlSocket() const { return controlSocket_; }
+    HandoffState saveState() const;
+
+    // Picks up a session saved by saveState() in the old process. Must be
+    // called before run(), on a session built with the same id and peer.
+    bool restoreState(const HandoffState& state);
     
 private:
-    void handleRequestSession(const std::vector<char>& message);
+    bool awaitCommand();
+    bool receiveCommand(std::vector<char>& message);
+    void handleRequestSession(std::vector<char>& message);
     void handleStartSessions();
     void handleStopSessions();
+    void touch();
+    void testStateChanged();
+    void publishIdentity();
+    void publishCounters();
     
+    uint64_t id_;
+    struct sockaddr_in6 controlPeer_;
+    std::chrono::steady_clock::time_point created_;
+    bool logTestPackets_;
+    bool reflectDscp_;
+    ForwardPathStats forwardStats_;
+    TokenBucket testRateLimit_;
+    std::atomic<uint64_t> rateDrops_;
+    std::atomic<uint64_t> authDrops_;
+    uint8_t mode_;
+    SessionKeys keys_;
+    ControlCipher controlCipher_;
+    TestPacketCipher testCipher_;
+    std::atomic<uint64_t> testClientKey_;
+    uint16_t offeredTestPort_;
+    std::atomic<uint8_t> offeredPortUse_;
+    std::atomic<uint16_t> testPort_;
+    size_t listener_;
+    std::function<void()> testStateListener_;
+    std::atomic<uint64_t> kernelPackets_;
+    std::shared_ptr<stats::SessionSlot> statsSlot_;
+
     std::atomic<bool> stopRequested_;
+    std::atomic<bool> detachRequested_;
+    bool detached_;
+    int detachWake_;
     int controlSocket_;
     int testSocket_;
-    std::chrono::steady_clock::time_point lastActivity_;
+    std::atomic<int64_t> lastActivityNs_;
+    std::atomic<Phase> phase_;
+    std::chrono::seconds requestTimeout_;
+    std::chrono::seconds startTimeout_;
+    std::chrono::seconds idleTimeout_;
     
-    struct sockaddr_in testClientAddr_;
+    // The session thread sets these on Request-Session while the reflector,
+    // kernel-sync and admin threads read them. Writes and other threads'
+    // reads hold identityMutex_; the session thread, the only writer, reads
+    // them without it.
+    mutable std::mutex identityMutex_;
+    struct sockaddr_in6 testClientAddr_;
     uint32_t sid_;
-    bool testActive_;
+    std::atomic<bool> testActive_;
     
-    std::vector<char> generateReflectorPacket(const char* data, size_t size, const sockaddr_in& fromAddr);
-    void sendControlMessage(const std::vector<char>& message);
-    std::vector<char> receiveControlMessage(size_t expectedSize);
+    void stampReflectorPacket(char* packet, size_t size, int64_t receivedNs, int64_t reflectedNs,
+                              const TrafficClass& traffic);
+    void sendControlMessage(const char* message, size_t size);
+    void receiveExactly(char* data, size_t size);
 };
 
 #endif // TWAMP_SESSION_H
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef TWAMP_STATS_SEGMENT_H
+#define TWAMP_STATS_SEGMENT_H
+
+#include "StatsLayout.h"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// The server's side of the shared-memory statistics segment: creates the
+// file, lays out the blocks and hands them to their writers. The control
+// thread writes the server block, each reflector worker its own block and
+// each session its directory slot. Nothing but acquiring and releasing a
+// session slot takes a lock.
+class StatsSegment {
+public:
+    StatsSegment();
+    ~StatsSegment();
+    StatsSegment(const StatsSegment&) = delete;
+    StatsSegment& operator=(const StatsSegment&) = delete;
+
+    // Replaces any file at `path` with a new segment that readers see only
+    // once it is complete.
+    bool open(const std::string& path, size_t workerCount, size_t sessionCapacity);
+
+    // Marks the segment closed for readers that still have it mapped and
+    // removes the file, unless another server has replaced it.
+    void close();
+    bool active() const { return base_ != nullptr; }
+
+    stats::ServerBlock* server() const;
+    stats::WorkerBlock* worker(size_t index) const;
+
+    // A free directory slot, marked free again and cleared when the last
+    // reference goes. Null when the directory is full or there is no
+    // segment. Sessions can outlive the server's other structures by a
+    // little, so the segment has to outlive every slot handed out.
+    std::shared_ptr<stats::SessionSlot> acquireSession();
+
+private:
+    void releaseSession(stats::SessionSlot* slot);
+
+    char* base_;
+    size_t size_;
+    std::string path_;
+    stats::Header* header_;
+    dev_t device_;
+    ino_t inode_;
+    std::mutex slotsMutex_;
+    std::vector<uint32_t> freeSlots_;
+};
+
+#endif // TWAMP_STATS_SEGMENT_H
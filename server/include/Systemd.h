@@ -0,0 +1,22 @@
+#ifndef TWAMP_SYSTEMD_H
+#define TWAMP_SYSTEMD_H
+
+#include <string>
+#include <vector>
+
+// The two pieces of the systemd service protocol the server uses, spoken
+// directly so there is no libsystemd dependency. Both do nothing when the
+// server was not started by systemd.
+namespace systemd {
+
+// Sockets passed by socket activation (LISTEN_FDS), if they were meant for
+// this process. The variables are cleared so that processes the server
+// starts do not pick them up again.
+std::vector<int> listenFds();
+
+// Sends a state such as "READY=1" to the service manager (NOTIFY_SOCKET).
+bool notify(const std::string& state);
+
+}  // namespace systemd
+
+#endif // TWAMP_SYSTEMD_H
@@ -0,0 +1,81 @@
+#ifndef TWAMP_TOKEN_BUCKET_H
+#define TWAMP_TOKEN_BUCKET_H
+
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Packet-rate token bucket for the reflector fast path. Not thread-safe: each
+// bucket is only ever touched by the reflector thread. A rate of zero means
+// unlimited.
+class TokenBucket {
+public:
+    TokenBucket(double ratePerSec = 0, double burst = 0) {
+        configure(ratePerSec, burst);
+    }
+
+    void configure(double ratePerSec, double burst) {
+        rate_ = ratePerSec / 1e9;
+        burst_ = burst > 1 ? burst : 1;
+        tokens_ = burst_;
+        lastNs_ = 0;
+    }
+
+    bool allow(int64_t nowNs) {
+        if (rate_ <= 0) {
+            return true;
+        }
+        if (nowNs > lastNs_) {
+            tokens_ += (nowNs - lastNs_) * rate_;
+            if (tokens_ > burst_) {
+                tokens_ = burst_;
+            }
+            lastNs_ = nowNs;
+        }
+        if (tokens_ < 1) {
+            return false;
+        }
+        tokens_ -= 1;
+        return true;
+    }
+
+private:
+    double rate_;   // tokens per nanosecond
+    double burst_;
+    double tokens_;
+    int64_t lastNs_;
+};
+
+// The same limit for a bucket shared by several reflector threads. Kept as
+// the time at which the bucket would be full again (GCRA), so a packet costs
+// one compare-and-swap and no lock. A rate of zero means unlimited.
+class SharedTokenBucket {
+public:
+    SharedTokenBucket(double ratePerSec, double burst)
+        : intervalNs_(ratePerSec > 0 ? std::max<int64_t>(std::llround(1e9 / ratePerSec), 1) : 0),
+          toleranceNs_(intervalNs_ * (static_cast<int64_t>(burst > 1 ? burst : 1) - 1)), fullAtNs_(0) {}
+
+    bool allow(int64_t nowNs) {
+        if (intervalNs_ == 0) {
+            return true;
+        }
+        int64_t fullAt = fullAtNs_.load(std::memory_order_relaxed);
+        for (;;) {
+            int64_t start = fullAt > nowNs ? fullAt : nowNs;
+            if (start - nowNs > toleranceNs_) {
+                return false;
+            }
+            if (fullAtNs_.compare_exchange_weak(fullAt, start + intervalNs_, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+private:
+    const int64_t intervalNs_;   // nanoseconds per token
+    const int64_t toleranceNs_;  // how far ahead of now fullAtNs_ may run
+    std::atomic<int64_t> fullAtNs_;
+};
+
+#endif // TWAMP_TOKEN_BUCKET_H
@@ -0,0 +1,63 @@
+#ifndef TWAMP_XDP_REFLECTOR_H
+#define TWAMP_XDP_REFLECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Reflects unauthenticated test packets inside the kernel. An XDP program
+// looks up the sender in a session map and, on a hit, stamps T2/T3 and the
+// sender's TTL and TOS, swaps the Ethernet, IP and UDP addresses and sends the
+// frame back out of the same interface with XDP_TX. The reply's DSCP is
+// cleared unless `reflectDscp` asks for it to be kept. Packets from senders that are not in the map are
+// passed up to the normal test socket, so user space only has to keep the map
+// in step with its sessions.
+//
+// Needs CAP_NET_ADMIN and CAP_BPF (or root). Closing the reflector detaches
+// the program and frees its maps. Not thread-safe.
+class XdpReflector {
+public:
+    // A test sender, both fields in network byte order. Matches the key
+    // layout of the session map.
+    struct Endpoint {
+        uint32_t addr;
+        uint16_t port;
+        uint16_t pad;
+    };
+
+    XdpReflector();
+    ~XdpReflector();
+    XdpReflector(const XdpReflector&) = delete;
+    XdpReflector& operator=(const XdpReflector&) = delete;
+
+    bool open(const std::string& interface, uint16_t port, bool generic = false, bool reflectDscp = false);
+    void close();
+
+    bool active() const { return linkFd_ >= 0; }
+    bool nativeMode() const { return nativeMode_; }
+
+    // The program reads CLOCK_MONOTONIC; this refreshes the offset that turns
+    // it into wall-clock time. Call it periodically so clock steps are
+    // picked up.
+    bool updateClock();
+
+    bool add(const Endpoint& endpoint);
+    bool remove(const Endpoint& endpoint);
+
+    // Packets reflected for an endpoint since it was added.
+    bool packets(const Endpoint& endpoint, uint64_t& count) const;
+
+    static const uint32_t kMaxSessions = 16384;
+
+    // Test packets shorter than this are left to user space.
+    static const size_t kMinPacketSize = 64;
+
+private:
+    int sessionsFd_;
+    int clockFd_;
+    int progFd_;
+    int linkFd_;
+    bool nativeMode_;
+};
+
+#endif // TWAMP_XDP_REFLECTOR_H
@@ -0,0 +1,115 @@
+#ifndef TWAMP_XDP_SOCKET_H
+#define TWAMP_XDP_SOCKET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <string>
+#include "TrafficClass.h"
+
+// AF_XDP socket bound to one receive queue of one interface. A small XDP
+// program redirects IPv4 UDP packets for the test port into the socket; all
+// other traffic, and test packets arriving on other queues, stays with the
+// kernel. Frames live in a UMEM shared with the kernel (zero-copy where the
+// driver supports it) and are reflected in place: the headers are swapped and
+// the same frame goes straight back out on the TX ring. The reply's TOS is
+// cleared, or keeps the received DSCP with setReflectDscp(), so it leaves
+// like one sent from the test socket.
+//
+// Needs CAP_NET_ADMIN and CAP_BPF (or root). Everything is released when the
+// socket is closed, including the XDP program. Not thread-safe: only the
+// reflector thread touches it, apart from stats().
+class XdpSocket {
+public:
+    static const size_t kBatchSize = 64;
+
+    // A received test packet. `payload` points at the UDP payload inside the
+    // UMEM frame and may be modified in place before reflect().
+    struct Packet {
+        char* payload;
+        size_t size;
+        struct sockaddr_in6 from;  // IPv4-mapped
+        int64_t receivedNs;  // always 0: frames carry no receive timestamp
+        TrafficClass traffic;
+        uint64_t addr;
+        uint32_t len;
+    };
+
+    struct Stats {
+        uint64_t received;
+        uint64_t reflected;
+        uint64_t invalid;
+        uint64_t txFull;
+    };
+
+    XdpSocket();
+    ~XdpSocket();
+    XdpSocket(const XdpSocket&) = delete;
+    XdpSocket& operator=(const XdpSocket&) = delete;
+
+    // Sets everything up, preferring zero-copy and a native (driver) XDP hook
+    // and falling back to copy mode and the generic hook; `generic` skips
+    // straight to the generic hook. On failure the error is logged and nothing
+    // is left attached.
+    bool open(const std::string& interface, uint32_t queue, uint16_t port, bool generic = false);
+    void close();
+
+    bool active() const { return fd_ >= 0; }
+    int fd() const { return fd_; }
+    bool zeroCopy() const { return zeroCopy_; }
+    bool nativeMode() const { return nativeMode_; }
+    void setReflectDscp(bool on) { reflectDscp_ = on; }
+
+    // Takes up to `max` packets off the RX ring. Each one must be handed back
+    // with reflect() or recycle() before the next flush().
+    size_t receive(Packet* packets, size_t max);
+
+    // Turns the frame around toward the sender and queues it for transmit.
+    void reflect(const Packet& packet);
+
+    // Returns the frame of a dropped packet to the kernel.
+    void recycle(const Packet& packet);
+
+    // Kicks the TX ring and reclaims transmitted frames.
+    void flush();
+
+    Stats stats() const;
+
+private:
+    struct Ring {
+        uint32_t* producer;
+        uint32_t* consumer;
+        uint32_t* flags;
+        void* descs;
+        uint32_t mask;
+        void* map;
+        size_t mapSize;
+    };
+
+    bool mapRing(Ring& ring, int ringOption, uint32_t size, uint64_t pgoff, size_t descSize);
+    bool attachProgram(int ifindex, uint32_t queue, uint16_t port, bool generic);
+    void fill(uint64_t addr);
+
+    int fd_;
+    int mapFd_;
+    int progFd_;
+    int linkFd_;
+    void* umem_;
+    size_t umemSize_;
+    bool zeroCopy_;
+    bool nativeMode_;
+    bool reflectDscp_;
+    Ring rx_;
+    Ring tx_;
+    Ring fill_;
+    Ring completion_;
+    uint32_t txPending_;
+
+    std::atomic<uint64_t> received_;
+    std::atomic<uint64_t> reflected_;
+    std::atomic<uint64_t> invalid_;
+    std::atomic<uint64_t> txFull_;
+};
+
+#endif // TWAMP_XDP_SOCKET_H
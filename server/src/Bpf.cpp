@@ -0,0 +1,171 @@
+#include "Bpf.h"
+#include <arpa/inet.h>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+long bpf(int cmd, union bpf_attr &attr)
+{
+    return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+} // namespace
+
+struct bpf_insn bpfInsn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    struct bpf_insn result;
+    memset(&result, 0, sizeof(result));
+    result.code = code;
+    result.dst_reg = dst;
+    result.src_reg = src;
+    result.off = off;
+    result.imm = imm;
+    return result;
+}
+
+void bpfLoadImm64(std::vector<struct bpf_insn> &prog, uint8_t dst, uint64_t value)
+{
+    prog.push_back(bpfInsn(BPF_LD | BPF_DW | BPF_IMM, dst, 0, 0, static_cast<int32_t>(value)));
+    prog.push_back(bpfInsn(0, 0, 0, 0, static_cast<int32_t>(value >> 32)));
+}
+
+void bpfLoadMap(std::vector<struct bpf_insn> &prog, uint8_t dst, int mapFd)
+{
+    prog.push_back(bpfInsn(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, mapFd));
+    prog.push_back(bpfInsn(0, 0, 0, 0, 0));
+}
+
+void bpfMatchUdpPort(std::vector<struct bpf_insn> &prog, std::vector<size_t> &misses, uint16_t port,
+                     size_t payloadSize)
+{
+    auto jump = [&](uint8_t code, uint8_t dst, uint8_t src, int32_t imm) {
+        misses.push_back(prog.size());
+        prog.push_back(bpfInsn(BPF_JMP | code, dst, src, 0, imm));
+    };
+    const int32_t headersSize = ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr);
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, headersSize + payloadSize));
+    jump(BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0);
+
+    // Header fields are compared in network byte order as loaded.
+    prog.push_back(bpfInsn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, offsetof(struct ethhdr, h_proto), 0));
+    jump(BPF_JNE | BPF_K, BPF_REG_5, 0, htons(ETH_P_IP));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH_HLEN, 0));
+    jump(BPF_JNE | BPF_K, BPF_REG_5, 0, 0x45);
+    prog.push_back(bpfInsn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct iphdr, frag_off), 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff)));
+    jump(BPF_JNE | BPF_K, BPF_REG_5, 0, 0);
+    prog.push_back(bpfInsn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct iphdr, protocol), 0));
+    jump(BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP);
+    prog.push_back(bpfInsn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2,
+                           ETH_HLEN + sizeof(struct iphdr) + offsetof(struct udphdr, dest), 0));
+    jump(BPF_JNE | BPF_K, BPF_REG_5, 0, htons(port));
+}
+
+void bpfPatchJumps(std::vector<struct bpf_insn> &prog, std::vector<size_t> &jumps)
+{
+    for (size_t jump : jumps)
+    {
+        prog[jump].off = static_cast<int16_t>(prog.size() - jump - 1);
+    }
+    jumps.clear();
+}
+
+int bpfCreateMap(enum bpf_map_type type, uint32_t keySize, uint32_t valueSize, uint32_t maxEntries)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = keySize;
+    attr.value_size = valueSize;
+    attr.max_entries = maxEntries;
+    return bpf(BPF_MAP_CREATE, attr);
+}
+
+bool bpfUpdateElement(int mapFd, const void *key, const void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFd;
+    attr.key = reinterpret_cast<uint64_t>(key);
+    attr.value = reinterpret_cast<uint64_t>(value);
+    return bpf(BPF_MAP_UPDATE_ELEM, attr) == 0;
+}
+
+bool bpfLookupElement(int mapFd, const void *key, void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFd;
+    attr.key = reinterpret_cast<uint64_t>(key);
+    attr.value = reinterpret_cast<uint64_t>(value);
+    return bpf(BPF_MAP_LOOKUP_ELEM, attr) == 0;
+}
+
+bool bpfDeleteElement(int mapFd, const void *key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFd;
+    attr.key = reinterpret_cast<uint64_t>(key);
+    return bpf(BPF_MAP_DELETE_ELEM, attr) == 0;
+}
+
+int bpfLoadXdpProgram(const std::vector<struct bpf_insn> &prog)
+{
+    static const char license[] = "Dual MIT/GPL";
+    char log[16384] = "";
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(prog.data());
+    attr.insn_cnt = prog.size();
+    attr.license = reinterpret_cast<uint64_t>(license);
+    attr.log_buf = reinterpret_cast<uint64_t>(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    int fd = bpf(BPF_PROG_LOAD, attr);
+    if (fd < 0 && log[0] != '\0')
+    {
+        int error = errno;
+        std::cerr << "XDP program rejected by the verifier:\n" << log << std::endl;
+        errno = error;
+    }
+    return fd;
+}
+
+int bpfAttachXdp(int progFd, int ifindex, bool generic, bool &nativeMode)
+{
+    int fd = -1;
+    for (uint32_t mode : {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE})
+    {
+        if (generic && mode == XDP_FLAGS_DRV_MODE)
+        {
+            continue;
+        }
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = progFd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = mode;
+        fd = bpf(BPF_LINK_CREATE, attr);
+        if (fd >= 0)
+        {
+            nativeMode = mode == XDP_FLAGS_DRV_MODE;
+            break;
+        }
+    }
+    return fd;
+}
@@ -0,0 +1,104 @@
+#include "ForwardPathStats.h"
+#include <cmath>
+#include <cstring>
+
+ForwardPathStats::ForwardPathStats()
+    : started_(false), firstSeq_(0), maxSeq_(0), window_(0), lastTransitNs_(0), jitterNs_(0),
+      packets_(0), bytes_(0), duplicates_(0), reordered_(0), expected_(0), highestSeq_(0), jitterNsBits_(0) {}
+
+void ForwardPathStats::update(uint32_t seq, int64_t sentNs, int64_t receivedNs, size_t bytes) {
+    packets_.store(packets_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    bytes_.store(bytes_.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+
+    if (!started_) {
+        started_ = true;
+        firstSeq_ = maxSeq_ = seq;
+        window_ = 1;
+    } else if (seq > maxSeq_) {
+        uint32_t shift = seq - maxSeq_;
+        window_ = shift >= kWindowSize ? 0 : window_ << shift;
+        window_ |= 1;
+        maxSeq_ = seq;
+    } else {
+        uint32_t offset = maxSeq_ - seq;
+        if (offset < kWindowSize && (window_ & (1ULL << offset))) {
+            duplicates_.store(duplicates_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        // Anything older than the window is assumed not to be a duplicate.
+        if (offset < kWindowSize) {
+            window_ |= 1ULL << offset;
+        }
+        if (seq < firstSeq_) {
+            firstSeq_ = seq;
+        }
+        reordered_.store(reordered_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    expected_.store(static_cast<uint64_t>(maxSeq_) - firstSeq_ + 1, std::memory_order_relaxed);
+    highestSeq_.store(maxSeq_, std::memory_order_relaxed);
+
+    // RFC 3550 interarrival jitter. The clock offset between sender and
+    // reflector cancels out in the transit-time difference.
+    int64_t transit = receivedNs - sentNs;
+    if (packets_.load(std::memory_order_relaxed) > 1) {
+        double d = std::fabs(static_cast<double>(transit - lastTransitNs_));
+        jitterNs_ += (d - jitterNs_) / 16.0;
+        uint64_t bits;
+        memcpy(&bits, &jitterNs_, sizeof(bits));
+        jitterNsBits_.store(bits, std::memory_order_relaxed);
+    }
+    lastTransitNs_ = transit;
+}
+
+ForwardPathStats::Snapshot ForwardPathStats::snapshot() const {
+    Snapshot s;
+    s.packets = packets_.load(std::memory_order_relaxed);
+    s.bytes = bytes_.load(std::memory_order_relaxed);
+    s.duplicates = duplicates_.load(std::memory_order_relaxed);
+    s.reordered = reordered_.load(std::memory_order_relaxed);
+    s.highestSeq = highestSeq_.load(std::memory_order_relaxed);
+
+    uint64_t unique = s.packets - s.duplicates;
+    uint64_t expected = expected_.load(std::memory_order_relaxed);
+    s.lost = expected > unique ? expected - unique : 0;
+
+    uint64_t bits = jitterNsBits_.load(std::memory_order_relaxed);
+    double jitterNs;
+    memcpy(&jitterNs, &bits, sizeof(jitterNs));
+    s.jitterUs = jitterNs / 1000.0;
+    return s;
+}
+
+ForwardPathStats::State ForwardPathStats::save() const {
+    State state;
+    state.started = started_;
+    state.firstSeq = firstSeq_;
+    state.maxSeq = maxSeq_;
+    state.window = window_;
+    state.lastTransitNs = lastTransitNs_;
+    state.jitterNs = jitterNs_;
+    state.packets = packets_.load(std::memory_order_relaxed);
+    state.bytes = bytes_.load(std::memory_order_relaxed);
+    state.duplicates = duplicates_.load(std::memory_order_relaxed);
+    state.reordered = reordered_.load(std::memory_order_relaxed);
+    return state;
+}
+
+void ForwardPathStats::restore(const State& state) {
+    started_ = state.started;
+    firstSeq_ = state.firstSeq;
+    maxSeq_ = state.maxSeq;
+    window_ = state.window;
+    lastTransitNs_ = state.lastTransitNs;
+    jitterNs_ = state.jitterNs;
+    packets_.store(state.packets, std::memory_order_relaxed);
+    bytes_.store(state.bytes, std::memory_order_relaxed);
+    duplicates_.store(state.duplicates, std::memory_order_relaxed);
+    reordered_.store(state.reordered, std::memory_order_relaxed);
+    expected_.store(started_ ? static_cast<uint64_t>(maxSeq_) - firstSeq_ + 1 : 0, std::memory_order_relaxed);
+    highestSeq_.store(maxSeq_, std::memory_order_relaxed);
+    uint64_t bits;
+    memcpy(&bits, &jitterNs_, sizeof(bits));
+    jitterNsBits_.store(bits, std::memory_order_relaxed);
+}
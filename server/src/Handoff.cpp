@@ -0,0 +1,175 @@
+#include "Handoff.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+bool socketAddress(const std::string &path, struct sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Handoff socket path too long: " << path << std::endl;
+        return false;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+} // namespace
+
+namespace handoff
+{
+
+Header header(Kind kind)
+{
+    Header result;
+    memset(&result, 0, sizeof(result));
+    result.magic = kMagic;
+    result.version = kVersion;
+    result.kind = kind;
+    return result;
+}
+
+int listen(const std::string &path)
+{
+    struct sockaddr_un addr;
+    if (!socketAddress(path, addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create handoff socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(fd, 1) < 0)
+    {
+        std::cerr << "Failed to bind handoff socket " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    // Whoever connects receives the sessions' keys.
+    chmod(path.c_str(), 0600);
+    return fd;
+}
+
+int connect(const std::string &path)
+{
+    struct sockaddr_un addr;
+    if (!socketAddress(path, addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        std::cerr << "No server to take over at " << path << ": " << strerror(errno) << std::endl;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+bool send(int socket, const Header &header, const void *payload, int fd)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<Header *>(&header);
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<void *>(payload);
+    iov[1].iov_len = header.payloadSize;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = header.payloadSize > 0 ? 2 : 1;
+    if (fd >= 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t size = sizeof(header) + header.payloadSize;
+    if (sendmsg(socket, &msg, MSG_NOSIGNAL) != size)
+    {
+        std::cerr << "Failed to send handoff message: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool receive(int socket, Header &header, std::vector<char> &payload, int &fd)
+{
+    std::vector<char> buffer(sizeof(Header) + kMaxPayload);
+    struct iovec iov;
+    iov.iov_base = buffer.data();
+    iov.iov_len = buffer.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    fd = -1;
+    ssize_t size = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = size > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (size < static_cast<ssize_t>(sizeof(Header)) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+        if (size < 0)
+        {
+            std::cerr << "Failed to receive handoff message: " << strerror(errno) << std::endl;
+        }
+        else
+        {
+            std::cerr << "Handoff connection closed or sent a malformed message" << std::endl;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        return false;
+    }
+
+    memcpy(&header, buffer.data(), sizeof(Header));
+    if (header.magic != kMagic || header.payloadSize != size - sizeof(Header))
+    {
+        std::cerr << "Handoff message is malformed" << std::endl;
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        return false;
+    }
+    payload.assign(buffer.begin() + sizeof(Header), buffer.begin() + size);
+    return true;
+}
+
+} // namespace handoff
@@ -0,0 +1,489 @@
+#include "IoUringSocket.h"
+#include "Address.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+const uint32_t kSubmissionEntries = 256;
+const uint32_t kCompletionEntries = 4096;
+const uint16_t kBufferGroup = 0;
+const uint64_t kReceiveTag = 1ULL << 63;
+const uint64_t kFixedSendTag = 1ULL << 62;
+const uint64_t kCancelTag = 1ULL << 61;
+
+// Each receive buffer holds the recvmsg header, then the source address,
+// then the receive timestamp, TOS and TTL, then the payload.
+const size_t kNameOffset = sizeof(struct io_uring_recvmsg_out);
+const size_t kControlOffset = kNameOffset + sizeof(struct sockaddr_in6);
+const size_t kControlSize = CMSG_SPACE(sizeof(struct timespec)) + kTrafficClassControlSize;
+const size_t kPayloadOffset = kControlOffset + kControlSize;
+
+int ioUringSetup(uint32_t entries, struct io_uring_params &params)
+{
+    return syscall(__NR_io_uring_setup, entries, &params);
+}
+
+int ioUringEnter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+int ioUringRegister(int fd, uint32_t opcode, const void *arg, uint32_t count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+TrafficClass trafficClass(char *control, size_t size)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = size;
+    return trafficClassOf(&msg);
+}
+
+int64_t receiveTimestamp(char *control, size_t size)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = size;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+} // namespace
+
+IoUringSocket::IoUringSocket()
+    : ringFd_(-1), sqRing_(nullptr), sqRingSize_(0), cqRing_(nullptr), cqRingSize_(0), sqes_(nullptr), sqesSize_(0),
+      sqHead_(nullptr), sqTail_(nullptr), sqMask_(0), cqHead_(nullptr), cqTail_(nullptr), cqMask_(0), cqes_(nullptr),
+      sqPending_(0), buffers_(nullptr), bufferRing_(nullptr), bufferTail_(0), receiveArmed_(false),
+      stopping_(false), fixedSends_(false), reflectDscp_(false), syscalls_(0), noBuffers_(0), sendErrors_(0)
+{
+    memset(&receiveMsg_, 0, sizeof(receiveMsg_));
+}
+
+IoUringSocket::~IoUringSocket()
+{
+    close();
+}
+
+bool IoUringSocket::open(int socketFd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = kCompletionEntries;
+    ringFd_ = ioUringSetup(kSubmissionEntries, params);
+    if (ringFd_ < 0)
+    {
+        std::cerr << "io_uring: setup failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        std::cerr << "io_uring: kernel too old" << std::endl;
+        close();
+        return false;
+    }
+
+    // One mapping covers both rings.
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_,
+                   IORING_OFF_SQ_RING);
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_,
+                      IORING_OFF_SQES);
+    if (sqRing_ == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        sqRing_ = sqRing_ == MAP_FAILED ? nullptr : sqRing_;
+        sqes_ = sqes == MAP_FAILED ? nullptr : static_cast<struct io_uring_sqe *>(sqes);
+        std::cerr << "io_uring: cannot map rings: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+    cqRing_ = sqRing_;
+    sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(sqRing_);
+    sqHead_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.head);
+    sqTail_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+    sqMask_ = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+    uint32_t *sqArray = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; ++i)
+    {
+        sqArray[i] = i;
+    }
+    char *cq = static_cast<char *>(cqRing_);
+    cqHead_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+
+    if (ioUringRegister(ringFd_, IORING_REGISTER_FILES, &socketFd, 1) < 0)
+    {
+        std::cerr << "io_uring: cannot register the test socket: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    buffers_ = static_cast<char *>(mmap(nullptr, kBufferCount * kBufferSize, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0));
+    bufferRing_ = mmap(nullptr, kBufferCount * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (buffers_ == MAP_FAILED || bufferRing_ == MAP_FAILED)
+    {
+        buffers_ = buffers_ == MAP_FAILED ? nullptr : buffers_;
+        bufferRing_ = bufferRing_ == MAP_FAILED ? nullptr : bufferRing_;
+        std::cerr << "io_uring: cannot allocate buffers: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufferRing_);
+    reg.ring_entries = kBufferCount;
+    reg.bgid = kBufferGroup;
+    if (ioUringRegister(ringFd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        std::cerr << "io_uring: provided buffer rings not supported: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+    for (uint32_t i = 0; i < kBufferCount; ++i)
+    {
+        provide(i);
+    }
+
+    // Fixed buffers spare the kernel a page lookup per send; only the
+    // zero-copy send opcode takes them. They count against RLIMIT_MEMLOCK,
+    // so go without them if that is too low.
+    struct iovec region = {buffers_, kBufferCount * kBufferSize};
+    fixedSends_ = ioUringRegister(ringFd_, IORING_REGISTER_BUFFERS, &region, 1) == 0;
+
+    // A kernel without multishot recvmsg fails the request as soon as it is
+    // submitted, so a bad completion here means falling back.
+    receiveMsg_.msg_namelen = sizeof(struct sockaddr_in6);
+    receiveMsg_.msg_controllen = kControlSize;
+    int on = 1;
+    setsockopt(socketFd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    enableTrafficClass(socketFd);
+    sends_.assign(kBufferCount, SendMessage());
+    flush();
+    if (__atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) != *cqHead_)
+    {
+        const struct io_uring_cqe &cqe = static_cast<const struct io_uring_cqe *>(cqes_)[*cqHead_ & cqMask_];
+        if (cqe.user_data == kReceiveTag && cqe.res < 0)
+        {
+            std::cerr << "io_uring: multishot receive not supported: " << strerror(-cqe.res) << std::endl;
+            close();
+            return false;
+        }
+    }
+
+    std::cout << "io_uring reflector backend" << (fixedSends_ ? " with fixed buffers" : "") << std::endl;
+    return true;
+}
+
+void IoUringSocket::close()
+{
+    if (ringFd_ >= 0)
+    {
+        ::close(ringFd_);
+        ringFd_ = -1;
+    }
+    if (sqRing_)
+    {
+        munmap(sqRing_, sqRingSize_);
+    }
+    if (sqes_)
+    {
+        munmap(sqes_, sqesSize_);
+    }
+    if (buffers_)
+    {
+        munmap(buffers_, kBufferCount * kBufferSize);
+    }
+    if (bufferRing_)
+    {
+        munmap(bufferRing_, kBufferCount * sizeof(struct io_uring_buf));
+    }
+    sqRing_ = cqRing_ = nullptr;
+    sqes_ = nullptr;
+    buffers_ = nullptr;
+    bufferRing_ = nullptr;
+    bufferTail_ = 0;
+    sqPending_ = 0;
+    receiveArmed_ = false;
+    stopping_ = false;
+}
+
+char *IoUringSocket::bufferAt(uint16_t buffer) const
+{
+    return buffers_ + static_cast<size_t>(buffer) * kBufferSize;
+}
+
+struct io_uring_sqe *IoUringSocket::nextSqe()
+{
+    uint32_t tail = *sqTail_ + sqPending_;
+    if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) > sqMask_)
+    {
+        submit();
+        tail = *sqTail_ + sqPending_;
+    }
+    struct io_uring_sqe *sqe = &sqes_[tail & sqMask_];
+    memset(sqe, 0, sizeof(*sqe));
+    sqPending_++;
+    return sqe;
+}
+
+void IoUringSocket::armReceive()
+{
+    struct io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->fd = 0;
+    sqe->addr = reinterpret_cast<uint64_t>(&receiveMsg_);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = kReceiveTag;
+    receiveArmed_ = true;
+}
+
+void IoUringSocket::queueSend(uint16_t buffer)
+{
+    char *data = bufferAt(buffer);
+    const struct io_uring_recvmsg_out *out = reinterpret_cast<const struct io_uring_recvmsg_out *>(data);
+
+    SendMessage &send = sends_[buffer];
+    if (send.dscp != 0)
+    {
+        const struct sockaddr_in6 *to = reinterpret_cast<const struct sockaddr_in6 *>(data + kNameOffset);
+        send.iov.iov_base = data + kPayloadOffset;
+        send.iov.iov_len = out->payloadlen;
+        memset(&send.msg, 0, sizeof(send.msg));
+        send.msg.msg_name = data + kNameOffset;
+        send.msg.msg_namelen = out->namelen;
+        send.msg.msg_iov = &send.iov;
+        send.msg.msg_iovlen = 1;
+        send.msg.msg_control = send.control;
+        send.msg.msg_controllen = writeTos(send.control, *to, send.dscp);
+
+        struct io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->addr = reinterpret_cast<uint64_t>(&send.msg);
+        sqe->len = 1;
+        sqe->user_data = buffer;
+        return;
+    }
+
+    struct io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = fixedSends_ ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = reinterpret_cast<uint64_t>(data + kPayloadOffset);
+    sqe->len = out->payloadlen;
+    sqe->addr2 = reinterpret_cast<uint64_t>(data + kNameOffset);
+    sqe->addr_len = out->namelen;
+    if (fixedSends_)
+    {
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+        sqe->buf_index = 0;
+        sqe->user_data = kFixedSendTag | buffer;
+    }
+    else
+    {
+        sqe->user_data = buffer;
+    }
+}
+
+void IoUringSocket::provide(uint16_t buffer)
+{
+    // The entries are indexed off the ring itself rather than through
+    // io_uring_buf_ring::bufs, which the uapi header lays out eight bytes
+    // too far in when compiled as C++.
+    struct io_uring_buf_ring *ring = static_cast<struct io_uring_buf_ring *>(bufferRing_);
+    struct io_uring_buf &entry = static_cast<struct io_uring_buf *>(bufferRing_)[bufferTail_ & (kBufferCount - 1)];
+    entry.addr = reinterpret_cast<uint64_t>(bufferAt(buffer));
+    entry.len = kBufferSize;
+    entry.bid = buffer;
+    bufferTail_++;
+    __atomic_store_n(&ring->tail, bufferTail_, __ATOMIC_RELEASE);
+}
+
+size_t IoUringSocket::receive(Packet *packets, size_t max)
+{
+    const struct io_uring_cqe *cqes = static_cast<const struct io_uring_cqe *>(cqes_);
+    uint32_t head = *cqHead_;
+    uint32_t tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+    size_t count = 0;
+    for (; head != tail && count < max; ++head)
+    {
+        const struct io_uring_cqe &cqe = cqes[head & cqMask_];
+
+        if (cqe.user_data == kCancelTag)
+        {
+            continue;
+        }
+        if (cqe.user_data != kReceiveTag)
+        {
+            // A send finished. A zero-copy send holds on to its buffer
+            // until the notification that follows a result flagged MORE.
+            // Kernels without zero-copy UDP fail those sends; they are
+            // retried as plain sends, and so is everything after them.
+            uint16_t buffer = static_cast<uint16_t>(cqe.user_data);
+            if (cqe.flags & IORING_CQE_F_NOTIF)
+            {
+                provide(buffer);
+                continue;
+            }
+            if (cqe.res == -EINVAL && (cqe.user_data & kFixedSendTag))
+            {
+                fixedSends_ = false;
+                queueSend(buffer);
+                continue;
+            }
+            if (cqe.res < 0)
+            {
+                sendErrors_.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+            {
+                provide(buffer);
+            }
+            continue;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            receiveArmed_ = false;
+        }
+        if (cqe.res < 0)
+        {
+            if (cqe.res == -ENOBUFS)
+            {
+                noBuffers_.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (cqe.res != -EINTR && cqe.res != -EAGAIN && !(cqe.res == -ECANCELED && stopping_))
+            {
+                std::cerr << "Failed to receive test packet: " << strerror(-cqe.res) << std::endl;
+            }
+            continue;
+        }
+
+        uint16_t buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        char *data = bufferAt(buffer);
+        const struct io_uring_recvmsg_out *out = reinterpret_cast<const struct io_uring_recvmsg_out *>(data);
+        if (out->namelen < sizeof(struct sockaddr_in) || out->namelen > sizeof(struct sockaddr_in6) ||
+            (out->flags & MSG_TRUNC))
+        {
+            provide(buffer);
+            continue;
+        }
+
+        Packet &packet = packets[count++];
+        packet.payload = data + kPayloadOffset;
+        packet.size = out->payloadlen;
+        memset(&packet.from, 0, sizeof(packet.from));
+        memcpy(&packet.from, data + kNameOffset, out->namelen);
+        packet.from = fromSocketAddress(packet.from);
+        packet.receivedNs = receiveTimestamp(data + kControlOffset, std::min<size_t>(out->controllen, kControlSize));
+        packet.traffic = trafficClass(data + kControlOffset, std::min<size_t>(out->controllen, kControlSize));
+        packet.buffer = buffer;
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+void IoUringSocket::reflect(const Packet &packet)
+{
+    sends_[packet.buffer].dscp = reflectDscp_ ? packet.traffic.tos & 0xfc : 0;
+    queueSend(packet.buffer);
+}
+
+void IoUringSocket::recycle(const Packet &packet)
+{
+    provide(packet.buffer);
+}
+
+void IoUringSocket::flush()
+{
+    if (!receiveArmed_ && !stopping_)
+    {
+        armReceive();
+    }
+    submit();
+}
+
+void IoUringSocket::stopReceiving()
+{
+    stopping_ = true;
+    if (!receiveArmed_)
+    {
+        return;
+    }
+    struct io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = kReceiveTag;
+    sqe->user_data = kCancelTag;
+    submit();
+}
+
+void IoUringSocket::submit()
+{
+    __atomic_store_n(sqTail_, *sqTail_ + sqPending_, __ATOMIC_RELEASE);
+    sqPending_ = 0;
+
+    // Entries the kernel could not take last time are still in the ring.
+    uint32_t unsubmitted = *sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    while (unsubmitted > 0)
+    {
+        syscalls_.fetch_add(1, std::memory_order_relaxed);
+        int submitted = ioUringEnter(ringFd_, unsubmitted, 0, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // EAGAIN and EBUSY clear once completions are reaped; the
+            // entries stay queued for the next flush.
+            if (errno != EAGAIN && errno != EBUSY)
+            {
+                std::cerr << "io_uring: submit failed: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+        unsubmitted -= std::min<uint32_t>(submitted, unsubmitted);
+    }
+}
+
+IoUringSocket::Stats IoUringSocket::stats() const
+{
+    Stats stats;
+    stats.syscalls = syscalls_.load(std::memory_order_relaxed);
+    stats.noBuffers = noBuffers_.load(std::memory_order_relaxed);
+    stats.sendErrors = sendErrors_.load(std::memory_order_relaxed);
+    return stats;
+}
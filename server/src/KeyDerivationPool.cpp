@@ -0,0 +1,140 @@
+#include "KeyDerivationPool.h"
+#include <cstring>
+#include <openssl/crypto.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace
+{
+void wipe(KeyDerivationPool::Job &job)
+{
+    if (!job.secret.empty())
+    {
+        OPENSSL_cleanse(&job.secret[0], job.secret.size());
+    }
+    job.secret.clear();
+}
+} // namespace
+
+KeyDerivationPool::KeyDerivationPool() : eventFd_(-1), maxPending_(0), stopping_(false) {}
+
+KeyDerivationPool::~KeyDerivationPool()
+{
+    stop();
+}
+
+bool KeyDerivationPool::start(size_t threads, size_t maxPending)
+{
+    eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd_ < 0)
+    {
+        return false;
+    }
+    maxPending_ = maxPending;
+    stopping_ = false;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        threads_.emplace_back(&KeyDerivationPool::run, this);
+    }
+    return true;
+}
+
+void KeyDerivationPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        for (auto &job : jobs_)
+        {
+            wipe(job);
+        }
+        jobs_.clear();
+    }
+    wake_.notify_all();
+    for (auto &thread : threads_)
+    {
+        thread.join();
+    }
+    threads_.clear();
+
+    for (auto &result : results_)
+    {
+        OPENSSL_cleanse(&result.keys, sizeof(result.keys));
+    }
+    results_.clear();
+    if (eventFd_ != -1)
+    {
+        close(eventFd_);
+        eventFd_ = -1;
+    }
+}
+
+bool KeyDerivationPool::submit(Job &job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || threads_.empty() || jobs_.size() >= maxPending_)
+        {
+            wipe(job);
+            return false;
+        }
+        jobs_.push_back(std::move(job));
+    }
+    wipe(job);
+    wake_.notify_one();
+    return true;
+}
+
+void KeyDerivationPool::collect(std::vector<Result> &out)
+{
+    uint64_t value;
+    if (read(eventFd_, &value, sizeof(value)) < 0)
+    {
+        // Nothing signalled; results are only ever added with a signal.
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    out.insert(out.end(), results_.begin(), results_.end());
+    for (auto &result : results_)
+    {
+        OPENSSL_cleanse(&result.keys, sizeof(result.keys));
+    }
+    results_.clear();
+}
+
+void KeyDerivationPool::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        wake_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+        if (stopping_)
+        {
+            return;
+        }
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+
+        Result result;
+        result.slot = job.slot;
+        result.generation = job.generation;
+        result.ok = false;
+        memset(&result.keys, 0, sizeof(result.keys));
+        if (TimerWheel::Clock::now() < job.deadline)
+        {
+            unsigned char key[16];
+            result.ok = deriveKey(job.secret, job.salt, job.count, key) &&
+                        openToken(key, job.token, job.challenge, result.keys);
+            OPENSSL_cleanse(key, sizeof(key));
+        }
+        wipe(job);
+
+        lock.lock();
+        results_.push_back(result);
+        OPENSSL_cleanse(&result.keys, sizeof(result.keys));
+        uint64_t one = 1;
+        ssize_t written = write(eventFd_, &one, sizeof(one));
+        (void)written;
+    }
+}
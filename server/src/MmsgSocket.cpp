@@ -0,0 +1,124 @@
+#include "MmsgSocket.h"
+#include "Address.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+int64_t receiveTimestamp(struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+} // namespace
+
+MmsgSocket::MmsgSocket() : fd_(-1), reflectDscp_(false), replyCount_(0), syscalls_(0) {}
+
+void MmsgSocket::open(int fd)
+{
+    fd_ = fd;
+    int on = 1;
+    if (setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    {
+        std::cerr << "Failed to enable receive timestamps: " << strerror(errno) << std::endl;
+    }
+    if (!enableTrafficClass(fd_))
+    {
+        std::cerr << "Failed to enable TOS and TTL reporting: " << strerror(errno) << std::endl;
+    }
+}
+
+size_t MmsgSocket::receive(Packet *packets, size_t max)
+{
+    size_t batch = max < kBatchSize ? max : kBatchSize;
+    for (size_t i = 0; i < batch; ++i)
+    {
+        iovs_[i].iov_base = buffers_[i];
+        iovs_[i].iov_len = kBufferSize;
+        memset(&messages_[i].msg_hdr, 0, sizeof(messages_[i].msg_hdr));
+        messages_[i].msg_hdr.msg_name = &addrs_[i];
+        messages_[i].msg_hdr.msg_namelen = sizeof(addrs_[i]);
+        messages_[i].msg_hdr.msg_iov = &iovs_[i];
+        messages_[i].msg_hdr.msg_iovlen = 1;
+        messages_[i].msg_hdr.msg_control = control_[i];
+        messages_[i].msg_hdr.msg_controllen = sizeof(control_[i]);
+    }
+
+    syscalls_.fetch_add(1, std::memory_order_relaxed);
+    int received = recvmmsg(fd_, messages_, batch, MSG_DONTWAIT, NULL);
+    if (received < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            std::cerr << "Failed to receive test packet: " << strerror(errno) << std::endl;
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < received; ++i)
+    {
+        packets[i].payload = buffers_[i];
+        packets[i].size = messages_[i].msg_len;
+        packets[i].from = fromSocketAddress(addrs_[i]);
+        packets[i].receivedNs = receiveTimestamp(&messages_[i].msg_hdr);
+        packets[i].traffic = trafficClassOf(&messages_[i].msg_hdr);
+        packets[i].slot = i;
+    }
+    return received;
+}
+
+void MmsgSocket::reflect(const Packet &packet)
+{
+    // Send back to the client's source address and port, which recvmmsg()
+    // left in the header along with its length. The receive control data has
+    // been read by now, so its buffer can carry the reply's DSCP.
+    size_t slot = packet.slot;
+    iovs_[slot].iov_len = packet.size;
+    replies_[replyCount_].msg_hdr = messages_[slot].msg_hdr;
+    uint8_t dscp = packet.traffic.tos & 0xfc;
+    if (reflectDscp_ && dscp != 0)
+    {
+        replies_[replyCount_].msg_hdr.msg_control = control_[slot];
+        replies_[replyCount_].msg_hdr.msg_controllen = writeTos(control_[slot], packet.from, dscp);
+    }
+    else
+    {
+        replies_[replyCount_].msg_hdr.msg_control = nullptr;
+        replies_[replyCount_].msg_hdr.msg_controllen = 0;
+    }
+    replyCount_++;
+}
+
+void MmsgSocket::flush()
+{
+    size_t sent = 0;
+    while (sent < replyCount_)
+    {
+        syscalls_.fetch_add(1, std::memory_order_relaxed);
+        int n = sendmmsg(fd_, replies_ + sent, replyCount_ - sent, 0);
+        if (n < 0)
+        {
+            std::cerr << "Failed to send reflector packet: " << strerror(errno) << std::endl;
+            // Skip the packet that failed and carry on with the rest.
+            n = 1;
+        }
+        sent += n;
+    }
+    replyCount_ = 0;
+}
+
+MmsgSocket::Stats MmsgSocket::stats() const
+{
+    Stats stats;
+    stats.syscalls = syscalls_.load(std::memory_order_relaxed);
+    return stats;
+}
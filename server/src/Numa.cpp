@@ -0,0 +1,159 @@
+#include "Numa.h"
+#include "Address.h"
+#include <cstring>
+#include <fstream>
+#include <ifaddrs.h>
+#include <linux/mempolicy.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+const int kMaxNodes = 1024;
+
+struct NodeMask
+{
+    unsigned long bits[kMaxNodes / (8 * sizeof(unsigned long))];
+};
+
+bool maskOf(int node, NodeMask &mask)
+{
+    if (node < 0 || node >= kMaxNodes)
+    {
+        return false;
+    }
+    memset(&mask, 0, sizeof(mask));
+    mask.bits[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return true;
+}
+
+bool sameAddress(const struct sockaddr *sa, const struct in6_addr &addr)
+{
+    if (sa->sa_family == AF_INET && isMappedIpv4(addr))
+    {
+        return reinterpret_cast<const struct sockaddr_in *>(sa)->sin_addr.s_addr == mappedIpv4(addr);
+    }
+    if (sa->sa_family == AF_INET6)
+    {
+        return memcmp(&reinterpret_cast<const struct sockaddr_in6 *>(sa)->sin6_addr, &addr, sizeof(addr)) == 0;
+    }
+    return false;
+}
+} // namespace
+
+namespace numa
+{
+
+int nodeOfAddress(const struct in6_addr &addr)
+{
+    struct ifaddrs *interfaces;
+    if (getifaddrs(&interfaces) < 0)
+    {
+        return -1;
+    }
+    std::string name;
+    for (struct ifaddrs *ifa = interfaces; ifa; ifa = ifa->ifa_next)
+    {
+        if (ifa->ifa_addr && sameAddress(ifa->ifa_addr, addr))
+        {
+            name = ifa->ifa_name;
+            break;
+        }
+    }
+    freeifaddrs(interfaces);
+
+    // Virtual interfaces have no device, and the kernel reports -1 for
+    // devices it cannot place.
+    int node = -1;
+    if (!name.empty())
+    {
+        std::ifstream file("/sys/class/net/" + name + "/device/numa_node");
+        if (!(file >> node))
+        {
+            node = -1;
+        }
+    }
+    return node;
+}
+
+bool nodeCpus(int node, cpu_set_t &cpus)
+{
+    if (node < 0)
+    {
+        return false;
+    }
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!(file >> list))
+    {
+        return false;
+    }
+
+    // e.g. "0-7,16-23"
+    CPU_ZERO(&cpus);
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t end = list.find(',', pos);
+        std::string range = list.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+        if (end == std::string::npos)
+        {
+            break;
+        }
+        pos = end + 1;
+    }
+    return CPU_COUNT(&cpus) > 0;
+}
+
+void *allocate(size_t size, int node)
+{
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    // Only a preference: if the node runs out, memory comes from elsewhere
+    // rather than not at all.
+    NodeMask mask;
+    if (maskOf(node, mask))
+    {
+        syscall(SYS_mbind, memory, size, MPOL_PREFERRED, mask.bits, kMaxNodes, 0);
+    }
+    return memory;
+}
+
+void release(void *memory, size_t size)
+{
+    if (memory)
+    {
+        munmap(memory, size);
+    }
+}
+
+ScopedPreference::ScopedPreference(int node) : set_(false)
+{
+    NodeMask mask;
+    if (maskOf(node, mask))
+    {
+        set_ = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.bits, kMaxNodes) == 0;
+    }
+}
+
+ScopedPreference::~ScopedPreference()
+{
+    if (set_)
+    {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+    }
+}
+
+} // namespace numa
@@ -1,5 +1,11 @@
 #include "Server.h"
+#include "Address.h"
+#include "Handoff.h"
+#include "Numa.h"
+#include "Probes.h"
 #include "Session.h"
+#include "Systemd.h"
+#include "TscClock.h"
 #include <iostream>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -14,27 +20,95 @@
 #include <csignal>
 #include <fcntl.h>
 #include <errno.h>
+#include <algorithm>
+#include <unordered_set>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <openssl/crypto.h>
 
 Server *Server::instance = nullptr;
 
-void Server::signalHandler(int signum)
+namespace
 {
-    if (Server::instance)
+// epoll tags of the listening sockets count down from here; control slots
+// use their index.
+const uint64_t kListenTag = ~0ULL;
+const uint64_t kWakeTag = 1ULL << 62;
+const uint64_t kAuthTag = kWakeTag + 1;
+
+// Secured-mode handshakes waiting for their key derivation; more are turned
+// away until some finish.
+const size_t kMaxPendingAuthentications = 256;
+
+// How often the control thread refreshes the server block of the statistics
+// segment.
+const std::chrono::milliseconds kStatsPublishInterval(100);
+
+// How long a handoff waits for sessions to reach a message boundary, and
+// for the new process to confirm it is serving.
+const std::chrono::seconds kDetachTimeout(2);
+const int kTakeoverAckTimeoutSec = 30;
+
+std::chrono::seconds configSeconds(const Config &config, const std::string &key, int defaultValue)
+{
+    return std::chrono::seconds(std::max(config.getInt(key, defaultValue), 1));
+}
+
+// Parses a "first-last" port range; a single port is a range of one.
+bool parsePortRange(const std::string &value, uint16_t &first, uint16_t &last)
+{
+    unsigned int from = 0, to = 0;
+    char extra;
+    int fields = sscanf(value.c_str(), "%u - %u %c", &from, &to, &extra);
+    if (fields == 1)
     {
-        std::cerr << "Received signal " << signum << ", initiating shutdown..." << std::endl;
-        Server::instance->stop();
+        to = from;
     }
+    else if (fields != 2)
+    {
+        return false;
+    }
+    if (from == 0 || from > to || to > 65535)
+    {
+        return false;
+    }
+    first = static_cast<uint16_t>(from);
+    last = static_cast<uint16_t>(to);
+    return true;
 }
+} // namespace
 
-Server::Server(const std::string &configFile) : config_(configFile), running_(false), controlSocket_(-1), testSocket_(-1)
+Server::Server(const std::string &configFile)
+    : config_(configFile), unlistedSessions_(0), adminSocket_(-1), takeover_(false), handoffSocket_(-1),
+      handoffConnection_(-1), handoffRequested_(false), detachWake_(-1), running_(false), nextSessionId_(1),
+      sessionsVersion_(1), handshakeAuthFailures_(0), offeredModes_(ModeUnauthenticated), keyDerivationCount_(1024),
+      controlEpoll_(-1), acceptPaused_(false),
+      controlTimers_(std::chrono::milliseconds(100), 1024), greetingTimeout_(5), authFailuresUnlogged_(0),
+      prefixLength_(24), prefixLengthV6_(64), busyPoll_(false), reflectDscp_(false),
+      stageSampleInterval_(0), kernelSessions_(0), kernelDemotions_(0)
 {
+    for (auto &counter : drops_)
+    {
+        counter = 0;
+    }
+    for (auto &counter : timeouts_)
+    {
+        counter = 0;
+    }
     if (!config_.load())
     {
         throw std::runtime_error("Failed to load configuration");
     }
+    // Signal handling belongs to main(), which calls stop() outside of
+    // signal context.
     Server::instance = this;
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
 }
 
 Server::~Server()
@@ -45,23 +119,202 @@ Server::~Server()
 
 bool Server::start()
 {
-    if (!setupControlSocket() || !setupTestSocket())
+    // Everything that can refuse the configuration is checked before any
+    // socket is touched, so that a takeover that cannot work ends before the
+    // old server stops. If a later step fails, the old server resumes.
+    std::string backend = config_.getString("reflector_backend", "socket");
+    if (backend != "socket" && backend != "io_uring")
     {
+        std::cerr << "Unknown reflector_backend: " << backend << std::endl;
         return false;
     }
 
-    running_ = true;
+    // The secured modes are offered only when there are keys to use.
+    offeredModes_ = config_.getBool("allow_unauthenticated", true) ? ModeUnauthenticated : 0;
+    std::string keyFile = config_.getString("auth_key_file", "");
+    if (!keyFile.empty())
+    {
+        if (!authKeys_.load(keyFile))
+        {
+            std::cerr << "Failed to load authentication keys from " << keyFile << std::endl;
+            return false;
+        }
+        offeredModes_ |= ModeAuthenticated | ModeEncrypted;
+    }
+    if (offeredModes_ == 0)
+    {
+        std::cerr << "No TWAMP mode enabled: set auth_key_file or allow_unauthenticated" << std::endl;
+        return false;
+    }
+    keyDerivationCount_ = static_cast<uint32_t>(std::min<int64_t>(
+        std::max<int64_t>(config_.getInt("key_derivation_count", 1024), kMinKeyDerivationCount),
+        kMaxKeyDerivationCount));
+    if (offeredModes_ & (ModeAuthenticated | ModeEncrypted))
+    {
+        // Enough threads that a flood of bad tokens leaves some for others.
+        size_t threads = std::max(1u, std::min(4u, std::thread::hardware_concurrency() / 2));
+        if (!keyDerivation_.start(threads, kMaxPendingAuthentications))
+        {
+            std::cerr << "Failed to start key derivation threads: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
 
-    controlThread_ = std::thread(&Server::controlServerThread, this);
-    testThread_ = std::thread(&Server::testServerThread, this);
-    cleanupThread_ = std::thread(&Server::sessionCleanupThread, this);
+    // Calibrate the packet clock now rather than on the first test packet.
+    TscClock::instance();
+
+    adoptSystemdSockets();
+    if (takeover_ && !receiveHandoff())
+    {
+        return false;
+    }
+    bool socketsReady = setupListeners() && setupTestSockets();
+    for (const auto &socket : inherited_)
+    {
+        std::cerr << "Closing inherited socket for " << formatIp(socket.address) << " port " << socket.port
+                  << ", which the configuration does not use" << std::endl;
+        close(socket.fd);
+    }
+    inherited_.clear();
+    if (!socketsReady)
+    {
+        return false;
+    }
+
+    busyPoll_ = config_.getBool("busy_poll", false);
+    reflectDscp_ = config_.getBool("reflect_dscp", false);
+    stageSampleInterval_ = static_cast<uint32_t>(std::max(config_.getInt("stage_timing_sample", 0), 0));
+
+    prefixLength_ = std::min(std::max(config_.getInt("prefix_length", 24), 0), 32);
+    prefixLengthV6_ = std::min(std::max(config_.getInt("prefix_length_v6", 64), 0), 128);
+
+    greetingTimeout_ = configSeconds(config_, "greeting_timeout", 5);
+
+    // Every connection in the handshake holds a descriptor until its
+    // deadline; don't let the default soft limit be the bottleneck.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // The old process is told before anything here starts serving; if it
+    // is not listening any more it has carried on, and this one must not.
+    if (takeover_ && !finishTakeover())
+    {
+        return false;
+    }
+    startServing();
 
     std::cout << "TWAMP Server started on control port " << config_.getInt("control_port", 862)
-              << ", test port " << config_.getInt("test_port", 863) << std::endl;
+              << ", test port " << config_.getInt("test_port", 863);
+    if (testWorkers_.size() > listeners_.size())
+    {
+        std::cout << ", session test ports " << testWorkers_[1]->port << "-" << testWorkers_.back()->port;
+    }
+    std::cout << std::endl;
+    for (const auto &listener : listeners_)
+    {
+        if (!IN6_IS_ADDR_UNSPECIFIED(&listener.address))
+        {
+            std::cout << "Listening on " << formatIp(listener.address);
+            if (listener.numaNode >= 0)
+            {
+                std::cout << ", NUMA node " << listener.numaNode;
+            }
+            std::cout << std::endl;
+        }
+    }
 
     return true;
 }
 
+// Everything that handOff() stops. Runs at start-up and again when a
+// handoff fails, on the sockets and sessions this process still holds.
+void Server::startServing()
+{
+    std::string backend = config_.getString("reflector_backend", "socket");
+    for (auto &worker : testWorkers_)
+    {
+        numa::ScopedPreference preference(listeners_[worker->listener].numaNode);
+        worker->mmsg.setReflectDscp(reflectDscp_);
+        worker->uring.setReflectDscp(reflectDscp_);
+        worker->mmsg.open(worker->socket);
+        if (backend == "io_uring" && !worker->uring.open(worker->socket))
+        {
+            std::cerr << "io_uring unavailable on test port " << worker->port << ", using the socket backend"
+                      << std::endl;
+        }
+    }
+
+    // Kernel bypass is optional: without it the test socket serves everything.
+    // The in-kernel reflector goes first so that, if both are configured for
+    // one interface, AF_XDP is the one that gives way.
+    bool xdpGeneric = config_.getBool("xdp_generic", false);
+    std::string reflectorInterface = config_.getString("xdp_reflector_interface", "");
+    if (!reflectorInterface.empty() &&
+        !kernelReflector_.open(reflectorInterface, config_.getInt("test_port", 863), xdpGeneric, reflectDscp_))
+    {
+        std::cerr << "In-kernel reflector disabled" << std::endl;
+    }
+    std::string xdpInterface = config_.getString("xdp_interface", "");
+    xdp_.setReflectDscp(reflectDscp_);
+    if (!xdpInterface.empty() &&
+        !xdp_.open(xdpInterface, config_.getInt("xdp_queue", 0), config_.getInt("test_port", 863), xdpGeneric))
+    {
+        std::cerr << "AF_XDP disabled, reflecting through the test socket only" << std::endl;
+    }
+
+    // The admin socket is a debugging aid; the reflector runs without it.
+    // After a failed handoff both are still open.
+    if (adminSocket_ == -1 && !setupAdminSocket())
+    {
+        std::cerr << "Admin socket disabled" << std::endl;
+    }
+    if (handoffSocket_ == -1 && !setupHandoffSocket())
+    {
+        std::cerr << "Handoff disabled, restarts will drop sessions" << std::endl;
+    }
+
+    // So is the statistics segment.
+    std::string statsPath = config_.getString("stats_segment", "");
+    if (!statsPath.empty())
+    {
+        size_t capacity = std::max(config_.getInt("max_sessions", 100), 1);
+        if (stats_.open(statsPath, testWorkers_.size(), capacity))
+        {
+            for (size_t i = 0; i < testWorkers_.size(); ++i)
+            {
+                testWorkers_[i]->stats = stats_.worker(i);
+                publishWorkerStats(*testWorkers_[i]);
+            }
+            publishServerStats();
+        }
+        else
+        {
+            std::cerr << "Statistics segment disabled" << std::endl;
+        }
+    }
+
+    running_ = true;
+    resumeSessions();
+
+    controlThread_ = std::thread(&Server::controlServerThread, this);
+    for (size_t i = 0; i < testWorkers_.size(); ++i)
+    {
+        testWorkers_[i]->thread = std::thread(&Server::testServerThread, this, std::ref(*testWorkers_[i]), i);
+    }
+    if (adminSocket_ != -1 || handoffSocket_ != -1)
+    {
+        adminThread_ = std::thread(&Server::adminServerThread, this);
+    }
+    if (kernelReflector_.active())
+    {
+        kernelSyncThread_ = std::thread(&Server::kernelReflectorSyncThread, this);
+    }
+}
+
 void Server::stop()
 {
     if (!running_) return;
@@ -70,15 +323,26 @@ void Server::stop()
     std::cout << "Stopping TWAMP server..." << std::endl;
 
     // Close sockets to unblock threads
-    if (controlSocket_ != -1) {
-        shutdown(controlSocket_, SHUT_RDWR);
-        close(controlSocket_);
-        controlSocket_ = -1;
+    for (auto &listener : listeners_) {
+        if (listener.controlSocket != -1) {
+            shutdown(listener.controlSocket, SHUT_RDWR);
+            close(listener.controlSocket);
+            listener.controlSocket = -1;
+        }
     }
-    if (testSocket_ != -1) {
-        shutdown(testSocket_, SHUT_RDWR);
-        close(testSocket_);
-        testSocket_ = -1;
+    if (adminSocket_ != -1) {
+        close(adminSocket_);
+        adminSocket_ = -1;
+        unlink(adminSocketPath_.c_str());
+    }
+    if (handoffSocket_ != -1) {
+        close(handoffSocket_);
+        handoffSocket_ = -1;
+        unlink(handoffSocketPath_.c_str());
+    }
+    if (handoffConnection_ != -1) {
+        close(handoffConnection_);
+        handoffConnection_ = -1;
     }
 
     // Stop all sessions
@@ -91,27 +355,37 @@ void Server::stop()
 
     // Join main threads first
     if (controlThread_.joinable()) controlThread_.join();
-    if (testThread_.joinable()) testThread_.join();
-    if (cleanupThread_.joinable()) cleanupThread_.join();
+    keyDerivation_.stop();
+    // The workers themselves stay: exiting sessions still look them up.
+    for (auto &worker : testWorkers_) {
+        if (worker->thread.joinable()) worker->thread.join();
+        worker->uring.close();
+        close(worker->socket);
+        worker->socket = -1;
+    }
+    xdp_.close();
+    kernelSyncWake_.notify_all();
+    if (kernelSyncThread_.joinable()) kernelSyncThread_.join();
+    kernelReflector_.close();
+    if (adminThread_.joinable()) adminThread_.join();
 
-    // Join control connection threads
-    std::vector<std::thread> controlThreads;
+    // Sessions created by the control thread before it exited
     {
-        std::lock_guard<std::mutex> lock(controlConnectionThreadsMutex_);
-        controlThreads = std::move(controlConnectionThreads_);
-        controlConnectionThreads_.clear();
-    }
-    for (auto& thread : controlThreads) {
-        if (thread.joinable()) thread.join();
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        for (auto &session : activeSessions_) {
+            session->requestStop();
+        }
     }
 
-    // Join session threads
+    // Join session threads; outside the lock, which they take on the way out
+    std::unordered_map<uint64_t, std::thread> threads;
     {
         std::lock_guard<std::mutex> lock(sessionThreadsMutex_);
-        for (auto& thread : sessionThreads_) {
-            if (thread.joinable()) thread.join();
-        }
-        sessionThreads_.clear();
+        threads.swap(sessionThreads_);
+        finishedSessionThreads_.clear();
+    }
+    for (auto& entry : threads) {
+        if (entry.second.joinable()) entry.second.join();
     }
 
     // Clear sessions
@@ -119,311 +393,2178 @@ void Server::stop()
         std::lock_guard<std::mutex> lock(sessionsMutex_);
         activeSessions_.clear();
     }
+    stats_.close();
+    if (detachWake_ != -1) {
+        close(detachWake_);
+        detachWake_ = -1;
+    }
 
     std::cout << "TWAMP server stopped." << std::endl;
 }
 
-bool Server::setupControlSocket()
+bool Server::setupListeners()
 {
-    controlSocket_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (controlSocket_ < 0)
+    // Without listen_addresses, one dual-stack wildcard socket per port
+    // takes both families.
+    std::vector<struct in6_addr> addresses;
+    std::stringstream list(config_.getString("listen_addresses", ""));
+    std::string item;
+    while (std::getline(list, item, ','))
     {
-        std::cerr << "Failed to create control socket" << std::endl;
-        return false;
+        item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+        if (item.empty())
+        {
+            continue;
+        }
+        struct in6_addr address;
+        if (!parseAddress(item, address))
+        {
+            std::cerr << "Invalid address in listen_addresses: " << item << std::endl;
+            return false;
+        }
+        addresses.push_back(address);
+    }
+    if (addresses.empty())
+    {
+        addresses.push_back(in6addr_any);
+    }
+
+    for (const auto &address : addresses)
+    {
+        Listener listener;
+        listener.address = address;
+        listener.numaNode = IN6_IS_ADDR_UNSPECIFIED(&address) ? -1 : numa::nodeOfAddress(address);
+        listener.hasCpus = numa::nodeCpus(listener.numaNode, listener.cpus);
+        listener.controlSocket = openControlSocket(address);
+        if (listener.controlSocket < 0)
+        {
+            for (auto &open : listeners_)
+            {
+                close(open.controlSocket);
+            }
+            listeners_.clear();
+            return false;
+        }
+        listeners_.push_back(listener);
+    }
+    return true;
+}
+
+int Server::openControlSocket(const struct in6_addr &address)
+{
+    int inherited = takeInheritedSocket(SOCK_STREAM, address, config_.getInt("control_port", 862));
+    if (inherited != -1)
+    {
+        return inherited;
+    }
+
+    int fd = openSocket(address, SOCK_STREAM);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create control socket: " << strerror(errno) << std::endl;
+        return -1;
     }
+    int family = socketFamily(fd);
 
     int enable = 1;
-    if (setsockopt(controlSocket_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+    int v6only = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0))
     {
-        std::cerr << "Failed to set SO_REUSEADDR on control socket" << std::endl;
-        close(controlSocket_);
-        controlSocket_ = -1;
-        return false;
+        std::cerr << "Failed to set control socket options" << std::endl;
+        close(fd);
+        return -1;
     }
 
     // Set socket to non-blocking mode to handle shutdown better
-    int flags = fcntl(controlSocket_, F_GETFL, 0);
-    if (flags == -1 || fcntl(controlSocket_, F_SETFL, flags | O_NONBLOCK) == -1)
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
     {
         std::cerr << "Failed to set control socket to non-blocking" << std::endl;
-        close(controlSocket_);
-        controlSocket_ = -1;
-        return false;
+        close(fd);
+        return -1;
     }
 
-    memset(&controlAddr_, 0, sizeof(controlAddr_));
-    controlAddr_.sin_family = AF_INET;
-    controlAddr_.sin_addr.s_addr = htonl(INADDR_ANY);
-    controlAddr_.sin_port = htons(config_.getInt("control_port", 862));
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = address;
+    addr.sin6_port = htons(config_.getInt("control_port", 862));
 
-    if (bind(controlSocket_, (struct sockaddr *)&controlAddr_, sizeof(controlAddr_)) < 0)
+    struct sockaddr_storage bound;
+    if (bind(fd, (struct sockaddr *)&bound, toSocketAddress(family, addr, bound)) < 0)
     {
-        std::cerr << "Failed to bind control socket: " << strerror(errno) << std::endl;
-        close(controlSocket_);
-        controlSocket_ = -1;
-        return false;
+        std::cerr << "Failed to bind control socket to " << formatAddress(addr) << ": " << strerror(errno)
+                  << std::endl;
+        close(fd);
+        return -1;
     }
 
-    if (listen(controlSocket_, 10) < 0)
+    if (listen(fd, SOMAXCONN) < 0)
     {
         std::cerr << "Failed to listen on control socket: " << strerror(errno) << std::endl;
-        close(controlSocket_);
-        controlSocket_ = -1;
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool Server::setupTestSockets()
+{
+    uint16_t first = 0, last = 0;
+    std::string range = config_.getString("test_ports", "");
+    if (!range.empty() && !parsePortRange(range, first, last))
+    {
+        std::cerr << "Invalid test_ports: " << range << std::endl;
         return false;
     }
 
+    std::vector<uint16_t> ports = {static_cast<uint16_t>(config_.getInt("test_port", 863))};
+    for (uint32_t port = first; first != 0 && port <= last; ++port)
+    {
+        if (port != ports[0])
+        {
+            ports.push_back(static_cast<uint16_t>(port));
+        }
+    }
+
+    for (size_t listener = 0; listener < listeners_.size(); ++listener)
+    {
+        for (uint16_t port : ports)
+        {
+            int fd = openTestSocket(listeners_[listener].address, port);
+            if (fd < 0)
+            {
+                for (auto &worker : testWorkers_)
+                {
+                    close(worker->socket);
+                }
+                testWorkers_.clear();
+                return false;
+            }
+            std::unique_ptr<TestWorker> worker(new (listeners_[listener].numaNode) TestWorker());
+            worker->listener = listener;
+            worker->primary = port == ports[0];
+            worker->port = port;
+            worker->socket = fd;
+            worker->sessions = 0;
+            worker->tableVersion = 0;
+            worker->stats = nullptr;
+            worker->batches = worker->received = worker->reflected = worker->reflectedBytes = 0;
+            std::fill(std::begin(worker->drops), std::end(worker->drops), 0);
+            worker->untilStageSample = 0;
+            testWorkers_.push_back(std::move(worker));
+        }
+    }
     return true;
 }
 
-bool Server::setupTestSocket()
+int Server::openTestSocket(const struct in6_addr &address, uint16_t port)
 {
-    testSocket_ = socket(AF_INET, SOCK_DGRAM, 0);
-    if (testSocket_ < 0)
+    int inherited = takeInheritedSocket(SOCK_DGRAM, address, port);
+    if (inherited != -1)
     {
-        std::cerr << "Failed to create test socket" << std::endl;
-        return false;
+        return inherited;
+    }
+
+    int fd = openSocket(address, SOCK_DGRAM);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create test socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    int family = socketFamily(fd);
+
+    int v6only = 0;
+    if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0)
+    {
+        std::cerr << "Failed to make test socket dual-stack" << std::endl;
+        close(fd);
+        return -1;
     }
 
     // Set socket to non-blocking mode
-    int flags = fcntl(testSocket_, F_GETFL, 0);
-    if (flags == -1 || fcntl(testSocket_, F_SETFL, flags | O_NONBLOCK) == -1)
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
     {
         std::cerr << "Failed to set test socket to non-blocking" << std::endl;
-        close(testSocket_);
-        testSocket_ = -1;
-        return false;
+        close(fd);
+        return -1;
     }
 
-    memset(&testAddr_, 0, sizeof(testAddr_));
-    testAddr_.sin_family = AF_INET;
-    testAddr_.sin_addr.s_addr = htonl(INADDR_ANY);
-    testAddr_.sin_port = htons(config_.getInt("test_port", 863));
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = address;
+    addr.sin6_port = htons(port);
 
-    if (bind(testSocket_, (struct sockaddr *)&testAddr_, sizeof(testAddr_)) < 0)
+    struct sockaddr_storage bound;
+    if (bind(fd, (struct sockaddr *)&bound, toSocketAddress(family, addr, bound)) < 0)
     {
-        std::cerr << "Failed to bind test socket: " << strerror(errno) << std::endl;
-        close(testSocket_);
-        testSocket_ = -1;
-        return false;
+        std::cerr << "Failed to bind test port " << formatAddress(addr) << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
     }
 
-    return true;
+    return fd;
+}
+
+// Workers hold the reflector's per-packet state (session table, rate
+// buckets, backend bookkeeping), so they live on their listener's node.
+void *Server::TestWorker::operator new(size_t size, int numaNode)
+{
+    void *memory = numa::allocate(size, numaNode);
+    if (!memory)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void Server::TestWorker::operator delete(void *memory, size_t size)
+{
+    numa::release(memory, size);
+}
+
+void Server::TestWorker::operator delete(void *memory, int numaNode)
+{
+    (void)numaNode;
+    numa::release(memory, sizeof(TestWorker));
 }
 
 void Server::controlServerThread()
 {
+    // Handshakes are driven from this one thread: a connection only gets a
+    // session thread once its greeting has arrived, and every phase has a
+    // deadline on controlTimers_, so silent or slow peers cost a descriptor
+    // and a slot, never a thread.
+    controlEpoll_ = epoll_create1(EPOLL_CLOEXEC);
+    if (controlEpoll_ < 0)
+    {
+        std::cerr << "Failed to create control epoll instance: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    pollListeners(true);
+    if (detachWake_ != -1)
+    {
+        // Only ever readable once a handoff has cleared running_.
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = kWakeTag;
+        epoll_ctl(controlEpoll_, EPOLL_CTL_ADD, detachWake_, &ev);
+    }
+    if (keyDerivation_.fd() != -1)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = kAuthTag;
+        epoll_ctl(controlEpoll_, EPOLL_CTL_ADD, keyDerivation_.fd(), &ev);
+    }
+
+    std::vector<struct epoll_event> events(256);
+    std::vector<TimerWheel::Timer> expired;
+
     while (running_)
     {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(controlSocket_, &readfds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(controlSocket_ + 1, &readfds, NULL, NULL, &timeout);
-        
+        int timeout = controlTimers_.pollTimeoutMs(TimerWheel::Clock::now());
+        if (timeout < 0 || timeout > 1000) timeout = 1000;
+        if ((acceptPaused_ || stats_.active()) && timeout > 100) timeout = 100;
+
+        int count = epoll_wait(controlEpoll_, events.data(), static_cast<int>(events.size()), timeout);
+
         if (!running_) break;
-        
-        if (activity < 0)
+
+        if (count < 0)
         {
             if (errno == EINTR) continue;
-            std::cerr << "Select error on control socket: " << strerror(errno) << std::endl;
+            std::cerr << "epoll_wait error on control socket: " << strerror(errno) << std::endl;
             break;
         }
-        
-        if (activity == 0) continue; // Timeout
-        
-        if (FD_ISSET(controlSocket_, &readfds))
-        {
-            struct sockaddr_in clientAddr;
-            socklen_t clientAddrLen = sizeof(clientAddr);
-            int clientSocket = accept(controlSocket_, (struct sockaddr *)&clientAddr, &clientAddrLen);
 
-            if (clientSocket < 0)
+        for (int i = 0; i < count; ++i)
+        {
+            if (events[i].data.u64 == kWakeTag)
             {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
-                if (errno == EINTR) continue;
-                if (running_)
-                {
-                    std::cerr << "Failed to accept control connection: " << strerror(errno) << std::endl;
-                }
                 continue;
             }
-
-            // Set client socket back to blocking mode for session handling
-            int flags = fcntl(clientSocket, F_GETFL, 0);
-            if (flags != -1) {
-                fcntl(clientSocket, F_SETFL, flags & ~O_NONBLOCK);
+            if (events[i].data.u64 == kAuthTag)
+            {
+                finishAuthentications();
+                continue;
             }
-
-            std::cout << "New control connection from " << inet_ntoa(clientAddr.sin_addr) << std::endl;
-            std::thread t(&Server::handleControlConnection, this, clientSocket);
+            if (events[i].data.u64 > kListenTag - listeners_.size())
             {
-                std::lock_guard<std::mutex> lock(controlConnectionThreadsMutex_);
-                controlConnectionThreads_.push_back(std::move(t));
+                acceptControlConnections(static_cast<size_t>(kListenTag - events[i].data.u64));
+            }
+            else
+            {
+                readClientGreeting(static_cast<uint32_t>(events[i].data.u64));
             }
         }
-    }
-}
-
-void Server::testServerThread()
-{
-    const int bufferSize = 1024;
-    char buffer[bufferSize];
 
-    while (running_)
-    {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(testSocket_, &readfds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(testSocket_ + 1, &readfds, NULL, NULL, &timeout);
-        
-        if (!running_) break;
-        
-        if (activity < 0)
+        expired.clear();
+        controlTimers_.advance(TimerWheel::Clock::now(), expired);
+        for (const auto &timer : expired)
         {
-            if (errno == EINTR) continue;
-            std::cerr << "Select error on test socket: " << strerror(errno) << std::endl;
-            break;
+            handleControlTimer(timer);
         }
-        
-        if (activity == 0) continue; // Timeout
-        
-        if (FD_ISSET(testSocket_, &readfds))
-        {
-            struct sockaddr_in clientAddr;
-            socklen_t clientAddrLen = sizeof(clientAddr);
+        reapSessionThreads();
 
-            ssize_t bytesRead = recvfrom(testSocket_, buffer, bufferSize, 0,
-                                         (struct sockaddr *)&clientAddr, &clientAddrLen);
+        if (stats_.active() && TimerWheel::Clock::now() >= nextStatsPublish_)
+        {
+            publishServerStats();
+            nextStatsPublish_ = TimerWheel::Clock::now() + kStatsPublishInterval;
+        }
 
-            if (bytesRead < 0)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
-                if (errno == EINTR) continue;
-                if (running_)
-                {
-                    std::cerr << "Failed to receive test packet: " << strerror(errno) << std::endl;
-                }
-                continue;
-            }
+        // Out of descriptors: accepting was paused for a moment so timeouts
+        // can free some; try again.
+        if (acceptPaused_ && TimerWheel::Clock::now() >= acceptResumeAt_)
+        {
+            pollListeners(true);
+            acceptPaused_ = false;
+        }
+    }
 
-            // Process test packet
-            std::lock_guard<std::mutex> lock(sessionsMutex_);
-            for (auto &session : activeSessions_)
-            {
-                if (session->matchesTestAddress(clientAddr))
-                {
-                    session->processTestPacket(buffer, bytesRead, clientAddr);
-                    break;
-                }
-            }
+    for (uint32_t i = 0; i < controlSlots_.size(); ++i)
+    {
+        if (controlSlots_[i].fd != -1)
+        {
+            close(controlSlots_[i].fd);
+            controlSlots_[i].fd = -1;
         }
     }
+    close(controlEpoll_);
+    controlEpoll_ = -1;
+}
+
+void Server::pollListeners(bool enable)
+{
+    for (size_t i = 0; i < listeners_.size(); ++i)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = kListenTag - i;
+        epoll_ctl(controlEpoll_, enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listeners_[i].controlSocket, &ev);
+    }
 }
 
-void Server::sessionCleanupThread()
+void Server::acceptControlConnections(size_t listener)
 {
     while (running_)
     {
-        for (int i = 0; i < 10 && running_; ++i) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-        }
-        
-        if (!running_) break;
+        struct sockaddr_in6 clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        int clientSocket = accept4(listeners_[listener].controlSocket, (struct sockaddr *)&clientAddr, &clientAddrLen,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-        std::lock_guard<std::mutex> lock(sessionsMutex_);
-        auto it = activeSessions_.begin();
-        while (it != activeSessions_.end())
+        if (clientSocket < 0)
         {
-            if ((*it)->isExpired())
-            {
-                std::cout << "Cleaning up expired session" << std::endl;
-                it = activeSessions_.erase(it);
-            }
-            else
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE)
             {
-                ++it;
+                // The listening sockets stay readable; stop polling them so
+                // the loop doesn't spin until descriptors are freed.
+                std::cerr << "Out of descriptors, pausing accept" << std::endl;
+                pollListeners(false);
+                acceptPaused_ = true;
+                acceptResumeAt_ = TimerWheel::Clock::now() + std::chrono::milliseconds(100);
+                return;
             }
+            std::cerr << "Failed to accept control connection: " << strerror(errno) << std::endl;
+            return;
         }
-    }
-}
 
-void Server::handleControlConnection(int clientSocket)
-{
-    try
-    {
-        // Send server greeting first
-        std::vector<char> serverGreeting(12, 0);
-        serverGreeting[3] = 1; // Mode 1 (unauthenticated)
+        uint32_t slot = allocateControlSlot();
+        ControlSlot &entry = controlSlots_[slot];
+        entry.fd = clientSocket;
+        entry.listener = listener;
+        entry.peer = fromSocketAddress(clientAddr);
+        entry.expected = ClientGreeting::kSize;
+        entry.received = 0;
+        entry.session.reset();
+
+        // Send server greeting first. The socket buffer of a fresh
+        // connection always has room for it.
+        char serverGreeting[ServerGreeting::kSize + ServerChallenge::kSize] = {0};
+        size_t greetingSize = ServerGreeting::kSize;
+        ServerGreeting greeting(serverGreeting);
+        greeting.setModes(offeredModes_);
 
         // Add server identifier (random number)
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<uint32_t> dis;
-        uint32_t serverId = htonl(dis(gen));
-        memcpy(&serverGreeting[4], &serverId, sizeof(serverId));
+        static std::mt19937 gen(std::random_device{}());
+        greeting.setServerId(std::uniform_int_distribution<uint32_t>()(gen));
 
-        if (send(clientSocket, serverGreeting.data(), serverGreeting.size(), 0) !=
-            static_cast<ssize_t>(serverGreeting.size()))
+        if (offeredModes_ & (ModeAuthenticated | ModeEncrypted))
         {
-            throw std::runtime_error("Failed to send server greeting");
-        }
-
-        // Receive client greeting
-        std::vector<char> clientGreeting(12);
-        ssize_t totalReceived = 0;
-        while (totalReceived < 12) {
-            ssize_t n = recv(clientSocket, clientGreeting.data() + totalReceived, 
-                            12 - totalReceived, 0);
-            if (n == 0) throw std::runtime_error("Client disconnected");
-            if (n < 0) {
-                if (errno == EINTR) continue;
-                if (errno == EAGAIN || errno == EWOULDBLOCK) 
-                    throw std::runtime_error("Client greeting timeout");
-                throw std::runtime_error(strerror(errno));
-            }
-            totalReceived += n;
+            ServerChallenge challenge(serverGreeting + ServerGreeting::kSize);
+            randomBytes(entry.challenge, sizeof(entry.challenge));
+            randomBytes(entry.salt, sizeof(entry.salt));
+            memcpy(challenge.challenge(), entry.challenge, 16);
+            memcpy(challenge.salt(), entry.salt, 16);
+            challenge.setCount(keyDerivationCount_);
+            greetingSize += ServerChallenge::kSize;
         }
 
-        // Check client mode
-        if (clientGreeting[3] != 1)
+        if (send(clientSocket, serverGreeting, greetingSize, MSG_NOSIGNAL) != static_cast<ssize_t>(greetingSize))
         {
-            throw std::runtime_error("Unsupported client mode");
+            std::cerr << "Failed to send server greeting" << std::endl;
+            releaseControlSlot(slot);
+            continue;
         }
 
-        std::cout << "Control handshake completed" << std::endl;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = slot;
+        epoll_ctl(controlEpoll_, EPOLL_CTL_ADD, clientSocket, &ev);
+        entry.deadline = TimerWheel::Clock::now() + greetingTimeout_;
+        controlTimers_.schedule(slot, entry.generation, entry.deadline);
 
-        // Create session and add to active sessions
-        auto session = std::make_shared<Session>(clientSocket, testSocket_);
+        std::cout << "New control connection from " << formatIp(clientAddr.sin6_addr) << std::endl;
+    }
+}
+
+void Server::readClientGreeting(uint32_t slot)
+{
+    ControlSlot &entry = controlSlots_[slot];
+    if (entry.fd == -1)
+    {
+        return;
+    }
+
+    ssize_t n = recv(entry.fd, entry.greeting + entry.received, entry.expected - entry.received, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (n <= 0)
+    {
+        std::cerr << "Control connection error: "
+                  << (n == 0 ? "Client disconnected" : strerror(errno)) << std::endl;
+        releaseControlSlot(slot);
+        return;
+    }
+
+    entry.received += n;
+    if (entry.received < entry.expected)
+    {
+        return;
+    }
+
+    // Check client mode: exactly one of the offered ones
+    uint8_t mode = ClientGreeting(entry.greeting).mode();
+    if ((mode & offeredModes_) == 0 || (mode & (mode - 1)) != 0)
+    {
+        std::cerr << "Control connection error: Unsupported client mode" << std::endl;
+        releaseControlSlot(slot);
+        return;
+    }
+
+    // The secured modes carry KeyID, Token and Client-IV after the greeting.
+    if (mode != ModeUnauthenticated && entry.expected == ClientGreeting::kSize)
+    {
+        entry.expected += SetupResponse::kSize;
+        return;
+    }
+
+    if (mode != ModeUnauthenticated)
+    {
+        authenticateClient(slot);
+        return;
+    }
+
+    SessionKeys keys;
+    unsigned char serverIv[16] = {0};
+    memset(&keys, 0, sizeof(keys));
+    std::cout << "Control handshake completed (" << modeName(mode) << ")" << std::endl;
+    startSession(slot, keys, serverIv);
+}
+
+void Server::authenticateClient(uint32_t slot)
+{
+    ControlSlot &entry = controlSlots_[slot];
+    SetupResponse response(entry.greeting + ClientGreeting::kSize);
+    std::string keyId(response.keyId(), strnlen(response.keyId(), kKeyIdSize));
+    const std::string *secret = authKeys_.find(keyId);
+    unsigned char noIv[16] = {0};
+    if (!secret)
+    {
+        handshakeAuthFailures_.fetch_add(1, std::memory_order_relaxed);
+        logAuthFailure(slot);
+        sendServerStart(slot, 1, noIv);
+        releaseControlSlot(slot);
+        return;
+    }
+
+    // The token is checked on the key derivation threads; the connection is
+    // left alone until the result is in, still under its greeting deadline.
+    KeyDerivationPool::Job job;
+    job.slot = slot;
+    job.generation = entry.generation;
+    job.secret = *secret;
+    job.count = keyDerivationCount_;
+    memcpy(job.salt, entry.salt, sizeof(job.salt));
+    memcpy(job.challenge, entry.challenge, sizeof(job.challenge));
+    memcpy(job.token, response.token(), sizeof(job.token));
+    job.deadline = entry.deadline;
+    epoll_ctl(controlEpoll_, EPOLL_CTL_DEL, entry.fd, NULL);
+    if (!keyDerivation_.submit(job))
+    {
+        // Accept code 5: temporary resource limitation (RFC 4656).
+        std::cerr << "Too many handshakes awaiting authentication, refusing " << formatIp(entry.peer.sin6_addr)
+                  << std::endl;
+        sendServerStart(slot, 5, noIv);
+        releaseControlSlot(slot);
+    }
+}
+
+void Server::finishAuthentications()
+{
+    authResults_.clear();
+    keyDerivation_.collect(authResults_);
+    for (auto &result : authResults_)
+    {
+        ControlSlot &entry = controlSlots_[result.slot];
+        // Timed out, and the slot perhaps reused, while the check ran.
+        if (entry.generation != result.generation || entry.fd == -1)
+        {
+            OPENSSL_cleanse(&result.keys, sizeof(result.keys));
+            continue;
+        }
+
+        unsigned char serverIv[16] = {0};
+        bool ok = result.ok && randomBytes(serverIv, sizeof(serverIv));
+        if (!ok)
+        {
+            handshakeAuthFailures_.fetch_add(1, std::memory_order_relaxed);
+            logAuthFailure(result.slot);
+        }
+        if (!sendServerStart(result.slot, ok ? 0 : 1, serverIv) || !ok)
+        {
+            releaseControlSlot(result.slot);
+        }
+        else
+        {
+            uint8_t mode = ClientGreeting(entry.greeting).mode();
+            std::cout << "Control handshake completed (" << modeName(mode) << ")" << std::endl;
+            startSession(result.slot, result.keys, serverIv);
+        }
+        OPENSSL_cleanse(&result.keys, sizeof(result.keys));
+    }
+    authResults_.clear();
+}
+
+bool Server::sendServerStart(uint32_t slot, uint8_t accept, const unsigned char serverIv[16])
+{
+    char serverStart[ServerStart::kSize] = {0};
+    ServerStart start(serverStart);
+    start.setAccept(accept);
+    if (accept == 0)
+    {
+        memcpy(start.serverIv(), serverIv, 16);
+    }
+    return send(controlSlots_[slot].fd, serverStart, sizeof(serverStart), MSG_NOSIGNAL) ==
+           static_cast<ssize_t>(sizeof(serverStart));
+}
+
+void Server::logAuthFailure(uint32_t slot)
+{
+    // KeyIDs are not secret, so anyone can fail as often as they like; keep
+    // the log readable.
+    auto now = TimerWheel::Clock::now();
+    if (now < authLogResumeAt_)
+    {
+        authFailuresUnlogged_++;
+        return;
+    }
+    ControlSlot &entry = controlSlots_[slot];
+    SetupResponse response(entry.greeting + ClientGreeting::kSize);
+    std::string keyId(response.keyId(), strnlen(response.keyId(), kKeyIdSize));
+    std::cerr << "Control connection error: Authentication failed for key '" << keyId << "' from "
+              << formatIp(entry.peer.sin6_addr);
+    if (authFailuresUnlogged_ > 0)
+    {
+        std::cerr << " (" << authFailuresUnlogged_ << " more failures not logged)";
+    }
+    std::cerr << std::endl;
+    authFailuresUnlogged_ = 0;
+    authLogResumeAt_ = now + std::chrono::seconds(1);
+}
+
+void Server::startSession(uint32_t slot, const SessionKeys &keys, const unsigned char serverIv[16])
+{
+    ControlSlot &entry = controlSlots_[slot];
+    int clientSocket = entry.fd;
+
+    // The session thread uses blocking I/O from here on.
+    epoll_ctl(controlEpoll_, EPOLL_CTL_DEL, clientSocket, NULL);
+    int flags = fcntl(clientSocket, F_GETFL, 0);
+    if (flags != -1)
+    {
+        fcntl(clientSocket, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    // Create session and add to active sessions
+    auto session = std::make_shared<Session>(clientSocket, testWorkers_[0]->socket, nextSessionId_++, entry.peer,
+                                             config_.getBool("log_test_packets", false));
+    configureSession(*session);
+    uint8_t mode = ClientGreeting(entry.greeting).mode();
+    if (mode != ModeUnauthenticated &&
+        !session->setSecurity(mode, keys, SetupResponse(entry.greeting + ClientGreeting::kSize).clientIv(), serverIv))
+    {
+        // The session owns the socket now and closes it.
+        std::cerr << "Failed to set up session keys" << std::endl;
+        entry.fd = -1;
+        releaseControlSlot(slot);
+        return;
+    }
+
+    // With session test ports, each session is offered the least loaded one
+    // of the address it connected to; clients that cannot follow it stay on
+    // test_port all the same. A port's load only counts sessions whose
+    // packets have arrived there, so ties are broken by session id to keep a
+    // burst of new sessions from all being offered the same port.
+    session->setListener(entry.listener);
+    TestWorker *target = nullptr;
+    for (size_t i = 0; i < testWorkers_.size(); i++)
+    {
+        const auto &worker = testWorkers_[(session->getId() + i) % testWorkers_.size()];
+        if (worker->listener == entry.listener && !worker->primary &&
+            (!target || worker->sessions < target->sessions))
+        {
+            target = worker.get();
+        }
+    }
+    if (target)
+    {
+        session->setOfferedTestPort(target->port);
+    }
+
+    launchSession(session);
+
+    // The slot now only watches the session's deadlines.
+    watchSession(slot, session);
+}
+
+void Server::configureSession(Session &session)
+{
+    session.setTestRateLimit(config_.getInt("session_rate_limit", 10000), config_.getInt("session_burst", 1000));
+    session.setTimeouts(configSeconds(config_, "request_timeout", 30), configSeconds(config_, "start_timeout", 30),
+                        std::chrono::minutes(std::max(config_.getInt("session_timeout", 5), 1)));
+    session.setReflectDscp(reflectDscp_);
+    session.setTestStateListener([this]() { sessionsChanged(); });
+    session.setDetachWake(detachWake_);
+}
+
+void Server::launchSession(const std::shared_ptr<Session> &session)
+{
+    if (stats_.active())
+    {
+        std::shared_ptr<stats::SessionSlot> statsSlot = stats_.acquireSession();
+        if (statsSlot)
+        {
+            session->setStatsSlot(std::move(statsSlot));
+        }
+        else
+        {
+            unlistedSessions_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        activeSessions_.push_back(session);
+    }
+
+    // Run session (this will block until session ends)
+    {
+        std::lock_guard<std::mutex> lock(sessionThreadsMutex_);
+        TWAMP_PROBE1(session_create, session->getId());
+        sessionThreads_.emplace(session->getId(), std::thread([this, session]() {
+            try {
+                session->run();
+            } catch (const std::exception &e) {
+                std::cerr << "Session run error: " << e.what() << std::endl;
+            }
+            removeSession(session);
+            TWAMP_PROBE1(session_destroy, session->getId());
+            std::lock_guard<std::mutex> lock(sessionThreadsMutex_);
+            finishedSessionThreads_.push_back(session->getId());
+        }));
+    }
+}
+
+uint32_t Server::allocateControlSlot()
+{
+    if (!freeControlSlots_.empty())
+    {
+        uint32_t slot = freeControlSlots_.back();
+        freeControlSlots_.pop_back();
+        return slot;
+    }
+    controlSlots_.push_back(ControlSlot());
+    controlSlots_.back().generation = 0;
+    return static_cast<uint32_t>(controlSlots_.size() - 1);
+}
+
+void Server::watchSession(uint32_t slot, const std::shared_ptr<Session> &session)
+{
+    ControlSlot &entry = controlSlots_[slot];
+    entry.fd = -1;
+    entry.session = session;
+    entry.generation++;
+    controlTimers_.schedule(slot, entry.generation, session->getDeadline());
+}
+
+void Server::handleControlTimer(const TimerWheel::Timer &timer)
+{
+    ControlSlot &entry = controlSlots_[timer.id];
+    if (entry.generation != timer.generation)
+    {
+        return;
+    }
+
+    if (entry.fd != -1)
+    {
+        std::cerr << "Greeting timeout from " << formatIp(entry.peer.sin6_addr) << ", closing" << std::endl;
+        timeouts_[TimeoutGreeting].fetch_add(1, std::memory_order_relaxed);
+        releaseControlSlot(timer.id);
+        return;
+    }
+
+    auto session = entry.session.lock();
+    if (!session || session->getPhase() == Session::Phase::Closed)
+    {
+        releaseControlSlot(timer.id);
+        return;
+    }
+
+    // Deadlines move with activity, so they are only checked when the last
+    // known one passes; a busy session costs one wakeup per timeout period.
+    if (!session->isExpired())
+    {
+        controlTimers_.schedule(timer.id, entry.generation, session->getDeadline());
+        return;
+    }
+
+    TimeoutPhase phase = TimeoutIdle;
+    const char *what = "test traffic";
+    switch (session->getPhase())
+    {
+    case Session::Phase::AwaitRequest:
+        phase = TimeoutRequest;
+        what = "Request-Session";
+        break;
+    case Session::Phase::AwaitStart:
+        phase = TimeoutStart;
+        what = "Start-Sessions";
+        break;
+    default:
+        break;
+    }
+    std::cerr << "Session " << session->getId() << " timed out waiting for " << what << ", closing" << std::endl;
+    timeouts_[phase].fetch_add(1, std::memory_order_relaxed);
+    session->requestStop();
+    releaseControlSlot(timer.id);
+}
+
+void Server::releaseControlSlot(uint32_t slot)
+{
+    ControlSlot &entry = controlSlots_[slot];
+    if (entry.fd != -1)
+    {
+        // Closing removes the descriptor from the epoll set.
+        close(entry.fd);
+        entry.fd = -1;
+    }
+    entry.session.reset();
+    entry.generation++;
+    freeControlSlots_.push_back(slot);
+}
+
+void Server::reapSessionThreads()
+{
+    std::vector<std::thread> finished;
+    {
+        std::lock_guard<std::mutex> lock(sessionThreadsMutex_);
+        for (uint64_t id : finishedSessionThreads_)
+        {
+            auto it = sessionThreads_.find(id);
+            if (it != sessionThreads_.end())
+            {
+                finished.push_back(std::move(it->second));
+                sessionThreads_.erase(it);
+            }
+        }
+        finishedSessionThreads_.clear();
+    }
+
+    // They have already left the session; joining only waits for the
+    // thread itself to wind down.
+    for (auto &thread : finished)
+    {
+        thread.join();
+    }
+}
+
+void Server::testServerThread(TestWorker &worker, size_t index)
+{
+    bool withXdp = index == 0 && xdp_.active();
+
+    // Keep the worker next to its NIC; a busy-poll CPU, if configured,
+    // overrides this below.
+    const Listener &listener = listeners_[worker.listener];
+    if (listener.hasCpus)
+    {
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(listener.cpus), &listener.cpus);
+        if (err != 0)
+        {
+            std::cerr << "Failed to pin reflector to NUMA node " << listener.numaNode << ": " << strerror(err)
+                      << std::endl;
+        }
+    }
+
+    // In busy-poll mode the thread never sleeps: it keeps asking every
+    // backend for packets, so a packet is picked up as soon as it lands
+    // instead of after a wakeup.
+    if (busyPoll_)
+    {
+        setupBusyPoll(worker, index);
+        while (running_)
+        {
+            if (worker.uring.active())
+            {
+                reflectBatches(worker, worker.uring);
+            }
+            else
+            {
+                reflectBatches(worker, worker.mmsg);
+            }
+            if (withXdp)
+            {
+                reflectBatches(worker, xdp_);
+            }
+        }
+        drainForHandoff(worker);
+        return;
+    }
+
+    // The test socket is served by whichever backend was configured; an
+    // AF_XDP socket, if any, is polled alongside test_port's.
+    // A handoff wakes it through detachWake_ so that it stops at once.
+    struct pollfd fds[3];
+    fds[0].fd = worker.uring.active() ? worker.uring.fd() : worker.socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = withXdp ? xdp_.fd() : -1;
+    fds[1].events = POLLIN;
+    fds[2].fd = detachWake_;
+    fds[2].events = POLLIN;
+
+    while (running_)
+    {
+        int activity = poll(fds, 3, 1000);
+
+        if (!running_) break;
+
+        if (activity < 0)
+        {
+            if (errno == EINTR) continue;
+            std::cerr << "Poll error on test socket: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        if (activity == 0) continue; // Timeout
+
+        if (fds[0].revents & POLLIN)
+        {
+            if (worker.uring.active())
+            {
+                reflectBatches(worker, worker.uring);
+            }
+            else
+            {
+                reflectBatches(worker, worker.mmsg);
+            }
+        }
+        if (withXdp && (fds[1].revents & POLLIN))
+        {
+            reflectBatches(worker, xdp_);
+        }
+    }
+    drainForHandoff(worker);
+}
+
+void Server::drainForHandoff(TestWorker &worker)
+{
+    // Packets still in the socket wait there for the new process, but the
+    // ones io_uring has already taken off it would go with the ring; they
+    // are reflected here first.
+    if (!handoffRequested_ || !worker.uring.active())
+    {
+        return;
+    }
+    worker.uring.stopReceiving();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    while (worker.uring.receiving() && std::chrono::steady_clock::now() < deadline)
+    {
+        reflectBatches(worker, worker.uring);
+    }
+    reflectBatches(worker, worker.uring);
+}
+
+template <typename Backend>
+void Server::reflectBatches(TestWorker &worker, Backend &backend)
+{
+    // Every backend hands over a batch of packets in its own buffers; each
+    // one is checked and stamped in place, then sent back or dropped, and the
+    // whole batch is flushed at once.
+    typename Backend::Packet packets[Backend::kBatchSize];
+    int64_t latencies[Backend::kBatchSize];
+
+    // At least one batch is taken even once running_ drops, so that a
+    // handoff can drain what a backend already holds.
+    do
+    {
+        size_t received = backend.receive(packets, Backend::kBatchSize);
+        TWAMP_PROBE2(receive, worker.port, received);
+
+        // At most one packet per batch has its stages timed.
+        size_t sampled = Backend::kBatchSize;
+        if (stageSampleInterval_ != 0 && received > 0)
+        {
+            if (worker.untilStageSample < received)
+            {
+                sampled = worker.untilStageSample;
+                worker.untilStageSample = stageSampleInterval_ - 1;
+            }
+            else
+            {
+                worker.untilStageSample -= static_cast<uint32_t>(received);
+            }
+        }
+        int64_t stages[StageCount + 1] = {0};
+
+        size_t measured = 0;
+        size_t reflected = 0;
+        for (size_t i = 0; i < received; ++i)
+        {
+            // Read just before the packet is stamped; packets without a
+            // kernel receive timestamp are not measured.
+            int64_t stampNs = (packets[i].receivedNs || i == sampled) ? TscClock::instance().nowNs() : 0;
+            int64_t lookupDoneNs = 0;
+            if (reflectTestPacket(worker, packets[i].payload, packets[i].size, packets[i].from, packets[i].traffic,
+                                  packets[i].receivedNs, i == sampled ? &lookupDoneNs : nullptr))
+            {
+                worker.reflected++;
+                worker.reflectedBytes += packets[i].size;
+                backend.reflect(packets[i]);
+                reflected++;
+                if (packets[i].receivedNs)
+                {
+                    latencies[measured++] = stampNs - packets[i].receivedNs;
+                }
+                if (i == sampled)
+                {
+                    // Stage boundaries; the send ends once the batch is
+                    // flushed. Without a kernel timestamp the wait is unknown.
+                    stages[StageWait] = packets[i].receivedNs;
+                    stages[StageLookup] = stampNs;
+                    stages[StageStamp] = lookupDoneNs;
+                    stages[StageSend] = TscClock::instance().nowNs();
+                }
+            }
+            else
+            {
+                backend.recycle(packets[i]);
+            }
+        }
+        backend.flush();
+        TWAMP_PROBE2(transmit, worker.port, reflected);
+        if (stages[StageSend] != 0)
+        {
+            stages[StageCount] = TscClock::instance().nowNs();
+            std::lock_guard<std::mutex> lock(stageLatencyMutex_);
+            for (int stage = 0; stage < StageCount; ++stage)
+            {
+                int64_t duration = stages[stage + 1] - stages[stage];
+                if (stages[stage] != 0)
+                {
+                    stageLatency_[stage].record(duration > 0 ? duration : 0);
+                }
+            }
+        }
+        worker.received += received;
+        worker.batches++;
+        publishWorkerStats(worker);
+
+        for (size_t i = 0; i < measured; ++i)
+        {
+            worker.stampLatency.record(latencies[i] > 0 ? latencies[i] : 0);
+        }
+
+        if (received < Backend::kBatchSize) break;
+    } while (running_);
+}
+
+void Server::countDrop(TestWorker &worker, DropReason reason)
+{
+    drops_[reason].fetch_add(1, std::memory_order_relaxed);
+    worker.drops[reason]++;
+}
+
+void Server::publishWorkerStats(TestWorker &worker)
+{
+    if (!worker.stats)
+    {
+        return;
+    }
+    stats::WorkerBlock &block = *worker.stats;
+    uint32_t sequence = stats::writeBegin(block.sequence);
+    stats::storeAddress(block.address, listeners_[worker.listener].address);
+    stats::store(block.port, worker.port);
+    stats::store(block.publishedAtNs, TscClock::instance().nowNs());
+    stats::store(block.batches, worker.batches);
+    stats::store(block.received, worker.received);
+    stats::store(block.reflected, worker.reflected);
+    stats::store(block.reflectedBytes, worker.reflectedBytes);
+    for (int i = 0; i < DropReasonCount; ++i)
+    {
+        stats::store(block.drops[i], worker.drops[i]);
+    }
+    stats::writeEnd(block.sequence, sequence);
+}
+
+void Server::publishServerStats()
+{
+    static_assert(DropReasonCount == stats::kDropReasonsUsed && TimeoutPhaseCount == stats::kTimeoutPhasesUsed,
+                  "the statistics segment must name every drop reason and timeout phase");
+    stats::ServerBlock *block = stats_.server();
+    if (!block)
+    {
+        return;
+    }
+    size_t sessions;
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        sessions = activeSessions_.size();
+    }
+    LatencyHistogram stampLatency;
+    mergeStampLatency(stampLatency);
+    uint64_t p50 = stampLatency.percentile(50);
+    uint64_t p99 = stampLatency.percentile(99);
+    uint64_t max = stampLatency.percentile(100);
+
+    uint32_t sequence = stats::writeBegin(block->sequence);
+    stats::store(block->publishedAtNs, TscClock::instance().nowNs());
+    stats::store(block->sessions, sessions);
+    stats::store(block->unlistedSessions, unlistedSessions_.load(std::memory_order_relaxed));
+    for (int i = 0; i < DropReasonCount; ++i)
+    {
+        stats::store(block->drops[i], drops_[i].load(std::memory_order_relaxed));
+    }
+    for (int i = 0; i < TimeoutPhaseCount; ++i)
+    {
+        stats::store(block->timeouts[i], timeouts_[i].load(std::memory_order_relaxed));
+    }
+    stats::store(block->handshakeAuthFailures, handshakeAuthFailures_.load(std::memory_order_relaxed));
+    stats::store(block->kernelSessions, kernelSessions_.load(std::memory_order_relaxed));
+    stats::store(block->kernelDemotions, kernelDemotions_.load(std::memory_order_relaxed));
+    stats::store(block->stampLatencyP50Ns, p50);
+    stats::store(block->stampLatencyP99Ns, p99);
+    stats::store(block->stampLatencyMaxNs, max);
+    stats::writeEnd(block->sequence, sequence);
+}
+
+void Server::mergeStampLatency(LatencyHistogram &out) const
+{
+    for (const auto &worker : testWorkers_)
+    {
+        worker->stampLatency.addTo(out);
+    }
+}
+
+void Server::setupBusyPoll(TestWorker &worker, size_t index)
+{
+    // Everything here is best effort: each step that fails (usually for lack
+    // of privileges) is reported and the reflector spins regardless. Workers
+    // take consecutive CPUs from busy_poll_cpu on.
+    int cpu = config_.getInt("busy_poll_cpu", -1);
+    if (cpu >= 0)
+    {
+        cpu += static_cast<int>(index);
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0)
+        {
+            std::cerr << "Failed to pin the reflector to CPU " << cpu << ": " << strerror(err) << std::endl;
+        }
+    }
+
+    // A real-time thread that never sleeps starves everything else on its
+    // CPU, so SCHED_FIFO is only used on a core of its own.
+    int priority = config_.getInt("busy_poll_priority", 0);
+    if (priority > 0 && cpu < 0)
+    {
+        std::cerr << "busy_poll_priority needs busy_poll_cpu; keeping normal scheduling" << std::endl;
+    }
+    else if (priority > 0)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0)
+        {
+            std::cerr << "Failed to set SCHED_FIFO priority " << priority << ": " << strerror(err) << std::endl;
+        }
+    }
+
+    // Lets a non-blocking receive poll the NIC queue directly instead of
+    // waiting for its interrupt; PREFER_BUSY_POLL keeps the interrupt from
+    // competing while the reflector is polling.
+    int usecs = config_.getInt("busy_poll_usecs", 50);
+    if (setsockopt(worker.socket, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+    {
+        std::cerr << "Failed to set SO_BUSY_POLL: " << strerror(errno) << std::endl;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int on = 1;
+    if (setsockopt(worker.socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0)
+    {
+        std::cerr << "Failed to set SO_PREFER_BUSY_POLL: " << strerror(errno) << std::endl;
+    }
+#endif
+
+    // Locking everything mapped so far also faults it in: the packet
+    // buffers, the rings and this thread's stack will not page-fault on the
+    // packet path. Memory mapped later, such as new session threads, is left
+    // alone.
+    if (mlockall(MCL_CURRENT) < 0)
+    {
+        std::cerr << "Failed to lock memory: " << strerror(errno) << std::endl;
+    }
+
+    std::cout << "Reflector for test port " << worker.port << " busy-polling"
+              << (cpu >= 0 ? " on CPU " + std::to_string(cpu) : "") << std::endl;
+}
+
+void Server::refreshTestTable(TestWorker &worker)
+{
+    uint64_t version = sessionsVersion_.load();
+    if (version == worker.tableVersion)
+    {
+        return;
+    }
+
+    // A worker only knows the sessions whose packets come to its address
+    // and port, so a packet sent to another session's port is dropped like a
+    // stranger's.
+    uint16_t port = worker.primary ? 0 : worker.port;
+    worker.table.clear();
+    worker.prefixRateLimits.clear();
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        for (const auto &session : activeSessions_)
+        {
+            uint64_t key = session->getTestClientKey();
+            if (key != 0 && session->getListener() == worker.listener && session->getTestPort() == port)
+            {
+                worker.table[key].push_back(session);
+            }
+        }
+
+        // Buckets are shared with the other workers. One only held here has
+        // no sessions left on any worker that has refreshed since, so it is
+        // forgotten and the map stays bounded by the number of sessions.
+        for (auto it = prefixRateLimits_.begin(); it != prefixRateLimits_.end();)
+        {
+            it = it->second.use_count() == 1 ? prefixRateLimits_.erase(it) : std::next(it);
+        }
+        for (const auto &entry : worker.table)
+        {
+            uint64_t prefix = prefixKey(entry.second.front()->getTestClientAddr().sin6_addr);
+            auto &bucket = prefixRateLimits_[prefix];
+            if (!bucket)
+            {
+                bucket = std::make_shared<SharedTokenBucket>(config_.getInt("prefix_rate_limit", 50000),
+                                                             config_.getInt("prefix_burst", 5000));
+            }
+            worker.prefixRateLimits.emplace(prefix, bucket);
+        }
+    }
+    worker.tableVersion = version;
+}
+
+// IPv4 sources are grouped by prefix_length, IPv6 ones by prefix_length_v6.
+uint64_t Server::prefixKey(const struct in6_addr &address) const
+{
+    if (isMappedIpv4(address))
+    {
+        return addressKey(maskAddress(address, 96 + prefixLength_));
+    }
+    return addressKey(maskAddress(address, prefixLengthV6_));
+}
+
+bool Server::reflectTestPacket(TestWorker &worker, char *packet, size_t size, const struct sockaddr_in6 &fromAddr,
+                               const TrafficClass &traffic, int64_t receivedNs, int64_t *lookupDoneNs)
+{
+    // Cheapest checks first: everything before processTestPacket() is a hash
+    // lookup or a token bucket, so a flood costs little more than the
+    // recvmmsg() that delivered it. Authentication comes last.
+    if (size < 16)
+    {
+        countDrop(worker, DropMalformed);
+        return false;
+    }
+
+    refreshTestTable(worker);
+
+    auto entry = worker.table.find(addressKey(fromAddr.sin6_addr));
+    if (entry == worker.table.end())
+    {
+        TWAMP_PROBE2(lookup, worker.port, 0);
+        countDrop(worker, DropUnknownSource);
+        return false;
+    }
+
+    int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    auto prefix = worker.prefixRateLimits.find(prefixKey(fromAddr.sin6_addr));
+    if (prefix != worker.prefixRateLimits.end() && !prefix->second->allow(nowNs))
+    {
+        countDrop(worker, DropPrefixRate);
+        return false;
+    }
+
+    for (const auto &session : entry->second)
+    {
+        if (session->matchesTestAddress(fromAddr))
+        {
+            TWAMP_PROBE2(lookup, worker.port, session->getId());
+            if (lookupDoneNs)
+            {
+                *lookupDoneNs = TscClock::instance().nowNs();
+            }
+            if (!session->admitTestPacket(nowNs))
+            {
+                countDrop(worker, DropSessionRate);
+                return false;
+            }
+            if (!session->processTestPacket(packet, size, fromAddr, traffic, receivedNs))
+            {
+                countDrop(worker, DropAuthFailed);
+                return false;
+            }
+            if (!worker.primary && session->offeredPortUnclaimed())
+            {
+                // Counted first so that a racing removeSession() never takes
+                // the count below zero; undone if the session is gone.
+                worker.sessions++;
+                if (!session->claimOfferedPort())
+                {
+                    worker.sessions--;
+                }
+            }
+            TWAMP_PROBE3(stamp, worker.port, session->getId(), size);
+            return true;
+        }
+    }
+
+    TWAMP_PROBE2(lookup, worker.port, 0);
+    countDrop(worker, DropInactiveSession);
+    return false;
+}
+
+void Server::removeSession(const std::shared_ptr<Session> &session)
+{
+    std::lock_guard<std::mutex> lock(sessionsMutex_);
+    auto it = std::find(activeSessions_.begin(), activeSessions_.end(), session);
+    if (it != activeSessions_.end())
+    {
+        activeSessions_.erase(it);
+        if (session->releaseOfferedPort())
+        {
+            for (const auto &worker : testWorkers_)
+            {
+                if (worker->listener == session->getListener() && !worker->primary &&
+                    worker->port == session->getOfferedTestPort())
+                {
+                    worker->sessions--;
+                }
+            }
+        }
+        sessionsChanged();
+    }
+}
+
+void Server::sessionsChanged()
+{
+    sessionsVersion_++;
+    kernelSyncWake_.notify_one();
+}
+
+void Server::kernelReflectorSyncThread()
+{
+    // Mirrors the active unauthenticated sessions on test_port into the
+    // in-kernel reflector's map; the secured modes need the user-space
+    // reflector, and the program only watches test_port.
+    // Packets that arrive before a session's entry is in place are passed up
+    // to the test socket, so the lag only decides which path reflects them.
+    //
+    // The kernel path has no token buckets. A session that sends more than
+    // its rate limit allows between two passes is handed back to user space
+    // for the rest of its life, where the normal policing applies.
+    struct Entry
+    {
+        XdpReflector::Endpoint endpoint;
+        uint64_t packets;
+    };
+    std::unordered_map<uint64_t, Entry> entries;
+    std::unordered_set<uint64_t> demoted;
+    double rate = config_.getInt("session_rate_limit", 10000);
+    double burst = config_.getInt("session_burst", 1000);
+    const auto kInterval = std::chrono::milliseconds(100);
+    uint64_t version = 0;
+    auto lastPass = std::chrono::steady_clock::now();
+    auto lastClockUpdate = lastPass;
+
+    while (running_)
+    {
+        {
+            std::unique_lock<std::mutex> lock(kernelSyncMutex_);
+            kernelSyncWake_.wait_for(lock, kInterval,
+                                     [&]() { return !running_ || sessionsVersion_.load() != version; });
+        }
+        if (!running_) break;
+        version = sessionsVersion_.load();
+
+        auto now = std::chrono::steady_clock::now();
+        int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        double budget = rate * std::chrono::duration<double>(now - lastPass).count() + burst;
+        lastPass = now;
+        if (now - lastClockUpdate >= std::chrono::seconds(1))
+        {
+            kernelReflector_.updateClock();
+            lastClockUpdate = now;
+        }
+
+        std::vector<std::shared_ptr<Session>> sessions;
+        {
+            std::lock_guard<std::mutex> lock(sessionsMutex_);
+            sessions = activeSessions_;
+        }
+
+        std::unordered_map<uint64_t, Entry> current;
+        std::unordered_set<uint64_t> stillDemoted;
+        for (const auto &session : sessions)
+        {
+            uint64_t id = session->getId();
+            if (demoted.count(id))
+            {
+                stillDemoted.insert(id);
+            }
+            struct sockaddr_in6 addr = session->getTestClientAddr();
+            XdpReflector::Endpoint endpoint = {mappedIpv4(addr.sin6_addr), addr.sin6_port, 0};
+            bool wanted = session->isTestActive() && session->getMode() == ModeUnauthenticated &&
+                          isMappedIpv4(addr.sin6_addr) && session->getTestPort() == 0 && !demoted.count(id);
+
+            auto it = entries.find(id);
+            if (it != entries.end())
+            {
+                uint64_t packets = it->second.packets;
+                kernelReflector_.packets(it->second.endpoint, packets);
+                uint64_t delta = packets - it->second.packets;
+                session->addKernelPackets(delta, nowNs);
+                bool sameEndpoint = memcmp(&it->second.endpoint, &endpoint, sizeof(endpoint)) == 0;
+                if (rate > 0 && delta > budget)
+                {
+                    std::cout << "Session " << id << " exceeds its rate limit, reflecting it in user space"
+                              << std::endl;
+                    stillDemoted.insert(id);
+                    kernelDemotions_++;
+                    wanted = false;
+                }
+                if (wanted && sameEndpoint)
+                {
+                    current[id] = {endpoint, packets};
+                    entries.erase(it);
+                    continue;
+                }
+                kernelReflector_.remove(it->second.endpoint);
+                entries.erase(it);
+            }
+            if (wanted && kernelReflector_.add(endpoint))
+            {
+                current[id] = {endpoint, 0};
+            }
+        }
+
+        // Whatever is left belongs to sessions that have gone away.
+        for (const auto &entry : entries)
+        {
+            kernelReflector_.remove(entry.second.endpoint);
+        }
+        entries.swap(current);
+        demoted.swap(stillDemoted);
+        kernelSessions_ = entries.size();
+    }
+}
+
+bool Server::setupAdminSocket()
+{
+    adminSocketPath_ = config_.getString("admin_socket", "/run/twamp-server/admin.sock");
+    if (adminSocketPath_.empty())
+    {
+        return false;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (adminSocketPath_.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Admin socket path too long: " << adminSocketPath_ << std::endl;
+        return false;
+    }
+    strncpy(addr.sun_path, adminSocketPath_.c_str(), sizeof(addr.sun_path) - 1);
+
+    adminSocket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (adminSocket_ < 0)
+    {
+        std::cerr << "Failed to create admin socket" << std::endl;
+        return false;
+    }
+
+    unlink(adminSocketPath_.c_str());
+    if (bind(adminSocket_, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(adminSocket_, 4) < 0)
+    {
+        std::cerr << "Failed to bind admin socket " << adminSocketPath_ << ": " << strerror(errno) << std::endl;
+        close(adminSocket_);
+        adminSocket_ = -1;
+        return false;
+    }
+
+    // Session control is for local operators only.
+    chmod(adminSocketPath_.c_str(), 0600);
+    return true;
+}
+
+bool Server::setupHandoffSocket()
+{
+    handoffSocketPath_ = config_.getString("handoff_socket", "/run/twamp-server/handoff.sock");
+    if (handoffSocketPath_.empty())
+    {
+        return false;
+    }
+    handoffSocket_ = handoff::listen(handoffSocketPath_);
+    if (handoffSocket_ == -1)
+    {
+        return false;
+    }
+    detachWake_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (detachWake_ == -1)
+    {
+        std::cerr << "Failed to create handoff wakeup: " << strerror(errno) << std::endl;
+        close(handoffSocket_);
+        handoffSocket_ = -1;
+        unlink(handoffSocketPath_.c_str());
+        return false;
+    }
+    return true;
+}
+
+void Server::acceptHandoff()
+{
+    int connection = accept4(handoffSocket_, NULL, NULL, SOCK_CLOEXEC);
+    if (connection < 0)
+    {
+        return;
+    }
+
+    // A peer that says nothing must not hold up the admin thread.
+    struct timeval tv;
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    handoff::Header hello;
+    std::vector<char> payload;
+    int fd;
+    if (!handoff::receive(connection, hello, payload, fd) || hello.kind != handoff::Hello)
+    {
+        if (fd >= 0) close(fd);
+        close(connection);
+        return;
+    }
+
+    // The new binary must agree on the layout of everything that follows;
+    // otherwise this server carries on and the new one gives up.
+    if (hello.version != handoff::kVersion || hello.value != sizeof(Session::HandoffState))
+    {
+        std::string reason = "handoff protocol version " + std::to_string(hello.version) + " is not supported";
+        std::cerr << "Refused takeover: " << reason << std::endl;
+        handoff::Header refuse = handoff::header(handoff::Refuse);
+        refuse.payloadSize = static_cast<uint32_t>(reason.size());
+        handoff::send(connection, refuse, reason.data(), -1);
+        close(connection);
+        return;
+    }
+
+    std::cout << "New server process connected, handing over" << std::endl;
+    handoffConnection_ = connection;
+    handoffRequested_ = true;
+}
+
+bool Server::handOff()
+{
+    int connection = handoffConnection_;
+    handoffConnection_ = -1;
 
+    // Accepting and reflecting stop here. Connections and test packets that
+    // arrive from now on wait in the sockets' queues for the new process,
+    // so none of them is lost. The sockets themselves stay open.
+    // Every thread that waits for something also waits on detachWake_,
+    // sessions included; those are asked to detach first so that none of
+    // them takes the wakeup for anything else. A detached session leaves
+    // activeSessions_, so they are collected here as they are asked.
+    running_ = false;
+    std::vector<std::shared_ptr<Session>> sessions;
+    auto detachAll = [this, &sessions]() {
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        for (auto &session : activeSessions_)
         {
-            std::lock_guard<std::mutex> lock(sessionsMutex_);
-            activeSessions_.push_back(session);
+            if (std::find(sessions.begin(), sessions.end(), session) == sessions.end())
+            {
+                session->requestDetach();
+                sessions.push_back(session);
+            }
         }
+    };
+    detachAll();
+    uint64_t wake = 1;
+    if (write(detachWake_, &wake, sizeof(wake)) != sizeof(wake))
+    {
+        std::cerr << "Failed to wake threads for handoff: " << strerror(errno) << std::endl;
+    }
+    if (controlThread_.joinable()) controlThread_.join();
+    detachAll();
+    for (auto &worker : testWorkers_)
+    {
+        if (worker->thread.joinable()) worker->thread.join();
+        worker->uring.close();
+    }
+    xdp_.close();
+    kernelSyncWake_.notify_all();
+    if (kernelSyncThread_.joinable()) kernelSyncThread_.join();
+    kernelReflector_.close();
+    if (adminThread_.joinable()) adminThread_.join();
 
-        // Run session (this will block until session ends)
+    // Sessions park between two control messages. One still in the middle
+    // of a message when time runs out cannot move and is closed.
+    auto deadline = std::chrono::steady_clock::now() + kDetachTimeout;
+    while (std::chrono::steady_clock::now() < deadline)
+    {
         {
             std::lock_guard<std::mutex> lock(sessionThreadsMutex_);
-            sessionThreads_.emplace_back([session]() {
-                try {
-                    session->run();
-                } catch (const std::exception &e) {
-                    std::cerr << "Session run error: " << e.what() << std::endl;
-                }
-            });
+            if (finishedSessionThreads_.size() >= sessionThreads_.size()) break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (auto &session : sessions)
+    {
+        if (!session->isDetached())
+        {
+            session->requestStop();
+        }
+    }
+    std::unordered_map<uint64_t, std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(sessionThreadsMutex_);
+        threads.swap(sessionThreads_);
+        finishedSessionThreads_.clear();
+    }
+    for (auto &entry : threads)
+    {
+        if (entry.second.joinable()) entry.second.join();
+    }
+
+    bool handedOver = sendHandoff(connection, sessions);
+    close(connection);
+
+    if (!handedOver)
+    {
+        // Nothing was given away: the new process only ever had copies of
+        // the descriptors. The parked sessions are resumed from their saved
+        // state, just as the new process would have, and everything that
+        // stopped above starts again.
+        std::cerr << "Handoff failed; the new server process did not confirm it is serving, resuming"
+                  << std::endl;
+        for (auto &session : sessions)
+        {
+            if (!session->isDetached())
+            {
+                continue;
+            }
+            Session::HandoffState state = session->saveState();
+            PendingSession pending;
+            pending.state.assign(reinterpret_cast<char *>(&state), reinterpret_cast<char *>(&state) + sizeof(state));
+            pending.listener = listeners_[session->getListener()].address;
+            pending.fd = dup(session->getControlSocket());
+            OPENSSL_cleanse(&state, sizeof(state));
+            if (pending.fd != -1)
+            {
+                pendingSessions_.push_back(std::move(pending));
+            }
+        }
+        sessions.clear();
+        stats_.close();
+
+        // The new process only binds the admin and handoff paths once it
+        // has confirmed, so they are still this one's.
+        uint64_t wakes;
+        while (read(detachWake_, &wakes, sizeof(wakes)) > 0)
+        {
+        }
+        handoffRequested_ = false;
+        startServing();
+        return false;
+    }
+
+    // The new process has bound the admin and handoff paths anew; only the
+    // descriptors go, not the paths.
+    if (adminSocket_ != -1)
+    {
+        close(adminSocket_);
+        adminSocket_ = -1;
+    }
+    close(handoffSocket_);
+    handoffSocket_ = -1;
+    close(detachWake_);
+    detachWake_ = -1;
+
+    // Only this process's references go; the new one holds its own.
+    for (auto &listener : listeners_)
+    {
+        close(listener.controlSocket);
+        listener.controlSocket = -1;
+    }
+    for (auto &worker : testWorkers_)
+    {
+        close(worker->socket);
+        worker->socket = -1;
+    }
+    sessions.clear();
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        activeSessions_.clear();
+    }
+    stats_.close();
+
+    std::cout << "Handed over to the new server process" << std::endl;
+    return true;
+}
+
+bool Server::sendHandoff(int connection, const std::vector<std::shared_ptr<Session>> &sessions)
+{
+    handoff::Header accept = handoff::header(handoff::Accept);
+    accept.value = nextSessionId_;
+    if (!handoff::send(connection, accept, nullptr, -1))
+    {
+        return false;
+    }
+
+    for (const auto &listener : listeners_)
+    {
+        handoff::Header record = handoff::header(handoff::ControlSocket);
+        record.address = listener.address;
+        record.port = static_cast<uint16_t>(config_.getInt("control_port", 862));
+        if (!handoff::send(connection, record, nullptr, listener.controlSocket))
+        {
+            return false;
+        }
+    }
+    for (const auto &worker : testWorkers_)
+    {
+        handoff::Header record = handoff::header(handoff::TestSocket);
+        record.address = listeners_[worker->listener].address;
+        record.port = worker->port;
+        if (!handoff::send(connection, record, nullptr, worker->socket))
+        {
+            return false;
+        }
+    }
+
+    static_assert(sizeof(Session::HandoffState) <= handoff::kMaxPayload, "session state must fit one message");
+    size_t moved = 0;
+    for (const auto &session : sessions)
+    {
+        if (!session->isDetached())
+        {
+            continue;
+        }
+        Session::HandoffState state = session->saveState();
+        handoff::Header record = handoff::header(handoff::SessionRecord);
+        record.address = listeners_[session->getListener()].address;
+        record.payloadSize = sizeof(state);
+        bool sent = handoff::send(connection, record, &state, session->getControlSocket());
+        OPENSSL_cleanse(&state, sizeof(state));
+        if (!sent)
+        {
+            return false;
+        }
+        moved++;
+    }
+
+    if (!handoff::send(connection, handoff::header(handoff::Done), nullptr, -1))
+    {
+        return false;
+    }
+    std::cout << "Passed " << listeners_.size() + testWorkers_.size() << " sockets and " << moved
+              << " sessions to the new server process" << std::endl;
+
+    struct timeval tv;
+    tv.tv_sec = kTakeoverAckTimeoutSec;
+    tv.tv_usec = 0;
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    handoff::Header ack;
+    std::vector<char> payload;
+    int fd;
+    if (!handoff::receive(connection, ack, payload, fd))
+    {
+        return false;
+    }
+    if (fd >= 0) close(fd);
+    return ack.kind == handoff::Ack;
+}
+
+void Server::adoptSystemdSockets()
+{
+    // Socket activation hands over bound sockets by position only; each is
+    // matched to the configuration by its type, address and port.
+    for (int fd : systemd::listenFds())
+    {
+        int type = 0;
+        socklen_t typeSize = sizeof(type);
+        struct sockaddr_in6 addr;
+        socklen_t addrSize = sizeof(addr);
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typeSize) < 0 ||
+            getsockname(fd, (struct sockaddr *)&addr, &addrSize) < 0 ||
+            (addr.sin6_family != AF_INET6 && addr.sin6_family != AF_INET))
+        {
+            std::cerr << "Ignoring socket " << fd << " from systemd: only IP sockets are supported" << std::endl;
+            close(fd);
+            continue;
+        }
+        addr = fromSocketAddress(addr);
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags != -1)
+        {
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+        inherited_.push_back({fd, type, addr.sin6_addr, ntohs(addr.sin6_port)});
+    }
+    if (!inherited_.empty())
+    {
+        std::cout << "Using " << inherited_.size() << " sockets from systemd" << std::endl;
+    }
+}
+
+int Server::takeInheritedSocket(int type, const struct in6_addr &address, uint16_t port)
+{
+    for (auto it = inherited_.begin(); it != inherited_.end(); ++it)
+    {
+        if (it->type == type && it->port == port && memcmp(&it->address, &address, sizeof(address)) == 0)
+        {
+            int fd = it->fd;
+            inherited_.erase(it);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+bool Server::receiveHandoff()
+{
+    std::string path = config_.getString("handoff_socket", "/run/twamp-server/handoff.sock");
+    int connection = path.empty() ? -1 : handoff::connect(path);
+    if (connection < 0)
+    {
+        return false;
+    }
+
+    handoff::Header hello = handoff::header(handoff::Hello);
+    hello.value = sizeof(Session::HandoffState);
+    handoff::Header header = handoff::header(handoff::Hello);
+    std::vector<char> payload;
+    int fd;
+    if (!handoff::send(connection, hello, nullptr, -1) || !handoff::receive(connection, header, payload, fd) ||
+        header.kind != handoff::Accept)
+    {
+        if (header.kind == handoff::Refuse)
+        {
+            std::cerr << "The running server refused the takeover: " << std::string(payload.begin(), payload.end())
+                      << std::endl;
+        }
+        close(connection);
+        return false;
+    }
+    nextSessionId_ = std::max<uint64_t>(nextSessionId_, header.value);
+
+    while (true)
+    {
+        if (!handoff::receive(connection, header, payload, fd))
+        {
+            close(connection);
+            return false;
+        }
+        if (header.kind == handoff::Done)
+        {
+            break;
+        }
+        if (fd < 0)
+        {
+            continue;
+        }
+        switch (header.kind)
+        {
+        case handoff::ControlSocket:
+            inherited_.push_back({fd, SOCK_STREAM, header.address, header.port});
+            break;
+        case handoff::TestSocket:
+            inherited_.push_back({fd, SOCK_DGRAM, header.address, header.port});
+            break;
+        case handoff::SessionRecord:
+            if (payload.size() == sizeof(Session::HandoffState))
+            {
+                pendingSessions_.push_back({payload, header.address, fd});
+                OPENSSL_cleanse(payload.data(), payload.size());
+                break;
+            }
+            close(fd);
+            break;
+        default:
+            close(fd);
+            break;
+        }
+    }
+
+    std::cout << "Took over " << inherited_.size() << " sockets and " << pendingSessions_.size()
+              << " sessions from the running server" << std::endl;
+    handoffConnection_ = connection;
+    return true;
+}
+
+void Server::resumeSessions()
+{
+    for (auto &pending : pendingSessions_)
+    {
+        Session::HandoffState state;
+        memcpy(&state, pending.state.data(), sizeof(state));
+        OPENSSL_cleanse(pending.state.data(), pending.state.size());
+
+        // The session stays on the address it connected to and, if the
+        // client follows it, on its test port.
+        size_t listener = 0;
+        while (listener < listeners_.size() &&
+               memcmp(&listeners_[listener].address, &pending.listener, sizeof(pending.listener)) != 0)
+        {
+            listener++;
+        }
+        TestWorker *target = nullptr;
+        for (const auto &worker : testWorkers_)
+        {
+            if (worker->listener == listener && !worker->primary && worker->port == state.offeredTestPort)
+            {
+                target = worker.get();
+            }
         }
+        if (listener == listeners_.size() || (state.testPort != 0 && !target))
+        {
+            std::cerr << "Session " << state.id << " is on an address or port no longer configured, closing"
+                      << std::endl;
+            close(pending.fd);
+            OPENSSL_cleanse(&state, sizeof(state));
+            continue;
+        }
+
+        auto session = std::make_shared<Session>(pending.fd, testWorkers_[0]->socket, state.id, state.controlPeer,
+                                                 config_.getBool("log_test_packets", false));
+        configureSession(*session);
+        session->setListener(listener);
+        bool restored = session->restoreState(state);
+        OPENSSL_cleanse(&state, sizeof(state));
+        if (!restored)
+        {
+            std::cerr << "Failed to restore session " << session->getId() << ", closing" << std::endl;
+            continue;
+        }
+        if (!target)
+        {
+            session->setOfferedTestPort(0);
+        }
+        launchSession(session);
+        watchSession(allocateControlSlot(), session);
+    }
+    pendingSessions_.clear();
+    sessionsChanged();
+}
+
+bool Server::finishTakeover()
+{
+    bool confirmed = handoff::send(handoffConnection_, handoff::header(handoff::Ack), nullptr, -1);
+    if (!confirmed)
+    {
+        std::cerr << "Failed to confirm the takeover" << std::endl;
     }
-    catch (const std::exception &e)
+    close(handoffConnection_);
+    handoffConnection_ = -1;
+    return confirmed;
+}
+
+void Server::adminServerThread()
+{
+    // Also waits for a process taking over; once one has been accepted
+    // there is nothing left for this thread to do.
+    while (running_ && !handoffRequested_)
     {
-        std::cerr << "Control connection error: " << e.what() << std::endl;
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        if (adminSocket_ != -1) FD_SET(adminSocket_, &readfds);
+        if (handoffSocket_ != -1) FD_SET(handoffSocket_, &readfds);
+
+        struct timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+
+        int activity = select(std::max(adminSocket_, handoffSocket_) + 1, &readfds, NULL, NULL, &timeout);
+
+        if (!running_) break;
+        if (activity <= 0) continue;
+
+        if (handoffSocket_ != -1 && FD_ISSET(handoffSocket_, &readfds))
+        {
+            acceptHandoff();
+        }
+        if (adminSocket_ == -1 || !FD_ISSET(adminSocket_, &readfds)) continue;
+
+        int clientSocket = accept(adminSocket_, NULL, NULL);
+        if (clientSocket < 0) continue;
+
+        // One short request per connection; don't let a stuck peer hold the
+        // admin thread.
+        struct timeval tv;
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        std::string command;
+        char buffer[256];
+        while (command.find('\n') == std::string::npos && command.size() < 1024)
+        {
+            ssize_t n = recv(clientSocket, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            command.append(buffer, n);
+        }
+        command = command.substr(0, command.find('\n'));
+
+        std::string response = handleAdminCommand(command);
+        send(clientSocket, response.data(), response.size(), MSG_NOSIGNAL);
         close(clientSocket);
     }
-}
\ No newline at end of file
+}
+
+std::string Server::handleAdminCommand(const std::string &command)
+{
+    std::istringstream in(command);
+    std::string verb;
+    in >> verb;
+
+    std::vector<std::shared_ptr<Session>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        sessions = activeSessions_;
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+
+    if (verb == "list")
+    {
+        out << std::left << std::setw(6) << "ID" << std::setw(12) << "SID" << std::setw(23) << "CONTROL"
+            << std::setw(23) << "TEST" << std::setw(8) << "STATE" << std::right << std::setw(9) << "AGE_S"
+            << std::setw(9) << "IDLE_S" << std::setw(11) << "PACKETS" << std::setw(8) << "LOST"
+            << std::setw(8) << "REORD" << std::setw(8) << "DUP" << std::setw(12) << "JITTER_US" << "\n";
+        for (const auto &session : sessions)
+        {
+            Session::Info info = session->getInfo();
+            out << std::left << std::setw(6) << info.id << std::setw(12) << info.sid
+                << std::setw(23) << info.controlPeer << std::setw(23) << info.testClient
+                << std::setw(8) << (info.testActive ? "active" : "setup") << std::right
+                << std::setw(9) << info.ageSec << std::setw(9) << info.idleSec
+                << std::setw(11) << info.forward.packets << std::setw(8) << info.forward.lost
+                << std::setw(8) << info.forward.reordered << std::setw(8) << info.forward.duplicates
+                << std::setw(12) << info.forward.jitterUs << "\n";
+        }
+        return out.str();
+    }
+
+    if (verb == "show" || verb == "kill")
+    {
+        uint64_t id = 0;
+        if (!(in >> id))
+        {
+            return "ERROR usage: " + verb + " <id>\n";
+        }
+
+        auto it = std::find_if(sessions.begin(), sessions.end(),
+                               [id](const std::shared_ptr<Session> &s) { return s->getId() == id; });
+        if (it == sessions.end())
+        {
+            return "ERROR no such session: " + std::to_string(id) + "\n";
+        }
+
+        if (verb == "kill")
+        {
+            std::cout << "Admin: terminating session " << id << std::endl;
+            (*it)->requestStop();
+            removeSession(*it);
+            return "OK\n";
+        }
+
+        Session::Info info = (*it)->getInfo();
+        out << "id: " << info.id << "\n"
+            << "sid: " << info.sid << "\n"
+            << "control_peer: " << info.controlPeer << "\n"
+            << "test_client: " << info.testClient << "\n"
+            << "state: " << (info.testActive ? "active" : "setup") << "\n"
+            << "phase: " << info.phase << "\n"
+            << "mode: " << info.mode << "\n"
+            << "age_s: " << info.ageSec << "\n"
+            << "idle_s: " << info.idleSec << "\n"
+            << "packets: " << info.forward.packets << "\n"
+            << "bytes: " << info.forward.bytes << "\n"
+            << "highest_seq: " << info.forward.highestSeq << "\n"
+            << "lost: " << info.forward.lost << "\n"
+            << "reordered: " << info.forward.reordered << "\n"
+            << "duplicates: " << info.forward.duplicates << "\n"
+            << "jitter_us: " << info.forward.jitterUs << "\n"
+            << "rate_drops: " << info.rateDrops << "\n"
+            << "auth_drops: " << info.authDrops << "\n"
+            << "kernel_packets: " << info.kernelPackets << "\n"
+            << "test_port: " << (info.testPort != 0 ? info.testPort : config_.getInt("test_port", 863)) << "\n";
+        return out.str();
+    }
+
+    if (verb == "counters")
+    {
+        static const char *const names[DropReasonCount] = {
+            "drop_malformed", "drop_unknown_source", "drop_prefix_rate",
+            "drop_inactive_session", "drop_session_rate", "drop_auth_failed"};
+        static const char *const timeoutNames[TimeoutPhaseCount] = {
+            "timeout_greeting", "timeout_request", "timeout_start", "timeout_idle"};
+        out << "sessions: " << sessions.size() << "\n";
+        {
+            std::lock_guard<std::mutex> lock(sessionThreadsMutex_);
+            out << "session_threads: " << sessionThreads_.size() - finishedSessionThreads_.size() << "\n";
+        }
+        for (int i = 0; i < DropReasonCount; ++i)
+        {
+            out << names[i] << ": " << drops_[i].load(std::memory_order_relaxed) << "\n";
+        }
+        for (int i = 0; i < TimeoutPhaseCount; ++i)
+        {
+            out << timeoutNames[i] << ": " << timeouts_[i].load(std::memory_order_relaxed) << "\n";
+        }
+        out << "handshake_auth_failed: " << handshakeAuthFailures_.load(std::memory_order_relaxed) << "\n";
+        {
+            LatencyHistogram stampLatency;
+            mergeStampLatency(stampLatency);
+            out << "clock: " << (TscClock::instance().usingTsc() ? "tsc" : "clock_gettime") << "\n"
+                << "busy_poll: " << (busyPoll_ ? "on" : "off") << "\n"
+                << "stamp_latency_samples: " << stampLatency.count() << "\n"
+                << "stamp_latency_p50_ns: " << stampLatency.percentile(50) << "\n"
+                << "stamp_latency_p99_ns: " << stampLatency.percentile(99) << "\n"
+                << "stamp_latency_p999_ns: " << stampLatency.percentile(99.9) << "\n"
+                << "stamp_latency_max_ns: " << stampLatency.percentile(100) << "\n";
+        }
+        if (stageSampleInterval_ != 0)
+        {
+            static const char *const stageNames[StageCount] = {"wait", "lookup", "stamp", "send"};
+            std::lock_guard<std::mutex> lock(stageLatencyMutex_);
+            out << "stage_samples: " << stageLatency_[StageLookup].count() << "\n";
+            for (int stage = 0; stage < StageCount; ++stage)
+            {
+                out << "stage_" << stageNames[stage] << "_p50_ns: " << stageLatency_[stage].percentile(50) << "\n"
+                    << "stage_" << stageNames[stage] << "_p99_ns: " << stageLatency_[stage].percentile(99) << "\n"
+                    << "stage_" << stageNames[stage] << "_max_ns: " << stageLatency_[stage].percentile(100)
+                    << "\n";
+            }
+        }
+        // Backend figures are summed over the test ports.
+        IoUringSocket::Stats uring = {0, 0, 0};
+        uint64_t syscalls = 0;
+        bool usingUring = false;
+        for (const auto &worker : testWorkers_)
+        {
+            if (worker->uring.active())
+            {
+                IoUringSocket::Stats stats = worker->uring.stats();
+                uring.syscalls += stats.syscalls;
+                uring.noBuffers += stats.noBuffers;
+                uring.sendErrors += stats.sendErrors;
+                syscalls += stats.syscalls;
+                usingUring = true;
+            }
+            else
+            {
+                syscalls += worker->mmsg.stats().syscalls;
+            }
+        }
+        out << "backend: " << (usingUring ? "io_uring" : "socket") << "\n"
+            << "backend_syscalls: " << syscalls << "\n";
+        if (usingUring)
+        {
+            out << "io_uring_no_buffers: " << uring.noBuffers << "\n"
+                << "io_uring_send_errors: " << uring.sendErrors << "\n";
+        }
+        for (const auto &worker : testWorkers_)
+        {
+            if (worker->primary)
+            {
+                continue;
+            }
+            out << "test_port_";
+            if (listeners_.size() > 1)
+            {
+                out << formatIp(listeners_[worker->listener].address) << "_";
+            }
+            out << worker->port << "_sessions: " << worker->sessions.load() << "\n";
+        }
+        if (kernelReflector_.active())
+        {
+            out << "kernel_sessions: " << kernelSessions_.load(std::memory_order_relaxed) << "\n"
+                << "kernel_demotions: " << kernelDemotions_.load(std::memory_order_relaxed) << "\n";
+        }
+        if (xdp_.active())
+        {
+            XdpSocket::Stats xdp = xdp_.stats();
+            out << "xdp_received: " << xdp.received << "\n"
+                << "xdp_reflected: " << xdp.reflected << "\n"
+                << "xdp_invalid: " << xdp.invalid << "\n"
+                << "xdp_tx_full: " << xdp.txFull << "\n";
+        }
+        return out.str();
+    }
+
+    return "Commands:\n"
+           "  list        List sessions with their forward-path statistics\n"
+           "  show <id>   Show one session in detail\n"
+           "  kill <id>   Terminate a session\n"
+           "  counters    Show server-wide counters\n";
+}
@@ -1,15 +1,43 @@
 #include "Session.h"
+#include "Address.h"
+#include "TscClock.h"
 #include <iostream>
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <cstring>
 #include <stdexcept>
 #include <chrono>
+#include <cerrno>
 
-Session::Session(int controlSocket, int testSocket) 
-    : controlSocket_(controlSocket), testSocket_(testSocket), testActive_(false) {
-    lastActivity_ = std::chrono::steady_clock::now();
+namespace {
+int64_t steadyNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char* phaseName(Session::Phase phase) {
+    switch (phase) {
+        case Session::Phase::AwaitRequest: return "request";
+        case Session::Phase::AwaitStart: return "start";
+        case Session::Phase::Testing: return "testing";
+        case Session::Phase::Closed: return "closed";
+    }
+    return "unknown";
+}
+}
+
+Session::Session(int controlSocket, int testSocket, uint64_t id, const struct sockaddr_in6& controlPeer,
+                 bool logTestPackets)
+    : id_(id), controlPeer_(controlPeer), logTestPackets_(logTestPackets), reflectDscp_(false),
+      rateDrops_(0), authDrops_(0), mode_(ModeUnauthenticated), testClientKey_(0), offeredTestPort_(0),
+      offeredPortUse_(0), testPort_(0), listener_(0), kernelPackets_(0), detachRequested_(false), detached_(false),
+      detachWake_(-1), controlSocket_(controlSocket), testSocket_(testSocket), phase_(Phase::AwaitRequest),
+      requestTimeout_(30), startTimeout_(30), idleTimeout_(300), testActive_(false) {
+    created_ = std::chrono::steady_clock::now();
+    lastActivityNs_ = steadyNowNs();
     sid_ = 0;
+    memset(&keys_, 0, sizeof(keys_));
     memset(&testClientAddr_, 0, sizeof(testClientAddr_));
     stopRequested_ = false;
 }
@@ -22,68 +50,72 @@ Session::~Session() {
 
 void Session::requestStop() {
     stopRequested_ = true;
+    // Only shut the socket down here: the session thread may still be inside
+    // recv() on it, and closing would let the descriptor be reused under it.
+    // The destructor closes it once the session thread is done.
     if (controlSocket_ != -1) {
         shutdown(controlSocket_, SHUT_RDWR); // Прервёт recv
-        close(controlSocket_);
-        controlSocket_ = -1;
     }
 }
 
+Session::Info Session::getInfo() const {
+    auto now = std::chrono::steady_clock::now();
+    Info info;
+    info.id = id_;
+    info.controlPeer = formatAddress(controlPeer_);
+    {
+        std::lock_guard<std::mutex> lock(identityMutex_);
+        info.sid = sid_;
+        info.testClient = formatAddress(testClientAddr_);
+    }
+    info.testPort = testPort_;
+    info.testActive = testActive_;
+    info.phase = phaseName(phase_);
+    info.mode = modeName(mode_);
+    info.ageSec = std::chrono::duration<double>(now - created_).count();
+    info.idleSec = (steadyNowNs() - lastActivityNs_.load(std::memory_order_relaxed)) / 1e9;
+    info.rateDrops = rateDrops_.load(std::memory_order_relaxed);
+    info.authDrops = authDrops_.load(std::memory_order_relaxed);
+    info.kernelPackets = kernelPackets_.load(std::memory_order_relaxed);
+    info.forward = forwardStats_.snapshot();
+    return info;
+}
+
 void Session::run() {
     try {
+        std::vector<char> message;
         while (!stopRequested_) {
-            // Read the first byte to determine message type and size
-            char firstByte;
-            ssize_t received = recv(controlSocket_, &firstByte, 1, 0);
-            
-            if (received == 0) {
+            if (!awaitCommand()) {
+                detached_ = true;
+                std::cout << "Session " << id_ << " detached for handoff" << std::endl;
+                return;
+            }
+            if (!receiveCommand(message)) {
                 // Client closed connection gracefully
                 std::cout << "Client closed connection" << std::endl;
                 break;
-            } else if (received != 1) {
-                throw std::runtime_error("Failed to receive first byte");
             }
             
-            lastActivity_ = std::chrono::steady_clock::now();
+            touch();
             
-            // Based on first byte, determine message size and read the rest
-            switch (firstByte) {
-                case 1:  // Request-Session (28 bytes total)
-                    {
-                        std::vector<char> message(27);
-                        if (recv(controlSocket_, message.data(), 27, MSG_WAITALL) != 27) {
-                            throw std::runtime_error("Failed to receive Request-Session data");
-                        }
-                        handleRequestSession(message);
-                    }
+            switch (message[0]) {
+                case CommandRequestSession:
+                    handleRequestSession(message);
                     break;
-                case 7:  // Start-Sessions (12 bytes total)
-                    {
-                        std::vector<char> message(11);
-                        if (recv(controlSocket_, message.data(), 11, MSG_WAITALL) != 11) {
-                            throw std::runtime_error("Failed to receive Start-Sessions data");
-                        }
-                        handleStartSessions();
-                    }
+                case CommandStartSessions:
+                    handleStartSessions();
                     break;
-                case 4:  // Stop-Sessions (12 bytes total)
-                    {
-                        std::vector<char> message(11);
-                        if (recv(controlSocket_, message.data(), 11, MSG_WAITALL) != 11) {
-                            throw std::runtime_error("Failed to receive Stop-Sessions data");
-                        }
-                        handleStopSessions();
-                        // After stop sessions, expect client to close connection
-                        return;
-                    }
-                    break;
-                default:
-                    std::cerr << "Unknown command: " << static_cast<int>(firstByte) << std::endl;
-                    throw std::runtime_error("Unknown command");
+                case CommandStopSessions:
+                    handleStopSessions();
+                    // After stop sessions, expect client to close connection
+                    phase_ = Phase::Closed;
+                    return;
             }
         }
+        phase_ = Phase::Closed;
     } catch (const std::exception& e) {
         std::cerr << "Session error: " << e.what() << std::endl;
+        phase_ = Phase::Closed;
         if (testActive_) {
             testActive_ = false;
         }
@@ -91,90 +123,370 @@ void Session::run() {
     }
 }
 
+bool Session::awaitCommand() {
+    if (detachWake_ == -1) {
+        return true;
+    }
+    // A message that has started to arrive is always read in full, so the
+    // session is only ever handed over between messages.
+    struct pollfd fds[2];
+    fds[0].fd = controlSocket_;
+    fds[0].events = POLLIN;
+    fds[1].fd = detachWake_;
+    fds[1].events = POLLIN;
+    bool woken = false;
+    while (true) {
+        if (detachRequested_) {
+            // Still take a message that has already started to arrive.
+            fds[0].revents = 0;
+            poll(fds, 1, 0);
+            return fds[0].revents != 0;
+        }
+        // The descriptor stays readable once written. A session woken
+        // before it was asked to detach checks back until it is.
+        int ready = poll(fds, woken ? 1 : 2, woken ? 10 : -1);
+        if (ready < 0 && errno != EINTR) {
+            return true;
+        }
+        if (ready > 0 && fds[0].revents != 0) {
+            return true;
+        }
+        if (ready > 0 && fds[1].revents != 0) {
+            woken = true;
+        }
+    }
+}
+
+bool Session::receiveCommand(std::vector<char>& message) {
+    // The command byte determines the message size. In the secured modes it
+    // is only readable once the first block has been decrypted.
+    bool secured = controlCipher_.active();
+    char first[16];
+    size_t firstSize = secured ? 16 : 1;
+    ssize_t received = recv(controlSocket_, first, firstSize, MSG_WAITALL);
+    if (received == 0) {
+        return false;
+    } else if (received != static_cast<ssize_t>(firstSize)) {
+        throw std::runtime_error("Failed to receive first byte");
+    }
+    if (secured && !controlCipher_.decrypt(first, 16, first)) {
+        throw std::runtime_error("Failed to decrypt control message");
+    }
+    
+    size_t size;
+    switch (first[0]) {
+        case CommandRequestSession:
+        case CommandStartSessions:
+        case CommandStopSessions:
+            size = controlMessageSize(first[0]);
+            break;
+        default:
+            std::cerr << "Unknown command: " << static_cast<int>(first[0]) << std::endl;
+            throw std::runtime_error("Unknown command");
+    }
+    
+    if (!secured) {
+        message.assign(size, 0);
+        message[0] = first[0];
+        receiveExactly(&message[1], size - 1);
+        return true;
+    }
+    
+    size_t sealedSize = ControlCipher::sealedSize(size);
+    size_t paddedSize = sealedSize - kMacSize;
+    std::vector<char> padded(sealedSize);
+    memcpy(padded.data(), first, 16);
+    receiveExactly(&padded[16], sealedSize - 16);
+    if (!controlCipher_.decrypt(&padded[16], sealedSize - 16, &padded[16]) ||
+        !controlCipher_.verify(padded.data(), paddedSize, &padded[paddedSize])) {
+        throw std::runtime_error("Control message failed authentication");
+    }
+    message.assign(padded.begin(), padded.begin() + size);
+    return true;
+}
+
+bool Session::setSecurity(uint8_t mode, const SessionKeys& keys, const unsigned char clientIv[16],
+                          const unsigned char serverIv[16]) {
+    mode_ = mode;
+    keys_ = keys;
+    return controlCipher_.init(keys, serverIv, clientIv);
+}
+
+void Session::setTimeouts(std::chrono::seconds request, std::chrono::seconds start, std::chrono::seconds idle) {
+    requestTimeout_ = request;
+    startTimeout_ = start;
+    idleTimeout_ = idle;
+}
+
+void Session::touch() {
+    lastActivityNs_.store(steadyNowNs(), std::memory_order_relaxed);
+}
+
+std::chrono::steady_clock::time_point Session::getDeadline() const {
+    std::chrono::seconds timeout;
+    switch (phase_.load()) {
+        case Phase::AwaitRequest: timeout = requestTimeout_; break;
+        case Phase::AwaitStart: timeout = startTimeout_; break;
+        case Phase::Testing: timeout = idleTimeout_; break;
+        default: return std::chrono::steady_clock::time_point::max();
+    }
+    return std::chrono::steady_clock::time_point(
+               std::chrono::nanoseconds(lastActivityNs_.load(std::memory_order_relaxed))) + timeout;
+}
+
 bool Session::isExpired() const {
-    auto now = std::chrono::steady_clock::now();
-    return std::chrono::duration_cast<std::chrono::minutes>(now - lastActivity_).count() > 5;
+    return phase_ != Phase::Closed && std::chrono::steady_clock::now() >= getDeadline();
+}
+
+bool Session::admitTestPacket(int64_t nowNs) {
+    if (testRateLimit_.allow(nowNs)) {
+        // A plain store: only the reflector thread writes here, and a lost
+        // race with touch() only moves the deadline by one packet interval.
+        lastActivityNs_.store(nowNs, std::memory_order_relaxed);
+        return true;
+    }
+    rateDrops_.store(rateDrops_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    publishCounters();
+    return false;
 }
 
-bool Session::matchesTestAddress(const struct sockaddr_in& addr) const {
-    return testActive_ && addr.sin_addr.s_addr == testClientAddr_.sin_addr.s_addr;
+void Session::addKernelPackets(uint64_t count, int64_t nowNs) {
+    if (count > 0) {
+        uint64_t total = kernelPackets_.fetch_add(count, std::memory_order_relaxed) + count;
+        lastActivityNs_.store(nowNs, std::memory_order_relaxed);
+        if (statsSlot_) {
+            stats::store(statsSlot_->kernelPackets, total);
+        }
+    }
 }
 
-void Session::processTestPacket(const char* data, size_t size, const struct sockaddr_in& fromAddr) {
+bool Session::matchesTestAddress(const struct sockaddr_in6& addr) const {
     if (!testActive_) {
-        std::cout << "Received test packet but session not active" << std::endl;
-        return;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(identityMutex_);
+    return memcmp(&addr.sin6_addr, &testClientAddr_.sin6_addr, sizeof(addr.sin6_addr)) == 0;
+}
+
+struct sockaddr_in6 Session::getTestClientAddr() const {
+    std::lock_guard<std::mutex> lock(identityMutex_);
+    return testClientAddr_;
+}
+
+bool Session::processTestPacket(char* packet, size_t size, const struct sockaddr_in6& fromAddr,
+                                const TrafficClass& traffic, int64_t kernelReceivedNs) {
+    if (!testActive_) {
+        if (logTestPackets_) {
+            std::cout << "Received test packet but session not active" << std::endl;
+        }
+        return false;
     }
     
-    std::cout << "Processing test packet from " << inet_ntoa(fromAddr.sin_addr) 
-              << ":" << ntohs(fromAddr.sin_port) << " (size: " << size << ")" << std::endl;
+    if (!testCipher_.open(packet, size)) {
+        authDrops_.store(authDrops_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        publishCounters();
+        if (logTestPackets_) {
+            std::cout << "Test packet from " << formatAddress(fromAddr) << " failed authentication" << std::endl;
+        }
+        return false;
+    }
     
-    auto reflectorPacket = generateReflectorPacket(data, size, fromAddr);
+    if (logTestPackets_) {
+        std::cout << "Processing test packet from " << formatAddress(fromAddr)
+                  << " (size: " << size << ")" << std::endl;
+    }
     
-    // Send back to the client's source address and port
-    ssize_t sent = sendto(testSocket_, reflectorPacket.data(), reflectorPacket.size(), 0,
-                         (struct sockaddr*)&fromAddr, sizeof(fromAddr));
+    // The kernel's receive time leaves out how long the reflector took to
+    // get to the packet. It comes from the system clock rather than the TSC,
+    // so it is capped at T3 in case the two disagree by a little.
+    int64_t reflectedNs = TscClock::instance().nowNs();
+    int64_t receivedNs = kernelReceivedNs != 0 && kernelReceivedNs < reflectedNs ? kernelReceivedNs : reflectedNs;
+    if (size >= 16) {
+        TestPacket header(packet);
+        forwardStats_.update(header.sequence(), unixNsFromNtp(header.senderTimestamp()), receivedNs, size);
+    }
     
-    if (sent < 0) {
-        std::cerr << "Failed to send reflector packet: " << strerror(errno) << std::endl;
-    } else {
-        std::cout << "Sent reflector packet back to " << inet_ntoa(fromAddr.sin_addr) 
-                  << ":" << ntohs(fromAddr.sin_port) << " (" << sent << " bytes)" << std::endl;
+    stampReflectorPacket(packet, size, receivedNs, reflectedNs, traffic);
+    publishCounters();
+    return testCipher_.seal(packet, size);
+}
+
+Session::HandoffState Session::saveState() const {
+    HandoffState state;
+    memset(&state, 0, sizeof(state));
+    state.id = id_;
+    state.mode = mode_;
+    state.phase = phase_;
+    state.testActive = testActive_;
+    state.controlPeer = controlPeer_;
+    {
+        std::lock_guard<std::mutex> lock(identityMutex_);
+        state.sid = sid_;
+        state.testClient = testClientAddr_;
     }
+    state.offeredTestPort = offeredTestPort_;
+    state.testPort = testPort_;
+    state.ageNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - created_).count();
+    state.idleNs = steadyNowNs() - lastActivityNs_.load(std::memory_order_relaxed);
+    state.rateDrops = rateDrops_.load(std::memory_order_relaxed);
+    state.authDrops = authDrops_.load(std::memory_order_relaxed);
+    state.kernelPackets = kernelPackets_.load(std::memory_order_relaxed);
+    state.keys = keys_;
+    state.control = controlCipher_.state();
+    state.forward = forwardStats_.save();
+    return state;
 }
 
-std::vector<char> Session::generateReflectorPacket(const char* data, size_t size, const sockaddr_in& fromAddr) {
-    std::vector<char> packet(data, data + size);
-    
+bool Session::restoreState(const HandoffState& state) {
+    mode_ = state.mode;
+    keys_ = state.keys;
+    if (mode_ != ModeUnauthenticated && !controlCipher_.init(keys_, state.control)) {
+        return false;
+    }
+    // The test keys only exist once Request-Session has bound them to the SID.
+    if (state.phase != Phase::AwaitRequest && !testCipher_.init(mode_, keys_, state.sid)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(identityMutex_);
+        sid_ = state.sid;
+        testClientAddr_ = state.testClient;
+    }
+    testClientKey_ = state.phase != Phase::AwaitRequest ? addressKey(state.testClient.sin6_addr) : 0;
+    offeredTestPort_ = state.offeredTestPort;
+    testPort_ = state.testPort;
+    created_ = std::chrono::steady_clock::now() - std::chrono::nanoseconds(state.ageNs);
+    lastActivityNs_ = steadyNowNs() - state.idleNs;
+    rateDrops_ = state.rateDrops;
+    authDrops_ = state.authDrops;
+    kernelPackets_ = state.kernelPackets;
+    forwardStats_.restore(state.forward);
+    phase_ = state.phase;
+    testActive_ = state.testActive;
+    return true;
+}
+
+void Session::setStatsSlot(std::shared_ptr<stats::SessionSlot> slot) {
+    statsSlot_ = std::move(slot);
+    publishIdentity();
+    publishCounters();
+}
+
+void Session::testStateChanged() {
+    publishIdentity();
+    if (testStateListener_) {
+        testStateListener_();
+    }
+}
+
+void Session::publishIdentity() {
+    if (!statsSlot_) {
+        return;
+    }
+    stats::SessionSlot& slot = *statsSlot_;
+    uint32_t sid;
+    struct sockaddr_in6 testClient;
+    {
+        std::lock_guard<std::mutex> lock(identityMutex_);
+        sid = sid_;
+        testClient = testClientAddr_;
+    }
+    auto startedAt = std::chrono::system_clock::now() - (std::chrono::steady_clock::now() - created_);
+    uint32_t sequence = stats::writeBegin(slot.identitySequence);
+    slot.state.store(testActive_ ? stats::SessionActive : stats::SessionSetup, std::memory_order_relaxed);
+    stats::store(slot.id, id_);
+    stats::store(slot.sid, sid);
+    stats::store(slot.mode, mode_);
+    stats::store(slot.startedAtNs,
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(startedAt.time_since_epoch()).count());
+    stats::storeAddress(slot.controlAddress, controlPeer_.sin6_addr);
+    stats::store(slot.controlPort, ntohs(controlPeer_.sin6_port));
+    stats::storeAddress(slot.testAddress, testClient.sin6_addr);
+    stats::store(slot.testClientPort, ntohs(testClient.sin6_port));
+    stats::store(slot.testPort, testPort_);
+    stats::writeEnd(slot.identitySequence, sequence);
+}
+
+void Session::publishCounters() {
+    if (!statsSlot_) {
+        return;
+    }
+    stats::SessionSlot& slot = *statsSlot_;
+    ForwardPathStats::Snapshot forward = forwardStats_.snapshot();
+    uint32_t sequence = stats::writeBegin(slot.countersSequence);
+    stats::store(slot.lastPacketNs, lastActivityNs_.load(std::memory_order_relaxed));
+    stats::store(slot.packets, forward.packets);
+    stats::store(slot.bytes, forward.bytes);
+    stats::store(slot.lost, forward.lost);
+    stats::store(slot.reordered, forward.reordered);
+    stats::store(slot.duplicates, forward.duplicates);
+    stats::store(slot.highestSeq, forward.highestSeq);
+    stats::store(slot.jitterNs, static_cast<uint64_t>(forward.jitterUs * 1000));
+    stats::store(slot.rateDrops, rateDrops_.load(std::memory_order_relaxed));
+    stats::store(slot.authDrops, authDrops_.load(std::memory_order_relaxed));
+    stats::writeEnd(slot.countersSequence, sequence);
+}
+
+void Session::stampReflectorPacket(char* packet, size_t size, int64_t receivedNs, int64_t reflectedNs,
+                                   const TrafficClass& traffic) {
     if (size >= 64) {  // Standard TWAMP test packet size
-        // Get current time in NTP format
-        auto now = std::chrono::system_clock::now();
-        auto duration = now.time_since_epoch();
-        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration).count();
-        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() % 1'000'000'000ULL;
-
-        // Переводим в NTP-время: 32 бита секунд и 32 бита дробной части
-        uint32_t secs = htonl(static_cast<uint32_t>(seconds + 2208988800ULL));
-        uint32_t frac = htonl(static_cast<uint32_t>((nanoseconds * (1LL << 32)) / 1'000'000'000ULL));
-
-        // Receive timestamp (bytes 16-23) - when we received the packet
-        memcpy(&packet[16], &secs, 4);
-        memcpy(&packet[20], &frac, 4);
-        
-        memcpy(&packet[24], &secs, 4);
-        memcpy(&packet[28], &frac, 4);
+        TestPacket header(packet);
+        header.setReceiveTimestamp(ntpFromUnixNs(receivedNs));
+        header.setReflectTimestamp(ntpFromUnixNs(reflectedNs));
+        if (traffic.ttl != 0) {
+            header.setSenderTtl(traffic.ttl);
+            header.setSenderTos(traffic.tos);
+            header.setReflectorFlags(ReflectorSawTrafficClass | (reflectDscp_ ? ReflectorMirroredDscp : 0));
+        }
     }
-    
-    return packet;
 }
 
-void Session::handleRequestSession(const std::vector<char>& message) {
+void Session::handleRequestSession(std::vector<char>& message) {
     try {
-        // Parse SID from bytes 11-14 (since we already read the command byte)
-        sid_ = ntohl(*reinterpret_cast<const uint32_t*>(&message[11]));
-        
-        // Parse test client port from bytes 19-20 (adjusted for removed command byte)
-        uint16_t clientPort = *reinterpret_cast<const uint16_t*>(&message[19]); // Keep in network order
+        RequestSession request(message.data());
+        uint16_t clientPort = htons(request.senderPort());
         
-        // Parse client IP from bytes 23-26 (adjusted for removed command byte)  
-        uint32_t clientIP = *reinterpret_cast<const uint32_t*>(&message[23]); // Keep in network order
+        // Test packet keys are bound to the SID. The reflector only reads
+        // them once Start-Sessions has activated the session.
+        if (testActive_) {
+            throw std::runtime_error("Request-Session during an active test");
+        }
+        if (!testCipher_.init(mode_, keys_, request.sid())) {
+            throw std::runtime_error("Failed to set up test packet keys");
+        }
         
-        // Set up test client address - store the client's address for matching
-        testClientAddr_.sin_family = AF_INET;
-        testClientAddr_.sin_port = clientPort;  // Client's port
-        testClientAddr_.sin_addr.s_addr = clientIP;  // Client's IP
+        // Set up test client address - store the client's address for matching.
+        // Sender-Address only holds IPv4; zero means the control connection's
+        // address, which is how IPv6 clients send from their own host.
+        {
+            std::lock_guard<std::mutex> lock(identityMutex_);
+            sid_ = request.sid();
+            testClientAddr_.sin6_family = AF_INET6;
+            testClientAddr_.sin6_port = clientPort;  // Client's port
+            testClientAddr_.sin6_addr = request.senderAddress() != 0 ? mapIpv4(htonl(request.senderAddress()))
+                                                                     : controlPeer_.sin6_addr;
+        }
+        testClientKey_ = addressKey(testClientAddr_.sin6_addr);
+        testPort_ = request.receiverPort() != 0 ? offeredTestPort_ : 0;
+        testStateChanged();
         
         std::cout << "Request-Session: SID=" << sid_ 
-                  << ", Client=" << inet_ntoa(testClientAddr_.sin_addr) 
-                  << ":" << ntohs(testClientAddr_.sin_port) << std::endl;
+                  << ", Client=" << formatAddress(testClientAddr_);
+        if (testPort_ != 0) {
+            std::cout << ", test port " << testPort_;
+        }
+        std::cout << std::endl;
         
-        // Send Accept-Session (28 bytes)
-        std::vector<char> acceptMessage(28, 0);
-        acceptMessage[0] = 3;  // Accept-Session command
-        *reinterpret_cast<uint32_t*>(&acceptMessage[12]) = htonl(sid_);  // Echo back SID
-        acceptMessage[16] = 0;  // Accept (0 means accepted)
+        char acceptBuffer[AcceptSession::kSize] = {0};
+        AcceptSession accept(acceptBuffer);
+        accept.setCommand(CommandAcceptSession);
+        accept.setSid(sid_);  // Echo back SID
+        accept.setAccept(0);  // 0 means accepted
+        accept.setPort(testPort_);
         
-        sendControlMessage(acceptMessage);
+        sendControlMessage(acceptBuffer, sizeof(acceptBuffer));
+        phase_ = Phase::AwaitStart;
         
     } catch (const std::exception& e) {
         std::cerr << "Request-Session error: " << e.what() << std::endl;
@@ -185,41 +497,49 @@ void Session::handleRequestSession(const std::vector<char>& message) {
 void Session::handleStartSessions() {
     std::cout << "Start-Sessions received for SID=" << sid_ << std::endl;
     
-    // Send Start-Ack (12 bytes)
-    std::vector<char> startAck(12, 0);
-    startAck[0] = 8;  // Start-Ack command
+    // Activate before acknowledging: the client may send its first test
+    // packet as soon as it sees Start-Ack.
+    testActive_ = true;
+    phase_ = Phase::Testing;
+    testStateChanged();
+    
+    char startAck[ControlMessage::kSize] = {0};
+    ControlMessage(startAck).setCommand(CommandStartAck);
     
-    sendControlMessage(startAck);
+    sendControlMessage(startAck, sizeof(startAck));
     
-    testActive_ = true;
-    std::cout << "Test session activated for client " << inet_ntoa(testClientAddr_.sin_addr) << std::endl;
+    std::cout << "Test session activated for client " << formatIp(testClientAddr_.sin6_addr) << std::endl;
 }
 
 void Session::handleStopSessions() {
     std::cout << "Stop-Sessions received for SID=" << sid_ << std::endl;
     
-    // Send Stop-Ack (12 bytes)
-    std::vector<char> stopAck(12, 0);
-    stopAck[0] = 9;  // Stop-Ack command
+    char stopAck[ControlMessage::kSize] = {0};
+    ControlMessage(stopAck).setCommand(CommandStopAck);
     
-    sendControlMessage(stopAck);
+    sendControlMessage(stopAck, sizeof(stopAck));
     
     testActive_ = false;
+    testStateChanged();
     std::cout << "Test session stopped for SID=" << sid_ << std::endl;
 }
 
-void Session::sendControlMessage(const std::vector<char>& message) {
-    if (send(controlSocket_, message.data(), message.size(), 0) != static_cast<ssize_t>(message.size())) {
+void Session::sendControlMessage(const char* message, size_t size) {
+    bool sent;
+    if (controlCipher_.active()) {
+        std::vector<char> sealed = controlCipher_.seal(message, size);
+        sent = !sealed.empty() &&
+               send(controlSocket_, sealed.data(), sealed.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(sealed.size());
+    } else {
+        sent = send(controlSocket_, message, size, MSG_NOSIGNAL) == static_cast<ssize_t>(size);
+    }
+    if (!sent) {
         throw std::runtime_error("Failed to send control message");
     }
 }
 
-std::vector<char> Session::receiveControlMessage(size_t expectedSize) {
-    std::vector<char> message(expectedSize);
-    
-    if (recv(controlSocket_, message.data(), expectedSize, MSG_WAITALL) != static_cast<ssize_t>(expectedSize)) {
+void Session::receiveExactly(char* data, size_t size) {
+    if (recv(controlSocket_, data, size, MSG_WAITALL) != static_cast<ssize_t>(size)) {
         throw std::runtime_error("Failed to receive control message");
     }
-    
-    return message;
 }
@@ -0,0 +1,180 @@
+#include "StatsSegment.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+size_t alignUp(size_t size)
+{
+    return (size + 63) & ~static_cast<size_t>(63);
+}
+
+void clearCounters(stats::SessionSlot &slot)
+{
+    uint32_t sequence = stats::writeBegin(slot.countersSequence);
+    stats::store(slot.lastPacketNs, 0);
+    stats::store(slot.packets, 0);
+    stats::store(slot.bytes, 0);
+    stats::store(slot.lost, 0);
+    stats::store(slot.reordered, 0);
+    stats::store(slot.duplicates, 0);
+    stats::store(slot.highestSeq, 0);
+    stats::store(slot.jitterNs, 0);
+    stats::store(slot.rateDrops, 0);
+    stats::store(slot.authDrops, 0);
+    stats::writeEnd(slot.countersSequence, sequence);
+    stats::store(slot.kernelPackets, 0);
+}
+} // namespace
+
+StatsSegment::StatsSegment() : base_(nullptr), size_(0), header_(nullptr), device_(0), inode_(0) {}
+
+StatsSegment::~StatsSegment()
+{
+    close();
+}
+
+bool StatsSegment::open(const std::string &path, size_t workerCount, size_t sessionCapacity)
+{
+    size_t serverOffset = alignUp(sizeof(stats::Header));
+    size_t workersOffset = serverOffset + alignUp(sizeof(stats::ServerBlock));
+    size_t workerSize = alignUp(sizeof(stats::WorkerBlock));
+    size_t sessionsOffset = workersOffset + workerCount * workerSize;
+    size_t sessionSize = alignUp(sizeof(stats::SessionSlot));
+    size_t size = sessionsOffset + sessionCapacity * sessionSize;
+
+    // Built under a temporary name and renamed into place, so a reader never
+    // maps a half-written header.
+    std::string temporary = path + ".new";
+    int fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create statistics segment " << temporary << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    void *memory = MAP_FAILED;
+    struct stat st;
+    if (ftruncate(fd, size) == 0 && fstat(fd, &st) == 0)
+    {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Failed to map statistics segment " << temporary << ": " << strerror(errno) << std::endl;
+        ::close(fd);
+        unlink(temporary.c_str());
+        return false;
+    }
+    ::close(fd);
+
+    // The file starts out zeroed, which is a valid empty state for every
+    // block and a free state for every slot.
+    base_ = static_cast<char *>(memory);
+    size_ = size;
+    header_ = reinterpret_cast<stats::Header *>(base_);
+    header_->magic = stats::kMagic;
+    header_->version = stats::kVersion;
+    header_->pid = getpid();
+    header_->startedAtNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count();
+    header_->workerCount = static_cast<uint32_t>(workerCount);
+    header_->sessionCapacity = static_cast<uint32_t>(sessionCapacity);
+    header_->serverOffset = serverOffset;
+    header_->workersOffset = workersOffset;
+    header_->workerSize = workerSize;
+    header_->sessionsOffset = sessionsOffset;
+    header_->sessionSize = sessionSize;
+
+    if (rename(temporary.c_str(), path.c_str()) < 0)
+    {
+        std::cerr << "Failed to publish statistics segment " << path << ": " << strerror(errno) << std::endl;
+        unlink(temporary.c_str());
+        munmap(base_, size_);
+        base_ = nullptr;
+        header_ = nullptr;
+        return false;
+    }
+    path_ = path;
+    device_ = st.st_dev;
+    inode_ = st.st_ino;
+
+    freeSlots_.clear();
+    for (size_t i = sessionCapacity; i > 0; --i)
+    {
+        freeSlots_.push_back(static_cast<uint32_t>(i - 1));
+    }
+    return true;
+}
+
+void StatsSegment::close()
+{
+    std::lock_guard<std::mutex> lock(slotsMutex_);
+    if (!base_)
+    {
+        return;
+    }
+    header_->closed.store(1, std::memory_order_release);
+    // After a handoff the path already holds the new server's segment.
+    struct stat st;
+    if (stat(path_.c_str(), &st) == 0 && st.st_dev == device_ && st.st_ino == inode_)
+    {
+        unlink(path_.c_str());
+    }
+    munmap(base_, size_);
+    base_ = nullptr;
+    header_ = nullptr;
+}
+
+stats::ServerBlock *StatsSegment::server() const
+{
+    return base_ ? reinterpret_cast<stats::ServerBlock *>(base_ + header_->serverOffset) : nullptr;
+}
+
+stats::WorkerBlock *StatsSegment::worker(size_t index) const
+{
+    if (!base_ || index >= header_->workerCount)
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<stats::WorkerBlock *>(base_ + header_->workersOffset + index * header_->workerSize);
+}
+
+std::shared_ptr<stats::SessionSlot> StatsSegment::acquireSession()
+{
+    uint32_t index;
+    {
+        std::lock_guard<std::mutex> lock(slotsMutex_);
+        if (!base_ || freeSlots_.empty())
+        {
+            return nullptr;
+        }
+        index = freeSlots_.back();
+        freeSlots_.pop_back();
+    }
+    auto slot = reinterpret_cast<stats::SessionSlot *>(base_ + header_->sessionsOffset + index * header_->sessionSize);
+    return std::shared_ptr<stats::SessionSlot>(slot, [this](stats::SessionSlot *slot) { releaseSession(slot); });
+}
+
+void StatsSegment::releaseSession(stats::SessionSlot *slot)
+{
+    // The session is gone, so nothing else writes the slot any more; the
+    // lock only keeps close() from unmapping it meanwhile.
+    std::lock_guard<std::mutex> lock(slotsMutex_);
+    if (!base_)
+    {
+        return;
+    }
+    uint32_t sequence = stats::writeBegin(slot->identitySequence);
+    slot->state.store(stats::SessionFree, std::memory_order_relaxed);
+    stats::writeEnd(slot->identitySequence, sequence);
+    clearCounters(*slot);
+
+    size_t offset = reinterpret_cast<char *>(slot) - (base_ + header_->sessionsOffset);
+    freeSlots_.push_back(static_cast<uint32_t>(offset / header_->sessionSize));
+}
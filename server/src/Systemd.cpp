@@ -0,0 +1,74 @@
+#include "Systemd.h"
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+// Passed descriptors start right after stdin, stdout and stderr.
+const int kListenFdsStart = 3;
+} // namespace
+
+namespace systemd
+{
+
+std::vector<int> listenFds()
+{
+    std::vector<int> fds;
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    if (pid && count && atol(pid) == getpid())
+    {
+        int n = atoi(count);
+        for (int fd = kListenFdsStart; fd < kListenFdsStart + n; ++fd)
+        {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds.push_back(fd);
+        }
+    }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return fds;
+}
+
+bool notify(const std::string &state)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (!path || !*path)
+    {
+        return false;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t length = strlen(path);
+    if (length >= sizeof(addr.sun_path))
+    {
+        return false;
+    }
+    memcpy(addr.sun_path, path, length);
+    // A leading '@' names a socket in the abstract namespace.
+    if (addr.sun_path[0] == '@')
+    {
+        addr.sun_path[0] = '\0';
+    }
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    socklen_t size = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + length);
+    bool sent = sendto(fd, state.data(), state.size(), MSG_NOSIGNAL, (struct sockaddr *)&addr, size) ==
+                static_cast<ssize_t>(state.size());
+    close(fd);
+    return sent;
+}
+
+} // namespace systemd
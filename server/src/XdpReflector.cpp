@@ -0,0 +1,266 @@
+#include "XdpReflector.h"
+#include "Bpf.h"
+#include "Messages.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+const int16_t kIpOffset = ETH_HLEN;
+const int16_t kUdpOffset = kIpOffset + sizeof(struct iphdr);
+const int16_t kPayloadOffset = kUdpOffset + sizeof(struct udphdr);
+
+// The reflector program. In C it would read:
+//
+//   if (!ipv4_udp_to(port) || payload < 64) return XDP_PASS;
+//   counter = bpf_map_lookup_elem(&sessions, {saddr, sport});
+//   offset = bpf_map_lookup_elem(&clock, 0);
+//   if (!counter || !offset) return XDP_PASS;
+//   now = bpf_ktime_get_ns() + *offset;
+//   T2 = T3 = ntp(now);
+//   sender_ttl = ip->ttl, sender_tos = ip->tos, flags = saw (| mirrored);
+//   ip->tos = reflect_dscp ? ip->tos & 0xfc : 0, patching ip->check;
+//   swap(eth), swap(ip addresses), swap(udp ports), udp->check = 0;
+//   __sync_fetch_and_add(counter, 1);
+//   return XDP_TX;
+//
+// The IP header checksum is unaffected by the swap. The UDP checksum would
+// not survive the new timestamps and is cleared, which IPv4 allows.
+std::vector<struct bpf_insn> reflectorProgram(int sessionsFd, int clockFd, uint16_t port, bool reflectDscp)
+{
+    std::vector<struct bpf_insn> prog;
+    std::vector<size_t> misses;
+    auto jumpToMiss = [&](uint8_t code, uint8_t dst, int32_t imm) {
+        misses.push_back(prog.size());
+        prog.push_back(bpfInsn(BPF_JMP | code, dst, 0, 0, imm));
+    };
+    auto load = [&](uint8_t size, uint8_t dst, int16_t off) {
+        prog.push_back(bpfInsn(BPF_LDX | size | BPF_MEM, dst, BPF_REG_7, off, 0));
+    };
+    auto store = [&](uint8_t size, int16_t off, uint8_t src) {
+        prog.push_back(bpfInsn(BPF_STX | size | BPF_MEM, BPF_REG_7, src, off, 0));
+    };
+
+    bpfMatchUdpPort(prog, misses, port, XdpReflector::kMinPacketSize);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_2, 0, 0));
+
+    // Session key {saddr, sport, 0} at fp-8, clock key 0 at fp-12.
+    load(BPF_W, BPF_REG_1, kIpOffset + offsetof(struct iphdr, saddr));
+    prog.push_back(bpfInsn(BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_1, -8, 0));
+    load(BPF_H, BPF_REG_1, kUdpOffset + offsetof(struct udphdr, source));
+    prog.push_back(bpfInsn(BPF_STX | BPF_H | BPF_MEM, BPF_REG_10, BPF_REG_1, -4, 0));
+    prog.push_back(bpfInsn(BPF_ST | BPF_H | BPF_MEM, BPF_REG_10, 0, -2, 0));
+    prog.push_back(bpfInsn(BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, -12, 0));
+
+    bpfLoadMap(prog, BPF_REG_1, sessionsFd);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    jumpToMiss(BPF_JEQ | BPF_K, BPF_REG_0, 0);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_0, 0, 0));
+
+    bpfLoadMap(prog, BPF_REG_1, clockFd);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -12));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    jumpToMiss(BPF_JEQ | BPF_K, BPF_REG_0, 0);
+    prog.push_back(bpfInsn(BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_8, BPF_REG_0, 0, 0));
+
+    // r1 = NTP seconds, r2 = NTP fraction, both big-endian.
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_0, BPF_REG_8, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_0, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_DIV | BPF_K, BPF_REG_1, 0, 0, 1000000000));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_0, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOD | BPF_K, BPF_REG_2, 0, 0, 1000000000));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_2, 0, 0, 32));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_DIV | BPF_K, BPF_REG_2, 0, 0, 1000000000));
+    bpfLoadImm64(prog, BPF_REG_3, kNtpEpochOffset);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_3, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_1, 0, 0, 32));
+    prog.push_back(bpfInsn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_2, 0, 0, 32));
+    store(BPF_W, kPayloadOffset + TestPacket::kReceiveTimestampOffset, BPF_REG_1);
+    store(BPF_W, kPayloadOffset + TestPacket::kReceiveTimestampOffset + 4, BPF_REG_2);
+    store(BPF_W, kPayloadOffset + TestPacket::kReflectTimestampOffset, BPF_REG_1);
+    store(BPF_W, kPayloadOffset + TestPacket::kReflectTimestampOffset + 4, BPF_REG_2);
+
+    // r1 = received TOS, r2 = the reply's.
+    uint8_t flags = ReflectorSawTrafficClass | (reflectDscp ? ReflectorMirroredDscp : 0);
+    load(BPF_B, BPF_REG_1, kIpOffset + offsetof(struct iphdr, ttl));
+    store(BPF_B, kPayloadOffset + TestPacket::kSenderTtlOffset, BPF_REG_1);
+    load(BPF_B, BPF_REG_1, kIpOffset + offsetof(struct iphdr, tos));
+    store(BPF_B, kPayloadOffset + TestPacket::kSenderTosOffset, BPF_REG_1);
+    prog.push_back(bpfInsn(BPF_ST | BPF_B | BPF_MEM, BPF_REG_7, 0, kPayloadOffset + TestPacket::kReflectorFlagsOffset,
+                           flags));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_2, 0, 0, reflectDscp ? 0xfc : 0));
+    store(BPF_B, kIpOffset + offsetof(struct iphdr, tos), BPF_REG_2);
+
+    // RFC 1624: check' = ~(~check + ~tos + tos'), in host order.
+    load(BPF_H, BPF_REG_3, kIpOffset + offsetof(struct iphdr, check));
+    prog.push_back(bpfInsn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_3, 0, 0, 16));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_3, 0, 0, 0xffff));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_1, 0, 0, 0xffff));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_3, BPF_REG_1, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_3, BPF_REG_2, 0, 0));
+    for (int fold = 0; fold < 2; ++fold)
+    {
+        prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0));
+        prog.push_back(bpfInsn(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_4, 0, 0, 16));
+        prog.push_back(bpfInsn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_3, 0, 0, 0xffff));
+        prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_3, BPF_REG_4, 0, 0));
+    }
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_3, 0, 0, 0xffff));
+    prog.push_back(bpfInsn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_3, 0, 0, 16));
+    store(BPF_H, kIpOffset + offsetof(struct iphdr, check), BPF_REG_3);
+
+    // Ethernet addresses, as 4 + 2 bytes each.
+    load(BPF_W, BPF_REG_1, 0);
+    load(BPF_H, BPF_REG_2, 4);
+    load(BPF_W, BPF_REG_3, 6);
+    load(BPF_H, BPF_REG_4, 10);
+    store(BPF_W, 0, BPF_REG_3);
+    store(BPF_H, 4, BPF_REG_4);
+    store(BPF_W, 6, BPF_REG_1);
+    store(BPF_H, 10, BPF_REG_2);
+
+    load(BPF_W, BPF_REG_1, kIpOffset + offsetof(struct iphdr, saddr));
+    load(BPF_W, BPF_REG_2, kIpOffset + offsetof(struct iphdr, daddr));
+    store(BPF_W, kIpOffset + offsetof(struct iphdr, saddr), BPF_REG_2);
+    store(BPF_W, kIpOffset + offsetof(struct iphdr, daddr), BPF_REG_1);
+
+    load(BPF_H, BPF_REG_1, kUdpOffset + offsetof(struct udphdr, source));
+    load(BPF_H, BPF_REG_2, kUdpOffset + offsetof(struct udphdr, dest));
+    store(BPF_H, kUdpOffset + offsetof(struct udphdr, source), BPF_REG_2);
+    store(BPF_H, kUdpOffset + offsetof(struct udphdr, dest), BPF_REG_1);
+    prog.push_back(bpfInsn(BPF_ST | BPF_H | BPF_MEM, BPF_REG_7, 0, kUdpOffset + offsetof(struct udphdr, check), 0));
+
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1));
+    prog.push_back(bpfInsn(BPF_STX | BPF_DW | BPF_ATOMIC, BPF_REG_6, BPF_REG_1, 0, BPF_ADD));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_TX));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    bpfPatchJumps(prog, misses);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    return prog;
+}
+
+int64_t clockNs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+} // namespace
+
+XdpReflector::XdpReflector() : sessionsFd_(-1), clockFd_(-1), progFd_(-1), linkFd_(-1), nativeMode_(false) {}
+
+XdpReflector::~XdpReflector()
+{
+    close();
+}
+
+bool XdpReflector::open(const std::string &interface, uint16_t port, bool generic, bool reflectDscp)
+{
+    int ifindex = if_nametoindex(interface.c_str());
+    if (ifindex == 0)
+    {
+        std::cerr << "XDP reflector: no such interface: " << interface << std::endl;
+        return false;
+    }
+
+    sessionsFd_ = bpfCreateMap(BPF_MAP_TYPE_HASH, sizeof(Endpoint), sizeof(uint64_t), kMaxSessions);
+    clockFd_ = bpfCreateMap(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(int64_t), 1);
+    if (sessionsFd_ < 0 || clockFd_ < 0)
+    {
+        std::cerr << "XDP reflector: cannot create maps: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+    if (!updateClock())
+    {
+        std::cerr << "XDP reflector: cannot set the clock offset: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    progFd_ = bpfLoadXdpProgram(reflectorProgram(sessionsFd_, clockFd_, port, reflectDscp));
+    if (progFd_ < 0)
+    {
+        std::cerr << "XDP reflector: cannot load program: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    linkFd_ = bpfAttachXdp(progFd_, ifindex, generic, nativeMode_);
+    if (linkFd_ < 0)
+    {
+        std::cerr << "XDP reflector: cannot attach to " << interface << ": " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    std::cout << "XDP reflector on " << interface << " (" << (nativeMode_ ? "native" : "generic") << " XDP)"
+              << std::endl;
+    return true;
+}
+
+void XdpReflector::close()
+{
+    for (int *fd : {&linkFd_, &progFd_, &clockFd_, &sessionsFd_})
+    {
+        if (*fd >= 0)
+        {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+bool XdpReflector::updateClock()
+{
+    // Bracket the wall-clock read with two monotonic reads and keep the
+    // tightest of a few tries, so preemption does not skew the offset.
+    int64_t offset = 0;
+    int64_t best = INT64_MAX;
+    for (int i = 0; i < 3; ++i)
+    {
+        int64_t before = clockNs(CLOCK_MONOTONIC);
+        int64_t wall = clockNs(CLOCK_REALTIME);
+        int64_t after = clockNs(CLOCK_MONOTONIC);
+        if (after - before < best)
+        {
+            best = after - before;
+            offset = wall - before - (after - before) / 2;
+        }
+    }
+
+    uint32_t key = 0;
+    return bpfUpdateElement(clockFd_, &key, &offset);
+}
+
+bool XdpReflector::add(const Endpoint &endpoint)
+{
+    uint64_t count = 0;
+    return bpfUpdateElement(sessionsFd_, &endpoint, &count);
+}
+
+bool XdpReflector::remove(const Endpoint &endpoint)
+{
+    return bpfDeleteElement(sessionsFd_, &endpoint);
+}
+
+bool XdpReflector::packets(const Endpoint &endpoint, uint64_t &count) const
+{
+    return bpfLookupElement(sessionsFd_, &endpoint, &count);
+}
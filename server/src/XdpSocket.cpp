@@ -0,0 +1,424 @@
+#include "XdpSocket.h"
+#include "Address.h"
+#include "Bpf.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace
+{
+const uint32_t kFrameSize = 2048;
+const uint32_t kFrameCount = 4096;
+const uint32_t kRingSize = 2048;
+
+// Ethernet + IPv4 without options + UDP.
+const size_t kHeadersSize = sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr);
+
+// The redirect program:
+//
+//   if the frame is IPv4 without options, unfragmented, UDP to `port`:
+//       return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+//   return XDP_PASS;
+//
+// Queues without a socket in the map fall back to XDP_PASS, so the kernel
+// socket keeps serving them.
+std::vector<struct bpf_insn> redirectProgram(int mapFd, uint16_t port)
+{
+    std::vector<struct bpf_insn> prog;
+    std::vector<size_t> misses;
+    bpfMatchUdpPort(prog, misses, port, 0);
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0));
+    bpfLoadMap(prog, BPF_REG_1, mapFd);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    bpfPatchJumps(prog, misses);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    return prog;
+}
+
+uint16_t udpChecksum(const struct iphdr *ip, const struct udphdr *udp, size_t udpLength)
+{
+    uint32_t sum = 0;
+    auto add = [&sum](const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i + 1 < size; i += 2)
+        {
+            sum += (bytes[i] << 8) | bytes[i + 1];
+        }
+        if (size & 1)
+        {
+            sum += bytes[size - 1] << 8;
+        }
+    };
+
+    add(&ip->saddr, 4);
+    add(&ip->daddr, 4);
+    sum += IPPROTO_UDP + udpLength;
+    add(udp, udpLength);
+    sum -= ntohs(udp->check);
+
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    uint16_t result = htons(static_cast<uint16_t>(~sum));
+    return result == 0 ? 0xffff : result;
+}
+} // namespace
+
+XdpSocket::XdpSocket()
+    : fd_(-1), mapFd_(-1), progFd_(-1), linkFd_(-1), umem_(nullptr), umemSize_(0), zeroCopy_(false),
+      nativeMode_(false), reflectDscp_(false), txPending_(0), received_(0), reflected_(0), invalid_(0), txFull_(0)
+{
+    memset(&rx_, 0, sizeof(rx_));
+    memset(&tx_, 0, sizeof(tx_));
+    memset(&fill_, 0, sizeof(fill_));
+    memset(&completion_, 0, sizeof(completion_));
+}
+
+XdpSocket::~XdpSocket()
+{
+    close();
+}
+
+bool XdpSocket::open(const std::string &interface, uint32_t queue, uint16_t port, bool generic)
+{
+    int ifindex = if_nametoindex(interface.c_str());
+    if (ifindex == 0)
+    {
+        std::cerr << "AF_XDP: no such interface: " << interface << std::endl;
+        return false;
+    }
+
+    fd_ = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (fd_ < 0)
+    {
+        std::cerr << "AF_XDP: socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    umemSize_ = static_cast<size_t>(kFrameSize) * kFrameCount;
+    umem_ = mmap(nullptr, umemSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem_ == MAP_FAILED)
+    {
+        umem_ = nullptr;
+        std::cerr << "AF_XDP: cannot allocate UMEM: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = reinterpret_cast<uint64_t>(umem_);
+    reg.len = umemSize_;
+    reg.chunk_size = kFrameSize;
+    if (setsockopt(fd_, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+    {
+        std::cerr << "AF_XDP: UMEM registration failed: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    // The fill ring can hold every frame, so returning one never fails.
+    if (!mapRing(fill_, XDP_UMEM_FILL_RING, kFrameCount, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) ||
+        !mapRing(completion_, XDP_UMEM_COMPLETION_RING, kRingSize, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) ||
+        !mapRing(rx_, XDP_RX_RING, kRingSize, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) ||
+        !mapRing(tx_, XDP_TX_RING, kRingSize, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)))
+    {
+        close();
+        return false;
+    }
+
+    for (uint32_t i = 0; i < kFrameCount; ++i)
+    {
+        fill(static_cast<uint64_t>(i) * kFrameSize);
+    }
+
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = queue;
+    addr.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+    zeroCopy_ = true;
+    if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+    {
+        addr.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+        zeroCopy_ = false;
+        if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            std::cerr << "AF_XDP: cannot bind to " << interface << " queue " << queue << ": " << strerror(errno)
+                      << std::endl;
+            close();
+            return false;
+        }
+    }
+
+    if (!attachProgram(ifindex, queue, port, generic))
+    {
+        close();
+        return false;
+    }
+
+    std::cout << "AF_XDP reflector on " << interface << " queue " << queue << " ("
+              << (zeroCopy_ ? "zero-copy" : "copy") << ", " << (nativeMode_ ? "native" : "generic") << " XDP)"
+              << std::endl;
+    return true;
+}
+
+bool XdpSocket::mapRing(Ring &ring, int ringOption, uint32_t size, uint64_t pgoff, size_t descSize)
+{
+    if (setsockopt(fd_, SOL_XDP, ringOption, &size, sizeof(size)) < 0)
+    {
+        std::cerr << "AF_XDP: cannot size ring: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct xdp_mmap_offsets offsets;
+    socklen_t length = sizeof(offsets);
+    if (getsockopt(fd_, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &length) < 0)
+    {
+        std::cerr << "AF_XDP: cannot get ring offsets: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    const struct xdp_ring_offset &off = ringOption == XDP_UMEM_FILL_RING         ? offsets.fr
+                                        : ringOption == XDP_UMEM_COMPLETION_RING ? offsets.cr
+                                        : ringOption == XDP_RX_RING              ? offsets.rx
+                                                                                 : offsets.tx;
+    ring.mapSize = off.desc + size * descSize;
+    ring.map = mmap(nullptr, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, pgoff);
+    if (ring.map == MAP_FAILED)
+    {
+        ring.map = nullptr;
+        std::cerr << "AF_XDP: cannot map ring: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    char *base = static_cast<char *>(ring.map);
+    ring.producer = reinterpret_cast<uint32_t *>(base + off.producer);
+    ring.consumer = reinterpret_cast<uint32_t *>(base + off.consumer);
+    ring.flags = reinterpret_cast<uint32_t *>(base + off.flags);
+    ring.descs = base + off.desc;
+    ring.mask = size - 1;
+    return true;
+}
+
+bool XdpSocket::attachProgram(int ifindex, uint32_t queue, uint16_t port, bool generic)
+{
+    mapFd_ = bpfCreateMap(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(uint32_t), queue + 1);
+    if (mapFd_ < 0)
+    {
+        std::cerr << "AF_XDP: cannot create XSKMAP: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    progFd_ = bpfLoadXdpProgram(redirectProgram(mapFd_, port));
+    if (progFd_ < 0)
+    {
+        std::cerr << "AF_XDP: cannot load XDP program: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    uint32_t value = fd_;
+    if (!bpfUpdateElement(mapFd_, &queue, &value))
+    {
+        std::cerr << "AF_XDP: cannot add socket to XSKMAP: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    linkFd_ = bpfAttachXdp(progFd_, ifindex, generic, nativeMode_);
+    if (linkFd_ < 0)
+    {
+        std::cerr << "AF_XDP: cannot attach XDP program: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void XdpSocket::close()
+{
+    for (int *fd : {&linkFd_, &progFd_, &mapFd_, &fd_})
+    {
+        if (*fd >= 0)
+        {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    for (Ring *ring : {&rx_, &tx_, &fill_, &completion_})
+    {
+        if (ring->map)
+        {
+            munmap(ring->map, ring->mapSize);
+        }
+        memset(ring, 0, sizeof(*ring));
+    }
+    if (umem_)
+    {
+        munmap(umem_, umemSize_);
+        umem_ = nullptr;
+    }
+    txPending_ = 0;
+}
+
+void XdpSocket::fill(uint64_t addr)
+{
+    uint32_t producer = *fill_.producer;
+    static_cast<uint64_t *>(fill_.descs)[producer & fill_.mask] = addr;
+    __atomic_store_n(fill_.producer, producer + 1, __ATOMIC_RELEASE);
+}
+
+size_t XdpSocket::receive(Packet *packets, size_t max)
+{
+    uint32_t consumer = *rx_.consumer;
+    uint32_t available = __atomic_load_n(rx_.producer, __ATOMIC_ACQUIRE) - consumer;
+    const struct xdp_desc *descs = static_cast<const struct xdp_desc *>(rx_.descs);
+
+    size_t count = 0;
+    uint32_t taken = 0;
+    for (; taken < available && count < max; ++taken)
+    {
+        const struct xdp_desc &desc = descs[(consumer + taken) & rx_.mask];
+        char *frame = static_cast<char *>(umem_) + desc.addr;
+        const struct iphdr *ip = reinterpret_cast<const struct iphdr *>(frame + ETH_HLEN);
+        const struct udphdr *udp = reinterpret_cast<const struct udphdr *>(frame + ETH_HLEN + sizeof(struct iphdr));
+
+        // The XDP program only passes IPv4 UDP without IP options, but the
+        // lengths still come from the wire.
+        size_t udpLength = desc.len >= kHeadersSize ? ntohs(udp->len) : 0;
+        if (udpLength < sizeof(struct udphdr) || udpLength > desc.len - ETH_HLEN - sizeof(struct iphdr))
+        {
+            invalid_.fetch_add(1, std::memory_order_relaxed);
+            fill(desc.addr);
+            continue;
+        }
+
+        Packet &packet = packets[count++];
+        packet.payload = frame + kHeadersSize;
+        packet.size = udpLength - sizeof(struct udphdr);
+        memset(&packet.from, 0, sizeof(packet.from));
+        packet.from.sin6_family = AF_INET6;
+        packet.from.sin6_addr = mapIpv4(ip->saddr);
+        packet.from.sin6_port = udp->source;
+        packet.receivedNs = 0;
+        packet.traffic.tos = ip->tos;
+        packet.traffic.ttl = ip->ttl;
+        packet.addr = desc.addr;
+        packet.len = desc.len;
+    }
+    __atomic_store_n(rx_.consumer, consumer + taken, __ATOMIC_RELEASE);
+
+    received_.fetch_add(count, std::memory_order_relaxed);
+    return count;
+}
+
+void XdpSocket::reflect(const Packet &packet)
+{
+    uint32_t producer = *tx_.producer + txPending_;
+    if (producer - __atomic_load_n(tx_.consumer, __ATOMIC_ACQUIRE) > tx_.mask)
+    {
+        txFull_.fetch_add(1, std::memory_order_relaxed);
+        fill(packet.addr);
+        return;
+    }
+
+    char *frame = static_cast<char *>(umem_) + packet.addr;
+    struct ethhdr *eth = reinterpret_cast<struct ethhdr *>(frame);
+    struct iphdr *ip = reinterpret_cast<struct iphdr *>(frame + ETH_HLEN);
+    struct udphdr *udp = reinterpret_cast<struct udphdr *>(frame + ETH_HLEN + sizeof(struct iphdr));
+
+    unsigned char mac[ETH_ALEN];
+    memcpy(mac, eth->h_dest, ETH_ALEN);
+    memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+    memcpy(eth->h_source, mac, ETH_ALEN);
+    std::swap(ip->saddr, ip->daddr);
+    std::swap(udp->source, udp->dest);
+
+    // Swapping addresses leaves the IP header checksum valid, but not a new
+    // TOS; that is patched in with the incremental update of RFC 1624.
+    uint8_t tos = reflectDscp_ ? ip->tos & 0xfc : 0;
+    if (tos != ip->tos)
+    {
+        uint32_t sum = static_cast<uint16_t>(~ntohs(ip->check)) + static_cast<uint16_t>(~ip->tos) + tos;
+        while (sum >> 16)
+        {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        ip->check = htons(static_cast<uint16_t>(~sum));
+        ip->tos = tos;
+    }
+
+    // The UDP checksum also covers the payload, which the reflector rewrote.
+    // Zero means the sender did not use one.
+    if (udp->check != 0)
+    {
+        udp->check = udpChecksum(ip, udp, packet.size + sizeof(struct udphdr));
+    }
+
+    struct xdp_desc &desc = static_cast<struct xdp_desc *>(tx_.descs)[producer & tx_.mask];
+    desc.addr = packet.addr;
+    desc.len = packet.len;
+    desc.options = 0;
+    txPending_++;
+}
+
+void XdpSocket::recycle(const Packet &packet)
+{
+    fill(packet.addr);
+}
+
+void XdpSocket::flush()
+{
+    if (txPending_ > 0)
+    {
+        __atomic_store_n(tx_.producer, *tx_.producer + txPending_, __ATOMIC_RELEASE);
+        reflected_.fetch_add(txPending_, std::memory_order_relaxed);
+        txPending_ = 0;
+        if (__atomic_load_n(tx_.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        {
+            sendto(fd_, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+        }
+    }
+
+    uint32_t consumer = *completion_.consumer;
+    uint32_t completed = __atomic_load_n(completion_.producer, __ATOMIC_ACQUIRE) - consumer;
+    for (uint32_t i = 0; i < completed; ++i)
+    {
+        fill(static_cast<const uint64_t *>(completion_.descs)[(consumer + i) & completion_.mask]);
+    }
+    __atomic_store_n(completion_.consumer, consumer + completed, __ATOMIC_RELEASE);
+}
+
+XdpSocket::Stats XdpSocket::stats() const
+{
+    Stats stats;
+    stats.received = received_.load(std::memory_order_relaxed);
+    stats.reflected = reflected_.load(std::memory_order_relaxed);
+    stats.invalid = invalid_.load(std::memory_order_relaxed);
+    stats.txFull = txFull_.load(std::memory_order_relaxed);
+    return stats;
+}
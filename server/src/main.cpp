@@ -1,27 +1,122 @@
 #include "Server.h"
+#include "Config.h"
+#include "Systemd.h"
 #include <iostream>
 #include <csignal>
+#include <cstring>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <limits.h>
 #include <memory>
 
 std::unique_ptr<Server> server;
 volatile sig_atomic_t shutdownRequested = 0;
+volatile sig_atomic_t upgradeRequested = 0;
 
-void signalHandler(int signum) {
-    std::cerr << "Received signal " << signum << ", requesting shutdown..." << std::endl;
+// Only sets the flag; the main loop does the actual shutdown outside of
+// signal context.
+void signalHandler(int) {
     shutdownRequested = 1;
-    if (server) {
-        server->stop();
+}
+
+void upgradeHandler(int) {
+    upgradeRequested = 1;
+}
+
+// Starts the binary now installed at this one's path with --takeover; it
+// connects to the handoff socket and this process exits once it serves.
+pid_t spawnTakeover(const std::string& configFile, bool runAsDaemon) {
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length < 0) {
+        std::cerr << "Failed to find the server binary: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    std::string binary(path, length);
+    // A package upgrade replaces the file this process was started from.
+    const std::string deleted = " (deleted)";
+    if (binary.size() > deleted.size() && binary.compare(binary.size() - deleted.size(), deleted.size(), deleted) == 0) {
+        binary.erase(binary.size() - deleted.size());
     }
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) std::cerr << "Failed to start the new server: " << strerror(errno) << std::endl;
+        return pid;
+    }
+    // Only stdin, stdout and stderr go along: a stray copy of a session's
+    // control connection would keep it open after the session ends.
+    if (syscall(SYS_close_range, 3U, ~0U, 0U) != 0) {
+        for (int fd = 3; fd < 65536; ++fd) close(fd);
+    }
+    std::vector<const char*> args = {binary.c_str(), "--takeover", "--config", configFile.c_str()};
+    if (!runAsDaemon) args.push_back("--foreground");
+    args.push_back(nullptr);
+    execv(binary.c_str(), const_cast<char* const*>(args.data()));
+    _exit(127);
+}
+
+// Sends one command to a running server's admin socket and prints the reply.
+int runAdminCommand(const std::string& configFile, const std::string& command) {
+    Config config(configFile);
+    config.load();
+    std::string path = config.getString("admin_socket", "/run/twamp-server/admin.sock");
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Failed to connect to admin socket " << path << ": " << strerror(errno) << std::endl;
+        if (sock >= 0) close(sock);
+        return EXIT_FAILURE;
+    }
+
+    std::string request = command + "\n";
+    send(sock, request.data(), request.size(), 0);
+
+    char buffer[4096];
+    ssize_t n;
+    bool ok = true;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+        std::cout.write(buffer, n);
+        if (strncmp(buffer, "ERROR", 5) == 0) ok = false;
+    }
+    close(sock);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char* argv[]) {
     bool runAsDaemon = true;
+    bool takeover = false;
+    std::string configFile = "/etc/twamp-server/twamp-server.conf";
     
-    if (argc > 1 && std::string(argv[1]) == "--foreground") {
-        runAsDaemon = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--foreground") {
+            runAsDaemon = false;
+        } else if (arg == "--config" && i + 1 < argc) {
+            configFile = argv[++i];
+        } else if (arg == "--takeover") {
+            takeover = true;
+        } else if (arg == "--admin") {
+            std::string command;
+            for (++i; i < argc; ++i) {
+                command += (command.empty() ? "" : " ") + std::string(argv[i]);
+            }
+            return runAdminCommand(configFile, command);
+        } else {
+            std::cerr << "Usage: twamp-server [--foreground] [--takeover] [--config <file>] [--admin <command>]"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
     }
     
     if (runAsDaemon) {
@@ -40,29 +135,65 @@ int main(int argc, char* argv[]) {
     
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
+    signal(SIGUSR2, upgradeHandler);
     signal(SIGPIPE, SIG_IGN); // Ignore broken pipe signals
     
     try {
-        server = std::make_unique<Server>("/etc/twamp-server/twamp-server.conf");
+        server = std::make_unique<Server>(configFile);
+        server->setTakeover(takeover);
         if (!server->start()) {
             std::cerr << "Failed to start TWAMP server" << std::endl;
             return EXIT_FAILURE;
         }
+
+        // After a takeover this process is the service's main process.
+        systemd::notify(takeover ? "MAINPID=" + std::to_string(getpid()) + "\nREADY=1" : "READY=1");
         
         if (!runAsDaemon) {
             std::cout << "TWAMP server running in foreground" << std::endl;
         }
         
-        // Wait for shutdown signal
+        // Wait for shutdown signal, or for a new process to take over
+        pid_t successor = -1;
         while (!shutdownRequested) {
+            if (server->handoffRequested()) {
+                if (server->handOff()) {
+                    server.reset();
+                    return EXIT_SUCCESS;
+                }
+                // The new process never confirmed; this one serves again.
+                systemd::notify("READY=1");
+                continue;
+            }
+            if (upgradeRequested) {
+                upgradeRequested = 0;
+                if (!server->canHandOff()) {
+                    std::cerr << "Upgrade requested, but handoff_socket is not set" << std::endl;
+                } else if (successor <= 0) {
+                    systemd::notify("RELOADING=1");
+                    successor = spawnTakeover(configFile, runAsDaemon);
+                }
+            }
+            // A successor that exits with an error never took anything
+            // over; this process just carries on.
+            int status;
+            if (successor > 0 && waitpid(successor, &status, WNOHANG) == successor) {
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                    std::cerr << "The new server failed to start; still serving" << std::endl;
+                }
+                systemd::notify("READY=1");
+                successor = -1;
+            }
             usleep(100000); // 100ms sleep to be more responsive
         }
+
+        systemd::notify("STOPPING=1");
         
         if (!runAsDaemon) {
             std::cout << "Shutdown signal received, cleaning up..." << std::endl;
         }
         
-        // Cleanup - server should already be stopped by signal handler
+        server->stop();
         server.reset();
         
         if (!runAsDaemon) {
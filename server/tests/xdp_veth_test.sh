@@ -0,0 +1,191 @@
+#!/bin/bash
+# End-to-end check of the in-kernel XDP reflector over a veth pair.
+#
+# Builds a network namespace joined to the host by a veth pair, starts the
+# server with xdp_reflector_interface on the host end and runs the client in
+# the namespace. Checks that:
+#   - an unauthenticated session is reflected in the kernel
+#     (kernel_packets > 0) and loses nothing,
+#   - an encrypted session still goes through user space
+#     (kernel_packets = 0) and loses nothing,
+#   - the XDP program is detached once the server exits.
+#
+# Needs root and a kernel with XDP. Everything it creates is removed on exit.
+#
+# Usage: sudo server/tests/xdp_veth_test.sh [build-dir]
+
+set -u
+
+BUILD_DIR=${1:-build}
+SERVER=$BUILD_DIR/server/twamp-server
+CLIENT=$BUILD_DIR/client/twamp-client
+
+NETNS=twamp-xdp-test
+HOST_IF=twxdp0
+PEER_IF=twxdp1
+SERVER_ADDR=10.98.0.1
+CLIENT_ADDR=10.98.0.2
+CONTROL_PORT=18620
+# Without test_ports the client sends to the port after the control port.
+TEST_PORT=18621
+PACKETS=200
+INTERVAL_MS=10
+
+WORK_DIR=$(mktemp -d)
+SERVER_PID=
+FAILURES=0
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+    fi
+    ip netns del "$NETNS" 2>/dev/null
+    ip link del "$HOST_IF" 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Whether an XDP program is attached to the host end of the pair.
+xdp_attached() {
+    ip link show "$HOST_IF" | grep -q "prog/xdp"
+}
+
+pass() {
+    echo "PASS: $*"
+}
+
+fail() {
+    echo "FAIL: $*"
+    FAILURES=$((FAILURES + 1))
+}
+
+admin() {
+    "$SERVER" --config "$WORK_DIR/server.conf" --admin "$@"
+}
+
+# Value of a "key: value" line of `--admin show`.
+show_field() {
+    admin show "$1" | sed -n "s/^$2: //p"
+}
+
+# Value of a numeric field of the client's JSON summary record.
+summary_field() {
+    grep '"type":"summary"' "$1" | sed -n "s/.*\"$2\":\([0-9]*\).*/\1/p"
+}
+
+# Runs one client session and checks where its packets were reflected.
+# $1: name for messages, $2: "kernel" or "user", rest: extra client options.
+run_session() {
+    local name=$1 expect=$2
+    shift 2
+    local output=$WORK_DIR/$name.jsonl
+
+    ip netns exec "$NETNS" "$CLIENT" "$SERVER_ADDR:$CONTROL_PORT" -c "$PACKETS" -i "$INTERVAL_MS" \
+        --format jsonl "$@" >"$output" 2>"$WORK_DIR/$name.err" &
+    local client_pid=$!
+
+    # Read the session's counters halfway through, while it still exists.
+    sleep $((PACKETS * INTERVAL_MS / 2000 + 1))
+    local id
+    id=$(admin list | awk 'NR > 1 && $5 == "active" { print $1; exit }')
+    local kernel=
+    if [ -n "$id" ]; then
+        kernel=$(show_field "$id" kernel_packets)
+    fi
+    wait "$client_pid"
+
+    local received lost
+    received=$(summary_field "$output" received)
+    lost=$(summary_field "$output" lost)
+    if [ -z "$received" ] || [ "$received" -eq 0 ]; then
+        fail "$name: no replies"
+        cat "$WORK_DIR/$name.err"
+        return
+    fi
+    if [ "$lost" = "0" ]; then
+        pass "$name: $received replies, no loss"
+    else
+        fail "$name: lost ${lost:-?} of $PACKETS packets"
+    fi
+
+    if [ -z "$kernel" ]; then
+        fail "$name: session not found on the admin socket"
+    elif [ "$expect" = kernel ] && [ "$kernel" -gt 0 ]; then
+        pass "$name: $kernel packets reflected in the kernel"
+    elif [ "$expect" = user ] && [ "$kernel" -eq 0 ]; then
+        pass "$name: reflected in user space"
+    else
+        fail "$name: kernel_packets = $kernel, expected $expect reflection"
+    fi
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Must be run as root" >&2
+    exit 2
+fi
+for binary in "$SERVER" "$CLIENT"; do
+    if [ ! -x "$binary" ]; then
+        echo "Missing $binary; pass the build directory as the first argument" >&2
+        exit 2
+    fi
+done
+
+ip netns add "$NETNS" || exit 2
+ip link add "$HOST_IF" type veth peer name "$PEER_IF" || exit 2
+ip link set "$PEER_IF" netns "$NETNS"
+ip addr add "$SERVER_ADDR/24" dev "$HOST_IF"
+ip link set "$HOST_IF" up
+ip netns exec "$NETNS" ip addr add "$CLIENT_ADDR/24" dev "$PEER_IF"
+ip netns exec "$NETNS" ip link set "$PEER_IF" up
+ip netns exec "$NETNS" ip link set lo up
+
+echo "1 xdp-veth-test-secret" >"$WORK_DIR/keys"
+cat >"$WORK_DIR/server.conf" <<EOF
+listen_addresses = $SERVER_ADDR
+control_port = $CONTROL_PORT
+test_port = $TEST_PORT
+admin_socket = $WORK_DIR/admin.sock
+handoff_socket =
+stats_segment =
+auth_key_file = $WORK_DIR/keys
+xdp_reflector_interface = $HOST_IF
+xdp_generic = true
+EOF
+
+"$SERVER" --foreground --config "$WORK_DIR/server.conf" >"$WORK_DIR/server.log" 2>&1 &
+SERVER_PID=$!
+for _ in $(seq 50); do
+    [ -S "$WORK_DIR/admin.sock" ] && break
+    sleep 0.1
+done
+if [ ! -S "$WORK_DIR/admin.sock" ]; then
+    echo "Server did not start:" >&2
+    cat "$WORK_DIR/server.log" >&2
+    exit 1
+fi
+
+if xdp_attached; then
+    pass "XDP program attached to $HOST_IF"
+else
+    fail "no XDP program on $HOST_IF"
+    cat "$WORK_DIR/server.log"
+fi
+
+run_session unauthenticated kernel
+run_session encrypted user -m encrypted --key-file "$WORK_DIR/keys"
+
+kill "$SERVER_PID"
+wait "$SERVER_PID"
+SERVER_PID=
+if xdp_attached; then
+    fail "XDP program still attached to $HOST_IF after exit"
+else
+    pass "XDP program detached after exit"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
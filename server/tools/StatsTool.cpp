@@ -0,0 +1,195 @@
+// Prints the counters a running server publishes in its shared-memory
+// statistics segment (stats_segment): the server-wide counters, one line per
+// reflector worker and one per session. With --interval it keeps sampling
+// and adds packet rates over each interval; reading the segment costs the
+// server nothing, so short intervals are fine.
+//
+// Usage: twamp-stats [--segment path | --config file] [--interval ms]
+//                    [--count n]
+
+#include "Address.h"
+#include "Config.h"
+#include "StatsReader.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+struct Options
+{
+    std::string segment;
+    std::string config = "/etc/twamp-server/twamp-server.conf";
+    int intervalMs = 0;
+    int count = 0;
+};
+
+struct Previous
+{
+    std::vector<uint64_t> workerReflected;
+    std::unordered_map<uint64_t, uint64_t> sessionPackets;
+};
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--segment" && i + 1 < argc)
+        {
+            options.segment = argv[++i];
+        }
+        else if (arg == "--config" && i + 1 < argc)
+        {
+            options.config = argv[++i];
+        }
+        else if (arg == "--interval" && i + 1 < argc)
+        {
+            options.intervalMs = std::atoi(argv[++i]);
+        }
+        else if (arg == "--count" && i + 1 < argc)
+        {
+            options.count = std::atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: twamp-stats [--segment path | --config file] [--interval ms] [--count n]\n");
+            return false;
+        }
+    }
+    if (options.segment.empty())
+    {
+        Config config(options.config);
+        if (config.load())
+        {
+            options.segment = config.getString("stats_segment", "");
+        }
+        if (options.segment.empty())
+        {
+            fprintf(stderr, "No stats_segment in %s; give --segment\n", options.config.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+double rate(uint64_t now, uint64_t before, double seconds)
+{
+    return seconds > 0 && now >= before ? (now - before) / seconds : 0;
+}
+
+void printSample(const StatsReader &reader, Previous &previous, double elapsedSec)
+{
+    StatsReader::Server server;
+    reader.readServer(server);
+    printf("sessions: %llu", static_cast<unsigned long long>(server.sessions));
+    if (server.unlistedSessions > 0)
+    {
+        printf(" (%llu unlisted)", static_cast<unsigned long long>(server.unlistedSessions));
+    }
+    printf(", stamp latency p50/p99/max: %llu/%llu/%llu ns\n",
+           static_cast<unsigned long long>(server.stampLatencyP50Ns),
+           static_cast<unsigned long long>(server.stampLatencyP99Ns),
+           static_cast<unsigned long long>(server.stampLatencyMaxNs));
+    printf("drops:");
+    for (size_t i = 0; i < stats::kDropReasonsUsed; ++i)
+    {
+        printf(" %s=%llu", stats::kDropReasonNames[i], static_cast<unsigned long long>(server.drops[i]));
+    }
+    printf("\ntimeouts:");
+    for (size_t i = 0; i < stats::kTimeoutPhasesUsed; ++i)
+    {
+        printf(" %s=%llu", stats::kTimeoutPhaseNames[i], static_cast<unsigned long long>(server.timeouts[i]));
+    }
+    printf(" handshake_auth_failed=%llu\n", static_cast<unsigned long long>(server.handshakeAuthFailures));
+
+    printf("%-28s %10s %12s %12s %10s %10s\n", "WORKER", "BATCHES", "RECEIVED", "REFLECTED", "DROPPED", "PPS");
+    previous.workerReflected.resize(reader.workerCount());
+    for (size_t i = 0; i < reader.workerCount(); ++i)
+    {
+        StatsReader::Worker worker;
+        reader.readWorker(i, worker);
+        uint64_t dropped = 0;
+        for (size_t d = 0; d < stats::kDropReasonsUsed; ++d)
+        {
+            dropped += worker.drops[d];
+        }
+        std::string name = IN6_IS_ADDR_UNSPECIFIED(&worker.address) ? "*" : formatIp(worker.address);
+        name += ":" + std::to_string(worker.port);
+        printf("%-28s %10llu %12llu %12llu %10llu %10.0f\n", name.c_str(),
+               static_cast<unsigned long long>(worker.batches), static_cast<unsigned long long>(worker.received),
+               static_cast<unsigned long long>(worker.reflected), static_cast<unsigned long long>(dropped),
+               rate(worker.reflected, previous.workerReflected[i], elapsedSec));
+        previous.workerReflected[i] = worker.reflected;
+    }
+
+    printf("%-6s %-10s %-28s %-7s %10s %8s %8s %8s %10s %8s\n", "ID", "SID", "TEST CLIENT", "STATE", "PACKETS",
+           "LOST", "REORD", "DUP", "JITTER_US", "PPS");
+    std::unordered_map<uint64_t, uint64_t> packets;
+    for (size_t slot = 0; slot < reader.sessionCapacity(); ++slot)
+    {
+        StatsReader::Session session;
+        if (!reader.readSession(slot, session))
+        {
+            continue;
+        }
+        uint64_t total = session.packets + session.kernelPackets;
+        auto before = previous.sessionPackets.find(session.id);
+        double pps = before != previous.sessionPackets.end() ? rate(total, before->second, elapsedSec) : 0;
+        packets[session.id] = total;
+        std::string client = IN6_IS_ADDR_UNSPECIFIED(&session.testClient.sin6_addr)
+                                 ? "-" : formatAddress(session.testClient);
+        printf("%-6llu %-10u %-28s %-7s %10llu %8llu %8llu %8llu %10.1f %8.0f\n",
+               static_cast<unsigned long long>(session.id), session.sid, client.c_str(),
+               session.state == stats::SessionActive ? "active" : "setup",
+               static_cast<unsigned long long>(total), static_cast<unsigned long long>(session.lost),
+               static_cast<unsigned long long>(session.reordered),
+               static_cast<unsigned long long>(session.duplicates), session.jitterUs, pps);
+    }
+    previous.sessionPackets.swap(packets);
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    StatsReader reader;
+    if (!reader.open(options.segment))
+    {
+        fprintf(stderr, "%s\n", reader.error().c_str());
+        return EXIT_FAILURE;
+    }
+
+    Previous previous;
+    auto last = std::chrono::steady_clock::now();
+    for (int sample = 0; options.count == 0 || sample < options.count; ++sample)
+    {
+        // A restarted server publishes a new segment under the same name.
+        if (reader.stale() && !reader.open(options.segment))
+        {
+            fprintf(stderr, "%s\n", reader.error().c_str());
+            return EXIT_FAILURE;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        printSample(reader, previous, sample == 0 ? 0 : std::chrono::duration<double>(now - last).count());
+        last = now;
+        if (options.intervalMs <= 0)
+        {
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+        std::this_thread::sleep_for(std::chrono::milliseconds(options.intervalMs));
+    }
+    return EXIT_SUCCESS;
+}